@@ -0,0 +1,430 @@
+//! Throughput benchmark for the compression methods, block sizes and thread
+//! counts.
+//!
+//! Run with `cargo bench --bench zpaq_bench [-- FILTER...]`. Every case
+//! prints one JSON object per line to stdout (and appends it to
+//! `$ZPAQ_BENCH_OUT` when set), so runs can be diffed, tracked over time or
+//! used as a PGO training workload. Positional arguments keep only the cases
+//! whose name contains one of them, e.g. `-- buffer/3/ text`.
+//!
+//! Environment:
+//!
+//! - `ZPAQ_BENCH_SIZE`: MB of each synthetic input (default 4).
+//! - `ZPAQ_BENCH_METHODS`: comma-separated methods (default
+//!   `0,1,2,3,4,5,10,12,30,32`; the second digit is the block size as a
+//!   power of two in MB).
+//! - `ZPAQ_BENCH_THREADS`: comma-separated thread counts (default 1 and the
+//!   number of CPUs).
+//! - `ZPAQ_BENCH_CORPUS`: a directory of files (e.g. Silesia, Canterbury)
+//!   benchmarked next to the synthetic inputs.
+//! - `ZPAQ_BENCH_ITERS`: runs per case; the fastest is reported (default 1).
+
+use std::fs;
+use std::io::Write;
+use std::path::{Path, PathBuf};
+use std::time::{Instant, SystemTime, UNIX_EPOCH};
+
+use zpaq_rs::{
+    compress_size_parallel, compress_to_vec_parallel, decompress_to_vec_parallel, zpaq_add,
+    zpaq_command,
+};
+
+struct Input {
+    name: String,
+    data: Vec<u8>,
+}
+
+struct Config {
+    size: usize,
+    methods: Vec<String>,
+    threads: Vec<usize>,
+    corpus: Option<PathBuf>,
+    iters: usize,
+    filters: Vec<String>,
+    out: Option<fs::File>,
+}
+
+#[derive(Default)]
+struct Measurement {
+    compressed: u64,
+    compress_secs: f64,
+    decompress_secs: Option<f64>,
+    peak_rss_kb: Option<u64>,
+}
+
+impl Measurement {
+    /// Keeps the fastest times and the highest peak of two runs of a case.
+    fn merge(&mut self, other: Measurement) {
+        self.compress_secs = self.compress_secs.min(other.compress_secs);
+        self.decompress_secs = match (self.decompress_secs, other.decompress_secs) {
+            (Some(a), Some(b)) => Some(a.min(b)),
+            (a, b) => a.or(b),
+        };
+        self.peak_rss_kb = self.peak_rss_kb.max(other.peak_rss_kb);
+    }
+}
+
+fn env_list(name: &str) -> Option<Vec<String>> {
+    let v = std::env::var(name).ok()?;
+    Some(
+        v.split(',')
+            .map(|s| s.trim().to_string())
+            .filter(|s| !s.is_empty())
+            .collect(),
+    )
+}
+
+fn env_usize(name: &str, default: usize) -> usize {
+    std::env::var(name)
+        .ok()
+        .and_then(|v| v.trim().parse().ok())
+        .unwrap_or(default)
+}
+
+impl Config {
+    fn from_env() -> Self {
+        let cpus = std::thread::available_parallelism().map_or(1, |n| n.get());
+        let mut threads = match env_list("ZPAQ_BENCH_THREADS") {
+            Some(list) => list.iter().filter_map(|s| s.parse().ok()).collect(),
+            None => vec![1, cpus],
+        };
+        threads.dedup();
+        let methods = env_list("ZPAQ_BENCH_METHODS").unwrap_or_else(|| {
+            ["0", "1", "2", "3", "4", "5", "10", "12", "30", "32"]
+                .iter()
+                .map(|s| s.to_string())
+                .collect()
+        });
+        // cargo passes `--bench`; everything that is not a flag is a filter.
+        let filters = std::env::args()
+            .skip(1)
+            .filter(|a| !a.starts_with('-'))
+            .collect();
+        let out = std::env::var_os("ZPAQ_BENCH_OUT").map(|p| {
+            fs::OpenOptions::new()
+                .create(true)
+                .append(true)
+                .open(&p)
+                .expect("open ZPAQ_BENCH_OUT")
+        });
+        Self {
+            size: env_usize("ZPAQ_BENCH_SIZE", 4).max(1) << 20,
+            methods,
+            threads,
+            corpus: std::env::var_os("ZPAQ_BENCH_CORPUS").map(PathBuf::from),
+            iters: env_usize("ZPAQ_BENCH_ITERS", 1).max(1),
+            filters,
+            out,
+        }
+    }
+
+    fn selected(&self, case: &str) -> bool {
+        self.filters.is_empty() || self.filters.iter().any(|f| case.contains(f.as_str()))
+    }
+}
+
+/// xorshift64*, so that the synthetic inputs are the same on every run.
+struct Rng(u64);
+
+impl Rng {
+    fn next(&mut self) -> u64 {
+        self.0 ^= self.0 >> 12;
+        self.0 ^= self.0 << 25;
+        self.0 ^= self.0 >> 27;
+        self.0.wrapping_mul(0x2545_f491_4f6c_dd1d)
+    }
+
+    fn below(&mut self, n: u64) -> u64 {
+        self.next() % n
+    }
+}
+
+/// English-like text: words drawn with a skewed distribution from a fixed
+/// vocabulary, with punctuation and line breaks.
+fn synthetic_text(size: usize) -> Vec<u8> {
+    let mut rng = Rng(0x7465_7874);
+    let vocab: Vec<String> = (0..4096)
+        .map(|_| {
+            let len = 1 + rng.below(4) + rng.below(6);
+            (0..len)
+                .map(|_| {
+                    (b"etaoinshrdlucmfwypvbgkjqxz"[rng.below(26).min(rng.below(26)) as usize])
+                        as char
+                })
+                .collect()
+        })
+        .collect();
+    let mut out = Vec::with_capacity(size + 16);
+    let mut col = 0;
+    while out.len() < size {
+        // Squaring the uniform value makes low indices (common words) likely.
+        let r = rng.below(1 << 16);
+        let word = &vocab[((r * r) >> 32) as usize % vocab.len()];
+        out.extend_from_slice(word.as_bytes());
+        col += word.len() + 1;
+        match rng.below(16) {
+            0 => out.extend_from_slice(b". "),
+            1 => out.extend_from_slice(b", "),
+            _ if col > 72 => {
+                out.push(b'\n');
+                col = 0;
+            }
+            _ => out.push(b' '),
+        }
+    }
+    out.truncate(size);
+    out
+}
+
+/// Fixed-size little-endian records: a counter, a slowly drifting float, a
+/// small enum and a few noisy bytes, like a table or sensor dump.
+fn synthetic_binary(size: usize) -> Vec<u8> {
+    let mut rng = Rng(0x6269_6e61);
+    let mut out = Vec::with_capacity(size + 32);
+    let mut value = 1000.0f64;
+    let mut id = 0u32;
+    while out.len() < size {
+        id += 1 + rng.below(3) as u32;
+        value += (rng.below(2001) as f64 - 1000.0) / 100.0;
+        out.extend_from_slice(&id.to_le_bytes());
+        out.extend_from_slice(&(value as f32).to_le_bytes());
+        out.extend_from_slice(&(rng.below(5) as u16).to_le_bytes());
+        out.extend_from_slice(&(rng.below(1 << 16) as u16).to_le_bytes());
+        out.extend_from_slice(&[0; 4]);
+    }
+    out.truncate(size);
+    out
+}
+
+/// Machine code, taken from this benchmark's own executable and repeated up
+/// to the requested size.
+fn x86_code(size: usize) -> Vec<u8> {
+    let exe = std::env::current_exe()
+        .and_then(fs::read)
+        .unwrap_or_else(|_| synthetic_binary(size));
+    exe.iter().copied().cycle().take(size).collect()
+}
+
+fn incompressible(size: usize) -> Vec<u8> {
+    let mut rng = Rng(0x726e_6421);
+    let mut out = Vec::with_capacity(size + 8);
+    while out.len() < size {
+        out.extend_from_slice(&rng.next().to_le_bytes());
+    }
+    out.truncate(size);
+    out
+}
+
+fn inputs(config: &Config) -> Vec<Input> {
+    let mut inputs = vec![
+        Input {
+            name: "text".to_string(),
+            data: synthetic_text(config.size),
+        },
+        Input {
+            name: "binary".to_string(),
+            data: synthetic_binary(config.size),
+        },
+        Input {
+            name: "x86".to_string(),
+            data: x86_code(config.size),
+        },
+        Input {
+            name: "random".to_string(),
+            data: incompressible(config.size),
+        },
+    ];
+    if let Some(dir) = &config.corpus {
+        let mut files: Vec<PathBuf> = fs::read_dir(dir)
+            .expect("read ZPAQ_BENCH_CORPUS")
+            .filter_map(|e| e.ok().map(|e| e.path()))
+            .filter(|p| p.is_file())
+            .collect();
+        files.sort();
+        for path in files {
+            let name = path.file_name().unwrap().to_string_lossy().into_owned();
+            let data = fs::read(&path).expect("read corpus file");
+            inputs.push(Input {
+                name: format!("corpus:{name}"),
+                data,
+            });
+        }
+    }
+    inputs
+}
+
+/// Resets the peak resident set size of the process, so that the next
+/// reading is the peak of one case. Linux only; elsewhere the peak of the
+/// whole run is not reported.
+fn reset_peak_rss() -> bool {
+    cfg!(target_os = "linux") && fs::write("/proc/self/clear_refs", "5").is_ok()
+}
+
+fn peak_rss_kb() -> Option<u64> {
+    let status = fs::read_to_string("/proc/self/status").ok()?;
+    let line = status.lines().find(|l| l.starts_with("VmHWM:"))?;
+    line.split_whitespace().nth(1)?.parse().ok()
+}
+
+fn measure(run: impl FnOnce() -> Measurement) -> Measurement {
+    let reset = reset_peak_rss();
+    let mut m = run();
+    m.peak_rss_kb = if reset { peak_rss_kb() } else { None };
+    m
+}
+
+fn time<T>(f: impl FnOnce() -> T) -> (T, f64) {
+    let start = Instant::now();
+    let r = f();
+    (r, start.elapsed().as_secs_f64())
+}
+
+fn unique_temp_dir(prefix: &str) -> PathBuf {
+    let nanos = SystemTime::now()
+        .duration_since(UNIX_EPOCH)
+        .expect("clock")
+        .as_nanos();
+    let dir = std::env::temp_dir().join(format!("{prefix}-{}-{nanos}", std::process::id()));
+    fs::create_dir_all(&dir).expect("create temp dir");
+    dir
+}
+
+/// One way of compressing and decompressing an input with a method and a
+/// number of threads.
+type Bench = fn(&[u8], &str, usize) -> Measurement;
+
+/// `compress_to_vec_parallel` and `decompress_to_vec_parallel`, checking the
+/// round trip.
+fn bench_buffer(input: &[u8], method: &str, threads: usize) -> Measurement {
+    let (c, compress_secs) =
+        time(|| compress_to_vec_parallel(input, method, threads).expect("compress"));
+    let (d, decompress_secs) =
+        time(|| decompress_to_vec_parallel(&c, threads).expect("decompress"));
+    assert!(d == input, "round trip mismatch for method {method}");
+    Measurement {
+        compressed: c.len() as u64,
+        compress_secs,
+        decompress_secs: Some(decompress_secs),
+        ..Default::default()
+    }
+}
+
+/// `compress_size_parallel`: compression without keeping the output.
+fn bench_size(input: &[u8], method: &str, threads: usize) -> Measurement {
+    let (compressed, compress_secs) =
+        time(|| compress_size_parallel(input, method, threads).expect("compress_size"));
+    Measurement {
+        compressed,
+        compress_secs,
+        ..Default::default()
+    }
+}
+
+/// `zpaq add` of the input as one file into a new archive, then `zpaq
+/// extract` of it, including the fragment hashing and deduplication.
+fn bench_add(input: &[u8], method: &str, threads: usize) -> Measurement {
+    let dir = unique_temp_dir("zpaq-bench");
+    let src = dir.join("in");
+    let dst = dir.join("out");
+    let archive = dir.join("a.zpaq");
+    fs::create_dir_all(&src).expect("create input dir");
+    fs::write(src.join("data"), input).expect("write input");
+    let (archive_s, src_s, dst_s) = (path_str(&archive), path_str(&src), path_str(&dst));
+    let threads_s = threads.to_string();
+
+    let (_, compress_secs) =
+        time(|| zpaq_add(&archive_s, &[&src_s], method, threads).expect("zpaq add"));
+    let compressed = fs::metadata(&archive).expect("archive").len();
+    let (_, decompress_secs) = time(|| {
+        zpaq_command(&[
+            "extract", &archive_s, &src_s, "-to", &dst_s, "-threads", &threads_s,
+        ])
+        .expect("zpaq extract")
+    });
+    let restored = fs::read(dst.join("data")).expect("read extracted file");
+    assert!(restored == input, "extract mismatch for method {method}");
+    let _ = fs::remove_dir_all(&dir);
+    Measurement {
+        compressed,
+        compress_secs,
+        decompress_secs: Some(decompress_secs),
+        ..Default::default()
+    }
+}
+
+fn path_str(p: &Path) -> String {
+    p.to_str().expect("utf-8 temp path").to_string()
+}
+
+fn mb_per_sec(bytes: usize, secs: f64) -> f64 {
+    bytes as f64 / (1 << 20) as f64 / secs.max(1e-9)
+}
+
+fn json_string(s: &str) -> String {
+    let mut out = String::with_capacity(s.len() + 2);
+    out.push('"');
+    for c in s.chars() {
+        match c {
+            '"' => out.push_str("\\\""),
+            '\\' => out.push_str("\\\\"),
+            c if (c as u32) < 0x20 => out.push_str(&format!("\\u{:04x}", c as u32)),
+            c => out.push(c),
+        }
+    }
+    out.push('"');
+    out
+}
+
+fn opt<T: std::fmt::Display>(v: Option<T>) -> String {
+    v.map_or_else(|| "null".to_string(), |v| v.to_string())
+}
+
+fn main() {
+    let mut config = Config::from_env();
+    let inputs = inputs(&config);
+    let modes: [(&str, Bench); 3] = [
+        ("buffer", bench_buffer),
+        ("size", bench_size),
+        ("add", bench_add),
+    ];
+
+    for input in &inputs {
+        for method in &config.methods {
+            for &threads in &config.threads {
+                for (mode, run) in modes {
+                    let case = format!("{mode}/{method}/{}/{threads}", input.name);
+                    if !config.selected(&case) {
+                        continue;
+                    }
+                    let mut m = measure(|| run(&input.data, method, threads));
+                    for _ in 1..config.iters {
+                        m.merge(measure(|| run(&input.data, method, threads)));
+                    }
+                    let n = input.data.len();
+                    let line = format!(
+                        "{{\"case\":{},\"mode\":\"{mode}\",\"method\":{},\"input\":{},\
+                         \"threads\":{threads},\"bytes\":{n},\"compressed\":{},\
+                         \"ratio\":{:.4},\"compress_s\":{:.6},\"compress_mb_s\":{:.3},\
+                         \"decompress_s\":{},\"decompress_mb_s\":{},\"peak_rss_kb\":{}}}",
+                        json_string(&case),
+                        json_string(method),
+                        json_string(&input.name),
+                        m.compressed,
+                        n as f64 / (m.compressed.max(1) as f64),
+                        m.compress_secs,
+                        mb_per_sec(n, m.compress_secs),
+                        opt(m.decompress_secs.map(|s| format!("{s:.6}"))),
+                        opt(m
+                            .decompress_secs
+                            .map(|s| format!("{:.3}", mb_per_sec(n, s)))),
+                        opt(m.peak_rss_kb),
+                    );
+                    println!("{line}");
+                    if let Some(out) = &mut config.out {
+                        writeln!(out, "{line}").expect("write ZPAQ_BENCH_OUT");
+                    }
+                }
+            }
+        }
+    }
+}
@@ -91,6 +91,8 @@ fn building_python_extension() -> bool {
 fn main() {
     println!("cargo:rerun-if-changed=zpaq/libzpaq.cpp");
     println!("cargo:rerun-if-changed=zpaq/libzpaq.h");
+    println!("cargo:rerun-if-changed=zpaq/zpaq.cpp");
+    println!("cargo:rerun-if-changed=zpaq/jidac.h");
     println!("cargo:rerun-if-changed=zpaq_rs_ffi.cpp");
     println!("cargo:rerun-if-env-changed=PYO3_BUILD_EXTENSION_MODULE");
 
@@ -133,9 +135,20 @@ fn main() {
     let target_arch = env::var("CARGO_CFG_TARGET_ARCH").unwrap_or_default();
     let target_os = env::var("CARGO_CFG_TARGET_OS").unwrap_or_default();
 
-    // libzpaq JIT is x86_64-specific. Force NOJIT on non-x86_64 targets,
-    // while still allowing explicit `--features nojit` on x86_64.
-    if env::var_os("CARGO_FEATURE_NOJIT").is_some() || target_arch != "x86_64" {
+    // libzpaq has x86_64 and AArch64 JIT back-ends. Force NOJIT on other
+    // targets, while still allowing explicit `--features nojit` anywhere.
+    // The AArch64 back-end needs mmap() for executable memory, so it is
+    // left off on Windows and on Apple platforms other than macOS, where
+    // MAP_JIT requires an entitlement.
+    let jit_supported = match target_arch.as_str() {
+        "x86_64" => true,
+        "aarch64" => !matches!(
+            target_os.as_str(),
+            "windows" | "ios" | "tvos" | "watchos" | "visionos"
+        ),
+        _ => false,
+    };
+    if env::var_os("CARGO_FEATURE_NOJIT").is_some() || !jit_supported {
         build.define("NOJIT", None);
     }
 
@@ -166,6 +179,8 @@ fn main() {
     //   C++-side LTO there to preserve reliable linking.
     // - Python extension builds often link with the platform linker rather
     //   than lld, so C++ LLVM bitcode objects are a portability hazard there.
+    // - Linkers without the compiler's LTO plugin (rust-lld with g++ objects)
+    //   cannot read the IR alone, so the objects also carry machine code.
     let profile = env::var("PROFILE").unwrap_or_default();
     if (profile == "release" || profile == "bench")
         && target_os != "windows"
@@ -174,6 +189,7 @@ fn main() {
         && !rustflags_request_pgo()
     {
         build.flag_if_supported("-flto");
+        build.flag_if_supported("-ffat-lto-objects");
     }
 
     build.compile("zpaq_rs_ffi");
@@ -17,6 +17,7 @@
 //! | `"3"` | Better (level 3) |
 //! | `"4"` | Maximum (level 4) |
 //! | `"5"` | Ultra (level 5) |
+//! | `"a"` | Automatic: per block, the best level at 10 MB/s (`aN[sS][rR]`) |
 //! | `"x4.3ci1"` | Example explicit method string |
 //!
 //! Higher numeric levels compress better but are slower and use more memory.
@@ -57,17 +58,30 @@
 //! * [`compress_size_parallel`] / [`compress_size_stream_parallel`] split the
 //!   input into ZPAQ blocks and compress them in parallel, which can be faster
 //!   on multi-core machines for large inputs.
+//! * [`compress_stream_parallel`] / [`compress_to_vec_parallel`] produce the
+//!   same bytes as their single-threaded counterparts from blocks compressed
+//!   in parallel.
+//! * [`decompress_stream_parallel`] / [`decompress_to_vec_parallel`] decode
+//!   the independent blocks of a multi-block stream concurrently and write
+//!   them back in order.
+//! * [`ZpaqContext`] / [`ContextPool`] keep model tables and JIT code between
+//!   calls, which avoids most of the setup cost of many small messages.
 
 mod sys;
 
+use std::borrow::Cow;
 use std::collections::VecDeque;
 use std::ffi::CString;
 use std::fs::OpenOptions;
-use std::io::{Read, Write};
-use std::os::raw::{c_char, c_int};
+use std::io::{Read, Seek, SeekFrom, Write};
+use std::marker::PhantomData;
+use std::os::raw::{c_char, c_int, c_void};
+use std::pin::Pin;
 use std::ptr;
 use std::slice;
-use std::sync::{Arc, Mutex};
+use std::sync::{Arc, Condvar, Mutex};
+use std::task::{Context, Poll, Waker};
+use std::time::Duration;
 
 /// Convenience alias for `std::result::Result<T, ZpaqError>`.
 pub type Result<T> = std::result::Result<T, ZpaqError>;
@@ -518,6 +532,271 @@ impl Drop for StreamingCompressor {
     }
 }
 
+// ---------------- Streaming decompressor ----------------
+
+/// Decoded bytes held for the caller before the decoder waits for them.
+const PUSH_OUTPUT_LIMIT: usize = 1 << 20;
+
+/// Bytes decoded per `decompress(n)` step between hand-offs.
+const PUSH_DECODE_STEP: c_int = 1 << 16;
+
+#[derive(Default)]
+struct PushState {
+    input: Vec<u8>,        // pushed, not yet taken by the decoder
+    finished: bool,        // no more input will be pushed
+    starved: bool,         // the decoder has used all input and waits
+    output: Vec<u8>,       // decoded, not yet written to the caller
+    done: bool,            // the decoder has returned
+    error: Option<String>, // why it stopped early
+    cancelled: bool,       // the decompressor was dropped
+}
+
+#[derive(Default)]
+struct PushShared {
+    state: Mutex<PushState>,
+    cv: Condvar,
+}
+
+impl PushShared {
+    fn lock(&self) -> std::sync::MutexGuard<'_, PushState> {
+        self.state.lock().unwrap_or_else(|e| e.into_inner())
+    }
+
+    /// Moves the decoded bytes in `out` to the caller, waiting while the
+    /// caller still holds `PUSH_OUTPUT_LIMIT` of them.
+    fn emit(&self, out: &MemWriter) -> std::io::Result<()> {
+        let data = out.as_slice();
+        if data.is_empty() {
+            return Ok(());
+        }
+        let mut st = self.lock();
+        while st.output.len() >= PUSH_OUTPUT_LIMIT && !st.cancelled {
+            self.cv.notify_all();
+            st = self.cv.wait(st).unwrap_or_else(|e| e.into_inner());
+        }
+        if st.cancelled {
+            return Err(std::io::Error::other("decompressor dropped"));
+        }
+        st.output.extend_from_slice(data);
+        drop(st);
+        unsafe { sys::zpaq_writer_buffer_clear(out.raw) };
+        Ok(())
+    }
+}
+
+/// The decoder's input: takes all pushed bytes at once, and when they are
+/// used up, hands the output decoded so far to the caller before waiting.
+struct PushedInput {
+    shared: Arc<PushShared>,
+    buf: Vec<u8>,
+    pos: usize,
+    out: *const MemWriter,
+}
+
+// `out` is only used on the decoder thread, which owns the `MemWriter`.
+unsafe impl Send for PushedInput {}
+
+impl Read for PushedInput {
+    fn read(&mut self, out: &mut [u8]) -> std::io::Result<usize> {
+        if self.pos == self.buf.len() {
+            self.shared.emit(unsafe { &*self.out })?;
+            self.buf.clear();
+            self.pos = 0;
+            let mut st = self.shared.lock();
+            loop {
+                if st.cancelled {
+                    return Err(std::io::Error::other("decompressor dropped"));
+                }
+                if !st.input.is_empty() {
+                    std::mem::swap(&mut self.buf, &mut st.input);
+                    break;
+                }
+                if st.finished {
+                    return Ok(0);
+                }
+                st.starved = true;
+                self.shared.cv.notify_all();
+                st = self.shared.cv.wait(st).unwrap_or_else(|e| e.into_inner());
+            }
+        }
+        let n = out.len().min(self.buf.len() - self.pos);
+        out[..n].copy_from_slice(&self.buf[self.pos..self.pos + n]);
+        self.pos += n;
+        Ok(n)
+    }
+}
+
+/// Runs on the decoder thread of a [`StreamingDecompressor`].
+fn decode_pushed(shared: &Arc<PushShared>) -> Result<()> {
+    clear_last_error();
+    let out = MemWriter::with_capacity(PUSH_DECODE_STEP as usize)?;
+    let reader = FfiReader::new(PushedInput {
+        shared: Arc::clone(shared),
+        buf: Vec::new(),
+        pos: 0,
+        out: &out,
+    })?;
+    let d = DecompresserGuard::new()?;
+    check_rc(unsafe { sys::zpaq_decompresser_set_input(d.0, reader.raw) })?;
+    check_rc(unsafe { sys::zpaq_decompresser_set_output(d.0, out.raw) })?;
+    loop {
+        let rc = unsafe { sys::zpaq_decompresser_find_block(d.0, ptr::null_mut()) };
+        if rc < 0 {
+            return Err(err_from_last());
+        }
+        if rc == 0 {
+            break;
+        }
+        loop {
+            let rc = unsafe { sys::zpaq_decompresser_find_filename(d.0, ptr::null_mut()) };
+            if rc < 0 {
+                return Err(err_from_last());
+            }
+            if rc == 0 {
+                break;
+            }
+            check_rc(unsafe { sys::zpaq_decompresser_read_comment(d.0, ptr::null_mut()) })?;
+            loop {
+                let rc = unsafe { sys::zpaq_decompresser_decompress(d.0, PUSH_DECODE_STEP) };
+                if rc < 0 {
+                    return Err(err_from_last());
+                }
+                shared
+                    .emit(&out)
+                    .map_err(|e| ZpaqError::Ffi(e.to_string()))?;
+                if rc == 0 {
+                    break;
+                }
+            }
+            check_rc(unsafe { sys::zpaq_decompresser_read_segment_end(d.0, ptr::null_mut()) })?;
+        }
+    }
+    shared.emit(&out).map_err(|e| ZpaqError::Ffi(e.to_string()))
+}
+
+/// Push-based ZPAQ decompressor for compressed data that arrives in pieces,
+/// e.g. from a network connection.
+///
+/// Each [`push`](Self::push) hands a chunk of compressed data to the decoder
+/// and writes everything that can be decoded from the data so far before it
+/// returns; [`finish`](Self::finish) marks the end of the input and writes
+/// the rest. The decoder runs the `findBlock` / `decompress(n)` /
+/// `readSegmentEnd` loop of `libzpaq::Decompresser` on a thread of its own
+/// and waits there when it runs out of input, so neither the compressed nor
+/// the decoded object is ever held whole: memory is the block's model plus
+/// at most about 1 MB of decoded bytes and the chunk being pushed.
+///
+/// # Example
+///
+/// ```rust
+/// use zpaq_rs::{StreamingDecompressor, compress_to_vec};
+///
+/// let compressed = compress_to_vec(b"hello, hello, hello", "2").unwrap();
+/// let mut d = StreamingDecompressor::new().unwrap();
+/// let mut out = Vec::new();
+/// for chunk in compressed.chunks(7) {
+///     d.push(chunk, &mut out).unwrap();
+/// }
+/// d.finish(&mut out).unwrap();
+/// assert_eq!(out, b"hello, hello, hello");
+/// ```
+pub struct StreamingDecompressor {
+    shared: Arc<PushShared>,
+    worker: Option<std::thread::JoinHandle<()>>,
+    spare: Vec<u8>,
+}
+
+impl StreamingDecompressor {
+    /// Starts a decompressor with no input yet.
+    ///
+    /// Returns [`ZpaqError::Ffi`] if its decoder thread cannot be started.
+    pub fn new() -> Result<Self> {
+        let shared = Arc::new(PushShared::default());
+        let worker_shared = Arc::clone(&shared);
+        let worker = std::thread::Builder::new()
+            .name("zpaq-decompress".into())
+            .spawn(move || {
+                let r = decode_pushed(&worker_shared);
+                let mut st = worker_shared.lock();
+                if let Err(e) = r
+                    && !st.cancelled
+                {
+                    st.error = Some(e.to_string());
+                }
+                st.done = true;
+                drop(st);
+                worker_shared.cv.notify_all();
+            })
+            .map_err(|e| ZpaqError::Ffi(format!("cannot start decoder thread: {e}")))?;
+        Ok(Self {
+            shared,
+            worker: Some(worker),
+            spare: Vec::new(),
+        })
+    }
+
+    /// Decodes `chunk`, the next piece of the compressed stream, and writes
+    /// all output that is ready to `out`.
+    ///
+    /// Returns [`ZpaqError::Ffi`] if the compressed data is invalid or if
+    /// writing to `out` fails.
+    pub fn push<W: Write + ?Sized>(&mut self, chunk: &[u8], out: &mut W) -> Result<()> {
+        if !chunk.is_empty() {
+            let mut st = self.shared.lock();
+            st.input.extend_from_slice(chunk);
+            st.starved = false;
+            drop(st);
+            self.shared.cv.notify_all();
+        }
+        self.drain(out)
+    }
+
+    /// Ends the input and writes the rest of the output to `out`.
+    ///
+    /// Returns [`ZpaqError::Ffi`] if the compressed data is invalid or if
+    /// writing to `out` fails.
+    pub fn finish<W: Write + ?Sized>(mut self, out: &mut W) -> Result<()> {
+        self.shared.lock().finished = true;
+        self.shared.cv.notify_all();
+        self.drain(out)
+    }
+
+    /// Writes decoded bytes to `out` until the decoder waits for input or
+    /// returns.
+    fn drain<W: Write + ?Sized>(&mut self, out: &mut W) -> Result<()> {
+        let mut st = self.shared.lock();
+        loop {
+            if !st.output.is_empty() {
+                self.spare.clear();
+                std::mem::swap(&mut self.spare, &mut st.output);
+                drop(st);
+                self.shared.cv.notify_all();
+                out.write_all(&self.spare)
+                    .map_err(|e| ZpaqError::Ffi(e.to_string()))?;
+                st = self.shared.lock();
+                continue;
+            }
+            if let Some(e) = &st.error {
+                return Err(ZpaqError::Ffi(e.clone()));
+            }
+            if st.done || (st.starved && st.input.is_empty() && !st.finished) {
+                return Ok(());
+            }
+            st = self.shared.cv.wait(st).unwrap_or_else(|e| e.into_inner());
+        }
+    }
+}
+
+impl Drop for StreamingDecompressor {
+    fn drop(&mut self) {
+        self.shared.lock().cancelled = true;
+        self.shared.cv.notify_all();
+        if let Some(worker) = self.worker.take() {
+            let _ = worker.join();
+        }
+    }
+}
+
 unsafe extern "C" fn put_cb<W: Write + Send>(ctx: *mut std::os::raw::c_void, c: c_int) -> c_int {
     unsafe {
         let ctx = &mut *(ctx as *mut WriteCtx<W>);
@@ -555,6 +834,11 @@ impl<R: Read + Send> FfiReader<R> {
         }
         Ok(Self { raw, ctx })
     }
+
+    /// The wrapped reader.  Only valid between FFI calls using `raw`.
+    fn get_ref(&self) -> &R {
+        unsafe { &(*self.ctx).reader }
+    }
 }
 
 impl<R: Read + Send> Drop for FfiReader<R> {
@@ -595,47 +879,69 @@ impl<W: Write + Send> Drop for FfiWriter<W> {
     }
 }
 
-#[derive(Clone, Default)]
-struct SharedVecWriter {
-    inner: Arc<Mutex<Vec<u8>>>,
+/// C++-side reader over a borrowed slice; libzpaq reads it without calling
+/// back into Rust.
+struct MemReader<'a> {
+    raw: *mut sys::RustReader,
+    _data: PhantomData<&'a [u8]>,
 }
 
-impl SharedVecWriter {
-    fn new() -> Self {
-        Self {
-            inner: Arc::new(Mutex::new(Vec::new())),
+impl<'a> MemReader<'a> {
+    fn new(data: &'a [u8]) -> Result<Self> {
+        let raw = unsafe { sys::zpaq_reader_new_memory(data.as_ptr(), data.len()) };
+        if raw.is_null() {
+            return Err(err_from_last());
         }
+        Ok(Self {
+            raw,
+            _data: PhantomData,
+        })
     }
+}
 
-    fn bytes(&self) -> Vec<u8> {
-        self.inner.lock().expect("poisoned writer buffer").clone()
+impl Drop for MemReader<'_> {
+    fn drop(&mut self) {
+        unsafe { sys::zpaq_reader_free(self.raw) };
     }
 }
 
-impl Write for SharedVecWriter {
-    fn write(&mut self, buf: &[u8]) -> std::io::Result<usize> {
-        self.inner
-            .lock()
-            .map_err(|_| std::io::Error::other("poisoned writer buffer"))?
-            .extend_from_slice(buf);
-        Ok(buf.len())
+/// C++-side growable output buffer; the bytes are copied out once with
+/// [`MemWriter::to_vec`].
+struct MemWriter {
+    raw: *mut sys::RustWriter,
+}
+
+impl MemWriter {
+    fn with_capacity(initial: usize) -> Result<Self> {
+        let raw = unsafe { sys::zpaq_writer_new_buffer(initial) };
+        if raw.is_null() {
+            return Err(err_from_last());
+        }
+        Ok(Self { raw })
     }
 
-    fn flush(&mut self) -> std::io::Result<()> {
-        Ok(())
+    fn as_slice(&self) -> &[u8] {
+        unsafe {
+            let len = sys::zpaq_writer_buffer_size(self.raw);
+            if len == 0 {
+                return &[];
+            }
+            std::slice::from_raw_parts(sys::zpaq_writer_buffer_data(self.raw), len)
+        }
     }
-}
 
-#[derive(Default)]
-struct SinkWriter;
+    fn to_vec(&self) -> Vec<u8> {
+        self.as_slice().to_vec()
+    }
 
-impl Write for SinkWriter {
-    fn write(&mut self, buf: &[u8]) -> std::io::Result<usize> {
-        Ok(buf.len())
+    fn clear(&mut self) {
+        unsafe { sys::zpaq_writer_buffer_clear(self.raw) };
     }
+}
 
-    fn flush(&mut self) -> std::io::Result<()> {
-        Ok(())
+impl Drop for MemWriter {
+    fn drop(&mut self) {
+        unsafe { sys::zpaq_writer_free(self.raw) };
     }
 }
 
@@ -674,102 +980,96 @@ pub struct ArchiveEntry<'a> {
     pub comment: Option<&'a str>,
 }
 
-/// Creates a ZPAQ stream archive in memory from raw byte entries.
-///
-/// This performs no scratch-file I/O and writes each entry with its `path`
-/// stored as the segment filename.
-pub fn archive_from_entries(entries: &[ArchiveEntry<'_>], method: &str) -> Result<Vec<u8>> {
-    clear_last_error();
-    if entries.is_empty() {
-        return Ok(Vec::new());
-    }
+/// Comment prefix of the segment of an entry written by
+/// [`archive_from_entries_dedupe`]: its data is the list of fragment IDs
+/// (`u32` little endian) of the entry and the rest of the comment is the
+/// entry's.
+const REFS_COMMENT: &str = "jDR\x01";
 
-    let compressor = unsafe { sys::zpaq_compressor_new() };
-    if compressor.is_null() {
-        return Err(err_from_last());
-    }
+/// Comment prefix of a fragment segment written by
+/// [`archive_from_entries_dedupe`], followed by the fragment ID in decimal.
+const FRAGMENT_COMMENT: &str = "jDF\x01";
 
-    let out_shared = SharedVecWriter::new();
-    let out_writer = FfiWriter::new(out_shared.clone())?;
+struct CompressorGuard(*mut sys::Compressor);
 
-    let set_out = unsafe { sys::zpaq_compressor_set_output(compressor, out_writer.raw) };
-    if set_out != 0 {
-        unsafe { sys::zpaq_compressor_free(compressor) };
-        return Err(err_from_last());
+impl Drop for CompressorGuard {
+    fn drop(&mut self) {
+        unsafe { sys::zpaq_compressor_free(self.0) };
     }
+}
 
-    let rc_tag = unsafe { sys::zpaq_compressor_write_tag(compressor) };
-    if rc_tag != 0 {
-        unsafe { sys::zpaq_compressor_free(compressor) };
+/// Starts a block of `method` on a new compressor writing to `out`.
+fn start_entry_block(out: &MemWriter, method: &str) -> Result<CompressorGuard> {
+    let c = CompressorGuard(unsafe { sys::zpaq_compressor_new() });
+    if c.0.is_null() {
         return Err(err_from_last());
     }
+    check_rc(unsafe { sys::zpaq_compressor_set_output(c.0, out.raw) })?;
+    check_rc(unsafe { sys::zpaq_compressor_write_tag(c.0) })?;
+    start_block_for_method(c.0, method)?;
+    Ok(c)
+}
 
-    start_block_for_method(compressor, method)?;
-
-    for entry in entries {
-        let filename_c = CString::new(entry.path).map_err(|_| ZpaqError::NulInString)?;
-        let comment_c = match entry.comment {
-            Some(text) => Some(CString::new(text).map_err(|_| ZpaqError::NulInString)?),
-            None => None,
-        };
-
-        let rc_seg = unsafe {
-            sys::zpaq_compressor_start_segment(
-                compressor,
-                filename_c.as_ptr(),
-                comment_c
-                    .as_ref()
-                    .map(|s| s.as_ptr())
-                    .unwrap_or(ptr::null()),
-            )
-        };
-        if rc_seg != 0 {
-            unsafe { sys::zpaq_compressor_free(compressor) };
-            return Err(err_from_last());
-        }
+/// Writes a segment of `data` to the block started by [`start_entry_block`].
+fn write_entry_segment(
+    c: &CompressorGuard,
+    filename: &str,
+    comment: Option<&str>,
+    data: &[u8],
+    sha1: Option<&[u8; 20]>,
+) -> Result<()> {
+    let filename_c = CString::new(filename).map_err(|_| ZpaqError::NulInString)?;
+    let comment_c = match comment {
+        Some(text) => Some(CString::new(text).map_err(|_| ZpaqError::NulInString)?),
+        None => None,
+    };
+    check_rc(unsafe {
+        sys::zpaq_compressor_start_segment(
+            c.0,
+            filename_c.as_ptr(),
+            comment_c
+                .as_ref()
+                .map(|s| s.as_ptr())
+                .unwrap_or(ptr::null()),
+        )
+    })?;
 
-        let input = FfiReader::new(std::io::Cursor::new(entry.data))?;
-        let rc_in = unsafe { sys::zpaq_compressor_set_input(compressor, input.raw) };
-        if rc_in != 0 {
-            unsafe { sys::zpaq_compressor_free(compressor) };
+    let input = MemReader::new(data)?;
+    check_rc(unsafe { sys::zpaq_compressor_set_input(c.0, input.raw) })?;
+    loop {
+        let rc = unsafe { sys::zpaq_compressor_compress(c.0, 1 << 20) };
+        if rc < 0 {
             return Err(err_from_last());
         }
-
-        loop {
-            let rc = unsafe { sys::zpaq_compressor_compress(compressor, 1 << 20) };
-            if rc < 0 {
-                unsafe { sys::zpaq_compressor_free(compressor) };
-                return Err(err_from_last());
-            }
-            if rc == 0 {
-                break;
-            }
-        }
-
-        let rc_end_seg = unsafe { sys::zpaq_compressor_end_segment(compressor, ptr::null()) };
-        if rc_end_seg != 0 {
-            unsafe { sys::zpaq_compressor_free(compressor) };
-            return Err(err_from_last());
+        if rc == 0 {
+            break;
         }
     }
+    check_rc(unsafe {
+        sys::zpaq_compressor_end_segment(c.0, sha1.map(|h| h.as_ptr()).unwrap_or(ptr::null()))
+    })
+}
 
-    let rc_end_block = unsafe { sys::zpaq_compressor_end_block(compressor) };
-    unsafe { sys::zpaq_compressor_free(compressor) };
-    if rc_end_block != 0 {
-        return Err(err_from_last());
+/// Creates a ZPAQ stream archive in memory from raw byte entries.
+///
+/// This performs no scratch-file I/O and writes each entry with its `path`
+/// stored as the segment filename.
+pub fn archive_from_entries(entries: &[ArchiveEntry<'_>], method: &str) -> Result<Vec<u8>> {
+    clear_last_error();
+    if entries.is_empty() {
+        return Ok(Vec::new());
     }
 
-    drop(out_writer);
-    Ok(out_shared.bytes())
+    let out_writer = MemWriter::with_capacity(0)?;
+    let compressor = start_entry_block(&out_writer, method)?;
+    for entry in entries {
+        write_entry_segment(&compressor, entry.path, entry.comment, entry.data, None)?;
+    }
+    check_rc(unsafe { sys::zpaq_compressor_end_block(compressor.0) })?;
+    Ok(out_writer.to_vec())
 }
 
-/// Appends raw byte entries to an archive file path without creating scratch files.
-pub fn archive_append_entries_file(
-    archive_path: &str,
-    entries: &[ArchiveEntry<'_>],
-    method: &str,
-) -> Result<()> {
-    let payload = archive_from_entries(entries, method)?;
+fn append_to_file(archive_path: &str, payload: &[u8]) -> Result<()> {
     if payload.is_empty() {
         return Ok(());
     }
@@ -779,169 +1079,834 @@ pub fn archive_append_entries_file(
         .append(true)
         .open(archive_path)
         .map_err(|e| ZpaqError::Ffi(format!("open archive for append failed: {e}")))?;
-    file.write_all(&payload)
+    file.write_all(payload)
         .map_err(|e| ZpaqError::Ffi(format!("append archive write failed: {e}")))
 }
 
-/// Reads the newest segment whose stored filename matches `path` from an
-/// in-memory archive stream.
-fn archive_read_file_bytes_single_stream(archive: &[u8], path: &str) -> Result<Option<Vec<u8>>> {
-    clear_last_error();
-
-    let reader = FfiReader::new(std::io::Cursor::new(archive))?;
-    let decompresser = unsafe { sys::zpaq_decompresser_new() };
-    if decompresser.is_null() {
-        return Err(err_from_last());
-    }
+/// Appends raw byte entries to an archive file path without creating scratch files.
+pub fn archive_append_entries_file(
+    archive_path: &str,
+    entries: &[ArchiveEntry<'_>],
+    method: &str,
+) -> Result<()> {
+    append_to_file(archive_path, &archive_from_entries(entries, method)?)
+}
 
-    let set_in = unsafe { sys::zpaq_decompresser_set_input(decompresser, reader.raw) };
-    if set_in != 0 {
-        unsafe { sys::zpaq_decompresser_free(decompresser) };
-        return Err(err_from_last());
-    }
+/// The fragments of a deduplicating entry archive.
+///
+/// Entries written by [`archive_from_entries_dedupe`] are split into
+/// content-defined fragments the way `zpaq add` splits files, and each
+/// fragment is stored once, under an ID that counts from 1 in archive
+/// order.  The table maps the SHA-1 of each stored fragment to its ID.  It
+/// must describe the archive the new bytes are appended to: start with
+/// [`FragmentTable::new`] for a new archive, or rebuild it with
+/// [`FragmentTable::from_index`], which needs no decoding.
+pub struct FragmentTable {
+    raw: *mut sys::ZpaqFragmentTable,
+    fragment: u32,
+}
 
-    let mut found: Option<Vec<u8>> = None;
-    let mut mem_out = 0.0f64;
+unsafe impl Send for FragmentTable {}
 
-    loop {
-        let rc_block = unsafe { sys::zpaq_decompresser_find_block(decompresser, &mut mem_out) };
-        if rc_block < 0 {
-            unsafe { sys::zpaq_decompresser_free(decompresser) };
+impl FragmentTable {
+    /// Creates the empty table of a new archive, with `zpaq add`'s default
+    /// fragment size (`-fragment 6`: 64 KiB on average).
+    pub fn new() -> Result<Self> {
+        clear_last_error();
+        let raw = unsafe { sys::zpaq_fragment_table_new() };
+        if raw.is_null() {
             return Err(err_from_last());
         }
-        if rc_block == 0 {
-            break;
-        }
-
-        loop {
-            let filename_shared = SharedVecWriter::new();
-            let filename_writer = FfiWriter::new(filename_shared.clone())?;
-            let rc_filename =
-                unsafe { sys::zpaq_decompresser_find_filename(decompresser, filename_writer.raw) };
-            if rc_filename < 0 {
-                unsafe { sys::zpaq_decompresser_free(decompresser) };
-                return Err(err_from_last());
-            }
-            if rc_filename == 0 {
-                break;
-            }
-            drop(filename_writer);
+        Ok(Self { raw, fragment: 6 })
+    }
 
-            let comment_writer = FfiWriter::new(SinkWriter)?;
-            let rc_comment =
-                unsafe { sys::zpaq_decompresser_read_comment(decompresser, comment_writer.raw) };
-            if rc_comment != 0 {
-                unsafe { sys::zpaq_decompresser_free(decompresser) };
+    /// Rebuilds the table of the archive `index` was built from.
+    pub fn from_index(index: &ArchiveIndex) -> Result<Self> {
+        let table = Self::new()?;
+        for &(b, s) in &index.fragments {
+            let sha1 = index.blocks[b].segments[s]
+                .sha1
+                .as_ref()
+                .expect("indexed fragments have a checksum");
+            if unsafe { sys::zpaq_fragment_table_insert(table.raw, sha1.as_ptr()) } == 0 {
                 return Err(err_from_last());
             }
-            drop(comment_writer);
-
-            let mut filename_bytes = filename_shared.bytes();
-            while filename_bytes.last().copied() == Some(0) {
-                filename_bytes.pop();
-            }
-            let filename = String::from_utf8_lossy(&filename_bytes);
-            let is_target = filename == path;
-
-            let output_shared = SharedVecWriter::new();
-            let output_sink: Box<dyn Write + Send> = if is_target {
-                Box::new(output_shared.clone())
-            } else {
-                Box::new(SinkWriter)
-            };
-            let output_writer = FfiWriter::new(output_sink)?;
+        }
+        Ok(table)
+    }
 
-            let rc_set_out =
-                unsafe { sys::zpaq_decompresser_set_output(decompresser, output_writer.raw) };
-            if rc_set_out != 0 {
-                unsafe { sys::zpaq_decompresser_free(decompresser) };
-                return Err(err_from_last());
-            }
+    /// Number of fragments in the table.
+    pub fn len(&self) -> usize {
+        unsafe { sys::zpaq_fragment_table_len(self.raw) as usize }
+    }
 
-            loop {
-                let rc_decompress =
-                    unsafe { sys::zpaq_decompresser_decompress(decompresser, 1 << 20) };
-                if rc_decompress < 0 {
-                    unsafe { sys::zpaq_decompresser_free(decompresser) };
-                    return Err(err_from_last());
-                }
-                if rc_decompress == 0 {
-                    break;
-                }
-            }
+    /// Returns true if the table has no fragments.
+    pub fn is_empty(&self) -> bool {
+        self.len() == 0
+    }
 
-            let mut segment_end = [0u8; 21];
-            let rc_end = unsafe {
-                sys::zpaq_decompresser_read_segment_end(decompresser, segment_end.as_mut_ptr())
-            };
-            if rc_end != 0 {
-                unsafe { sys::zpaq_decompresser_free(decompresser) };
-                return Err(err_from_last());
-            }
+    /// Returns the fragment size parameter (see
+    /// [`FragmentTable::set_fragment`]).
+    pub fn fragment(&self) -> u32 {
+        self.fragment
+    }
 
-            drop(output_writer);
+    /// Splits new entries into fragments of about 2^`fragment` KiB (at
+    /// least 2^`fragment` / 16 KiB, except at the end of an entry), like
+    /// `zpaq add -fragment`.  Smaller fragments find more of the common
+    /// parts of near-duplicate entries, at the cost of more fragment IDs
+    /// per entry.  Changing it between appends is allowed but only
+    /// deduplicates entries split the same way.
+    pub fn set_fragment(&mut self, fragment: u32) {
+        self.fragment = fragment.min(31);
+    }
 
-            if is_target {
-                found = Some(output_shared.bytes());
-            }
+    /// Returns the ID of `data`, SHA-1 and whether it was added.
+    fn add(&mut self, data: &[u8]) -> Result<(u32, [u8; 20], bool)> {
+        let mut sha1 = [0u8; 20];
+        let mut added: c_int = 0;
+        let id = unsafe {
+            sys::zpaq_fragment_table_add(
+                self.raw,
+                data.as_ptr() as *const c_char,
+                data.len(),
+                sha1.as_mut_ptr(),
+                &mut added,
+            )
+        };
+        if id == 0 {
+            return Err(err_from_last());
         }
+        Ok((id, sha1, added != 0))
     }
+}
 
-    unsafe { sys::zpaq_decompresser_free(decompresser) };
-    Ok(found)
+impl Drop for FragmentTable {
+    fn drop(&mut self) {
+        unsafe { sys::zpaq_fragment_table_free(self.raw) };
+    }
 }
 
-/// Reads the newest segment whose stored filename matches `path` from an
-/// archive byte slice.
-///
-/// Supports concatenated ZPAQ streams (e.g. repeated append operations).
-pub fn archive_read_file_bytes(archive: &[u8], path: &str) -> Result<Vec<u8>> {
-    const ZPAQ_TAG: [u8; 13] = [
-        0x37, 0x6b, 0x53, 0x74, 0xa0, 0x31, 0x83, 0xd3, 0x8c, 0xb2, 0x28, 0xb0, 0xd3,
-    ];
+/// Sets `ends` to the end offsets of the fragments of `data`.
+fn fragment_ends(
+    data: &[u8],
+    method: &CString,
+    fragment: u32,
+    ends: &mut Vec<usize>,
+) -> Result<()> {
+    loop {
+        let cap = ends.capacity();
+        let n = unsafe {
+            sys::zpaq_fragments(
+                data.as_ptr() as *const c_char,
+                data.len(),
+                method.as_ptr(),
+                fragment as c_int,
+                ends.as_mut_ptr(),
+                cap,
+            )
+        };
+        if n < 0 {
+            return Err(err_from_last());
+        }
+        let n = n as usize;
+        if n <= cap {
+            unsafe { ends.set_len(n) };
+            return Ok(());
+        }
+        ends.clear();
+        ends.reserve(n);
+    }
+}
 
-    if archive.is_empty() {
-        return Err(ZpaqError::Ffi("archive is empty".into()));
+/// Same as [`archive_from_entries`], but stores only the fragments of the
+/// entries that are not in `table` yet.
+///
+/// Each entry is split into content-defined fragments like `zpaq add`
+/// splits files, and is written as a segment with its `path` that lists
+/// the IDs of its fragments.  The new fragments follow in the same block,
+/// each once, and are added to `table`.  Repeated entries, and entries that
+/// share runs of fragments with earlier ones, in this batch or in the
+/// archive `table` describes, then cost only their fragment lists.
+///
+/// The output must be appended to the archive `table` describes.
+/// [`archive_read_file_bytes`] and [`ArchiveIndex`] reassemble the entries;
+/// other ZPAQ readers see the fragment lists and fragments as segments.
+/// If an error is returned, `table` is left as it was.
+///
+/// # Example
+///
+/// ```rust
+/// use zpaq_rs::{ArchiveEntry, FragmentTable, archive_from_entries_dedupe, archive_read_file_bytes};
+///
+/// let blob = b"setting = 1\n".repeat(1000);
+/// let mut table = FragmentTable::new().unwrap();
+/// let mut archive = archive_from_entries_dedupe(
+///     &[ArchiveEntry { path: "a.conf", data: &blob, comment: None }],
+///     "2",
+///     &mut table,
+/// )
+/// .unwrap();
+/// let fragments = table.len();
+/// let more = archive_from_entries_dedupe(
+///     &[ArchiveEntry { path: "b.conf", data: &blob, comment: None }],
+///     "2",
+///     &mut table,
+/// )
+/// .unwrap();
+/// assert_eq!(table.len(), fragments);
+/// archive.extend_from_slice(&more);
+/// assert_eq!(archive_read_file_bytes(&archive, "b.conf").unwrap(), blob);
+/// ```
+pub fn archive_from_entries_dedupe(
+    entries: &[ArchiveEntry<'_>],
+    method: &str,
+    table: &mut FragmentTable,
+) -> Result<Vec<u8>> {
+    clear_last_error();
+    if entries.is_empty() {
+        return Ok(Vec::new());
     }
+    let method_c = CString::new(method).map_err(|_| ZpaqError::NulInString)?;
+    let before = table.len() as u32;
+    let result = (|| {
+        // Fragment lists of the entries, and the new fragments
+        let mut refs = Vec::with_capacity(entries.len());
+        let mut fresh = Vec::new();
+        let mut ends = Vec::new();
+        for entry in entries {
+            fragment_ends(entry.data, &method_c, table.fragment, &mut ends)?;
+            let mut ids = Vec::with_capacity(ends.len() * 4);
+            let mut pos = 0;
+            for &end in &ends {
+                let data = &entry.data[pos..end];
+                let (id, sha1, added) = table.add(data)?;
+                if added {
+                    fresh.push((id, data, sha1));
+                }
+                ids.extend_from_slice(&id.to_le_bytes());
+                pos = end;
+            }
+            refs.push(ids);
+        }
 
-    let mut starts = Vec::new();
-    for index in 0..=archive.len().saturating_sub(ZPAQ_TAG.len()) {
-        if archive[index..].starts_with(&ZPAQ_TAG) {
-            starts.push(index);
+        let out_writer = MemWriter::with_capacity(0)?;
+        let compressor = start_entry_block(&out_writer, method)?;
+        for (entry, ids) in entries.iter().zip(&refs) {
+            let comment = format!("{REFS_COMMENT}{}", entry.comment.unwrap_or(""));
+            write_entry_segment(&compressor, entry.path, Some(&comment), ids, None)?;
         }
+        for (id, data, sha1) in &fresh {
+            let comment = format!("{FRAGMENT_COMMENT}{id}");
+            write_entry_segment(&compressor, "", Some(&comment), data, Some(sha1))?;
+        }
+        check_rc(unsafe { sys::zpaq_compressor_end_block(compressor.0) })?;
+        Ok(out_writer.to_vec())
+    })();
+    if result.is_err() {
+        unsafe { sys::zpaq_fragment_table_truncate(table.raw, before) };
     }
-    if starts.is_empty() {
-        return Err(ZpaqError::Ffi("no ZPAQ stream header found".into()));
+    result
+}
+
+/// Same as [`archive_append_entries_file`], deduplicating the entries
+/// against each other and the fragments already in the archive as
+/// [`archive_from_entries_dedupe`] does.
+///
+/// The fragment table is rebuilt from the archive's index, kept in the
+/// sidecar file of [`ArchiveIndex::open`] so that each append only scans
+/// the bytes appended since the last one.
+pub fn archive_append_entries_file_dedupe(
+    archive_path: &str,
+    entries: &[ArchiveEntry<'_>],
+    method: &str,
+) -> Result<()> {
+    if entries.is_empty() {
+        return Ok(());
+    }
+    let index = if std::path::Path::new(archive_path).exists() {
+        ArchiveIndex::open(archive_path, true)?
+    } else {
+        ArchiveIndex::default()
+    };
+    let mut table = FragmentTable::from_index(&index)?;
+    append_to_file(
+        archive_path,
+        &archive_from_entries_dedupe(entries, method, &mut table)?,
+    )
+}
+
+/// One segment of an [`IndexedBlock`].
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub struct IndexedSegment {
+    /// Stored filename (empty if the segment has none).
+    pub filename: String,
+    /// Stored comment.
+    pub comment: String,
+    /// Compressed size of the segment data, including its end marker and
+    /// checksum.
+    pub compressed_len: u64,
+    /// SHA-1 of the segment data stored at its end, if any.
+    pub sha1: Option<[u8; 20]>,
+}
+
+/// One ZPAQ block recorded by an [`ArchiveIndex`].
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub struct IndexedBlock {
+    /// Offset decoding can start from: the end of the previous block, or the
+    /// start of the archive.  Locator tags or other bytes between blocks
+    /// belong to the following block.
+    pub offset: u64,
+    /// Bytes from `offset` to the end of the block.
+    pub len: u64,
+    /// Segments in stream order.
+    pub segments: Vec<IndexedSegment>,
+}
+
+/// Block and segment index of a ZPAQ stream archive.
+///
+/// Building the index reads the archive once and skips over the segment
+/// data without running any model.  A read then decodes only the block
+/// that holds the newest segment with the requested filename.  Segments of
+/// one block share their model state, so the segments before the target in
+/// that block are still decoded, with their output discarded.
+///
+/// Entries written by [`archive_from_entries_dedupe`] are read back from
+/// their fragments, decoding each block that holds one of them.
+///
+/// The index records how much of the archive it covers and a checksum of
+/// the covered tail.  [`ArchiveIndex::update`] and [`ArchiveIndex::open`]
+/// only scan the new bytes of an archive that has grown by appending, and
+/// rebuild the index otherwise.  [`ArchiveIndex::open`] can keep the index
+/// in a sidecar file next to the archive.
+///
+/// # Example
+///
+/// ```rust
+/// use zpaq_rs::{ArchiveEntry, ArchiveIndex, archive_from_entries};
+///
+/// let archive = archive_from_entries(
+///     &[ArchiveEntry { path: "a.txt", data: b"hello", comment: None }],
+///     "1",
+/// )
+/// .unwrap();
+/// let index = ArchiveIndex::build(&archive).unwrap();
+/// assert_eq!(index.blocks()[0].segments[0].filename, "a.txt");
+/// assert_eq!(index.read_file_bytes(&archive, "a.txt").unwrap(), b"hello");
+/// ```
+#[derive(Debug, Clone, Default, PartialEq, Eq)]
+pub struct ArchiveIndex {
+    indexed_len: u64,
+    tail_sha1: [u8; 20],
+    blocks: Vec<IndexedBlock>,
+    // Block and segment of fragment ID i + 1
+    fragments: Vec<(usize, usize)>,
+}
+
+const INDEX_MAGIC: &[u8; 8] = b"ZRSIDX2\0";
+
+/// Bytes before `indexed_len` covered by the tail checksum.
+const INDEX_TAIL_LEN: u64 = 4096;
+
+struct DecompresserGuard(*mut sys::Decompresser);
+
+impl DecompresserGuard {
+    fn new() -> Result<Self> {
+        let raw = unsafe { sys::zpaq_decompresser_new() };
+        if raw.is_null() {
+            return Err(err_from_last());
+        }
+        Ok(Self(raw))
+    }
+}
+
+impl Drop for DecompresserGuard {
+    fn drop(&mut self) {
+        unsafe { sys::zpaq_decompresser_free(self.0) };
+    }
+}
+
+fn check_rc(rc: c_int) -> Result<()> {
+    if rc == 0 {
+        Ok(())
+    } else {
+        Err(err_from_last())
+    }
+}
+
+struct CountingReader<R> {
+    inner: R,
+    count: u64,
+}
+
+impl<R: Read> Read for CountingReader<R> {
+    fn read(&mut self, buf: &mut [u8]) -> std::io::Result<usize> {
+        let n = self.inner.read(buf)?;
+        self.count += n as u64;
+        Ok(n)
+    }
+}
+
+fn trimmed_lossy(bytes: &[u8]) -> String {
+    let mut bytes = bytes;
+    while let [rest @ .., 0] = bytes {
+        bytes = rest;
+    }
+    String::from_utf8_lossy(bytes).into_owned()
+}
+
+/// Decodes the segments `wanted` (in increasing order) of the single block
+/// in `block`.
+fn decode_block_segments(block: &[u8], wanted: &[usize]) -> Result<Vec<Vec<u8>>> {
+    clear_last_error();
+    let Some(&last) = wanted.last() else {
+        return Ok(Vec::new());
+    };
+    let reader = MemReader::new(block)?;
+    let mut out = MemWriter::with_capacity(0)?;
+    let mut decoded = Vec::with_capacity(wanted.len());
+    let d = DecompresserGuard::new()?;
+    check_rc(unsafe { sys::zpaq_decompresser_set_input(d.0, reader.raw) })?;
+    let rc = unsafe { sys::zpaq_decompresser_find_block(d.0, ptr::null_mut()) };
+    if rc <= 0 {
+        return Err(if rc < 0 {
+            err_from_last()
+        } else {
+            ZpaqError::Ffi("indexed block not found in archive".into())
+        });
+    }
+    for i in 0..=last {
+        let rc = unsafe { sys::zpaq_decompresser_find_filename(d.0, ptr::null_mut()) };
+        if rc <= 0 {
+            return Err(if rc < 0 {
+                err_from_last()
+            } else {
+                ZpaqError::Ffi("indexed segment not found in archive".into())
+            });
+        }
+        check_rc(unsafe { sys::zpaq_decompresser_read_comment(d.0, ptr::null_mut()) })?;
+        // Other segments are decoded only to advance the model.
+        let keep = wanted[decoded.len()] == i;
+        let target = if keep { out.raw } else { ptr::null_mut() };
+        check_rc(unsafe { sys::zpaq_decompresser_set_output(d.0, target) })?;
+        if unsafe { sys::zpaq_decompresser_decompress(d.0, -1) } < 0 {
+            return Err(err_from_last());
+        }
+        check_rc(unsafe { sys::zpaq_decompresser_read_segment_end(d.0, ptr::null_mut()) })?;
+        if keep {
+            decoded.push(out.to_vec());
+            out.clear();
+        }
+    }
+    Ok(decoded)
+}
+
+fn index_io_error(what: &str, e: std::io::Error) -> ZpaqError {
+    ZpaqError::Ffi(format!("{what} failed: {e}"))
+}
+
+impl ArchiveIndex {
+    /// Builds the index of an in-memory archive.
+    pub fn build(archive: &[u8]) -> Result<Self> {
+        let mut index = Self::default();
+        index.update(archive)?;
+        Ok(index)
+    }
+
+    /// Brings the index up to date with `archive`.
+    ///
+    /// If `archive` still starts with the bytes the index covers, only the
+    /// rest is scanned; otherwise the index is rebuilt.
+    pub fn update(&mut self, archive: &[u8]) -> Result<()> {
+        let covered = archive.len() as u64 >= self.indexed_len
+            && self.tail_sha1_of(archive)? == self.tail_sha1;
+        if !covered {
+            *self = Self::default();
+        }
+        let start = self.indexed_len as usize;
+        self.scan(&archive[start..], self.indexed_len)?;
+        self.tail_sha1 = self.tail_sha1_of(archive)?;
+        Ok(())
+    }
+
+    /// Opens the index of the archive file at `archive_path`.
+    ///
+    /// With `sidecar`, the index is loaded from
+    /// [`ArchiveIndex::sidecar_path`] if it is still valid for the archive,
+    /// extended over any appended bytes, and written back when it changed.
+    /// A missing or stale sidecar is rebuilt.  Without `sidecar`, the index
+    /// is built from the archive and not saved.
+    pub fn open(archive_path: &str, sidecar: bool) -> Result<Self> {
+        let mut file =
+            std::fs::File::open(archive_path).map_err(|e| index_io_error("open archive", e))?;
+        let file_len = file
+            .metadata()
+            .map_err(|e| index_io_error("read archive metadata", e))?
+            .len();
+
+        let sidecar_path = Self::sidecar_path(archive_path);
+        let mut loaded = false;
+        let mut index = Self::default();
+        if sidecar
+            && let Ok(bytes) = std::fs::read(&sidecar_path)
+            && let Ok(saved) = Self::from_bytes(&bytes)
+            && saved.indexed_len <= file_len
+            && sha1(&read_file_range(&mut file, saved.tail_range())?)? == saved.tail_sha1
+        {
+            index = saved;
+            loaded = true;
+        }
+
+        let before = index.indexed_len;
+        file.seek(SeekFrom::Start(index.indexed_len))
+            .map_err(|e| index_io_error("seek archive", e))?;
+        index.scan(&mut file, index.indexed_len)?;
+        index.tail_sha1 = sha1(&read_file_range(&mut file, index.tail_range())?)?;
+
+        if sidecar && (!loaded || index.indexed_len != before) {
+            let tmp = format!("{sidecar_path}.tmp");
+            std::fs::write(&tmp, index.to_bytes())
+                .and_then(|()| std::fs::rename(&tmp, &sidecar_path))
+                .map_err(|e| index_io_error("write archive index", e))?;
+        }
+        Ok(index)
+    }
+
+    /// Path of the sidecar file used by [`ArchiveIndex::open`]:
+    /// `archive_path` with `.idx` appended.
+    pub fn sidecar_path(archive_path: &str) -> String {
+        format!("{archive_path}.idx")
+    }
+
+    /// Number of archive bytes the index covers (the end of its last block).
+    pub fn indexed_len(&self) -> u64 {
+        self.indexed_len
+    }
+
+    /// Indexed blocks in stream order.
+    pub fn blocks(&self) -> &[IndexedBlock] {
+        &self.blocks
+    }
+
+    /// Returns the block and segment numbers of the newest segment whose
+    /// filename is `path`.
+    pub fn find(&self, path: &str) -> Option<(usize, usize)> {
+        self.blocks.iter().enumerate().rev().find_map(|(b, block)| {
+            block
+                .segments
+                .iter()
+                .rposition(|s| s.filename == path)
+                .map(|s| (b, s))
+        })
+    }
+
+    /// Reads the newest segment named `path` from `archive`, decoding only
+    /// the block it is in.
+    pub fn read_file_bytes(&self, archive: &[u8], path: &str) -> Result<Vec<u8>> {
+        self.read_entry(path, |block| {
+            usize::try_from(block.offset)
+                .ok()
+                .zip(usize::try_from(block.offset + block.len).ok())
+                .and_then(|(start, end)| archive.get(start..end))
+                .map(Cow::Borrowed)
+                .ok_or_else(|| ZpaqError::Ffi("archive is shorter than its index".into()))
+        })
     }
 
-    let mut latest = None;
-    for (position, start) in starts.iter().copied().enumerate() {
-        let end = starts.get(position + 1).copied().unwrap_or(archive.len());
-        if end <= start {
-            continue;
+    /// Like [`ArchiveIndex::read_file_bytes`], but seeks to the block in the
+    /// archive file at `archive_path` and reads only that block.
+    pub fn read_file_bytes_from_file(&self, archive_path: &str, path: &str) -> Result<Vec<u8>> {
+        self.find_or_err(path)?;
+        let mut file =
+            std::fs::File::open(archive_path).map_err(|e| index_io_error("open archive", e))?;
+        self.read_entry(path, |block| {
+            read_file_range(&mut file, block.offset..block.offset + block.len).map(Cow::Owned)
+        })
+    }
+
+    /// Reads the newest segment named `path`, and if it is a fragment list
+    /// the fragments it lists, getting the bytes of each block it needs from
+    /// `block_bytes`.
+    fn read_entry<'a>(
+        &self,
+        path: &str,
+        mut block_bytes: impl FnMut(&IndexedBlock) -> Result<Cow<'a, [u8]>>,
+    ) -> Result<Vec<u8>> {
+        let (b, s) = self.find_or_err(path)?;
+        let block = &self.blocks[b];
+        let data = decode_block_segments(&block_bytes(block)?, &[s])?
+            .pop()
+            .unwrap_or_default();
+        if !block.segments[s].comment.starts_with(REFS_COMMENT) {
+            return Ok(data);
+        }
+        if !data.len().is_multiple_of(4) {
+            return Err(ZpaqError::Ffi(format!("invalid fragment list of {path}")));
+        }
+
+        // Locate the fragments and decode each block that holds some
+        let mut ids = Vec::with_capacity(data.len() / 4);
+        let mut wanted: std::collections::BTreeMap<usize, Vec<usize>> = Default::default();
+        for id in data.chunks_exact(4) {
+            let id = u32::from_le_bytes(id.try_into().unwrap()) as usize;
+            let &(fb, fs) = id
+                .checked_sub(1)
+                .and_then(|i| self.fragments.get(i))
+                .ok_or_else(|| ZpaqError::Ffi(format!("fragment {id} of {path} not in archive")))?;
+            wanted.entry(fb).or_default().push(fs);
+            ids.push((fb, fs));
+        }
+        let mut fragments = std::collections::HashMap::new();
+        for (fb, mut segments) in wanted {
+            segments.sort_unstable();
+            segments.dedup();
+            let decoded = decode_block_segments(&block_bytes(&self.blocks[fb])?, &segments)?;
+            fragments.extend(segments.into_iter().map(|fs| (fb, fs)).zip(decoded));
+        }
+        let mut out = Vec::with_capacity(ids.iter().map(|k| fragments[k].len()).sum());
+        for k in &ids {
+            out.extend_from_slice(&fragments[k]);
+        }
+        Ok(out)
+    }
+
+    /// Serializes the index in the sidecar format.
+    pub fn to_bytes(&self) -> Vec<u8> {
+        fn put_str(out: &mut Vec<u8>, s: &str) {
+            out.extend_from_slice(&(s.len() as u32).to_le_bytes());
+            out.extend_from_slice(s.as_bytes());
+        }
+        let mut out = Vec::new();
+        out.extend_from_slice(INDEX_MAGIC);
+        out.extend_from_slice(&self.indexed_len.to_le_bytes());
+        out.extend_from_slice(&self.tail_sha1);
+        out.extend_from_slice(&(self.blocks.len() as u64).to_le_bytes());
+        for block in &self.blocks {
+            out.extend_from_slice(&block.offset.to_le_bytes());
+            out.extend_from_slice(&block.len.to_le_bytes());
+            out.extend_from_slice(&(block.segments.len() as u32).to_le_bytes());
+            for seg in &block.segments {
+                out.extend_from_slice(&seg.compressed_len.to_le_bytes());
+                put_str(&mut out, &seg.filename);
+                put_str(&mut out, &seg.comment);
+                match &seg.sha1 {
+                    Some(h) => {
+                        out.push(1);
+                        out.extend_from_slice(h);
+                    }
+                    None => out.push(0),
+                }
+            }
+        }
+        out
+    }
+
+    /// Parses an index written by [`ArchiveIndex::to_bytes`].
+    pub fn from_bytes(bytes: &[u8]) -> Result<Self> {
+        struct Input<'a>(&'a [u8]);
+        impl<'a> Input<'a> {
+            fn take(&mut self, n: usize) -> Result<&'a [u8]> {
+                if self.0.len() < n {
+                    return Err(ZpaqError::Ffi("truncated archive index".into()));
+                }
+                let (head, rest) = self.0.split_at(n);
+                self.0 = rest;
+                Ok(head)
+            }
+            fn u32(&mut self) -> Result<u32> {
+                Ok(u32::from_le_bytes(self.take(4)?.try_into().unwrap()))
+            }
+            fn u64(&mut self) -> Result<u64> {
+                Ok(u64::from_le_bytes(self.take(8)?.try_into().unwrap()))
+            }
+            fn string(&mut self) -> Result<String> {
+                let n = self.u32()? as usize;
+                String::from_utf8(self.take(n)?.to_vec())
+                    .map_err(|_| ZpaqError::Ffi("invalid archive index".into()))
+            }
+        }
+
+        let mut input = Input(bytes);
+        if input.take(INDEX_MAGIC.len())? != INDEX_MAGIC {
+            return Err(ZpaqError::Ffi("invalid archive index".into()));
+        }
+        let mut index = Self {
+            indexed_len: input.u64()?,
+            tail_sha1: input.take(20)?.try_into().unwrap(),
+            ..Self::default()
+        };
+        let nblocks = input.u64()?;
+        for _ in 0..nblocks {
+            let offset = input.u64()?;
+            let len = input.u64()?;
+            let nseg = input.u32()?;
+            let mut segments = Vec::new();
+            for _ in 0..nseg {
+                let compressed_len = input.u64()?;
+                let filename = input.string()?;
+                let comment = input.string()?;
+                let sha1 = match input.take(1)?[0] {
+                    0 => None,
+                    _ => Some(input.take(20)?.try_into().unwrap()),
+                };
+                segments.push(IndexedSegment {
+                    filename,
+                    comment,
+                    compressed_len,
+                    sha1,
+                });
+            }
+            index.push_block(IndexedBlock {
+                offset,
+                len,
+                segments,
+            });
+        }
+        if !input.0.is_empty() {
+            return Err(ZpaqError::Ffi("invalid archive index".into()));
+        }
+        Ok(index)
+    }
+
+    /// Appends `block`, numbering the fragments in it that continue the
+    /// fragment IDs so far.
+    fn push_block(&mut self, block: IndexedBlock) {
+        let b = self.blocks.len();
+        for (s, seg) in block.segments.iter().enumerate() {
+            if seg.sha1.is_some()
+                && seg.filename.is_empty()
+                && seg.comment.strip_prefix(FRAGMENT_COMMENT)
+                    == Some(&(self.fragments.len() + 1).to_string())
+            {
+                self.fragments.push((b, s));
+            }
         }
-        if let Some(bytes) = archive_read_file_bytes_single_stream(&archive[start..end], path)? {
-            latest = Some(bytes);
+        self.blocks.push(block);
+    }
+
+    fn find_or_err(&self, path: &str) -> Result<(usize, usize)> {
+        self.find(path)
+            .ok_or_else(|| ZpaqError::Ffi(format!("file path not found in archive: {path}")))
+    }
+
+    fn tail_range(&self) -> std::ops::Range<u64> {
+        self.indexed_len.saturating_sub(INDEX_TAIL_LEN)..self.indexed_len
+    }
+
+    fn tail_sha1_of(&self, archive: &[u8]) -> Result<[u8; 20]> {
+        let range = self.tail_range();
+        sha1(&archive[range.start as usize..range.end as usize])
+    }
+
+    /// Appends the blocks read from `reader`, whose first byte is at archive
+    /// offset `base`.  Segment data is skipped, not decoded.
+    fn scan<R: Read + Send>(&mut self, reader: R, base: u64) -> Result<()> {
+        clear_last_error();
+        let reader = FfiReader::new(CountingReader {
+            inner: reader,
+            count: 0,
+        })?;
+        let d = DecompresserGuard::new()?;
+        check_rc(unsafe { sys::zpaq_decompresser_set_input(d.0, reader.raw) })?;
+        let position = || {
+            let buffered = unsafe { sys::zpaq_decompresser_buffered(d.0) };
+            base + reader.get_ref().count - buffered as u64
+        };
+
+        let mut filename = MemWriter::with_capacity(0)?;
+        let mut comment = MemWriter::with_capacity(0)?;
+        let mut start = base;
+        loop {
+            let rc = unsafe { sys::zpaq_decompresser_find_block(d.0, ptr::null_mut()) };
+            if rc < 0 {
+                return Err(err_from_last());
+            }
+            if rc == 0 {
+                break;
+            }
+            let mut segments = Vec::new();
+            loop {
+                filename.clear();
+                let rc = unsafe { sys::zpaq_decompresser_find_filename(d.0, filename.raw) };
+                if rc < 0 {
+                    return Err(err_from_last());
+                }
+                if rc == 0 {
+                    break;
+                }
+                comment.clear();
+                check_rc(unsafe { sys::zpaq_decompresser_read_comment(d.0, comment.raw) })?;
+                let data_start = position();
+                let mut end = [0u8; 21];
+                check_rc(unsafe {
+                    sys::zpaq_decompresser_read_segment_end(d.0, end.as_mut_ptr())
+                })?;
+                segments.push(IndexedSegment {
+                    filename: trimmed_lossy(filename.as_slice()),
+                    comment: String::from_utf8_lossy(comment.as_slice()).into_owned(),
+                    compressed_len: position() - data_start,
+                    sha1: (end[0] == 1).then(|| end[1..].try_into().unwrap()),
+                });
+            }
+            let end = position();
+            self.push_block(IndexedBlock {
+                offset: start,
+                len: end - start,
+                segments,
+            });
+            start = end;
         }
+        self.indexed_len = start;
+        Ok(())
     }
+}
+
+fn read_file_range(file: &mut std::fs::File, range: std::ops::Range<u64>) -> Result<Vec<u8>> {
+    file.seek(SeekFrom::Start(range.start))
+        .map_err(|e| index_io_error("seek archive", e))?;
+    let mut bytes = vec![0u8; (range.end - range.start) as usize];
+    file.read_exact(&mut bytes)
+        .map_err(|e| index_io_error("read archive", e))?;
+    Ok(bytes)
+}
 
-    latest.ok_or_else(|| ZpaqError::Ffi(format!("file path not found in archive: {path}")))
+/// Reads the newest segment whose stored filename matches `path` from an
+/// archive byte slice.
+///
+/// Supports concatenated ZPAQ streams (e.g. repeated append operations).
+/// Builds an [`ArchiveIndex`] and decodes only the block holding `path`;
+/// keep the index yourself to serve several reads from one archive.
+pub fn archive_read_file_bytes(archive: &[u8], path: &str) -> Result<Vec<u8>> {
+    if archive.is_empty() {
+        return Err(ZpaqError::Ffi("archive is empty".into()));
+    }
+    let index = ArchiveIndex::build(archive)?;
+    if index.blocks().is_empty() {
+        return Err(ZpaqError::Ffi("no ZPAQ stream header found".into()));
+    }
+    index.read_file_bytes(archive, path)
 }
 
 /// Reads bytes for `path` from an archive file.
+///
+/// The file is scanned once without decoding and then only the block
+/// holding `path` is read again.  Use [`ArchiveIndex::open`] with a sidecar
+/// to avoid the scan on later calls.
 pub fn archive_read_file_bytes_from_file(archive_path: &str, path: &str) -> Result<Vec<u8>> {
-    let archive = std::fs::read(archive_path)
-        .map_err(|e| ZpaqError::Ffi(format!("read archive file failed: {e}")))?;
-    archive_read_file_bytes(&archive, path)
+    let index = ArchiveIndex::open(archive_path, false)?;
+    if index.blocks().is_empty() {
+        return Err(ZpaqError::Ffi("no ZPAQ stream header found".into()));
+    }
+    index.read_file_bytes_from_file(archive_path, path)
 }
 
 // ---------------- Public API ----------------
 
 /// Compresses `input` into a `Vec<u8>` using the given ZPAQ method string.
 ///
-/// This is a convenience wrapper around [`compress_stream`] that owns both the
-/// input and output buffers.  For large data, prefer [`compress_stream`] to
-/// avoid double-buffering, or [`compress_size`] if you only need the size.
+/// Produces the same bytes as [`compress_stream`], but libzpaq reads `input`
+/// and writes its output through C++-side buffers, so no Rust callbacks run
+/// during compression.  Use [`compress_size`] if you only need the size.
 ///
 /// # Example
 ///
@@ -950,10 +1915,60 @@ pub fn archive_read_file_bytes_from_file(archive_path: &str, path: &str) -> Resu
 /// assert!(!compressed.is_empty());
 /// ```
 pub fn compress_to_vec(input: &[u8], method: &str) -> Result<Vec<u8>> {
-    let cursor = std::io::Cursor::new(input);
-    let mut out = Vec::new();
-    compress_stream(cursor, &mut out, method, None, None)?;
-    Ok(out)
+    clear_last_error();
+    let method_c = CString::new(method).map_err(|_| ZpaqError::NulInString)?;
+    let reader = MemReader::new(input)?;
+    let writer = MemWriter::with_capacity(input.len() / 2 + 64)?;
+    let rc = unsafe {
+        sys::zpaq_compress(
+            reader.raw,
+            writer.raw,
+            method_c.as_ptr(),
+            ptr::null(),
+            ptr::null(),
+            1,
+        )
+    };
+    if rc == 0 {
+        Ok(writer.to_vec())
+    } else {
+        Err(err_from_last())
+    }
+}
+
+/// Compresses `input` into a `Vec<u8>` using up to `threads` threads.
+///
+/// Like [`compress_stream_parallel`], but the workers read their blocks
+/// directly from `input` without going through a reader callback.  The
+/// result is byte-identical to [`compress_to_vec`].
+///
+/// # Example
+///
+/// ```rust
+/// let c = zpaq_rs::compress_to_vec_parallel(b"hello zpaq", "1", 4).unwrap();
+/// assert_eq!(c, zpaq_rs::compress_to_vec(b"hello zpaq", "1").unwrap());
+/// ```
+pub fn compress_to_vec_parallel(input: &[u8], method: &str, threads: usize) -> Result<Vec<u8>> {
+    clear_last_error();
+    let method_c = CString::new(method).map_err(|_| ZpaqError::NulInString)?;
+    let writer = MemWriter::with_capacity(input.len() / 2 + 64)?;
+    let rc = unsafe {
+        sys::zpaq_compress_buffer_parallel(
+            input.as_ptr() as *const c_char,
+            input.len(),
+            writer.raw,
+            method_c.as_ptr(),
+            ptr::null(),
+            ptr::null(),
+            1,
+            threads.min(c_int::MAX as usize) as c_int,
+        )
+    };
+    if rc == 0 {
+        Ok(writer.to_vec())
+    } else {
+        Err(err_from_last())
+    }
 }
 
 /// Returns the compressed size of `input` in bytes without materialising the
@@ -970,24 +1985,62 @@ pub fn compress_to_vec(input: &[u8], method: &str) -> Result<Vec<u8>> {
 /// assert!(sz > 0);
 /// ```
 pub fn compress_size(input: &[u8], method: &str) -> Result<u64> {
-    compress_size_stream(std::io::Cursor::new(input), method, None, None)
+    clear_last_error();
+    let method_c = CString::new(method).map_err(|_| ZpaqError::NulInString)?;
+    let reader = MemReader::new(input)?;
+    let mut out_size: u64 = 0;
+    let rc = unsafe {
+        sys::zpaq_compress_size(
+            reader.raw,
+            method_c.as_ptr(),
+            ptr::null(),
+            ptr::null(),
+            1,
+            &mut out_size as *mut u64,
+        )
+    };
+    if rc == 0 {
+        Ok(out_size)
+    } else {
+        Err(err_from_last())
+    }
 }
 
 /// Returns the compressed size of `input` in bytes using multiple threads.
 ///
 /// Splits the input into ZPAQ blocks (based on the method's block size) and
-/// compresses them in parallel using `libzpaq::compressBlock`.  For
-/// `threads <= 1` this falls back to the single-threaded path.
+/// compresses them in parallel using `libzpaq::compressBlock`.  The workers
+/// copy their blocks straight from `input`, and at most `threads + 1` blocks
+/// are in memory at a time.
 ///
-/// Equivalent to [`compress_size_stream_parallel`] with a [`std::io::Cursor`]
-/// over `input`.
+/// Returns the same value as [`compress_size_stream_parallel`] with a
+/// [`std::io::Cursor`] over `input`.
 pub fn compress_size_parallel(input: &[u8], method: &str, threads: usize) -> Result<u64> {
-    compress_size_stream_parallel(std::io::Cursor::new(input), method, None, None, threads)
-}
-
-/// Returns the compressed size of data from `reader` in bytes without
-/// materialising the compressed output.
-///
+    clear_last_error();
+    let method_c = CString::new(method).map_err(|_| ZpaqError::NulInString)?;
+    let mut out_size: u64 = 0;
+    let rc = unsafe {
+        sys::zpaq_compress_size_buffer_parallel(
+            input.as_ptr() as *const c_char,
+            input.len(),
+            method_c.as_ptr(),
+            ptr::null(),
+            ptr::null(),
+            1,
+            threads.min(c_int::MAX as usize) as c_int,
+            &mut out_size as *mut u64,
+        )
+    };
+    if rc == 0 {
+        Ok(out_size)
+    } else {
+        Err(err_from_last())
+    }
+}
+
+/// Returns the compressed size of data from `reader` in bytes without
+/// materialising the compressed output.
+///
 /// Uses a C++-side counting writer to avoid Rust-side per-write overhead.
 /// `filename` and `comment` are optional ZPAQ segment metadata fields; pass
 /// `None` for both unless you are building interoperable archives.
@@ -1035,8 +2088,10 @@ pub fn compress_size_stream<R: Read + Send>(
 /// Returns the compressed size of data from `reader` in bytes using multiple
 /// threads.
 ///
-/// Splits the input into ZPAQ blocks and compresses them in parallel.  Falls
-/// back to the single-threaded path when `threads <= 1`.
+/// Splits the input into ZPAQ blocks and compresses them in parallel.  The
+/// reader is throttled so that at most `threads + 1` blocks are held in
+/// memory at once.  Falls back to the single-threaded path when
+/// `threads <= 1`.
 pub fn compress_size_stream_parallel<R: Read + Send>(
     reader: R,
     method: &str,
@@ -1080,6 +2135,80 @@ pub fn compress_size_stream_parallel<R: Read + Send>(
     }
 }
 
+/// An estimated compressed size from [`estimate_size_sampled`].
+#[derive(Debug, Default, Clone, Copy, PartialEq, Eq)]
+pub struct SizeEstimate {
+    /// Estimated compressed size in bytes.
+    pub bytes: u64,
+    /// 95% confidence bound on the difference between `bytes` and the
+    /// estimate of all blocks, or 0 if every block was estimated.
+    pub error: u64,
+    /// Blocks in the input.
+    pub blocks: u64,
+    /// Blocks that were estimated.
+    pub sampled_blocks: u64,
+}
+
+/// Estimates [`compress_size`]`(input, method)` without arithmetic coding.
+///
+/// The model predicts and learns from every bit as in real compression, but
+/// the ideal code lengths of its predictions are added up instead of being
+/// coded, and SHA-1 is not computed.  The result is usually within a few
+/// bytes of the real size per block, and takes less time the more the coder
+/// and checksum cost relative to the model (most at low levels).  Blocks
+/// are estimated on `threads` threads.
+///
+/// # Example
+///
+/// ```rust
+/// let data = b"an estimate of an estimate of an estimate".repeat(100);
+/// let est = zpaq_rs::estimate_size(&data, "3", 1).unwrap();
+/// let real = zpaq_rs::compress_size(&data, "3").unwrap();
+/// assert!(est.abs_diff(real) <= 8);
+/// ```
+pub fn estimate_size(input: &[u8], method: &str, threads: usize) -> Result<u64> {
+    estimate_size_sampled(input, method, threads, 1.0).map(|e| e.bytes)
+}
+
+/// Same as [`estimate_size`], estimating only a `fraction` of the blocks.
+///
+/// When `0 < fraction < 1`, an evenly spaced sample of
+/// `ceil(fraction * blocks)` blocks (at least 2) is estimated and scaled to
+/// the whole input by its ratio of compressed to input bytes.
+/// [`SizeEstimate::error`] then bounds the sampling error.  Other fractions
+/// estimate every block.  Sampling only saves time when the input has many
+/// blocks (see the block size of the method).
+pub fn estimate_size_sampled(
+    input: &[u8],
+    method: &str,
+    threads: usize,
+    fraction: f64,
+) -> Result<SizeEstimate> {
+    clear_last_error();
+    let method_c = CString::new(method).map_err(|_| ZpaqError::NulInString)?;
+    let mut e = sys::ZpaqSizeEstimate::default();
+    let rc = unsafe {
+        sys::zpaq_estimate_size_buffer(
+            input.as_ptr() as *const c_char,
+            input.len(),
+            method_c.as_ptr(),
+            threads.min(c_int::MAX as usize) as c_int,
+            fraction,
+            &mut e,
+        )
+    };
+    if rc == 0 {
+        Ok(SizeEstimate {
+            bytes: e.bytes,
+            error: e.error,
+            blocks: e.blocks,
+            sampled_blocks: e.sampled,
+        })
+    } else {
+        Err(err_from_last())
+    }
+}
+
 /// Returns the archive size (in bytes) that `zpaq add` would produce for a
 /// single file on disk.
 ///
@@ -1118,6 +2247,28 @@ pub fn zpaq_add_archive_size_file(path: &str, method: &str, threads: usize) -> R
     }
 }
 
+/// Same as [`zpaq_add_archive_size_file`] with the blocks estimated as by
+/// [`estimate_size`] instead of compressed (`zpaq add "" <path> -estimate`).
+pub fn zpaq_add_archive_estimate_file(path: &str, method: &str, threads: usize) -> Result<u64> {
+    clear_last_error();
+    let path_c = CString::new(path).map_err(|_| ZpaqError::NulInString)?;
+    let method_c = CString::new(method).map_err(|_| ZpaqError::NulInString)?;
+    let mut out_size: u64 = 0;
+    let rc = unsafe {
+        sys::zpaq_jidac_add_archive_estimate_file(
+            path_c.as_ptr(),
+            method_c.as_ptr(),
+            threads as c_int,
+            &mut out_size as *mut u64,
+        )
+    };
+    if rc == 0 {
+        Ok(out_size)
+    } else {
+        Err(err_from_last())
+    }
+}
+
 /// Runs an embedded `zpaq` command in-process and captures its output.
 ///
 /// `args` must contain only the command arguments, exactly as you would pass
@@ -1186,12 +2337,316 @@ pub fn zpaq_list(archive: &str, files: &[&str]) -> Result<ZpaqCommandOutput> {
     zpaq_command_inner(&args)
 }
 
+/// Results of an embedded `zpaq` command run with [`JidacCommand`].
+///
+/// Fields that do not apply to the command are 0.
+#[derive(Debug, Default, Clone, Copy, PartialEq, Eq)]
+pub struct JidacSummary {
+    /// Exit code of the `zpaq` binary: 0 OK, 1 warnings.
+    pub exit_code: i32,
+    /// Versions (updates) in the archive.
+    pub versions: u64,
+    /// Archive size in bytes after the command.
+    pub archive_size: u64,
+    /// `add`: archive size in bytes before the update.
+    pub header_size: u64,
+    /// `add`: bytes of changed input files. `list`: bytes of files shown.
+    pub input_size: u64,
+    /// `add`, `list`: those bytes after deduplication.
+    pub dedupe_size: u64,
+    /// Files added, extracted without error, or in the listed version.
+    pub files: u64,
+    /// `add`: files marked as deleted.
+    pub removed: u64,
+    /// Files that could not be added or extracted.
+    pub errors: u64,
+}
+
+impl From<sys::ZpaqJidacSummary> for JidacSummary {
+    fn from(s: sys::ZpaqJidacSummary) -> Self {
+        let n = |v: i64| v.max(0) as u64;
+        JidacSummary {
+            exit_code: s.exit_code,
+            versions: n(s.versions),
+            archive_size: n(s.archive_size),
+            header_size: n(s.header_size),
+            input_size: n(s.input_size),
+            dedupe_size: n(s.dedupe_size),
+            files: n(s.files),
+            removed: n(s.removed),
+            errors: n(s.errors),
+        }
+    }
+}
+
+/// Counters and timers of an embedded `zpaq` command, passed to the
+/// [`JidacCommand::progress`] callback as it runs and returned by
+/// [`JidacCommand::run_with_stats`].
+///
+/// Times are summed over the command's threads. Fields that do not apply
+/// to the command are 0.
+#[derive(Debug, Default, Clone, Copy, PartialEq, Eq)]
+pub struct JidacStats {
+    /// `add`, `extract`: bytes to add or extract.
+    pub total_bytes: u64,
+    /// Of those, bytes added or extracted so far.
+    pub done_bytes: u64,
+    /// `add`: bytes read from the input files.
+    pub bytes_read: u64,
+    /// `add`: fragments the input files were split into.
+    pub fragments: u64,
+    /// `add`: reading and fragmenting the input, SHA-1 and analysis.
+    pub scan_time: Duration,
+    /// `add`: time spent waiting for the scan of the input.
+    pub scan_wait: Duration,
+    /// `add`: fragments already in the archive (deduplicated).
+    pub dedupe_hits: u64,
+    /// `add`: new fragments.
+    pub dedupe_misses: u64,
+    /// `add`: blocks compressed.
+    pub blocks_compressed: u64,
+    /// `add`: bytes of those blocks.
+    pub compress_in_bytes: u64,
+    /// `add`: those bytes after compression.
+    pub compress_out_bytes: u64,
+    /// `add`: time compressing blocks.
+    pub compress_time: Duration,
+    /// `add`: time waiting for an empty block buffer.
+    pub queue_wait: Duration,
+    /// `add`: time full blocks waited for a compression thread.
+    pub compressor_wait: Duration,
+    /// `add`: time the archive writer waited for the next block.
+    pub write_stall: Duration,
+    /// `add`: time writing blocks to the archive.
+    pub write_time: Duration,
+    /// `extract`: blocks decompressed.
+    pub blocks_decompressed: u64,
+    /// `extract`: bytes of those blocks.
+    pub decompress_bytes: u64,
+    /// `extract`: time decompressing and verifying blocks.
+    pub decompress_time: Duration,
+}
+
+impl From<&sys::ZpaqJidacStats> for JidacStats {
+    fn from(s: &sys::ZpaqJidacStats) -> Self {
+        let n = |v: i64| v.max(0) as u64;
+        let t = |v: i64| Duration::from_nanos(n(v));
+        JidacStats {
+            total_bytes: n(s.total_bytes),
+            done_bytes: n(s.done_bytes),
+            bytes_read: n(s.bytes_read),
+            fragments: n(s.fragments),
+            scan_time: t(s.scan_ns),
+            scan_wait: t(s.scan_wait_ns),
+            dedupe_hits: n(s.dedupe_hits),
+            dedupe_misses: n(s.dedupe_misses),
+            blocks_compressed: n(s.blocks_compressed),
+            compress_in_bytes: n(s.compress_in_bytes),
+            compress_out_bytes: n(s.compress_out_bytes),
+            compress_time: t(s.compress_ns),
+            queue_wait: t(s.queue_wait_ns),
+            compressor_wait: t(s.compressor_wait_ns),
+            write_stall: t(s.write_stall_ns),
+            write_time: t(s.write_ns),
+            blocks_decompressed: n(s.blocks_decompressed),
+            decompress_bytes: n(s.decompress_bytes),
+            decompress_time: t(s.decompress_ns),
+        }
+    }
+}
+
+/// An embedded `zpaq` command with its own console.
+///
+/// Unlike [`zpaq_command`], which captures output as strings, the command's
+/// standard output and error go to optional writers (by default they are
+/// discarded) and its results are returned as a [`JidacSummary`]. Each run
+/// uses its own JIDAC instance, so commands on different threads run
+/// concurrently. Note that relative paths are resolved against the
+/// process-wide working directory.
+///
+/// # Examples
+///
+/// ```rust,no_run
+/// let mut listing = Vec::new();
+/// let summary = zpaq_rs::JidacCommand::new(&["list", "backup.zpaq"])
+///     .stdout(&mut listing)
+///     .run()?;
+/// println!("{} versions, {} files", summary.versions, summary.files);
+/// # Ok::<(), zpaq_rs::ZpaqError>(())
+/// ```
+pub struct JidacCommand<'a> {
+    args: Vec<String>,
+    stdout: Option<&'a mut (dyn Write + Send)>,
+    stderr: Option<&'a mut (dyn Write + Send)>,
+    progress: Option<&'a mut (dyn FnMut(&JidacStats) + Send)>,
+}
+
+struct ConsoleCtx<'a> {
+    out: Option<&'a mut (dyn Write + Send)>,
+    err: Option<&'a mut (dyn Write + Send)>,
+    progress: Option<&'a mut (dyn FnMut(&JidacStats) + Send)>,
+    failed: Option<std::io::Error>,
+}
+
+impl ConsoleCtx<'_> {
+    fn put(&mut self, to_err: bool, s: &[u8]) {
+        if self.failed.is_some() {
+            return;
+        }
+        let w = if to_err {
+            self.err.as_mut()
+        } else {
+            self.out.as_mut()
+        };
+        if let Some(w) = w
+            && let Err(e) = w.write_all(s)
+        {
+            self.failed = Some(e);
+        }
+    }
+}
+
+// JIDAC calls the sinks of a command one at a time, possibly from its
+// worker threads.
+unsafe extern "C" fn console_out_cb(ctx: *mut std::os::raw::c_void, s: *const c_char, n: usize) {
+    unsafe {
+        let ctx = &mut *(ctx as *mut ConsoleCtx<'_>);
+        ctx.put(false, slice::from_raw_parts(s as *const u8, n));
+    }
+}
+
+unsafe extern "C" fn console_err_cb(ctx: *mut std::os::raw::c_void, s: *const c_char, n: usize) {
+    unsafe {
+        let ctx = &mut *(ctx as *mut ConsoleCtx<'_>);
+        ctx.put(true, slice::from_raw_parts(s as *const u8, n));
+    }
+}
+
+// Called like the sinks, one call at a time and never during one of them.
+unsafe extern "C" fn progress_cb(
+    ctx: *mut std::os::raw::c_void,
+    stats: *const sys::ZpaqJidacStats,
+) {
+    unsafe {
+        let ctx = &mut *(ctx as *mut ConsoleCtx<'_>);
+        if let Some(f) = ctx.progress.as_mut() {
+            f(&JidacStats::from(&*stats));
+        }
+    }
+}
+
+impl<'a> JidacCommand<'a> {
+    /// Creates a command from the arguments that would follow `zpaq` on the
+    /// shell, e.g. `["add", "backup.zpaq", "data", "-method", "3"]`.
+    pub fn new(args: &[&str]) -> Self {
+        JidacCommand {
+            args: args.iter().map(|s| (*s).to_string()).collect(),
+            stdout: None,
+            stderr: None,
+            progress: None,
+        }
+    }
+
+    /// Sends the command's standard output to `w`.
+    pub fn stdout(mut self, w: &'a mut (dyn Write + Send)) -> Self {
+        self.stdout = Some(w);
+        self
+    }
+
+    /// Sends the command's standard error (warnings and the final timing
+    /// line) to `w`.
+    pub fn stderr(mut self, w: &'a mut (dyn Write + Send)) -> Self {
+        self.stderr = Some(w);
+        self
+    }
+
+    /// Calls `f` with the counters of the command after each file and
+    /// block, e.g. to show progress or to find where a job stalls. The
+    /// calls come from the command's threads, one at a time.
+    pub fn progress(mut self, f: &'a mut (dyn FnMut(&JidacStats) + Send)) -> Self {
+        self.progress = Some(f);
+        self
+    }
+
+    /// Runs the command.
+    ///
+    /// # Errors
+    ///
+    /// Returns [`ZpaqError::Ffi`] if the command fails (exit code 2) or if
+    /// writing its output fails. Warnings (exit code 1) are reported in
+    /// [`JidacSummary::exit_code`].
+    pub fn run(self) -> Result<JidacSummary> {
+        self.run_inner(false).map(|(summary, _)| summary)
+    }
+
+    /// Runs the command like [`run`](Self::run) and also returns its
+    /// counters and timers. Without this or a [`progress`](Self::progress)
+    /// callback, nothing is counted.
+    pub fn run_with_stats(self) -> Result<(JidacSummary, JidacStats)> {
+        self.run_inner(true)
+    }
+
+    fn run_inner(self, want_stats: bool) -> Result<(JidacSummary, JidacStats)> {
+        clear_last_error();
+        let mut cargs = Vec::with_capacity(self.args.len() + 1);
+        cargs.push(CString::new("zpaq").map_err(|_| ZpaqError::NulInString)?);
+        for arg in &self.args {
+            cargs.push(CString::new(arg.as_str()).map_err(|_| ZpaqError::NulInString)?);
+        }
+        let ptrs: Vec<*const c_char> = cargs.iter().map(|s| s.as_ptr()).collect();
+
+        let out_cb = self
+            .stdout
+            .is_some()
+            .then_some(console_out_cb as sys::ZpaqTextFn);
+        let err_cb = self
+            .stderr
+            .is_some()
+            .then_some(console_err_cb as sys::ZpaqTextFn);
+        let progress_fn = self
+            .progress
+            .is_some()
+            .then_some(progress_cb as sys::ZpaqProgressFn);
+        let mut ctx = ConsoleCtx {
+            out: self.stdout,
+            err: self.stderr,
+            progress: self.progress,
+            failed: None,
+        };
+        let mut summary = sys::ZpaqJidacSummary::default();
+        let mut stats = sys::ZpaqJidacStats::default();
+        let rc = unsafe {
+            sys::zpaq_jidac_command(
+                ptrs.len().min(c_int::MAX as usize) as c_int,
+                ptrs.as_ptr(),
+                out_cb,
+                err_cb,
+                &mut ctx as *mut ConsoleCtx<'_> as *mut std::os::raw::c_void,
+                &mut summary,
+                progress_fn,
+                if want_stats {
+                    &mut stats
+                } else {
+                    ptr::null_mut()
+                },
+            )
+        };
+        if rc != 0 {
+            return Err(err_from_last());
+        }
+        if let Some(e) = ctx.failed {
+            return Err(ZpaqError::Ffi(e.to_string()));
+        }
+        Ok((summary.into(), JidacStats::from(&stats)))
+    }
+}
+
 /// Decompresses a complete ZPAQ stream held in `input` and returns the
 /// original data as a `Vec<u8>`.
 ///
-/// This is a convenience wrapper around [`decompress_stream`] that owns both
-/// the input and output.  For large data, prefer [`decompress_stream`] to
-/// avoid double-buffering.
+/// Like [`compress_to_vec`], this reads `input` and collects the output on
+/// the C++ side without Rust callbacks.  For large data, prefer
+/// [`decompress_stream`] to avoid holding the whole output twice.
 ///
 /// # Example
 ///
@@ -1201,18 +2656,31 @@ pub fn zpaq_list(archive: &str, files: &[&str]) -> Result<ZpaqCommandOutput> {
 /// assert_eq!(d, b"hello zpaq");
 /// ```
 pub fn decompress_to_vec(input: &[u8]) -> Result<Vec<u8>> {
-    let cursor = std::io::Cursor::new(input);
-    let mut out = Vec::new();
-    decompress_stream(cursor, &mut out)?;
-    Ok(out)
+    clear_last_error();
+    let reader = MemReader::new(input)?;
+    let writer = MemWriter::with_capacity(input.len().saturating_mul(2))?;
+    let rc = unsafe { sys::zpaq_decompress(reader.raw, writer.raw) };
+    if rc == 0 {
+        Ok(writer.to_vec())
+    } else {
+        Err(err_from_last())
+    }
 }
 
 /// Returns the decompressed size of the ZPAQ stream in `input` without
 /// materialising the output.
 ///
-/// Wrapper around [`decompress_size_stream`] with a [`std::io::Cursor`].
+/// Same as [`decompress_size_stream`], reading `input` without callbacks.
 pub fn decompress_size(input: &[u8]) -> Result<u64> {
-    decompress_size_stream(std::io::Cursor::new(input))
+    clear_last_error();
+    let reader = MemReader::new(input)?;
+    let mut out_size: u64 = 0;
+    let rc = unsafe { sys::zpaq_decompress_size(reader.raw, &mut out_size as *mut u64) };
+    if rc == 0 {
+        Ok(out_size)
+    } else {
+        Err(err_from_last())
+    }
 }
 
 /// Returns the decompressed size of the ZPAQ stream from `reader` without
@@ -1290,26 +2758,908 @@ pub fn compress_stream<R: Read + Send, W: Write + Send>(
     }
 }
 
-/// Decompresses a ZPAQ archive from `reader` and writes raw data to `writer`.
+/// Compresses data from `reader` to `writer` using up to `threads` threads.
+///
+/// The input is split into blocks of the method's block size (as
+/// [`compress_stream`] does) that are compressed in parallel with
+/// `libzpaq::compressBlock` and written to `writer` in order.  Only the first
+/// block carries `filename` and `comment`, so the output is byte-identical to
+/// [`compress_stream`] and decodes with any ZPAQ decompressor.  Both `reader`
+/// and `writer` are only used from the calling thread.  Falls back to the
+/// single-threaded path when `threads <= 1`.
+pub fn compress_stream_parallel<R: Read + Send, W: Write + Send>(
+    reader: R,
+    writer: W,
+    method: &str,
+    filename: Option<&str>,
+    comment: Option<&str>,
+    threads: usize,
+) -> Result<()> {
+    clear_last_error();
+    let method_c = CString::new(method).map_err(|_| ZpaqError::NulInString)?;
+    let filename_c = match filename {
+        Some(s) => Some(CString::new(s).map_err(|_| ZpaqError::NulInString)?),
+        None => None,
+    };
+    let comment_c = match comment {
+        Some(s) => Some(CString::new(s).map_err(|_| ZpaqError::NulInString)?),
+        None => None,
+    };
+
+    let reader = FfiReader::new(reader)?;
+    let writer = FfiWriter::new(writer)?;
+
+    let rc = unsafe {
+        sys::zpaq_compress_parallel(
+            reader.raw,
+            writer.raw,
+            method_c.as_ptr(),
+            filename_c
+                .as_ref()
+                .map(|c| c.as_ptr())
+                .unwrap_or(ptr::null()),
+            comment_c
+                .as_ref()
+                .map(|c| c.as_ptr())
+                .unwrap_or(ptr::null()),
+            1,
+            threads.min(c_int::MAX as usize) as c_int,
+        )
+    };
+    if rc == 0 {
+        Ok(())
+    } else {
+        Err(err_from_last())
+    }
+}
+
+/// Decompresses a ZPAQ archive from `reader` and writes raw data to `writer`.
+///
+/// # Example
+///
+/// ```rust
+/// use std::io::Cursor;
+/// let compressed = zpaq_rs::compress_to_vec(b"hello", "1").unwrap();
+/// let mut out = Vec::new();
+/// zpaq_rs::decompress_stream(Cursor::new(&compressed), &mut out).unwrap();
+/// assert_eq!(out, b"hello");
+/// ```
+pub fn decompress_stream<R: Read + Send, W: Write + Send>(reader: R, writer: W) -> Result<()> {
+    clear_last_error();
+    let reader = FfiReader::new(reader)?;
+    let writer = FfiWriter::new(writer)?;
+    let rc = unsafe { sys::zpaq_decompress(reader.raw, writer.raw) };
+    if rc == 0 {
+        Ok(())
+    } else {
+        Err(err_from_last())
+    }
+}
+
+/// Decompresses a multi-block ZPAQ stream held in `input` using up to
+/// `threads` worker threads and returns the original data.
+///
+/// Same as [`decompress_stream_parallel`], but `input` is read and the output
+/// collected on the C++ side without Rust callbacks.
+///
+/// # Example
+///
+/// ```rust
+/// let mut c = zpaq_rs::compress_to_vec(b"hello ", "1").unwrap();
+/// c.extend(zpaq_rs::compress_to_vec(b"zpaq", "1").unwrap());
+/// let d = zpaq_rs::decompress_to_vec_parallel(&c, 2).unwrap();
+/// assert_eq!(d, b"hello zpaq");
+/// ```
+pub fn decompress_to_vec_parallel(input: &[u8], threads: usize) -> Result<Vec<u8>> {
+    clear_last_error();
+    let reader = MemReader::new(input)?;
+    let writer = MemWriter::with_capacity(input.len().saturating_mul(2))?;
+    let rc = unsafe {
+        sys::zpaq_decompress_parallel(
+            reader.raw,
+            writer.raw,
+            threads.min(c_int::MAX as usize) as c_int,
+        )
+    };
+    if rc == 0 {
+        Ok(writer.to_vec())
+    } else {
+        Err(err_from_last())
+    }
+}
+
+/// Decompresses a ZPAQ stream from `reader` to `writer`, decoding
+/// independent blocks in parallel.
+///
+/// Blocks are found by skipping over their segments without running the
+/// model, decoded concurrently, and written to `writer` in stream order, so
+/// the output is identical to [`decompress_stream`].  At most `2 * threads`
+/// blocks are buffered at once.  Both `reader` and `writer` are only used
+/// from the calling thread.
+///
+/// Streams written by `zpaq add`, [`compress_size_parallel`]-style block
+/// splitting, or concatenated [`compress_to_vec`] outputs contain many blocks;
+/// a single-block stream decodes on one thread.  Falls back to
+/// [`decompress_stream`] when `threads <= 1`.
+pub fn decompress_stream_parallel<R: Read + Send, W: Write + Send>(
+    reader: R,
+    writer: W,
+    threads: usize,
+) -> Result<()> {
+    clear_last_error();
+    let reader = FfiReader::new(reader)?;
+    let writer = FfiWriter::new(writer)?;
+    let rc = unsafe {
+        sys::zpaq_decompress_parallel(
+            reader.raw,
+            writer.raw,
+            threads.min(c_int::MAX as usize) as c_int,
+        )
+    };
+    if rc == 0 {
+        Ok(())
+    } else {
+        Err(err_from_last())
+    }
+}
+
+/// A compression, decompression or `zpaq` command running in the
+/// background.
+///
+/// Jobs run on a pool of threads shared by the process, started as needed up
+/// to one per core, so starting one does not block the caller.  A job can be
+/// waited for with [`Job::wait`], polled with [`Job::is_finished`], or
+/// awaited as a [`Future`](std::future::Future) from any executor; the job
+/// wakes the task itself when it finishes, so no runtime thread is blocked.
+///
+/// [`Job::cancel`] asks the job to stop at its next block, or its next
+/// file for `add` and `extract` commands, after which it fails with
+/// `ZpaqError::Ffi("cancelled")`.  Dropping an unfinished job cancels it
+/// without waiting.
+///
+/// # Example
+///
+/// ```rust
+/// let job = zpaq_rs::Job::compress(b"hello hello hello", "1", 1).unwrap();
+/// let c = job.wait().unwrap();
+/// let d = zpaq_rs::Job::decompress(&c, 1).unwrap().wait().unwrap();
+/// assert_eq!(d, b"hello hello hello");
+/// ```
+pub struct Job<T> {
+    raw: *mut sys::ZpaqJob,
+    // Read by `job_wake` on the worker thread, so it is boxed to keep its
+    // address while the job is moved.
+    waker: Box<Mutex<Option<Waker>>>,
+    take: fn(*mut sys::ZpaqJob) -> T,
+}
+
+// The C++ job keeps its state behind a mutex and is shared with its
+// worker by reference count, so `raw` may be used and freed from any
+// thread. The result is made by `take` on the thread that waits, so `T`
+// must be `Send` for it to arrive there.
+unsafe impl<T: Send> Send for Job<T> {}
+
+unsafe extern "C" fn job_wake(ctx: *mut c_void) {
+    let slot = unsafe { &*(ctx as *const Mutex<Option<Waker>>) };
+    if let Some(w) = slot.lock().unwrap_or_else(|e| e.into_inner()).take() {
+        w.wake();
+    }
+}
+
+fn job_output(raw: *mut sys::ZpaqJob) -> Vec<u8> {
+    let mut len = 0usize;
+    let p = unsafe { sys::zpaq_job_output(raw, &mut len) };
+    if p.is_null() || len == 0 {
+        return Vec::new();
+    }
+    unsafe { slice::from_raw_parts(p, len) }.to_vec()
+}
+
+fn job_command_output(raw: *mut sys::ZpaqJob) -> ZpaqCommandOutput {
+    let mut len = 0usize;
+    let p = unsafe { sys::zpaq_job_stderr(raw, &mut len) };
+    let stderr = if p.is_null() || len == 0 {
+        String::new()
+    } else {
+        String::from_utf8_lossy(unsafe { slice::from_raw_parts(p as *const u8, len) }).into_owned()
+    };
+    ZpaqCommandOutput {
+        stdout: String::from_utf8_lossy(&job_output(raw)).into_owned(),
+        stderr,
+    }
+}
+
+impl<T> Job<T> {
+    fn new(raw: *mut sys::ZpaqJob, take: fn(*mut sys::ZpaqJob) -> T) -> Result<Self> {
+        if raw.is_null() {
+            return Err(err_from_last());
+        }
+        Ok(Self {
+            raw,
+            waker: Box::new(Mutex::new(None)),
+            take,
+        })
+    }
+
+    fn result(&self, status: c_int) -> Result<T> {
+        if status > 0 {
+            Ok((self.take)(self.raw))
+        } else {
+            Err(err_from_last())
+        }
+    }
+
+    /// Blocks until the job finishes and returns its result.
+    pub fn wait(self) -> Result<T> {
+        let status = unsafe { sys::zpaq_job_wait(self.raw, -1) };
+        self.result(status)
+    }
+
+    /// Blocks for up to `timeout` and returns whether the job has finished.
+    pub fn wait_timeout(&self, timeout: Duration) -> bool {
+        let ms = timeout.as_millis().min(i64::MAX as u128) as i64;
+        unsafe { sys::zpaq_job_wait(self.raw, ms) != 0 }
+    }
+
+    /// Returns whether the job has finished, successfully or not.
+    pub fn is_finished(&self) -> bool {
+        unsafe { sys::zpaq_job_poll(self.raw) != 0 }
+    }
+
+    /// Asks the job to stop.  It fails with `"cancelled"` unless it
+    /// finishes first.
+    pub fn cancel(&self) {
+        unsafe { sys::zpaq_job_cancel(self.raw) };
+    }
+}
+
+impl Job<Vec<u8>> {
+    /// Starts compressing a copy of `input` like [`compress_to_vec_parallel`].
+    pub fn compress(input: &[u8], method: &str, threads: usize) -> Result<Self> {
+        clear_last_error();
+        let method_c = CString::new(method).map_err(|_| ZpaqError::NulInString)?;
+        let raw = unsafe {
+            sys::zpaq_job_compress(
+                input.as_ptr() as *const c_char,
+                input.len(),
+                method_c.as_ptr(),
+                threads.min(c_int::MAX as usize) as c_int,
+            )
+        };
+        Self::new(raw, job_output)
+    }
+
+    /// Starts decompressing a copy of `input` like
+    /// [`decompress_to_vec_parallel`].
+    pub fn decompress(input: &[u8], threads: usize) -> Result<Self> {
+        clear_last_error();
+        let raw = unsafe {
+            sys::zpaq_job_decompress(
+                input.as_ptr() as *const c_char,
+                input.len(),
+                threads.min(c_int::MAX as usize) as c_int,
+            )
+        };
+        Self::new(raw, job_output)
+    }
+}
+
+impl Job<ZpaqCommandOutput> {
+    /// Starts a `zpaq` command like [`zpaq_command`].
+    pub fn command(args: &[&str]) -> Result<Self> {
+        clear_last_error();
+        let mut cargs = Vec::with_capacity(args.len() + 1);
+        cargs.push(CString::new("zpaq").map_err(|_| ZpaqError::NulInString)?);
+        for arg in args {
+            cargs.push(CString::new(*arg).map_err(|_| ZpaqError::NulInString)?);
+        }
+        let ptrs: Vec<*const c_char> = cargs.iter().map(|s| s.as_ptr()).collect();
+        let raw = unsafe { sys::zpaq_job_command(ptrs.len() as c_int, ptrs.as_ptr()) };
+        Self::new(raw, job_command_output)
+    }
+}
+
+impl<T> std::future::Future for Job<T> {
+    type Output = Result<T>;
+
+    fn poll(self: Pin<&mut Self>, cx: &mut Context<'_>) -> Poll<Result<T>> {
+        *self.waker.lock().unwrap_or_else(|e| e.into_inner()) = Some(cx.waker().clone());
+        let ctx = &*self.waker as *const Mutex<Option<Waker>> as *mut c_void;
+        let status = unsafe { sys::zpaq_job_set_notify(self.raw, Some(job_wake), ctx) };
+        if status == 0 {
+            return Poll::Pending;
+        }
+        Poll::Ready(self.result(unsafe { sys::zpaq_job_poll(self.raw) }))
+    }
+}
+
+impl<T> Drop for Job<T> {
+    fn drop(&mut self) {
+        unsafe { sys::zpaq_job_free(self.raw) };
+    }
+}
+
+/// A compressor and decompressor that keep their state between calls.
+///
+/// Each call to [`compress_to_vec`] or [`decompress_to_vec`] builds a new
+/// `libzpaq` model: every component table is allocated and zeroed, and the
+/// JIT compiles the model again.  A `ZpaqContext` keeps the model, its
+/// tables and its JIT code between calls.  When the next block expands to the
+/// same model, which is always the case for the same method and similar
+/// input sizes, the tables are only zeroed in place and the code is reused.
+/// This makes many small calls much cheaper.
+///
+/// The output is byte-identical to the stateless functions.  A context is
+/// [`Send`] but not [`Sync`]; use a [`ContextPool`] to share contexts
+/// between threads.
+///
+/// # Example
+///
+/// ```rust
+/// let mut ctx = zpaq_rs::ZpaqContext::new("1").unwrap();
+/// for msg in [&b"first message"[..], b"second message"] {
+///     let c = ctx.compress_to_vec(msg).unwrap();
+///     assert_eq!(ctx.decompress_to_vec(&c).unwrap(), msg);
+/// }
+/// ```
+pub struct ZpaqContext {
+    raw: *mut sys::ZpaqContext,
+    method: String,
+    method_c: CString,
+    // Output buffer for the `*_to_vec` methods, kept across calls.
+    out: MemWriter,
+}
+
+unsafe impl Send for ZpaqContext {}
+
+impl ZpaqContext {
+    /// Creates a context that compresses with `method`.
+    ///
+    /// Nothing is allocated for the model until the first call.
+    pub fn new(method: &str) -> Result<Self> {
+        let method_c = CString::new(method).map_err(|_| ZpaqError::NulInString)?;
+        clear_last_error();
+        let out = MemWriter::with_capacity(0)?;
+        let raw = unsafe { sys::zpaq_context_new() };
+        if raw.is_null() {
+            return Err(err_from_last());
+        }
+        Ok(Self {
+            raw,
+            method: method.to_string(),
+            method_c,
+            out,
+        })
+    }
+
+    /// Returns the method this context compresses with.
+    pub fn method(&self) -> &str {
+        &self.method
+    }
+
+    /// Compresses `input` into a `Vec<u8>`.  Same output as
+    /// [`compress_to_vec`].
+    pub fn compress_to_vec(&mut self, input: &[u8]) -> Result<Vec<u8>> {
+        clear_last_error();
+        self.out.clear();
+        let rc = unsafe {
+            sys::zpaq_context_compress_buffer(
+                self.raw,
+                input.as_ptr() as *const c_char,
+                input.len(),
+                self.out.raw,
+                self.method_c.as_ptr(),
+                ptr::null(),
+                ptr::null(),
+                1,
+            )
+        };
+        if rc == 0 {
+            Ok(self.out.to_vec())
+        } else {
+            Err(err_from_last())
+        }
+    }
+
+    /// Returns the compressed size of `input` in bytes.  Same result as
+    /// [`compress_size`].
+    pub fn compress_size(&mut self, input: &[u8]) -> Result<u64> {
+        clear_last_error();
+        let mut out_size: u64 = 0;
+        let rc = unsafe {
+            sys::zpaq_context_compress_size_buffer(
+                self.raw,
+                input.as_ptr() as *const c_char,
+                input.len(),
+                self.method_c.as_ptr(),
+                ptr::null(),
+                ptr::null(),
+                1,
+                &mut out_size as *mut u64,
+            )
+        };
+        if rc == 0 {
+            Ok(out_size)
+        } else {
+            Err(err_from_last())
+        }
+    }
+
+    /// Returns the compressed size of each of `inputs`, in order.  Same
+    /// results as [`compress_size`] on each, in one call.
+    pub fn compress_sizes(&mut self, inputs: &[&[u8]]) -> Result<Vec<u64>> {
+        self.sizes(inputs, false)
+    }
+
+    /// Estimates the compressed size of `input`.  Same result as
+    /// [`estimate_size`].
+    pub fn estimate_size(&mut self, input: &[u8]) -> Result<u64> {
+        Ok(self.sizes(&[input], true)?[0])
+    }
+
+    /// Estimates the compressed size of each of `inputs`, in order.  Same
+    /// results as [`estimate_size`] on each, in one call.
+    pub fn estimate_sizes(&mut self, inputs: &[&[u8]]) -> Result<Vec<u64>> {
+        self.sizes(inputs, true)
+    }
+
+    fn sizes(&mut self, inputs: &[&[u8]], estimate: bool) -> Result<Vec<u64>> {
+        clear_last_error();
+        let data: Vec<*const c_char> = inputs.iter().map(|s| s.as_ptr() as *const c_char).collect();
+        let lens: Vec<usize> = inputs.iter().map(|s| s.len()).collect();
+        let mut out = vec![0u64; inputs.len()];
+        let rc = unsafe {
+            sys::zpaq_context_compress_sizes(
+                self.raw,
+                data.as_ptr(),
+                lens.as_ptr(),
+                inputs.len(),
+                self.method_c.as_ptr(),
+                estimate as c_int,
+                out.as_mut_ptr(),
+            )
+        };
+        if rc == 0 {
+            Ok(out)
+        } else {
+            Err(err_from_last())
+        }
+    }
+
+    /// Compresses data from `reader` to `writer`.  Same output as
+    /// [`compress_stream`].
+    pub fn compress_stream<R: Read + Send, W: Write + Send>(
+        &mut self,
+        reader: R,
+        writer: W,
+        filename: Option<&str>,
+        comment: Option<&str>,
+    ) -> Result<()> {
+        clear_last_error();
+        let filename_c = match filename {
+            Some(s) => Some(CString::new(s).map_err(|_| ZpaqError::NulInString)?),
+            None => None,
+        };
+        let comment_c = match comment {
+            Some(s) => Some(CString::new(s).map_err(|_| ZpaqError::NulInString)?),
+            None => None,
+        };
+
+        let reader = FfiReader::new(reader)?;
+        let writer = FfiWriter::new(writer)?;
+
+        let rc = unsafe {
+            sys::zpaq_context_compress(
+                self.raw,
+                reader.raw,
+                writer.raw,
+                self.method_c.as_ptr(),
+                filename_c
+                    .as_ref()
+                    .map(|c| c.as_ptr())
+                    .unwrap_or(ptr::null()),
+                comment_c
+                    .as_ref()
+                    .map(|c| c.as_ptr())
+                    .unwrap_or(ptr::null()),
+                1,
+            )
+        };
+        if rc == 0 {
+            Ok(())
+        } else {
+            Err(err_from_last())
+        }
+    }
+
+    /// Decompresses the ZPAQ stream in `input`.  Any method can be
+    /// decoded; the model is reused while consecutive blocks share it.
+    pub fn decompress_to_vec(&mut self, input: &[u8]) -> Result<Vec<u8>> {
+        clear_last_error();
+        self.out.clear();
+        let reader = MemReader::new(input)?;
+        let rc = unsafe { sys::zpaq_context_decompress(self.raw, reader.raw, self.out.raw) };
+        if rc == 0 {
+            Ok(self.out.to_vec())
+        } else {
+            Err(err_from_last())
+        }
+    }
+
+    /// Decompresses a ZPAQ stream from `reader` to `writer`.  Same output
+    /// as [`decompress_stream`].
+    pub fn decompress_stream<R: Read + Send, W: Write + Send>(
+        &mut self,
+        reader: R,
+        writer: W,
+    ) -> Result<()> {
+        clear_last_error();
+        let reader = FfiReader::new(reader)?;
+        let writer = FfiWriter::new(writer)?;
+        let rc = unsafe { sys::zpaq_context_decompress(self.raw, reader.raw, writer.raw) };
+        if rc == 0 {
+            Ok(())
+        } else {
+            Err(err_from_last())
+        }
+    }
+}
+
+impl Drop for ZpaqContext {
+    fn drop(&mut self) {
+        unsafe { sys::zpaq_context_free(self.raw) };
+    }
+}
+
+/// A thread-safe pool of [`ZpaqContext`]s for one method.
+///
+/// [`get`](Self::get) hands out an idle context, or creates one if all are
+/// in use, and the returned guard puts it back when dropped.  The pool
+/// therefore grows to the largest number of contexts used at once.
+///
+/// # Example
+///
+/// ```rust
+/// let pool = zpaq_rs::ContextPool::new("1").unwrap();
+/// std::thread::scope(|s| {
+///     for i in 0..4 {
+///         let pool = &pool;
+///         s.spawn(move || {
+///             let msg = format!("message {i}");
+///             let c = pool.get().unwrap().compress_to_vec(msg.as_bytes()).unwrap();
+///             assert_eq!(zpaq_rs::decompress_to_vec(&c).unwrap(), msg.as_bytes());
+///         });
+///     }
+/// });
+/// ```
+pub struct ContextPool {
+    method: String,
+    idle: Mutex<Vec<ZpaqContext>>,
+}
+
+impl ContextPool {
+    /// Creates an empty pool whose contexts compress with `method`.
+    pub fn new(method: &str) -> Result<Self> {
+        if method.contains('\0') {
+            return Err(ZpaqError::NulInString);
+        }
+        Ok(Self {
+            method: method.to_string(),
+            idle: Mutex::new(Vec::new()),
+        })
+    }
+
+    /// Returns the method the pooled contexts compress with.
+    pub fn method(&self) -> &str {
+        &self.method
+    }
+
+    /// Takes an idle context, or creates a new one if there is none.
+    pub fn get(&self) -> Result<PooledContext<'_>> {
+        let idle = self.idle.lock().map(|mut v| v.pop()).unwrap_or(None);
+        let ctx = match idle {
+            Some(ctx) => ctx,
+            None => ZpaqContext::new(&self.method)?,
+        };
+        Ok(PooledContext {
+            pool: self,
+            ctx: Some(ctx),
+        })
+    }
+
+    /// Returns the number of contexts waiting in the pool.
+    pub fn idle(&self) -> usize {
+        self.idle.lock().map(|v| v.len()).unwrap_or(0)
+    }
+}
+
+/// A [`ZpaqContext`] borrowed from a [`ContextPool`].  It dereferences to
+/// the context and returns it to the pool on drop.
+pub struct PooledContext<'a> {
+    pool: &'a ContextPool,
+    ctx: Option<ZpaqContext>,
+}
+
+impl std::ops::Deref for PooledContext<'_> {
+    type Target = ZpaqContext;
+
+    fn deref(&self) -> &ZpaqContext {
+        self.ctx.as_ref().expect("pooled context taken")
+    }
+}
+
+impl std::ops::DerefMut for PooledContext<'_> {
+    fn deref_mut(&mut self) -> &mut ZpaqContext {
+        self.ctx.as_mut().expect("pooled context taken")
+    }
+}
+
+impl Drop for PooledContext<'_> {
+    fn drop(&mut self) {
+        if let (Some(ctx), Ok(mut idle)) = (self.ctx.take(), self.pool.idle.lock()) {
+            idle.push(ctx);
+        }
+    }
+}
+
+/// A context model that has already been trained on a dictionary.
+///
+/// Short records compressed one at a time each start from an empty model,
+/// which costs a full model setup per record and gives poor ratios.  A
+/// `PrimedModel` runs a dictionary (a sample of typical records) through the
+/// model once.  A [`PrimedCoder`] then starts every record from a copy of
+/// that state, so records compress about as well as if they followed the
+/// dictionary in one block, without batching them.
+///
+/// `method` is a level (`"0"`..`"9"`; levels up to 4 all use the fast
+/// context model of level 4) or an `x` method without preprocessing.  Each
+/// record costs one copy of the model tables, so small custom models such as
+/// `"x0.0ci1.1.1m"` suit small records best.
+///
+/// Records are not ZPAQ streams: they start with the 4 byte [`id`] of the
+/// model, a hash of the method and dictionary, and can only be decompressed
+/// by a model built from the same method and dictionary.  Use
+/// [`primed_record_id`] to pick the model for a record.  A model is
+/// [`Send`] and [`Sync`] and can be shared by the coders of several threads.
+///
+/// [`id`]: PrimedModel::id
+///
+/// # Example
+///
+/// ```rust
+/// use std::sync::Arc;
+/// use zpaq_rs::{PrimedCoder, PrimedModel};
+///
+/// let dict = br#"{"user":"alice","event":"login"}{"user":"bob","event":"logout"}"#;
+/// let model = Arc::new(PrimedModel::new("x0.0ci1.1m", dict).unwrap());
+/// let mut coder = PrimedCoder::new(model).unwrap();
+/// let record = br#"{"user":"carol","event":"login"}"#;
+/// let c = coder.compress(record).unwrap();
+/// assert_eq!(coder.decompress(&c).unwrap(), record);
+/// ```
+pub struct PrimedModel {
+    raw: *mut sys::ZpaqPrimedModel,
+}
+
+unsafe impl Send for PrimedModel {}
+unsafe impl Sync for PrimedModel {}
+
+impl PrimedModel {
+    /// Builds the model of `method` for `dict` and trains it on `dict`.
+    pub fn new(method: &str, dict: &[u8]) -> Result<Self> {
+        let method_c = CString::new(method).map_err(|_| ZpaqError::NulInString)?;
+        clear_last_error();
+        let raw = unsafe {
+            sys::zpaq_primed_model_new(
+                method_c.as_ptr(),
+                dict.as_ptr() as *const c_char,
+                dict.len(),
+            )
+        };
+        if raw.is_null() {
+            return Err(err_from_last());
+        }
+        Ok(Self { raw })
+    }
+
+    /// Returns the id written at the start of each record.
+    pub fn id(&self) -> u32 {
+        unsafe { sys::zpaq_primed_model_id(self.raw) }
+    }
+
+    /// Returns the `x` method that `method` expanded to.
+    pub fn method(&self) -> String {
+        let p = unsafe { sys::zpaq_primed_model_method(self.raw) };
+        unsafe { std::ffi::CStr::from_ptr(p) }
+            .to_string_lossy()
+            .into_owned()
+    }
+}
+
+impl Drop for PrimedModel {
+    fn drop(&mut self) {
+        unsafe { sys::zpaq_primed_model_free(self.raw) };
+    }
+}
+
+/// Returns the id of the [`PrimedModel`] that compressed `record`, or
+/// `None` if it is too short to be a record.
+pub fn primed_record_id(record: &[u8]) -> Option<u32> {
+    let id: [u8; 4] = record.get(..4)?.try_into().ok()?;
+    Some(u32::from_be_bytes(id))
+}
+
+/// Compresses and decompresses records with a [`PrimedModel`].
+///
+/// A coder keeps its own copy of the model's tables and JIT code, so after
+/// the first record only the primed state is copied back in.  A coder is
+/// [`Send`] but not [`Sync`]; use one per thread.
+pub struct PrimedCoder {
+    raw: *mut sys::ZpaqPrimedCoder,
+    // Output buffer, kept across calls.
+    out: MemWriter,
+    // The C++ coder refers to the model.
+    _model: Arc<PrimedModel>,
+}
+
+unsafe impl Send for PrimedCoder {}
+
+impl PrimedCoder {
+    /// Creates a coder for `model`.  Its tables are allocated at the first
+    /// record.
+    pub fn new(model: Arc<PrimedModel>) -> Result<Self> {
+        clear_last_error();
+        let out = MemWriter::with_capacity(0)?;
+        let raw = unsafe { sys::zpaq_primed_coder_new(model.raw) };
+        if raw.is_null() {
+            return Err(err_from_last());
+        }
+        Ok(Self {
+            raw,
+            out,
+            _model: model,
+        })
+    }
+
+    /// Compresses `record` on its own, starting from the primed state.
+    pub fn compress(&mut self, record: &[u8]) -> Result<Vec<u8>> {
+        clear_last_error();
+        self.out.clear();
+        let rc = unsafe {
+            sys::zpaq_primed_compress(
+                self.raw,
+                record.as_ptr() as *const c_char,
+                record.len(),
+                self.out.raw,
+            )
+        };
+        if rc == 0 {
+            Ok(self.out.to_vec())
+        } else {
+            Err(err_from_last())
+        }
+    }
+
+    /// Decompresses a record written by [`compress`](Self::compress) with a
+    /// model of the same id.
+    pub fn decompress(&mut self, data: &[u8]) -> Result<Vec<u8>> {
+        clear_last_error();
+        self.out.clear();
+        let rc = unsafe {
+            sys::zpaq_primed_decompress(
+                self.raw,
+                data.as_ptr() as *const c_char,
+                data.len(),
+                self.out.raw,
+            )
+        };
+        if rc == 0 {
+            Ok(self.out.to_vec())
+        } else {
+            Err(err_from_last())
+        }
+    }
+}
+
+impl Drop for PrimedCoder {
+    fn drop(&mut self) {
+        unsafe { sys::zpaq_primed_coder_free(self.raw) };
+    }
+}
+
+/// Sets how many bytes of freed model tables and block buffers libzpaq
+/// keeps for reuse, process-wide, and returns the previous limit.
+///
+/// With a limit of 0 (the default) memory is returned with `free()` as
+/// usual.  Otherwise allocations of 64 KB or more are kept when freed and
+/// handed out again, zeroed, for the next request of the same size, which
+/// saves the page faults and kernel zeroing of the hash and model tables
+/// that every block allocates.  Kept memory is released when the
+/// allocations in use plus kept would exceed the limit, or when the limit
+/// is lowered.  Commands run through [`JidacCommand`] raise the limit by
+/// their `-pool N` MB (1024 by default) while they run.
 ///
 /// # Example
 ///
 /// ```rust
-/// use std::io::Cursor;
-/// let compressed = zpaq_rs::compress_to_vec(b"hello", "1").unwrap();
-/// let mut out = Vec::new();
-/// zpaq_rs::decompress_stream(Cursor::new(&compressed), &mut out).unwrap();
-/// assert_eq!(out, b"hello");
+/// let old = zpaq_rs::set_pool_limit(256 << 20);
+/// let c = zpaq_rs::compress_to_vec(b"hello hello hello", "2").unwrap();
+/// assert_eq!(zpaq_rs::decompress_to_vec(&c).unwrap(), b"hello hello hello");
+/// zpaq_rs::set_pool_limit(old);
 /// ```
-pub fn decompress_stream<R: Read + Send, W: Write + Send>(reader: R, writer: W) -> Result<()> {
-    clear_last_error();
-    let reader = FfiReader::new(reader)?;
-    let writer = FfiWriter::new(writer)?;
-    let rc = unsafe { sys::zpaq_decompress(reader.raw, writer.raw) };
-    if rc == 0 {
-        Ok(())
-    } else {
-        Err(err_from_last())
+pub fn set_pool_limit(bytes: usize) -> usize {
+    unsafe { sys::zpaq_set_pool_limit(bytes) }
+}
+
+/// Use of libzpaq's memory pool (see [`set_pool_limit`]).
+#[derive(Debug, Default, Clone, Copy, PartialEq, Eq)]
+pub struct PoolStats {
+    /// Bytes in allocations of 64 KB or more that are in use.
+    pub used: usize,
+    /// Bytes freed and kept for reuse.
+    pub kept: usize,
+    /// Current limit on `used + kept`.
+    pub limit: usize,
+    /// Allocations met from kept memory.
+    pub hits: u64,
+    /// Allocations of 64 KB or more that were not, while the limit was set.
+    pub misses: u64,
+    /// Bytes in use or kept on explicit huge pages (see [`set_huge_pages`]).
+    pub huge: usize,
+    /// Bytes in use or kept that transparent huge pages were requested for.
+    pub advised: usize,
+    /// Tables that asked for huge pages and got normal pages.
+    pub huge_fallbacks: u64,
+}
+
+/// How [`set_huge_pages`] backs large model tables.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum HugePages {
+    /// Normal pages (the default).
+    Off,
+    /// Transparent huge pages, `madvise(MADV_HUGEPAGE)` on Linux.
+    Transparent,
+    /// Explicit huge pages (`MAP_HUGETLB` on Linux, `MEM_LARGE_PAGES` on
+    /// Windows), else transparent ones.
+    Explicit,
+}
+
+/// Backs new model tables of `min_bytes` or more with huge pages,
+/// process-wide, and returns the previous mode.
+///
+/// Context models look up their tables at random once per bit, so methods
+/// 3 to 5 spend much of their time on TLB misses that huge pages avoid.
+/// Explicit huge pages must be reserved (`/proc/sys/vm/nr_hugepages`, or the
+/// "Lock pages in memory" right on Windows).  When a kind of huge page is
+/// not available the table falls back to the next one and then to normal
+/// pages; [`pool_stats`] shows what was obtained.  Commands run through
+/// [`JidacCommand`] take `-hugepages 1` or `-hugepages 2` for the same.
+pub fn set_huge_pages(mode: HugePages, min_bytes: usize) -> HugePages {
+    let m = match mode {
+        HugePages::Off => 0,
+        HugePages::Transparent => 1,
+        HugePages::Explicit => 2,
+    };
+    match unsafe { sys::zpaq_set_huge_pages(m, min_bytes) } {
+        0 => HugePages::Off,
+        1 => HugePages::Transparent,
+        _ => HugePages::Explicit,
+    }
+}
+
+/// Returns the current use of libzpaq's memory pool.
+pub fn pool_stats() -> PoolStats {
+    let mut s = sys::ZpaqPoolStats::default();
+    unsafe { sys::zpaq_pool_stats(&mut s) };
+    PoolStats {
+        used: s.used,
+        kept: s.kept,
+        limit: s.limit,
+        hits: s.hits as u64,
+        misses: s.misses as u64,
+        huge: s.huge,
+        advised: s.advised,
+        huge_fallbacks: s.huge_fallbacks as u64,
     }
 }
 
@@ -1330,6 +3680,40 @@ pub fn stretch_key(key32: [u8; 32], salt32: [u8; 32]) -> Result<[u8; 32]> {
     }
 }
 
+/// Derives one key per `(key32, salt32)` pair like [`stretch_key`], using
+/// up to `threads` threads.
+///
+/// Each stretch takes a fraction of a second and 16 MiB of memory, so
+/// opening many encrypted archives is faster when their keys are derived
+/// together.
+pub fn stretch_keys_parallel(
+    inputs: &[([u8; 32], [u8; 32])],
+    threads: usize,
+) -> Result<Vec<[u8; 32]>> {
+    clear_last_error();
+    let n =
+        c_int::try_from(inputs.len()).map_err(|_| ZpaqError::Ffi("too many keys".to_string()))?;
+    let keys: Vec<u8> = inputs.iter().flat_map(|(k, _)| *k).collect();
+    let salts: Vec<u8> = inputs.iter().flat_map(|(_, s)| *s).collect();
+    let mut out = vec![0u8; inputs.len() * 32];
+    let rc = unsafe {
+        sys::zpaq_stretch_keys(
+            out.as_mut_ptr(),
+            keys.as_ptr(),
+            salts.as_ptr(),
+            n,
+            threads.min(c_int::MAX as usize) as c_int,
+        )
+    };
+    if rc != 0 {
+        return Err(err_from_last());
+    }
+    Ok(out
+        .chunks_exact(32)
+        .map(|c| <[u8; 32]>::try_from(c).expect("32 bytes"))
+        .collect())
+}
+
 /// Returns `len` cryptographically strong random bytes.
 ///
 /// On Unix delegates to `/dev/urandom`; on Windows uses `CryptGenRandom`.
@@ -1378,9 +3762,7 @@ pub fn sha256(bytes: &[u8]) -> Result<[u8; 32]> {
         return Err(err_from_last());
     }
     unsafe {
-        for &b in bytes {
-            sys::zpaq_sha256_put(s, b as c_int);
-        }
+        sys::zpaq_sha256_write(s, bytes.as_ptr() as *const c_char, bytes.len() as i64);
     }
     let mut out = [0u8; 32];
     let rc = unsafe { sys::zpaq_sha256_result(s, out.as_mut_ptr()) };
@@ -1446,6 +3828,452 @@ mod tests {
         }
     }
 
+    fn multi_block_payload() -> Vec<u8> {
+        // Just over two 1 MiB blocks for block size 0 ("10", "20").
+        let mut x = 12345u32;
+        (0..(2 << 20) + 5000)
+            .map(|i| {
+                x = x.wrapping_mul(1103515245).wrapping_add(12345);
+                if i % 3 == 0 {
+                    b'a' + (x >> 28) as u8
+                } else {
+                    (i >> 7) as u8
+                }
+            })
+            .collect()
+    }
+
+    #[test]
+    fn compress_parallel_matches_serial() {
+        let big = multi_block_payload();
+        for method in ["10", "20"] {
+            let serial = compress_to_vec(&big, method).expect("compress");
+            for threads in [1, 2, 5] {
+                let par = compress_to_vec_parallel(&big, method, threads).expect("compress");
+                assert_eq!(par, serial, "method={method} threads={threads}");
+                let mut par = Vec::new();
+                compress_stream_parallel(&big[..], &mut par, method, None, None, threads)
+                    .expect("compress");
+                assert_eq!(par, serial, "method={method} threads={threads}");
+            }
+            for threads in [0, 1, 3] {
+                let sz = compress_size_parallel(&big, method, threads).expect("compress_size");
+                assert_eq!(sz as usize, serial.len(), "method={method}");
+                let sz = compress_size_stream_parallel(&big[..], method, None, None, threads)
+                    .expect("compress_size");
+                assert_eq!(sz as usize, serial.len(), "method={method}");
+            }
+        }
+
+        let mut serial = Vec::new();
+        compress_stream(&big[..], &mut serial, "10", Some("f.bin"), Some("c")).expect("compress");
+        let mut par = Vec::new();
+        compress_stream_parallel(&big[..], &mut par, "10", Some("f.bin"), Some("c"), 4)
+            .expect("compress");
+        assert_eq!(par, serial);
+        assert_eq!(decompress_to_vec(&par).expect("decompress"), big);
+    }
+
+    #[test]
+    fn bwt_roundtrip() {
+        let big = multi_block_payload();
+        for method in ["x4.3", "x4.7ci1", "x0.3ci1", "x0.7"] {
+            for data in test_payloads().iter().chain([&big]) {
+                let c = compress_to_vec(data, method).expect("compress");
+                let par = compress_to_vec_parallel(data, method, 3).expect("compress");
+                assert_eq!(par, c, "method={method}");
+                let d = decompress_to_vec(&c).expect("decompress");
+                assert!(d == *data, "method={method} len={}", data.len());
+            }
+        }
+    }
+
+    #[test]
+    fn streaming_decompressor_matches_decompress() {
+        let big = multi_block_payload();
+        for method in ["0", "10", "2", "x4.3"] {
+            for data in test_payloads().iter().chain([&big]) {
+                let c = compress_to_vec_parallel(data, method, 2).expect("compress");
+                for chunk in [1, 4096, 1 << 20] {
+                    if chunk == 1 && c.len() > 100_000 {
+                        continue;
+                    }
+                    let mut d = StreamingDecompressor::new().expect("new");
+                    let mut out = Vec::new();
+                    for part in c.chunks(chunk) {
+                        d.push(part, &mut out).expect("push");
+                    }
+                    d.finish(&mut out).expect("finish");
+                    assert!(out == *data, "method={method} chunk={chunk}");
+                }
+            }
+        }
+
+        // The blocks before the end of the input are decoded at once
+        let c = compress_to_vec(&big, "10").expect("compress");
+        let mut d = StreamingDecompressor::new().expect("new");
+        let mut out = Vec::new();
+        d.push(&c[..c.len() * 3 / 4], &mut out).expect("push");
+        assert!(out.len() >= 1 << 20, "{}", out.len());
+        assert!(big.starts_with(&out));
+        // Dropped halfway
+        drop(d);
+
+        let mut d = StreamingDecompressor::new().expect("new");
+        let mut out = Vec::new();
+        d.push(&c[..c.len() / 2], &mut out).expect("push");
+        assert!(d.finish(&mut out).is_err());
+    }
+
+    #[test]
+    fn compress_parallel_bounds_blocks_in_flight() {
+        use std::sync::Arc;
+        use std::sync::atomic::{AtomicUsize, Ordering};
+
+        const BLOCK: usize = (1 << 20) - 4096; // block size of method "10"
+        struct BlockReader {
+            left: usize,
+            reads: Arc<AtomicUsize>,
+        }
+        impl Read for BlockReader {
+            fn read(&mut self, buf: &mut [u8]) -> std::io::Result<usize> {
+                let n = buf.len().min(self.left);
+                buf[..n]
+                    .iter_mut()
+                    .enumerate()
+                    .for_each(|(i, b)| *b = (i % 61) as u8);
+                self.left -= n;
+                if n > 0 {
+                    self.reads.fetch_add(1, Ordering::SeqCst);
+                }
+                Ok(n)
+            }
+        }
+        struct BlockWriter {
+            writes: usize,
+            max_ahead: usize,
+            reads: Arc<AtomicUsize>,
+        }
+        impl Write for BlockWriter {
+            fn write(&mut self, buf: &[u8]) -> std::io::Result<usize> {
+                let ahead = self.reads.load(Ordering::SeqCst) - self.writes;
+                self.max_ahead = self.max_ahead.max(ahead);
+                self.writes += 1;
+                Ok(buf.len())
+            }
+            fn flush(&mut self) -> std::io::Result<()> {
+                Ok(())
+            }
+        }
+
+        let threads = 2;
+        let reads = Arc::new(AtomicUsize::new(0));
+        let reader = BlockReader {
+            left: BLOCK * 10,
+            reads: reads.clone(),
+        };
+        let mut writer = BlockWriter {
+            writes: 0,
+            max_ahead: 0,
+            reads: reads.clone(),
+        };
+        compress_stream_parallel(reader, &mut writer, "10", None, None, threads).expect("compress");
+        assert_eq!(writer.writes, 10);
+        assert!(
+            writer.max_ahead <= threads + 1,
+            "max_ahead={}",
+            writer.max_ahead
+        );
+    }
+
+    #[test]
+    fn decompress_parallel_matches_serial() {
+        let mut stream = Vec::new();
+        let mut expected = Vec::new();
+        for (i, data) in test_payloads().iter().enumerate() {
+            let method = ["1", "2", "x4.3ci1", "3"][i % 4];
+            stream.extend(compress_to_vec(data, method).expect("compress"));
+            expected.extend_from_slice(data);
+        }
+        for threads in [0, 1, 2, 3, 8] {
+            let out = decompress_to_vec_parallel(&stream, threads).expect("decompress");
+            assert_eq!(out, expected, "threads={threads}");
+        }
+    }
+
+    #[test]
+    fn decompress_parallel_reports_corrupt_block() {
+        let first = compress_to_vec(b"first block", "1").expect("compress");
+        let mut second = compress_to_vec(&test_payloads()[3], "2").expect("compress");
+        second[16] = 9; // ZPAQ level byte after the 16 byte block marker
+        let mut stream = first;
+        stream.extend(second);
+        let serial = decompress_to_vec(&stream).unwrap_err().to_string();
+        let parallel = decompress_to_vec_parallel(&stream, 4)
+            .unwrap_err()
+            .to_string();
+        assert_eq!(parallel, serial);
+    }
+
+    #[test]
+    fn archive_index_reads_one_block() {
+        let big = test_payloads().pop().unwrap();
+        let first = archive_from_entries(
+            &[
+                ArchiveEntry {
+                    path: "big.bin",
+                    data: &big,
+                    comment: None,
+                },
+                ArchiveEntry {
+                    path: "a.txt",
+                    data: b"old a",
+                    comment: Some("c1"),
+                },
+            ],
+            "2",
+        )
+        .expect("archive");
+        let second = archive_from_entries(
+            &[ArchiveEntry {
+                path: "a.txt",
+                data: b"new a",
+                comment: None,
+            }],
+            "1",
+        )
+        .expect("archive");
+        let mut archive = [first.clone(), second].concat();
+
+        let mut index = ArchiveIndex::build(&first).expect("index");
+        index.update(&archive).expect("update");
+        assert_eq!(index, ArchiveIndex::build(&archive).expect("index"));
+        assert_eq!(index.indexed_len(), archive.len() as u64);
+        let blocks = index.blocks();
+        assert_eq!(blocks.len(), 2);
+        assert_eq!(blocks[0].offset, 0);
+        assert_eq!(blocks[1].offset, blocks[0].len);
+        assert_eq!(blocks[0].segments[1].comment, "c1");
+        assert_eq!(index.find("a.txt"), Some((1, 0)));
+        assert_eq!(index.find("big.bin"), Some((0, 0)));
+        assert_eq!(index.find("missing"), None);
+        assert_eq!(
+            ArchiveIndex::from_bytes(&index.to_bytes()).expect("parse"),
+            index
+        );
+
+        // Damage the data of the first block: reading from the second block
+        // never runs the first block's model.
+        let mid = (blocks[0].segments[0].compressed_len / 2) as usize + 64;
+        assert!(archive[mid] != 0 && archive[mid] != 0x55);
+        archive[mid] ^= 0x55;
+        assert_eq!(
+            index.read_file_bytes(&archive, "a.txt").expect("read"),
+            b"new a"
+        );
+        assert_eq!(
+            archive_read_file_bytes(&archive, "a.txt").expect("read"),
+            b"new a"
+        );
+        archive[mid] ^= 0x55;
+        assert_eq!(
+            archive_read_file_bytes(&archive, "big.bin").expect("read"),
+            big
+        );
+
+        let path = std::env::temp_dir().join(format!("zpaq-rs-index-{}.zpaq", std::process::id()));
+        let path_s = path.to_string_lossy().to_string();
+        let sidecar = ArchiveIndex::sidecar_path(&path_s);
+        std::fs::write(&path, &first).expect("write archive");
+        let opened = ArchiveIndex::open(&path_s, true).expect("open");
+        assert_eq!(opened.blocks().len(), 1);
+        archive_append_entries_file(
+            &path_s,
+            &[ArchiveEntry {
+                path: "a.txt",
+                data: b"new a",
+                comment: None,
+            }],
+            "1",
+        )
+        .expect("append");
+        let opened = ArchiveIndex::open(&path_s, true).expect("open");
+        assert_eq!(opened, index);
+        let saved = std::fs::read(&sidecar).expect("sidecar");
+        assert_eq!(ArchiveIndex::from_bytes(&saved).expect("parse"), index);
+        assert_eq!(
+            opened
+                .read_file_bytes_from_file(&path_s, "a.txt")
+                .expect("read"),
+            b"new a"
+        );
+        assert_eq!(
+            archive_read_file_bytes_from_file(&path_s, "big.bin").expect("read"),
+            big
+        );
+
+        // A replaced archive invalidates the sidecar.
+        std::fs::write(&path, [second_only(), first.clone()].concat()).expect("write");
+        let opened = ArchiveIndex::open(&path_s, true).expect("open");
+        assert_eq!(opened.find("a.txt"), Some((1, 1)));
+        let _ = std::fs::remove_file(&path);
+        let _ = std::fs::remove_file(&sidecar);
+
+        fn second_only() -> Vec<u8> {
+            archive_from_entries(
+                &[ArchiveEntry {
+                    path: "b.txt",
+                    data: b"b",
+                    comment: None,
+                }],
+                "1",
+            )
+            .expect("archive")
+        }
+    }
+
+    #[test]
+    fn memory_io_matches_callback_io() {
+        let mut payloads = test_payloads();
+        payloads.push(multi_block_payload());
+        for data in &payloads {
+            let c = compress_to_vec(data, "1").expect("compress");
+            let mut expected = Vec::new();
+            compress_stream(&data[..], &mut expected, "1", None, None).expect("compress");
+            assert_eq!(c, expected);
+            let sz = compress_size_stream(&data[..], "1", None, None).expect("compress_size");
+            assert_eq!(compress_size(data, "1").expect("compress_size"), sz);
+
+            assert_eq!(&decompress_to_vec(&c).expect("decompress"), data);
+            assert_eq!(
+                &decompress_to_vec_parallel(&c, 2).expect("decompress"),
+                data
+            );
+            assert_eq!(
+                decompress_size(&c).expect("decompress_size"),
+                data.len() as u64
+            );
+        }
+    }
+
+    #[test]
+    fn context_matches_stateless() {
+        for method in ["1", "2", "3", "x4.3ci1"] {
+            let mut ctx = ZpaqContext::new(method).expect("context");
+            assert_eq!(ctx.method(), method);
+            // Twice over, so the second round reuses the tables and JIT code.
+            for data in test_payloads().iter().chain(test_payloads().iter()) {
+                let expected = compress_to_vec(data, method).expect("compress");
+                let c = ctx.compress_to_vec(data).expect("compress");
+                assert_eq!(c, expected, "method={method}");
+                let sz = ctx.compress_size(data).expect("compress_size");
+                assert_eq!(sz as usize, expected.len(), "method={method}");
+                let mut c = Vec::new();
+                ctx.compress_stream(&data[..], &mut c, Some("f"), Some("x"))
+                    .expect("compress");
+                let mut expected = Vec::new();
+                compress_stream(&data[..], &mut expected, method, Some("f"), Some("x"))
+                    .expect("compress");
+                assert_eq!(c, expected, "method={method}");
+                assert_eq!(&ctx.decompress_to_vec(&c).expect("decompress"), data);
+            }
+        }
+
+        // One context decoding streams of different methods, and recovering
+        // after a corrupt one.
+        let mut ctx = ZpaqContext::new("1").expect("context");
+        let data = &test_payloads()[3];
+        for method in ["2", "1", "x4.3ci1", "2"] {
+            let c = compress_to_vec(data, method).expect("compress");
+            assert_eq!(&ctx.decompress_to_vec(&c).expect("decompress"), data);
+            let mut bad = c.clone();
+            bad[16] = 9;
+            let err = ctx.decompress_to_vec(&bad).unwrap_err().to_string();
+            assert_eq!(err, decompress_to_vec(&bad).unwrap_err().to_string());
+        }
+        let big = multi_block_payload();
+        let mut ctx = ZpaqContext::new("20").expect("context");
+        let c = ctx.compress_to_vec(&big).expect("compress");
+        assert_eq!(c, compress_to_vec(&big, "20").expect("compress"));
+        assert_eq!(ctx.decompress_to_vec(&c).expect("decompress"), big);
+    }
+
+    #[test]
+    fn context_pool_across_threads() {
+        let pool = ContextPool::new("2").expect("pool");
+        let payloads = test_payloads();
+        std::thread::scope(|s| {
+            for t in 0..4 {
+                let (pool, payloads) = (&pool, &payloads);
+                s.spawn(move || {
+                    for i in 0..8 {
+                        let data = &payloads[(t + i) % payloads.len()];
+                        let mut ctx = pool.get().expect("get");
+                        let c = ctx.compress_to_vec(data).expect("compress");
+                        assert_eq!(c, compress_to_vec(data, "2").expect("compress"));
+                        assert_eq!(&ctx.decompress_to_vec(&c).expect("decompress"), data);
+                    }
+                });
+            }
+        });
+        assert!((1..=4).contains(&pool.idle()), "idle={}", pool.idle());
+        assert!(matches!(
+            ContextPool::new("a\0b"),
+            Err(ZpaqError::NulInString)
+        ));
+    }
+
+    #[test]
+    fn aes_ctr_vectors() {
+        // Keystreams from `openssl enc -aes-*-ctr` with iv + 64 bit counter
+        // (no iv = zeros)
+        let cases: [(&[u8], &[u8], &str); 2] = [
+            (
+                b"0123456789abcdef0123456789abcdef",
+                b"abcdefgh",
+                "44b261a74620fb96cd4cc6b3d02a95f13d32fd2093a085de11354ac59e06bd7fbc8876b6d37facb8",
+            ),
+            (
+                b"0123456789abcdef",
+                b"",
+                "0b9b15da4b44a0f5151dcfc4c01f35d501b04c381a66e4e94590d25fb0335aec42e22a45f98a8cc3",
+            ),
+        ];
+        for (key, iv, expect) in cases {
+            let iv = if iv.is_empty() {
+                std::ptr::null()
+            } else {
+                iv.as_ptr() as *const c_char
+            };
+            let a = unsafe {
+                sys::zpaq_aes_ctr_new(key.as_ptr() as *const c_char, key.len() as c_int, iv)
+            };
+            assert!(!a.is_null());
+            let mut whole = vec![0u8; 40];
+            let mut split = vec![0u8; 40];
+            unsafe {
+                sys::zpaq_aes_ctr_encrypt_slice(a, whole.as_mut_ptr() as *mut c_char, 40, 0);
+                sys::zpaq_aes_ctr_encrypt_slice(a, split.as_mut_ptr() as *mut c_char, 7, 0);
+                sys::zpaq_aes_ctr_encrypt_slice(a, split[7..].as_mut_ptr() as *mut c_char, 33, 7);
+                sys::zpaq_aes_ctr_free(a);
+            }
+            assert_eq!(hex::encode(&whole), expect);
+            assert_eq!(whole, split);
+        }
+    }
+
+    #[test]
+    fn stretch_keys_parallel_matches_stretch_key() {
+        let inputs: Vec<([u8; 32], [u8; 32])> =
+            (0..3u8).map(|i| ([i; 32], [i + 100; 32])).collect();
+        let keys = stretch_keys_parallel(&inputs, 2).expect("stretch_keys_parallel");
+        assert_eq!(keys.len(), inputs.len());
+        for (&(k, s), out) in inputs.iter().zip(&keys) {
+            assert_eq!(*out, stretch_key(k, s).expect("stretch_key"));
+        }
+        assert!(stretch_keys_parallel(&[], 4).expect("empty").is_empty());
+    }
+
     #[test]
     fn sha_vectors() {
         // "abc" test vectors
@@ -1456,6 +4284,26 @@ mod tests {
             hex::encode(s256),
             "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad"
         );
+
+        // Two blocks after padding, and many whole blocks
+        let m = b"abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq";
+        assert_eq!(
+            hex::encode(sha1(m).expect("sha1")),
+            "84983e441c3bd26ebaae4aa1f95129e5e54670f1"
+        );
+        assert_eq!(
+            hex::encode(sha256(m).expect("sha256")),
+            "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1"
+        );
+        let a = vec![b'a'; 1_000_000];
+        assert_eq!(
+            hex::encode(sha1(&a).expect("sha1")),
+            "34aa973cd4c4daa4f61eeb2bdbad27316534016f"
+        );
+        assert_eq!(
+            hex::encode(sha256(&a).expect("sha256")),
+            "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0"
+        );
     }
 
     #[test]
@@ -1491,4 +4339,608 @@ mod tests {
         let msg = err.to_string();
         assert!(msg.contains("callback failed"));
     }
+
+    #[test]
+    fn jidac_commands_run_concurrently() {
+        let dir = std::env::temp_dir().join(format!("zpaq-rs-jidac-{}", std::process::id()));
+        std::fs::create_dir_all(&dir).expect("mkdir");
+        let data = multi_block_payload();
+        let handles: Vec<_> = (0..3)
+            .map(|i| {
+                let input = dir.join(format!("in{i}.bin"));
+                let archive = dir.join(format!("out{i}.zpaq"));
+                std::fs::write(&input, &data[..data.len() / (i + 1)]).expect("write input");
+                std::thread::spawn(move || {
+                    let input = input.to_string_lossy().to_string();
+                    let archive = archive.to_string_lossy().to_string();
+                    let mut out = Vec::new();
+                    let added = JidacCommand::new(&[
+                        "add", &archive, &input, "-method", "1", "-threads", "2",
+                    ])
+                    .stdout(&mut out)
+                    .run()
+                    .expect("add");
+                    assert_eq!(added.exit_code, 0);
+                    assert_eq!(added.files, 1);
+                    assert_eq!(added.input_size, std::fs::metadata(&input).unwrap().len());
+                    assert_eq!(
+                        added.archive_size,
+                        std::fs::metadata(&archive).unwrap().len()
+                    );
+                    assert!(String::from_utf8_lossy(&out).contains(&input));
+
+                    let mut listing = Vec::new();
+                    let listed = JidacCommand::new(&["list", &archive])
+                        .stdout(&mut listing)
+                        .run()
+                        .expect("list");
+                    assert_eq!(listed.versions, 1);
+                    assert_eq!(listed.files, 1);
+                    assert_eq!(listed.input_size, added.input_size);
+                    assert!(String::from_utf8_lossy(&listing).contains(&input));
+                })
+            })
+            .collect();
+        for h in handles {
+            h.join().expect("thread");
+        }
+
+        let missing = dir.join("missing.zpaq").to_string_lossy().to_string();
+        let err = JidacCommand::new(&["extract", &missing]).run().unwrap_err();
+        assert!(err.to_string().contains("missing.zpaq"), "{err}");
+        let _ = std::fs::remove_dir_all(&dir);
+    }
+
+    #[test]
+    fn jidac_stats_count_work() {
+        let dir = std::env::temp_dir().join(format!("zpaq-rs-stats-{}", std::process::id()));
+        let input = dir.join("in");
+        std::fs::create_dir_all(&input).expect("mkdir");
+        let data = multi_block_payload();
+        // The second copy is deduplicated against the first
+        std::fs::write(input.join("a"), &data).expect("write");
+        std::fs::write(input.join("b"), &data).expect("write");
+        let archive = dir.join("a.zpaq").to_string_lossy().to_string();
+        let input_s = input.to_string_lossy().to_string();
+
+        let mut calls = Vec::new();
+        let mut record = |s: &JidacStats| calls.push(*s);
+        let (summary, stats) =
+            JidacCommand::new(&["add", &archive, &input_s, "-method", "1", "-threads", "2"])
+                .progress(&mut record)
+                .run_with_stats()
+                .expect("add");
+        assert_eq!(summary.files, 3); // the directory and its two files
+        assert_eq!(stats.bytes_read, 2 * data.len() as u64);
+        assert_eq!(stats.total_bytes, 2 * data.len() as u64);
+        assert_eq!(stats.fragments, stats.dedupe_hits + stats.dedupe_misses);
+        assert!(stats.dedupe_hits >= stats.dedupe_misses);
+        assert!(stats.blocks_compressed > 0);
+        assert!(stats.compress_in_bytes >= data.len() as u64);
+        assert!(stats.compress_out_bytes > 0);
+        assert!(!calls.is_empty());
+        assert!(calls.windows(2).all(|w| w[0].done_bytes <= w[1].done_bytes));
+
+        let to = dir.join("out").to_string_lossy().to_string();
+        let (_, extracted) = JidacCommand::new(&["extract", &archive, &input_s, "-to", &to])
+            .run_with_stats()
+            .expect("extract");
+        assert_eq!(extracted.blocks_decompressed, stats.blocks_compressed);
+        assert!(extracted.decompress_bytes >= data.len() as u64);
+        assert_eq!(std::fs::read(dir.join("out").join("b")).unwrap(), data);
+        let _ = std::fs::remove_dir_all(&dir);
+    }
+
+    #[test]
+    fn auto_method_round_trips() {
+        let text = multi_block_payload();
+        let random = random_bytes(100_000).expect("random");
+        for (data, method) in [
+            (&text, "a"),
+            (&text, "a4r100"),
+            (&random, "a2r1"),
+            (&random, "a0"),
+        ] {
+            let c = compress_to_vec(data, method).expect(method);
+            assert_eq!(&decompress_to_vec(&c).expect(method), data, "{method}");
+        }
+        // No level runs at 100 GB/s, so the block is stored
+        let stored = compress_to_vec(&text, "a4s100000").expect("a4s100000");
+        assert!(stored.len() > text.len());
+        assert!(compress_to_vec(&text, "a4r100").unwrap().len() < text.len());
+        assert!(compress_to_vec(&text, "a4q1").is_err());
+
+        let dir = std::env::temp_dir().join(format!("zpaq-rs-auto-{}", std::process::id()));
+        std::fs::create_dir_all(&dir).expect("mkdir");
+        let input = dir.join("in").to_string_lossy().to_string();
+        std::fs::write(&input, &text).expect("write");
+        let archive = dir.join("a.zpaq").to_string_lossy().to_string();
+        JidacCommand::new(&["add", &archive, &input, "-method", "a2", "-threads", "2"])
+            .run()
+            .expect("add");
+        let to = dir.join("out").to_string_lossy().to_string();
+        JidacCommand::new(&["extract", &archive, &input, "-to", &to])
+            .run()
+            .expect("extract");
+        assert_eq!(std::fs::read(&to).expect("read"), text);
+        let _ = std::fs::remove_dir_all(&dir);
+    }
+
+    #[test]
+    fn pool_reuses_block_memory() {
+        let data = multi_block_payload();
+        let old = set_pool_limit(512 << 20);
+        let before = pool_stats();
+        let a = compress_to_vec(&data, "20").expect("compress");
+        let b = compress_to_vec(&data, "20").expect("compress");
+        let after = pool_stats();
+        set_pool_limit(old);
+        assert_eq!(a, b);
+        assert_eq!(decompress_to_vec(&a).expect("decompress"), data);
+        assert!(after.hits > before.hits);
+        assert!(after.used + after.kept <= after.limit.max(after.used));
+    }
+
+    #[test]
+    fn huge_pages_back_model_tables() {
+        let before = pool_stats();
+        let old = set_huge_pages(HugePages::Explicit, 1 << 16);
+        let mut sc = StreamingCompressor::new("1").expect("new");
+        for &b in b"abracadabra" {
+            sc.push(b).expect("push");
+        }
+        let during = pool_stats();
+        set_huge_pages(old, 4 << 20);
+        // Explicit pages fall back to transparent ones, then to normal pages
+        assert!(
+            during.huge + during.advised > before.huge + before.advised
+                || during.huge_fallbacks > before.huge_fallbacks
+        );
+    }
+
+    #[test]
+    fn jidac_cache_matches_archive() {
+        let dir = std::env::temp_dir().join(format!("zpaq-rs-jdx-{}", std::process::id()));
+        let input = dir.join("in");
+        std::fs::create_dir_all(&input).expect("mkdir");
+        let archive = dir.join("a.zpaq").to_string_lossy().to_string();
+        let input_s = input.to_string_lossy().to_string();
+        let list = |extra: &[&str]| {
+            let mut args = vec!["list", &archive, "-all"];
+            args.extend_from_slice(extra);
+            let mut out = Vec::new();
+            JidacCommand::new(&args)
+                .stdout(&mut out)
+                .run()
+                .expect("list");
+            out
+        };
+
+        for (i, payload) in test_payloads().iter().enumerate() {
+            std::fs::write(input.join(format!("f{i}")), payload).expect("write");
+            JidacCommand::new(&["add", &archive, &input_s, "-cache"])
+                .run()
+                .expect("add");
+            // Each update is appended to the cache
+            let cached = std::fs::read(format!("{archive}.jdx")).expect("cache");
+            std::fs::remove_file(format!("{archive}.jdx")).expect("rm cache");
+            let plain = list(&[]);
+            assert_eq!(list(&["-cache"]), plain);
+            assert_eq!(std::fs::read(format!("{archive}.jdx")).unwrap(), cached);
+            assert_eq!(list(&["-cache"]), plain);
+        }
+
+        let to = dir.join("out").to_string_lossy().to_string();
+        JidacCommand::new(&["extract", &archive, &input_s, "-to", &to, "-cache"])
+            .run()
+            .expect("extract");
+        for (i, payload) in test_payloads().iter().enumerate() {
+            let got = std::fs::read(dir.join("out").join(format!("f{i}"))).expect("read");
+            assert_eq!(&got, payload);
+        }
+        let _ = std::fs::remove_dir_all(&dir);
+    }
+
+    #[test]
+    fn jidac_cache_rejects_rewritten_archive() {
+        let dir = std::env::temp_dir().join(format!("zpaq-rs-jdx2-{}", std::process::id()));
+        let input = dir.join("in");
+        std::fs::create_dir_all(&input).expect("mkdir");
+        let archive = dir.join("a.zpaq").to_string_lossy().to_string();
+        let input_s = input.to_string_lossy().to_string();
+        let list = |extra: &[&str]| {
+            let mut args = vec!["list", &archive, "-all"];
+            args.extend_from_slice(extra);
+            let mut out = Vec::new();
+            JidacCommand::new(&args)
+                .stdout(&mut out)
+                .run()
+                .expect("list");
+            out
+        };
+
+        // The last version is far from both ends of the archive, so only
+        // the last transaction check sees a change to its header.
+        let mut x = 7u32;
+        for i in 0..3 {
+            let data: Vec<u8> = (0..65536)
+                .map(|_| {
+                    x ^= x << 13;
+                    x ^= x >> 17;
+                    x ^= x << 5;
+                    x as u8
+                })
+                .collect();
+            std::fs::write(input.join(format!("f{i}")), data).expect("write");
+            JidacCommand::new(&["add", &archive, &input_s, "-cache", "-method", "0"])
+                .run()
+                .expect("add");
+        }
+        let plain = list(&[]);
+        assert_eq!(list(&["-cache"]), plain);
+
+        // Change the year of the last version's date in its c block
+        let mut bytes = std::fs::read(&archive).expect("read");
+        let last = bytes
+            .windows(18)
+            .rposition(|w| w.starts_with(b"jDC") && w[17] == b'c')
+            .expect("c block");
+        assert!(last > 4096 && bytes.len() - last > 8192);
+        bytes[last + 6] = if bytes[last + 6] == b'0' { b'1' } else { b'0' };
+        std::fs::write(&archive, &bytes).expect("write");
+        let plain = list(&[]);
+        assert_eq!(list(&["-cache"]), plain);
+        let _ = std::fs::remove_dir_all(&dir);
+    }
+
+    #[test]
+    fn jidac_parallel_extract_writes_files_across_blocks() {
+        let dir = std::env::temp_dir().join(format!("zpaq-rs-pwrite-{}", std::process::id()));
+        let input = dir.join("in");
+        std::fs::create_dir_all(&input).expect("mkdir");
+        let archive = dir.join("a.zpaq").to_string_lossy().to_string();
+        let input_s = input.to_string_lossy().to_string();
+
+        // Files that span several 1 MiB blocks, with and without zero runs
+        let mut files = vec![multi_block_payload(), vec![0u8; 3 << 20]];
+        files[1].extend_from_slice(b"end");
+        files.extend(test_payloads());
+        for (i, payload) in files.iter().enumerate() {
+            std::fs::write(input.join(format!("f{i}")), payload).expect("write");
+        }
+        JidacCommand::new(&["add", &archive, &input_s, "-method", "10"])
+            .run()
+            .expect("add");
+
+        for threads in ["1", "4"] {
+            let out = dir.join(format!("out{threads}"));
+            let to = out.to_string_lossy().to_string();
+            let summary = JidacCommand::new(&[
+                "extract", &archive, &input_s, "-to", &to, "-threads", threads,
+            ])
+            .run()
+            .expect("extract");
+            assert_eq!(summary.errors, 0);
+            for (i, payload) in files.iter().enumerate() {
+                let got = std::fs::read(out.join(format!("f{i}"))).expect("read");
+                assert_eq!(&got, payload, "f{i} -threads {threads}");
+            }
+        }
+        let _ = std::fs::remove_dir_all(&dir);
+    }
+
+    #[test]
+    fn jobs_run_in_background_and_cancel() {
+        struct ThreadWaker(std::thread::Thread);
+        impl std::task::Wake for ThreadWaker {
+            fn wake(self: Arc<Self>) {
+                self.0.unpark();
+            }
+        }
+        fn block_on<F: std::future::Future>(f: F) -> F::Output {
+            let waker = Waker::from(Arc::new(ThreadWaker(std::thread::current())));
+            let mut cx = Context::from_waker(&waker);
+            let mut f = std::pin::pin!(f);
+            loop {
+                if let Poll::Ready(v) = f.as_mut().poll(&mut cx) {
+                    return v;
+                }
+                std::thread::park();
+            }
+        }
+
+        let data = multi_block_payload();
+        let expected = compress_to_vec_parallel(&data, "1", 2).expect("compress");
+        let c = Job::compress(&data, "1", 2)
+            .expect("job")
+            .wait()
+            .expect("wait");
+        assert_eq!(c, expected);
+        let job = Job::decompress(&c, 2).expect("job");
+        assert_eq!(block_on(job).expect("await"), data);
+        assert!(
+            Job::compress(&data, "a4q1", 1)
+                .expect("job")
+                .wait()
+                .is_err()
+        );
+
+        let job = Job::compress(&data[..1 << 18], "5", 1).expect("job");
+        job.cancel();
+        let err = job.wait().expect_err("cancelled").to_string();
+        assert!(err.contains("cancelled"), "{err}");
+        drop(Job::compress(&data[..1 << 18], "5", 1).expect("job"));
+
+        let dir = std::env::temp_dir().join(format!("zpaq-rs-job-{}", std::process::id()));
+        std::fs::create_dir_all(&dir).expect("mkdir");
+        let input = dir.join("in").to_string_lossy().to_string();
+        std::fs::write(&input, &data).expect("write");
+        let archive = dir.join("a.zpaq").to_string_lossy().to_string();
+        let job = Job::command(&["add", &archive, &input, "-method", "5"]).expect("job");
+        job.cancel();
+        let err = job.wait().expect_err("cancelled").to_string();
+        assert!(err.contains("cancelled"), "{err}");
+        let job = Job::command(&["add", &archive, &input, "-method", "1"]).expect("job");
+        assert!(!job.wait_timeout(Duration::ZERO) || job.is_finished());
+        let out = job.wait().expect("add");
+        assert!(out.stdout.contains("Adding"), "{}", out.stdout);
+        let to = dir.join("out").to_string_lossy().to_string();
+        zpaq_command(&["extract", &archive, &input, "-to", &to]).expect("extract");
+        assert_eq!(std::fs::read(&to).expect("read"), data);
+        let _ = std::fs::remove_dir_all(&dir);
+    }
+
+    #[test]
+    fn primed_model_round_trips_records() {
+        let record = |i: usize| {
+            format!(
+                "{{\"id\":{i},\"user\":\"user{}\",\"event\":\"{}\",\"status\":{}}}\n",
+                i % 97,
+                if i.is_multiple_of(3) { "view" } else { "click" },
+                if i.is_multiple_of(5) { 404 } else { 200 }
+            )
+            .into_bytes()
+        };
+        let dict: Vec<u8> = (0..500).flat_map(record).collect();
+        let model = Arc::new(PrimedModel::new("x0.0ci1.1.1m", &dict).expect("model"));
+        assert_eq!(model.method(), "x0.0ci1.1.1m");
+        let mut coder = PrimedCoder::new(model.clone()).expect("coder");
+        let mut other = PrimedCoder::new(model.clone()).expect("coder");
+        let (mut primed, mut plain) = (0, 0);
+        for i in 1000..1020 {
+            let r = record(i);
+            let c = coder.compress(&r).expect("compress");
+            assert_eq!(primed_record_id(&c), Some(model.id()));
+            // Every record starts from the dictionary, not from the last record.
+            assert_eq!(other.decompress(&c).expect("decompress"), r);
+            primed += c.len();
+            plain += compress_to_vec(&r, "x0.0ci1.1.1m").expect("plain").len();
+        }
+        assert!(primed * 3 < plain, "{primed} vs {plain}");
+        let empty = coder.compress(b"").expect("compress");
+        assert_eq!(coder.decompress(&empty).expect("decompress"), b"");
+        for i in 0..20 {
+            let r = random_bytes(1 + i * 13).expect("random");
+            assert_eq!(other.decompress(&coder.compress(&r).unwrap()).unwrap(), r);
+        }
+
+        // Levels expand to a model without preprocessing.
+        let level = Arc::new(PrimedModel::new("3", &dict).expect("model"));
+        assert!(level.method().starts_with("x0,0ci1"), "{}", level.method());
+        let mut lc = PrimedCoder::new(level.clone()).expect("coder");
+        let c = lc.compress(&record(7)).expect("compress");
+        assert_eq!(lc.decompress(&c).expect("decompress"), record(7));
+        assert_ne!(level.id(), model.id());
+        assert!(coder.decompress(&c).is_err());
+        assert!(coder.decompress(&c[..2]).is_err());
+        assert!(PrimedModel::new("x0.3ci1", &dict).is_err());
+        assert!(PrimedModel::new("a4", &dict).is_err());
+    }
+
+    #[test]
+    fn estimate_size_tracks_compress_size() {
+        let big = multi_block_payload();
+        let mut inputs = test_payloads();
+        inputs.push(big[..100_000].to_vec());
+        let refs: Vec<&[u8]> = inputs.iter().map(|v| &v[..]).collect();
+        for method in ["0", "1", "2", "3", "4", "x4.0ci1.1.1m"] {
+            let mut ctx = ZpaqContext::new(method).expect("context");
+            let exact = ctx.compress_sizes(&refs).expect("sizes");
+            let est = ctx.estimate_sizes(&refs).expect("estimates");
+            for (i, input) in inputs.iter().enumerate() {
+                let real = compress_size(input, method).expect("size");
+                assert_eq!(exact[i], real, "method={method} input={i}");
+                assert!(
+                    est[i].abs_diff(real) <= 8,
+                    "method={method} input={i}: {} vs {real}",
+                    est[i]
+                );
+                assert_eq!(estimate_size(input, method, 2).expect("estimate"), est[i]);
+            }
+            // The context codes again afterwards
+            assert_eq!(ctx.compress_size(&inputs[4]).expect("size"), exact[4]);
+            assert_eq!(ctx.estimate_size(&inputs[4]).expect("estimate"), est[4]);
+        }
+
+        let all = estimate_size_sampled(&big, "10", 3, 1.0).expect("estimate");
+        let real = compress_size(&big, "10").expect("size");
+        assert_eq!((all.blocks, all.sampled_blocks, all.error), (3, 3, 0));
+        assert!(all.bytes.abs_diff(real) <= 3 * 8, "{} vs {real}", all.bytes);
+        let sample = estimate_size_sampled(&big, "10", 2, 0.5).expect("estimate");
+        assert_eq!((sample.blocks, sample.sampled_blocks), (3, 2));
+        assert!(sample.error > 0);
+        assert!(
+            sample.bytes.abs_diff(all.bytes) <= all.bytes / 10,
+            "{sample:?} {all:?}"
+        );
+        assert!(estimate_size(&big, "a4q1", 1).is_err());
+
+        let dir = std::env::temp_dir().join(format!("zpaq-rs-estimate-{}", std::process::id()));
+        std::fs::create_dir_all(&dir).expect("mkdir");
+        let input = dir.join("in").to_string_lossy().to_string();
+        std::fs::write(&input, &big).expect("write");
+        let real = zpaq_add_archive_size_file(&input, "2", 2).expect("size");
+        let est = zpaq_add_archive_estimate_file(&input, "2", 2).expect("estimate");
+        assert!(est.abs_diff(real) <= 64, "{est} vs {real}");
+        let archive = dir.join("a.zpaq").to_string_lossy().to_string();
+        assert!(zpaq_command(&["add", &archive, &input, "-estimate"]).is_err());
+        let _ = std::fs::remove_dir_all(&dir);
+    }
+
+    #[test]
+    fn dedupe_entries_store_fragments_once() {
+        let mut x = 7u32;
+        let base: Vec<u8> = (0..200_000)
+            .map(|_| {
+                x = x.wrapping_mul(1103515245).wrapping_add(12345);
+                b"abcdefgh ijklm\n"[(x >> 27) as usize % 15]
+            })
+            .collect();
+        let mut edited = base.clone();
+        edited.splice(100_000..100_010, b"an edit in the middle".iter().copied());
+        let entry = |path, data| ArchiveEntry {
+            path,
+            data,
+            comment: None,
+        };
+
+        let mut table = FragmentTable::new().expect("table");
+        table.set_fragment(2);
+        let first = archive_from_entries_dedupe(
+            &[
+                entry("a", &base),
+                ArchiveEntry {
+                    path: "b",
+                    data: &base,
+                    comment: Some("copy"),
+                },
+                entry("empty", b""),
+            ],
+            "1",
+            &mut table,
+        )
+        .expect("archive");
+        let fragments = table.len();
+        assert!(fragments > 10, "{fragments}");
+        let plain = archive_from_entries(&[entry("a", &base)], "1").expect("archive");
+        assert!(
+            first.len() < plain.len() * 21 / 20,
+            "{} vs {}",
+            first.len(),
+            plain.len()
+        );
+
+        let second =
+            archive_from_entries_dedupe(&[entry("c", &edited), entry("a", &base)], "1", &mut table)
+                .expect("archive");
+        assert!(
+            table.len() - fragments <= 3,
+            "{} new",
+            table.len() - fragments
+        );
+        assert!(
+            second.len() * 10 < plain.len(),
+            "{} vs {}",
+            second.len(),
+            plain.len()
+        );
+        let before = table.len();
+        assert!(archive_from_entries_dedupe(&[entry("d", b"new")], "0", &mut table).is_err());
+        assert_eq!(table.len(), before);
+
+        let third = archive_from_entries(&[entry("b", b"plain b")], "1").expect("archive");
+        let archive = [first, second, third].concat();
+        let index = ArchiveIndex::build(&archive).expect("index");
+        assert_eq!(
+            FragmentTable::from_index(&index).expect("table").len(),
+            table.len()
+        );
+        assert_eq!(
+            ArchiveIndex::from_bytes(&index.to_bytes()).expect("parse"),
+            index
+        );
+        assert_eq!(index.blocks()[0].segments[1].comment, "jDR\x01copy");
+        for (path, data) in [
+            ("a", &base[..]),
+            ("c", &edited),
+            ("empty", b""),
+            ("b", b"plain b"),
+        ] {
+            assert_eq!(
+                index.read_file_bytes(&archive, path).expect("read"),
+                data,
+                "{path}"
+            );
+        }
+
+        let dir = std::env::temp_dir().join(format!("zpaq-rs-dedupe-{}", std::process::id()));
+        std::fs::create_dir_all(&dir).expect("mkdir");
+        let path = dir.join("a.zpaq").to_string_lossy().to_string();
+        archive_append_entries_file_dedupe(&path, &[entry("a", &base)], "2").expect("append");
+        let len = std::fs::metadata(&path).expect("stat").len();
+        archive_append_entries_file_dedupe(&path, &[entry("c", &edited), entry("b", &base)], "2")
+            .expect("append");
+        let grown = std::fs::metadata(&path).expect("stat").len() - len;
+        // Default fragments are about 64 KiB: the edit costs one or two.
+        assert!(grown < len, "{grown} vs {len}");
+        assert!(std::path::Path::new(&ArchiveIndex::sidecar_path(&path)).exists());
+        assert_eq!(
+            archive_read_file_bytes_from_file(&path, "c").expect("read"),
+            edited
+        );
+        assert_eq!(
+            archive_read_file_bytes_from_file(&path, "b").expect("read"),
+            base
+        );
+        let _ = std::fs::remove_dir_all(&dir);
+    }
+
+    #[test]
+    fn long_fragment_lists_grow_linearly() {
+        // An arena block holds 2^18 IDs. The list spills out of one and
+        // keeps growing while another list takes the arena's top.
+        let n = 1 << 20;
+        let bytes = unsafe { sys::zpaq_jidac_test_fraglist(n) };
+        assert!(bytes > 0, "list contents");
+        assert!(bytes <= 4 * 4 * n as usize, "{bytes} bytes for {n} IDs");
+    }
+
+    #[test]
+    fn fragment_lists_stay_flat_across_versions() {
+        let dir = std::env::temp_dir().join(format!("zpaq-rs-versions-{}", std::process::id()));
+        std::fs::create_dir_all(&dir).expect("mkdir");
+        let file = dir.join("f");
+        let file_s = file.to_string_lossy().to_string();
+        let archive = dir.join("a.zpaq").to_string_lossy().to_string();
+        let carchive = CString::new(archive.as_str()).unwrap();
+        let mut data = Vec::with_capacity(4 << 20);
+        let mut x = 1u32;
+        while data.len() < 4 << 20 {
+            x ^= x << 13;
+            x ^= x >> 17;
+            x ^= x << 5;
+            data.extend_from_slice(&x.to_le_bytes());
+        }
+
+        // Each version lists the file again with about 4000 fragments,
+        // so the lists of 100 versions would fill 2 arena blocks.
+        let mut first = 0;
+        for v in 0..100 {
+            data.extend_from_slice(&[v as u8; 64]);
+            std::fs::write(&file, &data).expect("write");
+            JidacCommand::new(&["add", &archive, &file_s, "-fragment", "0", "-method", "1"])
+                .run()
+                .expect("add");
+            if v == 0 {
+                first = unsafe { sys::zpaq_jidac_test_archive_fraglists(carchive.as_ptr()) };
+                assert!(first > 0);
+            }
+        }
+        let last = unsafe { sys::zpaq_jidac_test_archive_fraglists(carchive.as_ptr()) };
+        assert!(
+            last <= first,
+            "{last} bytes after 100 versions, {first} after 1"
+        );
+        let _ = std::fs::remove_dir_all(&dir);
+    }
 }
@@ -26,11 +26,107 @@ pub struct Decompresser {
     _private: [u8; 0],
 }
 
+#[repr(C)]
+pub struct ZpaqContext {
+    _private: [u8; 0],
+}
+
+#[repr(C)]
+pub struct ZpaqFragmentTable {
+    _private: [u8; 0],
+}
+
 #[repr(C)]
 pub struct StringBuffer {
     _private: [u8; 0],
 }
 
+#[repr(C)]
+pub struct ZpaqJob {
+    _private: [u8; 0],
+}
+
+#[repr(C)]
+pub struct ZpaqPrimedModel {
+    _private: [u8; 0],
+}
+
+#[repr(C)]
+pub struct ZpaqPrimedCoder {
+    _private: [u8; 0],
+}
+
+/// Receives console text from a `zpaq.cpp` command (`zpaq_text_fn`).
+pub type ZpaqTextFn = unsafe extern "C" fn(ctx: *mut c_void, s: *const c_char, n: usize);
+
+/// Results of a `zpaq.cpp` command (`zpaq_jidac_summary` in `zpaq/jidac.h`).
+#[repr(C)]
+#[derive(Debug, Default, Clone, Copy)]
+pub struct ZpaqJidacSummary {
+    pub exit_code: c_int,
+    pub versions: i64,
+    pub archive_size: i64,
+    pub header_size: i64,
+    pub input_size: i64,
+    pub dedupe_size: i64,
+    pub files: i64,
+    pub removed: i64,
+    pub errors: i64,
+}
+
+/// Result of `zpaq_estimate_size_buffer`.
+#[repr(C)]
+#[derive(Debug, Default, Clone, Copy)]
+pub struct ZpaqSizeEstimate {
+    pub bytes: u64,
+    pub error: u64,
+    pub blocks: u64,
+    pub sampled: u64,
+}
+
+/// `libzpaq::PoolStats`.
+#[repr(C)]
+#[derive(Debug, Default, Clone, Copy)]
+pub struct ZpaqPoolStats {
+    pub used: usize,
+    pub kept: usize,
+    pub limit: usize,
+    pub hits: i64,
+    pub misses: i64,
+    pub huge: usize,
+    pub advised: usize,
+    pub huge_fallbacks: i64,
+}
+
+/// Counters of a running `zpaq.cpp` command (`zpaq_jidac_stats` in
+/// `zpaq/jidac.h`).
+#[repr(C)]
+#[derive(Debug, Default, Clone, Copy)]
+pub struct ZpaqJidacStats {
+    pub total_bytes: i64,
+    pub done_bytes: i64,
+    pub bytes_read: i64,
+    pub fragments: i64,
+    pub scan_ns: i64,
+    pub scan_wait_ns: i64,
+    pub dedupe_hits: i64,
+    pub dedupe_misses: i64,
+    pub blocks_compressed: i64,
+    pub compress_in_bytes: i64,
+    pub compress_out_bytes: i64,
+    pub compress_ns: i64,
+    pub queue_wait_ns: i64,
+    pub compressor_wait_ns: i64,
+    pub write_stall_ns: i64,
+    pub write_ns: i64,
+    pub blocks_decompressed: i64,
+    pub decompress_bytes: i64,
+    pub decompress_ns: i64,
+}
+
+/// Receives the counters of a running command (`zpaq_progress_fn`).
+pub type ZpaqProgressFn = unsafe extern "C" fn(ctx: *mut c_void, stats: *const ZpaqJidacStats);
+
 #[repr(C)]
 pub struct SHA1 {
     _private: [u8; 0],
@@ -77,6 +173,13 @@ unsafe extern "C" {
     pub fn zpaq_writer_new(ctx: *mut c_void, put_cb: PutFn, write_cb: WriteFn) -> *mut RustWriter;
     pub fn zpaq_writer_free(w: *mut RustWriter);
 
+    // Memory-backed readers/writers (no callbacks)
+    pub fn zpaq_reader_new_memory(data: *const u8, len: usize) -> *mut RustReader;
+    pub fn zpaq_writer_new_buffer(initial: usize) -> *mut RustWriter;
+    pub fn zpaq_writer_buffer_data(w: *mut RustWriter) -> *const u8;
+    pub fn zpaq_writer_buffer_size(w: *mut RustWriter) -> usize;
+    pub fn zpaq_writer_buffer_clear(w: *mut RustWriter);
+
     // Convenience top-level
     pub fn zpaq_compress(
         input: *mut RustReader,
@@ -86,7 +189,21 @@ unsafe extern "C" {
         comment: *const c_char,
         dosha1: c_int,
     ) -> c_int;
+    pub fn zpaq_compress_parallel(
+        input: *mut RustReader,
+        output: *mut RustWriter,
+        method: *const c_char,
+        filename: *const c_char,
+        comment: *const c_char,
+        dosha1: c_int,
+        threads: c_int,
+    ) -> c_int;
     pub fn zpaq_decompress(input: *mut RustReader, output: *mut RustWriter) -> c_int;
+    pub fn zpaq_decompress_parallel(
+        input: *mut RustReader,
+        output: *mut RustWriter,
+        threads: c_int,
+    ) -> c_int;
 
     // Size-only convenience (avoids copying compressed/decompressed bytes into Rust)
     pub fn zpaq_compress_size(
@@ -106,8 +223,83 @@ unsafe extern "C" {
         threads: ::std::os::raw::c_int,
         out_size: *mut u64,
     ) -> ::std::os::raw::c_int;
+    pub fn zpaq_compress_buffer_parallel(
+        data: *const c_char,
+        len: usize,
+        output: *mut RustWriter,
+        method: *const c_char,
+        filename: *const c_char,
+        comment: *const c_char,
+        dosha1: c_int,
+        threads: c_int,
+    ) -> c_int;
+    pub fn zpaq_compress_size_buffer_parallel(
+        data: *const c_char,
+        len: usize,
+        method: *const c_char,
+        filename: *const c_char,
+        comment: *const c_char,
+        dosha1: c_int,
+        threads: c_int,
+        out_size: *mut u64,
+    ) -> c_int;
+    pub fn zpaq_estimate_size_buffer(
+        data: *const c_char,
+        len: usize,
+        method: *const c_char,
+        threads: c_int,
+        fraction: c_double,
+        out: *mut ZpaqSizeEstimate,
+    ) -> c_int;
     pub fn zpaq_decompress_size(input: *mut RustReader, out_size: *mut u64) -> c_int;
 
+    // Reusable compression/decompression contexts
+    pub fn zpaq_context_new() -> *mut ZpaqContext;
+    pub fn zpaq_context_free(ctx: *mut ZpaqContext);
+    pub fn zpaq_context_compress(
+        ctx: *mut ZpaqContext,
+        input: *mut RustReader,
+        output: *mut RustWriter,
+        method: *const c_char,
+        filename: *const c_char,
+        comment: *const c_char,
+        dosha1: c_int,
+    ) -> c_int;
+    pub fn zpaq_context_compress_buffer(
+        ctx: *mut ZpaqContext,
+        data: *const c_char,
+        len: usize,
+        output: *mut RustWriter,
+        method: *const c_char,
+        filename: *const c_char,
+        comment: *const c_char,
+        dosha1: c_int,
+    ) -> c_int;
+    pub fn zpaq_context_compress_size_buffer(
+        ctx: *mut ZpaqContext,
+        data: *const c_char,
+        len: usize,
+        method: *const c_char,
+        filename: *const c_char,
+        comment: *const c_char,
+        dosha1: c_int,
+        out_size: *mut u64,
+    ) -> c_int;
+    pub fn zpaq_context_compress_sizes(
+        ctx: *mut ZpaqContext,
+        data: *const *const c_char,
+        lens: *const usize,
+        n: usize,
+        method: *const c_char,
+        estimate: c_int,
+        out: *mut u64,
+    ) -> c_int;
+    pub fn zpaq_context_decompress(
+        ctx: *mut ZpaqContext,
+        input: *mut RustReader,
+        output: *mut RustWriter,
+    ) -> c_int;
+
     // JIDAC (zpaq.cpp) convenience
     pub fn zpaq_jidac_add_archive_size_file(
         path: *const c_char,
@@ -115,7 +307,91 @@ unsafe extern "C" {
         threads: c_int,
         out_archive_size_bytes: *mut u64,
     ) -> c_int;
+    pub fn zpaq_jidac_add_archive_estimate_file(
+        path: *const c_char,
+        method: *const c_char,
+        threads: c_int,
+        out_archive_size_bytes: *mut u64,
+    ) -> c_int;
+    pub fn zpaq_jidac_test_fraglist(n: c_uint) -> usize;
+    pub fn zpaq_jidac_test_archive_fraglists(arc: *const c_char) -> usize;
+    pub fn zpaq_fragment_table_new() -> *mut ZpaqFragmentTable;
+    pub fn zpaq_fragment_table_free(t: *mut ZpaqFragmentTable);
+    pub fn zpaq_fragment_table_len(t: *const ZpaqFragmentTable) -> u32;
+    pub fn zpaq_fragment_table_truncate(t: *mut ZpaqFragmentTable, n: u32);
+    pub fn zpaq_fragment_table_add(
+        t: *mut ZpaqFragmentTable,
+        data: *const c_char,
+        len: usize,
+        sha1_out: *mut c_uchar,
+        added: *mut c_int,
+    ) -> u32;
+    pub fn zpaq_fragment_table_insert(t: *mut ZpaqFragmentTable, sha1: *const c_uchar) -> u32;
+    pub fn zpaq_fragments(
+        data: *const c_char,
+        len: usize,
+        method: *const c_char,
+        fragment: c_int,
+        ends: *mut usize,
+        cap: usize,
+    ) -> i64;
     pub fn zpaq_jidac_run(argc: c_int, argv: *const *const c_char) -> c_int;
+    pub fn zpaq_jidac_command(
+        argc: c_int,
+        argv: *const *const c_char,
+        out: Option<ZpaqTextFn>,
+        err: Option<ZpaqTextFn>,
+        ctx: *mut c_void,
+        summary: *mut ZpaqJidacSummary,
+        progress: Option<ZpaqProgressFn>,
+        stats: *mut ZpaqJidacStats,
+    ) -> c_int;
+
+    // Primed models
+    pub fn zpaq_primed_model_new(
+        method: *const c_char,
+        dict: *const c_char,
+        len: usize,
+    ) -> *mut ZpaqPrimedModel;
+    pub fn zpaq_primed_model_free(m: *mut ZpaqPrimedModel);
+    pub fn zpaq_primed_model_id(m: *const ZpaqPrimedModel) -> u32;
+    pub fn zpaq_primed_model_method(m: *const ZpaqPrimedModel) -> *const c_char;
+    pub fn zpaq_primed_coder_new(m: *mut ZpaqPrimedModel) -> *mut ZpaqPrimedCoder;
+    pub fn zpaq_primed_coder_free(c: *mut ZpaqPrimedCoder);
+    pub fn zpaq_primed_compress(
+        c: *mut ZpaqPrimedCoder,
+        data: *const c_char,
+        len: usize,
+        out: *mut RustWriter,
+    ) -> c_int;
+    pub fn zpaq_primed_decompress(
+        c: *mut ZpaqPrimedCoder,
+        data: *const c_char,
+        len: usize,
+        out: *mut RustWriter,
+    ) -> c_int;
+
+    // Jobs
+    pub fn zpaq_job_compress(
+        data: *const c_char,
+        len: usize,
+        method: *const c_char,
+        threads: c_int,
+    ) -> *mut ZpaqJob;
+    pub fn zpaq_job_decompress(data: *const c_char, len: usize, threads: c_int) -> *mut ZpaqJob;
+    pub fn zpaq_job_command(argc: c_int, argv: *const *const c_char) -> *mut ZpaqJob;
+    pub fn zpaq_job_poll(job: *mut ZpaqJob) -> c_int;
+    pub fn zpaq_job_wait(job: *mut ZpaqJob, timeout_ms: i64) -> c_int;
+    pub fn zpaq_job_cancel(job: *mut ZpaqJob);
+    pub fn zpaq_job_set_notify(
+        job: *mut ZpaqJob,
+        f: Option<unsafe extern "C" fn(ctx: *mut c_void)>,
+        ctx: *mut c_void,
+    ) -> c_int;
+    pub fn zpaq_job_output(job: *mut ZpaqJob, len: *mut usize) -> *const c_uchar;
+    pub fn zpaq_job_stderr(job: *mut ZpaqJob, len: *mut usize) -> *const c_char;
+    pub fn zpaq_job_summary(job: *mut ZpaqJob, summary: *mut ZpaqJidacSummary) -> c_int;
+    pub fn zpaq_job_free(job: *mut ZpaqJob);
 
     // StringBuffer
     pub fn zpaq_string_buffer_new(initial: usize) -> *mut StringBuffer;
@@ -189,6 +465,7 @@ unsafe extern "C" {
     pub fn zpaq_sha256_new() -> *mut SHA256;
     pub fn zpaq_sha256_free(s: *mut SHA256);
     pub fn zpaq_sha256_put(s: *mut SHA256, c: c_int);
+    pub fn zpaq_sha256_write(s: *mut SHA256, buf: *const c_char, n: i64);
     pub fn zpaq_sha256_usize(s: *const SHA256) -> c_ulonglong;
     pub fn zpaq_sha256_size(s: *const SHA256) -> c_double;
     pub fn zpaq_sha256_result(s: *mut SHA256, out_hash32: *mut c_uchar) -> c_int;
@@ -216,6 +493,17 @@ unsafe extern "C" {
         key32: *const c_uchar,
         salt32: *const c_uchar,
     ) -> c_int;
+    pub fn zpaq_stretch_keys(
+        out: *mut c_uchar,
+        keys: *const c_uchar,
+        salts: *const c_uchar,
+        n: c_int,
+        threads: c_int,
+    ) -> c_int;
     pub fn zpaq_random(buf: *mut c_uchar, n: c_int) -> c_int;
     pub fn zpaq_to_u16(p: *const c_char) -> u16;
+
+    pub fn zpaq_set_pool_limit(n: usize) -> usize;
+    pub fn zpaq_set_huge_pages(mode: c_int, min_bytes: usize) -> c_int;
+    pub fn zpaq_pool_stats(out: *mut ZpaqPoolStats);
 }
@@ -55,11 +55,12 @@ fn ensure_zpaq_cli(root: &Path) -> PathBuf {
     );
 
     // Keep the standalone CLI build aligned with the crate build:
-    // libzpaq JIT is x86_64-specific, and some CI jobs force NOJIT via env.
+    // libzpaq JIT supports x86_64 and AArch64, and some CI jobs force NOJIT
+    // via env.
     let force_nojit = std::env::var("ZPAQ_NOJIT").is_ok()
         || std::env::var("CARGO_FEATURE_NOJIT").is_ok()
         || cfg!(feature = "nojit")
-        || !cfg!(target_arch = "x86_64");
+        || !(cfg!(target_arch = "x86_64") || cfg!(target_arch = "aarch64"));
 
     let mut cmd = Command::new("make");
     cmd.current_dir(&zpaq_dir);
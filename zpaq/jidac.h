@@ -0,0 +1,126 @@
+/* jidac.h - run zpaq.cpp commands in-process
+
+  zpaq.cpp can be compiled as a library (with main renamed) and its
+  commands run with jidac_command(). Each call uses its own Jidac and
+  its own console, so several commands may run at once in one process.
+*/
+
+#ifndef JIDAC_H
+#define JIDAC_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <atomic>
+
+// Receives n bytes of console text s (not NUL terminated)
+typedef void (*zpaq_text_fn)(void* ctx, const char* s, size_t n);
+
+// Destinations of console output. If out or err is NULL then that
+// text goes to stdout or stderr. Sinks may be called from the threads
+// of a command, one call at a time within a command.
+struct zpaq_console {
+  zpaq_text_fn out;  // normal output (stdout)
+  zpaq_text_fn err;  // errors and the final summary line (stderr)
+  void* ctx;         // passed to out and err
+};
+
+// Results of a command. Fields that do not apply are 0.
+struct zpaq_jidac_summary {
+  int exit_code;         // 0 = OK, 1 = warnings, 2 = error, as main()
+  int64_t versions;      // versions in the archive
+  int64_t archive_size;  // archive bytes after the command
+  int64_t header_size;   // add: archive bytes before the update
+  int64_t input_size;    // add: bytes of changed files. list: bytes shown
+  int64_t dedupe_size;   // add, list: those bytes after deduplication
+  int64_t files;         // files added, extracted OK, or shown
+  int64_t removed;       // add: files marked deleted
+  int64_t errors;        // files that could not be added or extracted
+};
+
+// Counters of a command so far, summed over its threads. Times are in
+// nanoseconds. Fields that do not apply are 0.
+struct zpaq_jidac_stats {
+  int64_t total_bytes;          // add, extract: bytes to add or extract
+  int64_t done_bytes;           // of those, bytes added or extracted so far
+  int64_t bytes_read;           // add: bytes read from input files
+  int64_t fragments;            // add: fragments of the input files
+  int64_t scan_ns;              // add: fragmenting, SHA-1 and analysis
+  int64_t scan_wait_ns;         // add: waiting for the scan of the input
+  int64_t dedupe_hits;          // add: fragments already in the archive
+  int64_t dedupe_misses;        // add: new fragments
+  int64_t blocks_compressed;    // add: blocks compressed
+  int64_t compress_in_bytes;    // add: bytes of those blocks
+  int64_t compress_out_bytes;   // add: those bytes compressed
+  int64_t compress_ns;          // add: in compressBlock()
+  int64_t queue_wait_ns;        // add: waiting for an empty block buffer
+  int64_t compressor_wait_ns;   // add: full blocks waiting for a thread
+  int64_t write_stall_ns;       // add: writer waiting for the next block
+  int64_t write_ns;             // add: writing blocks to the archive
+  int64_t blocks_decompressed;  // extract: blocks decompressed
+  int64_t decompress_bytes;     // extract: bytes of those blocks
+  int64_t decompress_ns;        // extract: decompressing and verifying
+};
+
+// Receives the counters of a running command
+typedef void (*zpaq_progress_fn)(void* ctx, const zpaq_jidac_stats* stats);
+
+// Where the statistics of a command go. Nothing is counted or timed
+// unless stats or progress is set. progress is called from the threads
+// of the command wherever it would show its progress (after each file
+// and block), one call at a time and never at the same time as the
+// console sinks. If cancel is set and becomes nonzero, add and extract
+// stop before their next file or block and the command fails with the
+// error "cancelled".
+struct zpaq_jidac_monitor {
+  zpaq_jidac_stats* stats;    // receives the totals at the end, or NULL
+  zpaq_progress_fn progress;  // or NULL
+  void* ctx;                  // passed to progress
+  const std::atomic<int>* cancel;  // or NULL
+};
+
+// Run argv[1..argc-1] like "zpaq" would. Output goes to con, or to
+// stdout and stderr if con is NULL. If summary is not NULL it receives
+// the results. If error is not NULL then it receives the message of an
+// error that stopped the command. If mon is not NULL the command's
+// counters go there. Returns the exit code. argv is UTF-8. In Windows,
+// \ in argv is read as /, as in main().
+int jidac_command(int argc, const char** argv, const zpaq_console* con,
+                  zpaq_jidac_summary* summary, std::string* error=0,
+                  const zpaq_jidac_monitor* mon=0);
+
+// Append to ends the end offset of each fragment of data[0..n-1] as
+// add splits a file with -fragment fragment into blocks of blocksize
+// bytes. Fragments end where a rolling hash of their content says so, so
+// data that is inserted or removed only changes the fragments around it.
+void jidac_fragments(const char* data, size_t n, int fragment,
+                     unsigned blocksize, std::vector<size_t>& ends);
+
+// For tests: push n fragment IDs onto one list of a DTMap, interleaved
+// with pushes onto another. Return the bytes of fragment lists
+// allocated, or 0 if the list came out wrong.
+size_t jidac_test_fraglist(unsigned n);
+
+// For tests: list archive arc and return the bytes of fragment lists
+// allocated for its files, or 0 on error.
+size_t jidac_test_archive_fraglists(const char* arc);
+
+// A table of fragment hashes with IDs 1, 2, 3... in the order added,
+// looked up by SHA-1 like the fragments of an archive in add.
+class JidacFragmentTable {
+public:
+  JidacFragmentTable();
+  ~JidacFragmentTable();
+  unsigned size() const;                      // number of fragments
+  unsigned find(const char* sha1);            // ID of sha1[20], or 0
+  unsigned add(const char* sha1, int usize);  // add with the next ID
+  void truncate(unsigned n);                  // keep IDs 1..n
+private:
+  struct Impl;
+  Impl* p;
+  JidacFragmentTable(const JidacFragmentTable&);
+  JidacFragmentTable& operator=(const JidacFragmentTable&);
+};
+
+#endif
@@ -26,16 +26,44 @@ See libzpaq.h for additional documentation.
 #include <string.h>
 #include <string>
 #include <vector>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <exception>
 #include <stdio.h>
 #include <cmath>
+#include <chrono>
 
-#ifdef _OPENMP
-#include <omp.h>
+
+#if !defined(NOSHAHW) || !defined(NOAESHW) || !defined(NOMIXHW)
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) \
+    || defined(_M_IX86)
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#ifdef __linux__
+#include <sys/auxv.h>
+#endif
+#endif
+#endif
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef _MSC_VER
+#include <intrin.h>
 #endif
 
 #ifdef unix
-#ifndef NOJIT
 #include <sys/mman.h>
+#if !defined(NOJIT) && defined(__APPLE__) && defined(__aarch64__)
+#include <pthread.h>
 #endif
 #else
 #include <windows.h>
@@ -62,6 +90,264 @@ void Writer::write(const char* buf, int n) {
     put(U8(buf[i]));
 }
 
+//////////////////////////// memory pool ////////////////////////////
+
+static const size_t POOL_MIN=size_t(1)<<16;  // smaller sizes are not kept
+
+// Memory mapped for huge pages: len bytes, mode 1 (advised) or 2 (explicit)
+struct Mapping {
+  size_t len;
+  int mode;
+};
+
+// Freed memory by size, with the counts reported by poolStats(), and
+// the allocations that were mapped for huge pages rather than calloc()ed.
+// Allocated once and never destroyed, like jitMutex().
+struct Pool {
+  std::mutex mu;
+  std::multimap<size_t, void*> idle;
+  std::map<void*, Mapping> mapped;
+  PoolStats st;
+  int hugeMode;    // set by setHugePages()
+  size_t hugeMin;
+  Pool(): hugeMode(0), hugeMin(0) {memset(&st, 0, sizeof(st));}
+};
+static Pool& pool() {
+  static Pool* p=new Pool;
+  return *p;
+}
+
+// Map n bytes of zeros for an Array on huge pages. Try explicit huge
+// pages first if mode is 2, then transparent ones. Set m to what was
+// obtained and return the memory, or return 0 to use calloc() instead.
+static void* hugeMap(size_t n, int mode, Mapping& m) {
+#ifdef unix
+  const size_t H=size_t(2)<<20;  // x86-64 and 4K-page AArch64 huge page
+  m.len=(n+H-1)&~(H-1);
+#ifdef MAP_HUGETLB
+  if (mode>=2) {
+    void* p=mmap(0, m.len, PROT_READ|PROT_WRITE,
+        MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+    if (p!=MAP_FAILED) return m.mode=2, p;
+  }
+#endif
+#ifdef MADV_HUGEPAGE
+  // Map H extra bytes and trim them so that the start is aligned to H
+  char* p=(char*)mmap(0, m.len+H, PROT_READ|PROT_WRITE,
+      MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if (p==MAP_FAILED) return 0;
+  const size_t lead=(H-(size_t(p)&(H-1)))&(H-1);
+  if (lead>0) munmap(p, lead);
+  if (lead<H) munmap(p+lead+m.len, H-lead);
+  p+=lead;
+  if (madvise(p, m.len, MADV_HUGEPAGE)==0) return m.mode=1, p;
+  munmap(p, m.len);  // THP not configured
+#endif
+  (void)mode;
+  return 0;
+#else
+  // Large pages need SeLockMemoryPrivilege, which is enabled here once
+  static bool priv=false;
+  static std::once_flag once;
+  std::call_once(once, [] {
+    HANDLE token;
+    TOKEN_PRIVILEGES tp;
+    if (!OpenProcessToken(GetCurrentProcess(),
+        TOKEN_ADJUST_PRIVILEGES|TOKEN_QUERY, &token)) return;
+    tp.PrivilegeCount=1;
+    tp.Privileges[0].Attributes=SE_PRIVILEGE_ENABLED;
+    if (LookupPrivilegeValueA(0, "SeLockMemoryPrivilege",
+        &tp.Privileges[0].Luid)
+        && AdjustTokenPrivileges(token, FALSE, &tp, 0, 0, 0)
+        && GetLastError()==ERROR_SUCCESS)
+      priv=true;
+    CloseHandle(token);
+  });
+  const size_t H=GetLargePageMinimum();
+  if (mode<2 || !priv || H==0) return 0;  // no transparent large pages
+  m.len=(n+H-1)/H*H;
+  void* p=VirtualAlloc(0, m.len, MEM_RESERVE|MEM_COMMIT|MEM_LARGE_PAGES,
+      PAGE_READWRITE);
+  if (p) m.mode=2;
+  return p;
+#endif
+}
+
+// Memory to free once the pool is unlocked
+struct Freed {
+  void* p;
+  size_t len;  // 0 if calloc()ed or malloc()ed, else mapped
+};
+
+// Remove p from the huge page counts if mapped and append it to freed
+static void poolRelease(Pool& pl, void* p, std::vector<Freed>& freed) {
+  Freed f={p, 0};
+  std::map<void*, Mapping>::iterator it=pl.mapped.find(p);
+  if (it!=pl.mapped.end()) {
+    f.len=it->second.len;
+    (it->second.mode==2 ? pl.st.huge : pl.st.advised)-=f.len;
+    pl.mapped.erase(it);
+  }
+  freed.push_back(f);
+}
+
+// Take kept memory out of pl, largest first, until used+kept+n <= limit,
+// and append it to freed.
+static void poolTrim(Pool& pl, size_t n, std::vector<Freed>& freed) {
+  while (pl.idle.size()>0 && pl.st.used+pl.st.kept+n>pl.st.limit) {
+    std::multimap<size_t, void*>::iterator it=--pl.idle.end();
+    pl.st.kept-=it->first;
+    poolRelease(pl, it->second, freed);
+    pl.idle.erase(it);
+  }
+}
+
+static void freeAll(const std::vector<Freed>& freed) {
+  for (size_t i=0; i<freed.size(); ++i) {
+    if (freed[i].len==0) free(freed[i].p);
+#ifdef unix
+    else munmap(freed[i].p, freed[i].len);
+#else
+    else VirtualFree(freed[i].p, 0, MEM_RELEASE);
+#endif
+  }
+}
+
+void* poolAlloc(size_t n, bool zero) {
+  if (n>=POOL_MIN) {
+    Pool& pl=pool();
+    std::vector<Freed> freed;
+    void* p=0;
+    int huge=0;
+    {
+      std::lock_guard<std::mutex> lock(pl.mu);
+      std::multimap<size_t, void*>::iterator it=pl.idle.find(n);
+      if (it!=pl.idle.end()) {
+        p=it->second;
+        pl.idle.erase(it);
+        pl.st.kept-=n;
+        ++pl.st.hits;
+      }
+      else {
+        if (pl.st.limit>0) ++pl.st.misses;
+        poolTrim(pl, n, freed);
+        if (zero && n>=pl.hugeMin) huge=pl.hugeMode;
+      }
+      pl.st.used+=n;
+    }
+    freeAll(freed);
+    if (p) {
+      if (zero) memset(p, 0, n);
+      return p;
+    }
+    Mapping m={0, 0};
+    if (huge>0) p=hugeMap(n, huge, m);
+    if (!p) p=zero ? calloc(n, 1) : malloc(n);
+    if (!p || huge>0) {
+      std::lock_guard<std::mutex> lock(pl.mu);
+      if (!p) pl.st.used-=n;
+      else if (m.mode==0) ++pl.st.hugeFallbacks;
+      else {
+        pl.mapped[p]=m;
+        (m.mode==2 ? pl.st.huge : pl.st.advised)+=m.len;
+      }
+    }
+    return p;
+  }
+  return zero ? calloc(n, 1) : malloc(n);
+}
+
+void poolFree(void* p, size_t n) {
+  if (!p) return;
+  if (n>=POOL_MIN) {
+    Pool& pl=pool();
+    std::vector<Freed> freed;
+    {
+      std::lock_guard<std::mutex> lock(pl.mu);
+      pl.st.used-=n;
+      if (pl.st.used+pl.st.kept+n<=pl.st.limit) {
+        pl.idle.insert(std::make_pair(n, p));
+        pl.st.kept+=n;
+        return;
+      }
+      if (pl.mapped.size()>0) poolRelease(pl, p, freed);
+    }
+    if (freed.size()>0) {
+      freeAll(freed);
+      return;
+    }
+  }
+  free(p);
+}
+
+void* poolRealloc(void* p, size_t n, size_t m) {
+  Pool& pl=pool();
+  if (n<POOL_MIN && m<POOL_MIN) return realloc(p, m);
+  bool pooling;
+  {
+    std::lock_guard<std::mutex> lock(pl.mu);
+    pooling=pl.st.limit>0;
+  }
+
+  // Not pooling: realloc() may extend p in place
+  if (!pooling) {
+    void* q=realloc(p, m);
+    if (q) {
+      std::lock_guard<std::mutex> lock(pl.mu);
+      if (n>=POOL_MIN) pl.st.used-=n;
+      if (m>=POOL_MIN) pl.st.used+=m;
+    }
+    return q;
+  }
+  void* q=poolAlloc(m, false);
+  if (q) {
+    memcpy(q, p, n<m ? n : m);
+    poolFree(p, n);
+  }
+  return q;
+}
+
+void addPoolLimit(int64_t d) {
+  Pool& pl=pool();
+  std::vector<Freed> freed;
+  {
+    std::lock_guard<std::mutex> lock(pl.mu);
+    if (d<0 && size_t(-d)>pl.st.limit) pl.st.limit=0;
+    else pl.st.limit+=d;
+    poolTrim(pl, 0, freed);
+  }
+  freeAll(freed);
+}
+
+size_t setPoolLimit(size_t n) {
+  Pool& pl=pool();
+  std::vector<Freed> freed;
+  size_t old;
+  {
+    std::lock_guard<std::mutex> lock(pl.mu);
+    old=pl.st.limit;
+    pl.st.limit=n;
+    poolTrim(pl, 0, freed);
+  }
+  freeAll(freed);
+  return old;
+}
+
+int setHugePages(int mode, size_t min) {
+  Pool& pl=pool();
+  std::lock_guard<std::mutex> lock(pl.mu);
+  const int old=pl.hugeMode;
+  pl.hugeMode=mode<0 ? 0 : mode>2 ? 2 : mode;
+  pl.hugeMin=min>POOL_MIN ? min : POOL_MIN;
+  return old;
+}
+
+PoolStats poolStats() {
+  Pool& pl=pool();
+  std::lock_guard<std::mutex> lock(pl.mu);
+  return pl.st;
+}
+
 ///////////////////////// allocx //////////////////////
 
 // Allocate newsize > 0 bytes of executable memory and update
@@ -86,9 +372,16 @@ void allocx(U8* &p, int &n, int newsize) {
   }
   if (newsize>0) {
 #ifdef unix
+#if defined(__APPLE__) && defined(__aarch64__)
+    p=(U8*)mmap(0, newsize, PROT_READ|PROT_WRITE|PROT_EXEC,
+                MAP_PRIVATE|MAP_ANON|MAP_JIT, -1, 0);
+    if ((void*)p==MAP_FAILED) p=0;
+    else pthread_jit_write_protect_np(0);  // writable until syncx()
+#else
     p=(U8*)mmap(0, newsize, PROT_READ|PROT_WRITE|PROT_EXEC,
                 MAP_PRIVATE|MAP_ANON, -1, 0);
     if ((void*)p==MAP_FAILED) p=0;
+#endif
 #else
     p=(U8*)VirtualAlloc(0, newsize, MEM_RESERVE|MEM_COMMIT,
                         PAGE_EXECUTE_READWRITE);
@@ -103,6 +396,380 @@ void allocx(U8* &p, int &n, int newsize) {
 #endif
 }
 
+// Make code just assembled into p[0..n-1] by allocx() and assemble()
+// executable and read-only. AArch64 must also flush the data cache to
+// the instruction cache, and on Apple MAP_JIT memory is switched back
+// from writable to executable for the current thread instead.
+void syncx(U8* p, int n) {
+#ifndef NOJIT
+  if (p && n>0) {
+#ifdef __aarch64__
+#ifdef __APPLE__
+    pthread_jit_write_protect_np(1);
+#endif
+    __builtin___clear_cache((char*)p, (char*)p+n);
+#endif
+#ifdef unix
+#if !(defined(__APPLE__) && defined(__aarch64__))
+    mprotect(p, n, PROT_READ|PROT_EXEC);
+#endif
+#else // Windows
+    DWORD old;
+    VirtualProtect(p, n, PAGE_EXECUTE_READ, &old);
+#endif
+  }
+#else
+  (void)p;
+  (void)n;
+#endif
+}
+
+#ifndef NOJIT
+
+// JIT code shared by all ZPAQL and Predictor instances that run the
+// same program. Entries are keyed by rkey or pkey and never change once
+// added. Entries no longer in use are kept for later instances until
+// the cache holds more than JIT_CACHE_MAX bytes of code.
+struct JITCode {
+  U8* p;     // code
+  int n;     // allocated size of p
+  int refs;  // number of instances using p
+};
+
+static const size_t JIT_CACHE_MAX=size_t(64)<<20;
+
+// Allocated once and never destroyed, so that instances destroyed
+// during static destruction can still release their code.
+static std::mutex& jitMutex() {
+  static std::mutex* mu=new std::mutex;
+  return *mu;
+}
+static std::map<std::string, JITCode>& jitCache() {
+  static std::map<std::string, JITCode>* cache=
+      new std::map<std::string, JITCode>;
+  return *cache;
+}
+static size_t jit_bytes=0;  // sum of n in jitCache()
+
+// Return the code cached for key and count one more user, or 0.
+static JITCode* jitFind(const std::string& key) {
+  std::lock_guard<std::mutex> lock(jitMutex());
+  std::map<std::string, JITCode>::iterator it=jitCache().find(key);
+  if (it==jitCache().end()) return 0;
+  ++it->second.refs;
+  return &it->second;
+}
+
+// Add p[0..n-1], just assembled for key by allocx() and syncx(), to the
+// cache with one user and return its entry. If another thread added key
+// first then free p and share that code instead.
+static JITCode* jitAdd(const std::string& key, U8* p, int n) {
+  std::lock_guard<std::mutex> lock(jitMutex());
+  std::map<std::string, JITCode>& cache=jitCache();
+  std::map<std::string, JITCode>::iterator it=cache.find(key);
+  if (it!=cache.end()) {
+    allocx(p, n, 0);
+    ++it->second.refs;
+    return &it->second;
+  }
+  for (it=cache.begin(); it!=cache.end() && jit_bytes+n>JIT_CACHE_MAX;) {
+    if (it->second.refs==0) {  // free unused code to make room
+      jit_bytes-=it->second.n;
+      allocx(it->second.p, it->second.n, 0);
+      cache.erase(it++);
+    }
+    else ++it;
+  }
+  JITCode& e=cache[key];
+  e.p=p;
+  e.n=n;
+  e.refs=1;
+  jit_bytes+=n;
+  return &e;
+}
+
+// Stop using code returned by jitFind() or jitAdd()
+static void jitRelease(JITCode* e) {
+  std::lock_guard<std::mutex> lock(jitMutex());
+  assert(e && e->refs>0);
+  --e->refs;
+}
+
+#endif // NOJIT
+
+////////////////////// crypto instructions //////////////////////
+
+// Unless compiled with -DNOSHAHW or -DNOAESHW, SHA1, SHA256 and AES_CTR
+// use the SHA-NI and AES-NI instructions on x86 or the crypto extension
+// on AArch64 when cpuCrypto() finds them at run time. Functions using
+// them are compiled with SHAHW_TARGET or AESHW_TARGET so that the rest
+// of libzpaq does not depend on them.
+
+#if !defined(NOSHAHW) || !defined(NOAESHW)
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) \
+    || defined(_M_IX86)
+#define CRYPTO_X86
+#elif defined(__aarch64__) && (defined(__linux__) || defined(__APPLE__))
+#define CRYPTO_ARM
+#endif
+#endif
+
+#if defined(CRYPTO_X86) || defined(CRYPTO_ARM)
+#ifndef NOSHAHW
+#define SHAHW
+#endif
+#ifndef NOAESHW
+#define AESHW
+#endif
+#endif
+
+enum {CPU_SHA1=1, CPU_SHA256=2, CPU_AES=4};  // cpuCrypto() bits
+
+#ifdef CRYPTO_X86
+
+#ifdef _MSC_VER
+#define SHAHW_TARGET
+#define AESHW_TARGET
+#else
+#define SHAHW_TARGET __attribute__((target("sha,sse4.1,ssse3")))
+#define AESHW_TARGET __attribute__((target("aes,sse2")))
+#endif
+
+// Return the CPU_* instructions available
+static int cpuCrypto() {
+  static const int hw=[]() {
+    unsigned r1[4]={0}, r7[4]={0};  // eax, ebx, ecx, edx of leaf 1, 7
+#ifdef _MSC_VER
+    int r[4];
+    __cpuid(r, 0);
+    const unsigned maxleaf=r[0];
+    __cpuid(r, 1);
+    memcpy(r1, r, 16);
+    if (maxleaf>=7) {
+      __cpuidex(r, 7, 0);
+      memcpy(r7, r, 16);
+    }
+#else
+    const unsigned maxleaf=__get_cpuid_max(0, 0);
+    if (maxleaf<1) return 0;
+    __cpuid(1, r1[0], r1[1], r1[2], r1[3]);
+    if (maxleaf>=7) __cpuid_count(7, 0, r7[0], r7[1], r7[2], r7[3]);
+#endif
+    int hw=0;
+    if ((r7[1]>>29&1)          // SHA
+        && (r1[2]>>9&1)        // SSSE3
+        && (r1[2]>>19&1))      // SSE4.1
+      hw|=CPU_SHA1|CPU_SHA256;
+    if (r1[2]>>25&1) hw|=CPU_AES;  // AES-NI
+    return hw;
+  }();
+  return hw;
+}
+
+#endif // CRYPTO_X86
+
+#ifdef CRYPTO_ARM
+
+#if defined(__ARM_FEATURE_CRYPTO) \
+    || (defined(__ARM_FEATURE_SHA2) && defined(__ARM_FEATURE_AES))
+#define SHAHW_TARGET
+#elif defined(__clang__)
+#define SHAHW_TARGET __attribute__((target("crypto")))
+#else
+#define SHAHW_TARGET __attribute__((target("+crypto")))
+#endif
+#define AESHW_TARGET SHAHW_TARGET
+
+// Return the CPU_* instructions available
+static int cpuCrypto() {
+#ifdef __APPLE__
+  return CPU_SHA1|CPU_SHA256|CPU_AES;  // all Apple AArch64 CPUs
+#else
+  static const int hw=[]() {
+    const unsigned long cap=getauxval(AT_HWCAP);
+    int hw=0;
+    if (cap>>3&1) hw|=CPU_AES;     // HWCAP_AES
+    if (cap>>5&1) hw|=CPU_SHA1;    // HWCAP_SHA1
+    if (cap>>6&1) hw|=CPU_SHA256;  // HWCAP_SHA2
+    return hw;
+  }();
+  return hw;
+#endif
+}
+
+#endif // CRYPTO_ARM
+
+// SHA-256 round constants
+static const U32 sha256k[64]={
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+  0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+  0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+  0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+  0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+  0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+  0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+  0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+  0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+////////////////////////// SHA hardware //////////////////////////
+
+// sha1HW() and sha256HW() hash n 64 byte blocks at p into state h. If
+// words then p is the w[16] of SHA1 or SHA256 (big-endian words already
+// assembled), else the input bytes.
+
+#if defined(SHAHW) && defined(CRYPTO_X86)
+
+SHAHW_TARGET
+static void sha1HW(U32* h, const void* p, size_t n, bool words) {
+
+  // Load big-endian bytes, or words in order, as W0 in the high lane
+  const __m128i mask=words
+      ? _mm_set_epi64x(0x0302010007060504LL, 0x0b0a09080f0e0d0cLL)
+      : _mm_set_epi64x(0x0001020304050607LL, 0x08090a0b0c0d0e0fLL);
+  __m128i abcd=_mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)h), 0x1B);
+  __m128i e=_mm_set_epi32(h[4], 0, 0, 0);
+  const __m128i* in=(const __m128i*)p;
+  for (; n>0; --n, in+=4) {
+    const __m128i abcd0=abcd, e0=e;
+    __m128i m[4], prev=abcd;
+    for (int i=0; i<4; ++i)
+      m[i]=_mm_shuffle_epi8(_mm_loadu_si128(in+i), mask);
+
+    // 4 rounds using message words m[g&3] = W[4g..4g+3]
+    #define G(g) \
+      if ((g)>=4) m[(g)&3]=_mm_sha1msg2_epu32(_mm_xor_si128( \
+          _mm_sha1msg1_epu32(m[(g)&3], m[((g)+1)&3]), m[((g)+2)&3]), \
+          m[((g)+3)&3]); \
+      e=(g)==0 ? _mm_add_epi32(e, m[0]) : _mm_sha1nexte_epu32(prev, m[(g)&3]); \
+      prev=abcd; \
+      abcd=_mm_sha1rnds4_epu32(abcd, e, (g)/5);
+    G(0)  G(1)  G(2)  G(3)  G(4)  G(5)  G(6)  G(7)  G(8)  G(9)
+    G(10) G(11) G(12) G(13) G(14) G(15) G(16) G(17) G(18) G(19)
+    #undef G
+    e=_mm_sha1nexte_epu32(prev, e0);
+    abcd=_mm_add_epi32(abcd, abcd0);
+  }
+  _mm_storeu_si128((__m128i*)h, _mm_shuffle_epi32(abcd, 0x1B));
+  h[4]=_mm_extract_epi32(e, 3);
+}
+
+SHAHW_TARGET
+static void sha256HW(U32* h, const void* p, size_t n, bool words) {
+
+  // Load big-endian bytes, or words as they are
+  const __m128i mask=words
+      ? _mm_set_epi64x(0x0f0e0d0c0b0a0908LL, 0x0706050403020100LL)
+      : _mm_set_epi64x(0x0c0d0e0f08090a0bLL, 0x0405060700010203LL);
+  __m128i t=_mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)h), 0xB1);
+  __m128i s1=_mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)(h+4)), 0x1B);
+  __m128i s0=_mm_alignr_epi8(t, s1, 8);  // ABEF
+  s1=_mm_blend_epi16(s1, t, 0xF0);       // CDGH
+  const __m128i* in=(const __m128i*)p;
+  for (; n>0; --n, in+=4) {
+    const __m128i abef=s0, cdgh=s1;
+    __m128i m[4], x;
+    for (int i=0; i<4; ++i)
+      m[i]=_mm_shuffle_epi8(_mm_loadu_si128(in+i), mask);
+
+    // 4 rounds using message words m[g&3] = W[4g..4g+3]
+    #define G(g) \
+      if ((g)>=4) m[(g)&3]=_mm_sha256msg2_epu32(_mm_add_epi32( \
+          _mm_sha256msg1_epu32(m[(g)&3], m[((g)+1)&3]), \
+          _mm_alignr_epi8(m[((g)+3)&3], m[((g)+2)&3], 4)), m[((g)+3)&3]); \
+      x=_mm_add_epi32(m[(g)&3], _mm_loadu_si128((const __m128i*)(sha256k+4*(g)))); \
+      s1=_mm_sha256rnds2_epu32(s1, s0, x); \
+      s0=_mm_sha256rnds2_epu32(s0, s1, _mm_shuffle_epi32(x, 0x0E));
+    G(0)  G(1)  G(2)  G(3)  G(4)  G(5)  G(6)  G(7)
+    G(8)  G(9)  G(10) G(11) G(12) G(13) G(14) G(15)
+    #undef G
+    s0=_mm_add_epi32(s0, abef);
+    s1=_mm_add_epi32(s1, cdgh);
+  }
+  t=_mm_shuffle_epi32(s0, 0x1B);         // FEBA
+  s1=_mm_shuffle_epi32(s1, 0xB1);        // DCHG
+  _mm_storeu_si128((__m128i*)h, _mm_blend_epi16(t, s1, 0xF0));  // DCBA
+  _mm_storeu_si128((__m128i*)(h+4), _mm_alignr_epi8(s1, t, 8));  // HGFE
+}
+
+#endif // SHAHW && CRYPTO_X86
+
+#if defined(SHAHW) && defined(CRYPTO_ARM)
+
+SHAHW_TARGET
+static void sha1HW(U32* h, const void* p, size_t n, bool words) {
+  static const U32 k[4]={0x5A827999, 0x6ED9EBA1, 0x8F1BBCDC, 0xCA62C1D6};
+  uint32x4_t abcd=vld1q_u32(h);
+  U32 e=h[4];
+  const U32* in=(const U32*)p;
+  for (; n>0; --n, in+=16) {
+    const uint32x4_t abcd0=abcd;
+    const U32 e0=e;
+    uint32x4_t m[4], t;
+    U32 e1;
+    for (int i=0; i<4; ++i) {
+      m[i]=vld1q_u32(in+4*i);
+      if (!words) m[i]=vreinterpretq_u32_u8(vrev32q_u8(vreinterpretq_u8_u32(m[i])));
+    }
+
+    // 4 rounds using message words m[g&3] = W[4g..4g+3]
+    #define G(g) \
+      if ((g)>=4) m[(g)&3]=vsha1su1q_u32(vsha1su0q_u32( \
+          m[(g)&3], m[((g)+1)&3], m[((g)+2)&3]), m[((g)+3)&3]); \
+      t=vaddq_u32(m[(g)&3], vdupq_n_u32(k[(g)/5])); \
+      e1=vsha1h_u32(vgetq_lane_u32(abcd, 0)); \
+      abcd=(g)<5 ? vsha1cq_u32(abcd, e, t) \
+          : (g)>=10 && (g)<15 ? vsha1mq_u32(abcd, e, t) \
+          : vsha1pq_u32(abcd, e, t); \
+      e=e1;
+    G(0)  G(1)  G(2)  G(3)  G(4)  G(5)  G(6)  G(7)  G(8)  G(9)
+    G(10) G(11) G(12) G(13) G(14) G(15) G(16) G(17) G(18) G(19)
+    #undef G
+    abcd=vaddq_u32(abcd, abcd0);
+    e+=e0;
+  }
+  vst1q_u32(h, abcd);
+  h[4]=e;
+}
+
+SHAHW_TARGET
+static void sha256HW(U32* h, const void* p, size_t n, bool words) {
+  uint32x4_t s0=vld1q_u32(h), s1=vld1q_u32(h+4);
+  const U32* in=(const U32*)p;
+  for (; n>0; --n, in+=16) {
+    const uint32x4_t abcd=s0, efgh=s1;
+    uint32x4_t m[4], t, s;
+    for (int i=0; i<4; ++i) {
+      m[i]=vld1q_u32(in+4*i);
+      if (!words) m[i]=vreinterpretq_u32_u8(vrev32q_u8(vreinterpretq_u8_u32(m[i])));
+    }
+
+    // 4 rounds using message words m[g&3] = W[4g..4g+3]
+    #define G(g) \
+      if ((g)>=4) m[(g)&3]=vsha256su1q_u32(vsha256su0q_u32( \
+          m[(g)&3], m[((g)+1)&3]), m[((g)+2)&3], m[((g)+3)&3]); \
+      t=vaddq_u32(m[(g)&3], vld1q_u32(sha256k+4*(g))); \
+      s=s0; \
+      s0=vsha256hq_u32(s0, s1, t); \
+      s1=vsha256h2q_u32(s1, s, t);
+    G(0)  G(1)  G(2)  G(3)  G(4)  G(5)  G(6)  G(7)
+    G(8)  G(9)  G(10) G(11) G(12) G(13) G(14) G(15)
+    #undef G
+    s0=vaddq_u32(s0, abcd);
+    s1=vaddq_u32(s1, efgh);
+  }
+  vst1q_u32(h, s0);
+  vst1q_u32(h+4, s1);
+}
+
+#endif // SHAHW && CRYPTO_ARM
+
 //////////////////////////// SHA1 ////////////////////////////
 
 // SHA1 code, see http://en.wikipedia.org/wiki/SHA-1
@@ -152,6 +819,15 @@ const char* SHA1::result() {
 void SHA1::write(const char* buf, int64_t n) {
   const unsigned char* p=(const unsigned char*) buf;
   for (; n>0 && (U32(len)&511)!=0; --n) put(*p++);
+#ifdef SHAHW
+  if (n>=64 && (cpuCrypto()&CPU_SHA1)) {  // whole blocks straight from buf
+    const int64_t nb=n>>6;
+    sha1HW(h, p, size_t(nb), false);
+    len+=U64(nb)<<9;
+    p+=nb<<6;
+    n&=63;
+  }
+#endif
   for (; n>=64; n-=64) {
     for (int i=0; i<16; ++i)
       w[i]=p[0]<<24|p[1]<<16|p[2]<<8|p[3], p+=4;
@@ -163,6 +839,12 @@ void SHA1::write(const char* buf, int64_t n) {
 
 // Hash 1 block of 64 bytes
 void SHA1::process() {
+#ifdef SHAHW
+  if (cpuCrypto()&CPU_SHA1) {
+    sha1HW(h, w, 1, true);
+    return;
+  }
+#endif
   U32 a=h[0], b=h[1], c=h[2], d=h[3], e=h[4];
   static const U32 k[4]={0x5A827999, 0x6ED9EBA1, 0x8F1BBCDC, 0xCA62C1D6};
   #define f(a,b,c,d,e,i) \
@@ -196,7 +878,39 @@ void SHA256::init() {
   memset(w, 0, sizeof(w));
 }
 
+// Hash buf[0..n-1]
+void SHA256::write(const char* buf, int64_t n) {
+  const unsigned char* p=(const unsigned char*) buf;
+  for (; n>0 && (len0&511)!=0; --n) put(*p++);
+  const int64_t nb=n>>6;  // whole blocks
+  if (nb>0) {
+    const U64 bits=(U64(len1)<<32|len0)+(U64(nb)<<9);
+    len0=U32(bits);
+    len1=U32(bits>>32);
+  }
+#ifdef SHAHW
+  if (nb>0 && (cpuCrypto()&CPU_SHA256)) {
+    sha256HW(s, p, size_t(nb), false);
+    p+=nb<<6;
+    n&=63;
+  }
+#endif
+  for (; n>=64; n-=64) {
+    for (int i=0; i<16; ++i)
+      w[i]=p[0]<<24|p[1]<<16|p[2]<<8|p[3], p+=4;
+    process();
+  }
+  for (; n>0; --n) put(*p++);
+}
+
 void SHA256::process() {
+#ifdef SHAHW
+  if (cpuCrypto()&CPU_SHA256) {
+    sha256HW(s, w, 1, true);
+    return;
+  }
+#endif
+  const U32* k=sha256k;
 
   #define ror(a,b) ((a)>>(b)|(a<<(32-(b))))
 
@@ -236,23 +950,6 @@ void SHA256::process() {
     mr(c,d,e,f,g,h,a,b,i+6); \
     mr(b,c,d,e,f,g,h,a,i+7);
 
-  static const unsigned k[64]={
-    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
-    0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
-    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
-    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
-    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
-    0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
-    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
-    0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
-    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
-    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
-    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
-    0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
-    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
-    0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
-    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
-    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
 
   unsigned a=s[0];
   unsigned b=s[1];
@@ -456,6 +1153,10 @@ AES_CTR::AES_CTR(const char* key, int keylen, const char* iv) {
       rk += 8;
     }
   }
+
+  // Round keys as bytes for the AES instructions
+  for (int j=0; j<4*(Nr+1); ++j)
+    STORE32H(ek[j], ekb+4*j);
 }
 
 // Encrypt to ct[16]
@@ -555,9 +1256,86 @@ void AES_CTR::encrypt(U32 s0, U32 s1, U32 s2, U32 s3, unsigned char* ct) {
   STORE32H(s3, ct+12);
 }
 
+// aesHW() puts in ks[0..16*m-1] the encryption of the m <= 8 counter
+// blocks iv[0..7] followed by i..i+m-1 (64 bit big-endian) with the round
+// keys rk[0..16*nr+15] (ekb). The blocks are encrypted together so that
+// the rounds of different blocks overlap in the pipeline.
+
+#if defined(AESHW) && defined(CRYPTO_X86)
+
+AESHW_TARGET
+static void aesHW(const U8* rk, int nr, const U8* iv, U64 i, int m, U8* ks) {
+  assert(m>0 && m<=8);
+  __m128i b[8];
+  const __m128i k0=_mm_loadu_si128((const __m128i*)rk);
+  U64 ivq;
+  memcpy(&ivq, iv, 8);
+  for (int j=0; j<m; ++j) {
+    U64 c=i+j, be=0;  // c big-endian
+    for (int k=0; k<8; ++k) be=be<<8|(c&255), c>>=8;
+    b[j]=_mm_xor_si128(_mm_set_epi64x(be, ivq), k0);
+  }
+  for (int r=1; r<nr; ++r) {
+    const __m128i k=_mm_loadu_si128((const __m128i*)(rk+16*r));
+    for (int j=0; j<m; ++j) b[j]=_mm_aesenc_si128(b[j], k);
+  }
+  const __m128i kn=_mm_loadu_si128((const __m128i*)(rk+16*nr));
+  for (int j=0; j<m; ++j)
+    _mm_storeu_si128((__m128i*)(ks+16*j), _mm_aesenclast_si128(b[j], kn));
+}
+
+#endif // AESHW && CRYPTO_X86
+
+#if defined(AESHW) && defined(CRYPTO_ARM)
+
+AESHW_TARGET
+static void aesHW(const U8* rk, int nr, const U8* iv, U64 i, int m, U8* ks) {
+  assert(m>0 && m<=8);
+  uint8x16_t b[8];
+  const uint8x8_t ivv=vld1_u8(iv);
+  for (int j=0; j<m; ++j)
+    b[j]=vcombine_u8(ivv, vrev64_u8(vcreate_u8(i+j)));
+  for (int r=0; r<nr-1; ++r) {
+    const uint8x16_t k=vld1q_u8(rk+16*r);
+    for (int j=0; j<m; ++j) b[j]=vaesmcq_u8(vaeseq_u8(b[j], k));
+  }
+  const uint8x16_t k1=vld1q_u8(rk+16*(nr-1)), kn=vld1q_u8(rk+16*nr);
+  for (int j=0; j<m; ++j)
+    vst1q_u8(ks+16*j, veorq_u8(vaeseq_u8(b[j], k1), kn));
+}
+
+#endif // AESHW && CRYPTO_ARM
+
 // Encrypt or decrypt slice buf[0..n-1] at offset by XOR with AES(i) where
 // i is the 128 bit big-endian distance from the start in 16 byte blocks.
 void AES_CTR::encrypt(char* buf, int n, U64 offset) {
+#ifdef AESHW
+  if (cpuCrypto()&CPU_AES) {
+    U8 iv[8], ks[128];
+    STORE32H(iv0, iv);
+    STORE32H(iv1, iv+4);
+    U64 i=offset/16;
+    int skip=offset%16;  // bytes of block i before buf
+    while (n>0) {
+      const int m=n>=128-skip ? 8 : (skip+n+15)/16;  // blocks
+      aesHW(ekb, Nr, iv, i, m, ks);
+      const int len=n<16*m-skip ? n : 16*m-skip;
+      if (len==128) {  // whole blocks, 8 bytes at a time
+        for (int j=0; j<128; j+=8) {
+          U64 x, k;
+          memcpy(&x, buf+j, 8);
+          memcpy(&k, ks+j, 8);
+          x^=k;
+          memcpy(buf+j, &x, 8);
+        }
+      }
+      else
+        for (int j=0; j<len; ++j) buf[j]^=ks[skip+j];
+      buf+=len, n-=len, i+=m, skip=0;
+    }
+    return;
+  }
+#endif
   for (U64 i=offset/16; i<=(offset+n)/16; ++i) {
     unsigned char ct[16];
     encrypt(iv0, iv1, i>>32, i, ct);
@@ -660,17 +1438,48 @@ static void smix(char* b, int r, int n) {
   for (int i=0; i<r*128; ++i) b[i]=x[i/4]>>(i%4*8);
 }
 
+// Call f(i) for i in 0..n-1 using up to threads threads. If any call
+// throws then rethrow the first exception after all threads finish.
+template <typename F>
+static void parallelFor(int n, int threads, F f) {
+  if (threads>n) threads=n;
+  if (threads<=1) {
+    for (int i=0; i<n; ++i) f(i);
+    return;
+  }
+  std::atomic<int> next(0);
+  std::exception_ptr err;
+  std::mutex mu;
+  auto work=[&]() {
+    for (int i; (i=next++)<n;) {
+      try {
+        f(i);
+      }
+      catch (...) {
+        std::lock_guard<std::mutex> lock(mu);
+        if (!err) err=std::current_exception();
+      }
+    }
+  };
+  std::vector<std::thread> t;
+  for (int i=1; i<threads; ++i) t.emplace_back(work);
+  work();
+  for (unsigned i=0; i<t.size(); ++i) t[i].join();
+  if (err) std::rethrow_exception(err);
+}
+
 // Strengthen password pw[0..pwlen-1] and salt[0..saltlen-1]
 // to produce key buf[0..buflen-1]. Uses O(n*r*p) time and 128*r*n bytes
-// of memory. n must be a power of 2 and r <= 8.
+// of memory. n must be a power of 2 and r <= 8. The p mixes run on up
+// to threads threads (each using its 128*r*n bytes at the same time).
 void scrypt(const char* pw, int pwlen,
             const char* salt, int saltlen,
-            int n, int r, int p, char* buf, int buflen) {
+            int n, int r, int p, char* buf, int buflen, int threads) {
   assert(r<=8);
   assert(n>0 && (n&(n-1))==0);  // power of 2?
   libzpaq::Array<char> b(p*r*128);
   pbkdf2(pw, pwlen, salt, saltlen, 1, &b[0], p*r*128);
-  for (int i=0; i<p; ++i) smix(&b[i*r*128], r, n);
+  parallelFor(p, threads, [&](int i) {smix(&b[i*r*128], r, n);});
   pbkdf2(pw, pwlen, &b[0], p*r*128, 1, buf, buflen);
 }
 
@@ -680,6 +1489,15 @@ void stretchKey(char* out, const char* in, const char* salt) {
   scrypt(in, 32, salt, 32, 1<<14, 8, 1, out, 32);
 }
 
+// stretchKey(out+32*i, in+32*i, salt+32*i) for i in 0..n-1 on up to
+// threads threads
+void stretchKeys(char* out, const char* in, const char* salt, int n,
+                 int threads) {
+  parallelFor(n, threads, [&](int i) {
+    stretchKey(out+32*i, in+32*i, salt+32*i);
+  });
+}
+
 //////////////////////////// random //////////////////////////
 
 // Put n cryptographic random bytes in buf[0..n-1].
@@ -929,11 +1747,11 @@ int ZPAQL::read(Reader* in2) {
   assert(hend>hbegin && hend<header.isize());
   assert(hsize==header[0]+256*header[1]);
   assert(hsize==cend-2+hend-hbegin);
-  allocx(rcode, rcode_size, 0);  // clear JIT code
   return cend+hend-hbegin;
 }
 
-// Free memory, but preserve output, sha1 pointers
+// Free memory, but preserve output, sha1 pointers. JIT code is kept
+// and reused by init() if the program and memory layout do not change.
 void ZPAQL::clear() {
   cend=hbegin=hend=0;  // COMP and HCOMP locations
   a=b=c=d=f=pc=0;      // machine state
@@ -941,7 +1759,6 @@ void ZPAQL::clear() {
   h.resize(0);
   m.resize(0);
   r.resize(0);
-  allocx(rcode, rcode_size, 0);
 }
 
 // Constructor
@@ -950,12 +1767,26 @@ ZPAQL::ZPAQL() {
   sha1=0;
   rcode=0;
   rcode_size=0;
+  rjit=0;
   clear();
   outbuf.resize(1<<14);
   bufptr=0;
 }
 
 ZPAQL::~ZPAQL() {
+  freex();
+}
+
+// Free rcode, or stop sharing it
+void ZPAQL::freex() {
+#ifndef NOJIT
+  if (rjit) {
+    jitRelease(rjit);
+    rjit=0;
+    rcode=0;
+    rcode_size=0;
+  }
+#endif
   allocx(rcode, rcode_size, 0);
 }
 
@@ -967,6 +1798,21 @@ void ZPAQL::inith() {
   init(header[2], header[3]); // hh, hm
 }
 
+// Copy b to a, reusing the memory of a if the size is the same
+template <typename T>
+static void copyArray(Array<T>& a, Array<T>& b) {
+  if (a.size()!=b.size()) a.resize(b.size());
+  if (b.size()>0) memcpy(&a[0], &b[0], b.size()*sizeof(T));
+}
+
+// Copy the machine state of from, which runs the same program
+void ZPAQL::copyState(ZPAQL& from) {
+  copyArray(h, from.h);
+  copyArray(m, from.m);
+  copyArray(r, from.r);
+  a=from.a, b=from.b, c=from.c, d=from.d, f=from.f, pc=from.pc;
+}
+
 // Initialize machine state as PCOMP
 void ZPAQL::initp() {
   assert(header.isize()>6);
@@ -1026,6 +1872,22 @@ void ZPAQL::init(int hbits, int mbits) {
   m.resize(1, mbits);
   r.resize(256);
   a=b=c=d=pc=f=0;
+
+#ifndef NOJIT
+  // The JIT code depends on HCOMP and the sizes of H, M and outbuf.
+  // 64-bit code finds the machine state through this and can be shared
+  // by all instances. 32-bit x86 code has the addresses built in.
+  std::string key(1, 'R');
+  key.append((const char*)&header[hbegin], hend-hbegin+2);
+  const size_t sizes[3]={h.size(), m.size(), outbuf.size()};
+  key.append((const char*)sizes, sizeof(sizes));
+  if (sizeof(char*)==4) {
+    const void* addrs[5]={this, &h[0], &m[0], &r[0], &outbuf[0]};
+    key.append((const char*)addrs, sizeof(addrs));
+  }
+  if (rcode && key!=rkey) freex();
+  rkey.swap(key);
+#endif
 }
 
 // Run program on input by interpreting header
@@ -1717,18 +2579,39 @@ Predictor::Predictor(ZPAQL& zr):
   assert(sizeof(int)==4);
   pcode=0;
   pcode_size=0;
+  pjit=0;
   initTables=false;
 }
 
 Predictor::~Predictor() {
-  allocx(pcode, pcode_size, 0);  // free executable memory
+  freex();  // free executable memory
+}
+
+// Free pcode, or stop sharing it
+void Predictor::freex() {
+#ifndef NOJIT
+  if (pjit) {
+    jitRelease(pjit);
+    pjit=0;
+    pcode=0;
+    pcode_size=0;
+  }
+#endif
+  allocx(pcode, pcode_size, 0);
 }
 
 // Initialize the predictor with a new model in z
 void Predictor::init() {
 
-  // Clear old JIT code if any
-  allocx(pcode, pcode_size, 0);
+#ifndef NOJIT
+  // Clear old JIT code unless it was built from the same COMP section.
+  // It addresses the component arrays through this, so only the model
+  // description matters and it can be shared by all instances.
+  std::string key(1, 'P');
+  key.append((const char*)&z.header[0], z.cend);
+  if (pcode && key!=pkey) freex();
+  pkey.swap(key);
+#endif
 
   // Initialize context hash function
   z.inith();
@@ -1769,15 +2652,23 @@ void Predictor::init() {
   // Initialize predictions
   for (int i=0; i<256; ++i) h[i]=p[i]=0;
 
-  // Initialize components
-  for (int i=0; i<256; ++i)  // clear old model
-    comp[i].init();
+  // Initialize components. Arrays that the new component type uses
+  // are kept and resized below, which zeros them in place when the
+  // size is unchanged. The rest of the old model is freed.
   int n=z.header[6]; // hsize[0..1] hh hm ph pm n (comp)[n] END 0[128] (hcomp) END
+  for (int i=n; i<256; ++i)  // clear old model
+    comp[i].init();
   const U8* cp=&z.header[7];  // start of component list
   for (int i=0; i<n; ++i) {
     assert(cp<&z.header[z.cend]);
     assert(cp>&z.header[0] && cp<&z.header[z.header.isize()-8]);
     Component& cr=comp[i];
+    cr.limit=cr.cxt=cr.a=cr.b=cr.c=0;
+    const int t=cp[0];
+    if (t!=CM && t!=ICM && t!=MATCH && t!=MIX && t!=ISSE && t!=SSE)
+      cr.cm.resize(0);
+    if (t!=ICM && t!=MATCH && t!=ISSE) cr.ht.resize(0);
+    if (t!=MIX2) cr.a16.resize(0);
     switch(cp[0]) {
       case CONS:  // c
         p[i]=(cp[1]-128)*4;
@@ -1855,6 +2746,163 @@ void Predictor::init() {
   }
 }
 
+// Make this model and its state a copy of from. The model is built with
+// init() only if it differs from the last one, so after the first call
+// the tables and JIT code are reused and only their contents copied.
+void Predictor::copyFrom(Predictor& from) {
+  Array<U8>& hd=from.z.header;
+  assert(hd.isize()>6);
+  if (z.header.size()!=hd.size()
+      || memcmp(&z.header[0], &hd[0], hd.size())!=0) {
+    copyArray(z.header, hd);
+    z.cend=from.z.cend;
+    z.hbegin=from.z.hbegin;
+    z.hend=from.z.hend;
+    init();
+  }
+  z.copyState(from.z);
+  c8=from.c8;
+  hmap4=from.hmap4;
+  memcpy(p, from.p, sizeof(p));
+  memcpy(h, from.h, sizeof(h));
+  for (int i=0; i<z.header[6]; ++i) {
+    Component& cr=comp[i];
+    Component& cf=from.comp[i];
+    cr.limit=cf.limit;
+    cr.cxt=cf.cxt;
+    cr.a=cf.a, cr.b=cf.b, cr.c=cf.c;
+    copyArray(cr.cm, cf.cm);
+    copyArray(cr.ht, cf.ht);
+    copyArray(cr.a16, cf.a16);
+  }
+}
+
+// MIX dot product and weight update on vectors: AVX2 on x86 and NEON on
+// AArch64. The results are the same as the scalar loops because
+// wt[j]>>8 and p[j] fit in 12 bits, err*p[j] in 31, and no sum
+// overflows. Compile with -DNOMIXHW to use the scalar loops only.
+
+#ifndef NOMIXHW
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) \
+    || defined(_M_IX86)
+#define MIXHW_X86
+#elif defined(__aarch64__)
+#define MIXHW_ARM
+#endif
+#endif
+
+#ifdef MIXHW_X86
+
+#ifdef _MSC_VER
+#define AVX2_TARGET
+#else
+#define AVX2_TARGET __attribute__((target("avx2")))
+#endif
+
+// Return 2 if AVX2 is available, 1 if only SSE4.1 is, else 0
+static int cpuMix() {
+  static const int hw=[]() {
+    unsigned r1[4]={0}, r7[4]={0};  // eax, ebx, ecx, edx of leaf 1, 7
+    U64 xcr0=0;
+#ifdef _MSC_VER
+    int r[4];
+    __cpuid(r, 0);
+    const unsigned maxleaf=r[0];
+    __cpuid(r, 1);
+    memcpy(r1, r, 16);
+    if (maxleaf>=7) {
+      __cpuidex(r, 7, 0);
+      memcpy(r7, r, 16);
+    }
+    if (r1[2]>>27&1) xcr0=_xgetbv(0);  // OSXSAVE
+#else
+    const unsigned maxleaf=__get_cpuid_max(0, 0);
+    if (maxleaf<1) return 0;
+    __cpuid(1, r1[0], r1[1], r1[2], r1[3]);
+    if (maxleaf>=7) __cpuid_count(7, 0, r7[0], r7[1], r7[2], r7[3]);
+    if (r1[2]>>27&1) {  // OSXSAVE
+      unsigned lo, hi;
+      __asm__("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+      xcr0=U64(hi)<<32|lo;
+    }
+#endif
+    if ((r7[1]>>5&1) && (xcr0&6)==6) return 2;  // AVX2, OS saves YMM
+    return int(r1[2]>>19&1);  // SSE4.1
+  }();
+  return hw;
+}
+
+// Return sum (wt[j]>>8)*p[j], j=0..m-1
+AVX2_TARGET
+static int mixDotAVX2(const int* wt, const int* p, int m) {
+  __m256i s=_mm256_setzero_si256();
+  int j=0;
+  for (; j+8<=m; j+=8)
+    s=_mm256_add_epi32(s, _mm256_mullo_epi32(
+        _mm256_srai_epi32(_mm256_loadu_si256((const __m256i*)(wt+j)), 8),
+        _mm256_loadu_si256((const __m256i*)(p+j))));
+  __m128i t=_mm_add_epi32(_mm256_castsi256_si128(s),
+                          _mm256_extracti128_si256(s, 1));
+  t=_mm_add_epi32(t, _mm_shuffle_epi32(t, 0x4e));
+  t=_mm_add_epi32(t, _mm_shuffle_epi32(t, 0xb1));
+  int sum=_mm_cvtsi128_si32(t);
+  for (; j<m; ++j) sum+=(wt[j]>>8)*p[j];
+  return sum;
+}
+
+// wt[j]=clamp512k(wt[j]+((err*p[j]+(1<<12))>>13)), j=0..m-1
+AVX2_TARGET
+static void mixTrainAVX2(int* wt, const int* p, int m, int err) {
+  const __m256i e=_mm256_set1_epi32(err), r=_mm256_set1_epi32(1<<12);
+  const __m256i lo=_mm256_set1_epi32(-(1<<19));
+  const __m256i hi=_mm256_set1_epi32((1<<19)-1);
+  int j=0;
+  for (; j+8<=m; j+=8) {
+    __m256i x=_mm256_mullo_epi32(_mm256_loadu_si256((const __m256i*)(p+j)), e);
+    x=_mm256_srai_epi32(_mm256_add_epi32(x, r), 13);
+    x=_mm256_add_epi32(x, _mm256_loadu_si256((const __m256i*)(wt+j)));
+    x=_mm256_max_epi32(_mm256_min_epi32(x, hi), lo);
+    _mm256_storeu_si256((__m256i*)(wt+j), x);
+  }
+  for (; j<m; ++j) {
+    const int x=wt[j]+((err*p[j]+(1<<12))>>13);
+    wt[j]=x<-(1<<19) ? -(1<<19) : x>=(1<<19) ? (1<<19)-1 : x;
+  }
+}
+
+#endif // MIXHW_X86
+
+#ifdef MIXHW_ARM
+
+// Return sum (wt[j]>>8)*p[j], j=0..m-1
+static int mixDotNEON(const int* wt, const int* p, int m) {
+  int32x4_t s=vdupq_n_s32(0);
+  int j=0;
+  for (; j+4<=m; j+=4)
+    s=vmlaq_s32(s, vshrq_n_s32(vld1q_s32(wt+j), 8), vld1q_s32(p+j));
+  int sum=vaddvq_s32(s);
+  for (; j<m; ++j) sum+=(wt[j]>>8)*p[j];
+  return sum;
+}
+
+// wt[j]=clamp512k(wt[j]+((err*p[j]+(1<<12))>>13)), j=0..m-1
+static void mixTrainNEON(int* wt, const int* p, int m, int err) {
+  const int32x4_t e=vdupq_n_s32(err), r=vdupq_n_s32(1<<12);
+  const int32x4_t lo=vdupq_n_s32(-(1<<19)), hi=vdupq_n_s32((1<<19)-1);
+  int j=0;
+  for (; j+4<=m; j+=4) {
+    int32x4_t x=vshrq_n_s32(vaddq_s32(vmulq_s32(vld1q_s32(p+j), e), r), 13);
+    x=vaddq_s32(x, vld1q_s32(wt+j));
+    vst1q_s32(wt+j, vmaxq_s32(vminq_s32(x, hi), lo));
+  }
+  for (; j<m; ++j) {
+    const int x=wt[j]+((err*p[j]+(1<<12))>>13);
+    wt[j]=x<-(1<<19) ? -(1<<19) : x>=(1<<19) ? (1<<19)-1 : x;
+  }
+}
+
+#endif // MIXHW_ARM
+
 // Return next bit prediction using interpreted COMP code
 int Predictor::predict0() {
   assert(initTables);
@@ -1916,6 +2964,18 @@ int Predictor::predict0() {
         cr.cxt=(cr.cxt&(cr.c-1))*m; // pointer to row of weights
         assert(cr.cxt<=cr.cm.size()-m);
         int* wt=(int*)&cr.cm[cr.cxt];
+#ifdef MIXHW_X86
+        if (m>=8 && cpuMix()>=2) {
+          p[i]=clamp2k(mixDotAVX2(wt, &p[cp[2]], m)>>8);
+          break;
+        }
+#endif
+#ifdef MIXHW_ARM
+        if (m>=4) {
+          p[i]=clamp2k(mixDotNEON(wt, &p[cp[2]], m)>>8);
+          break;
+        }
+#endif
         p[i]=0;
         for (int j=0; j<m; ++j)
           p[i]+=(wt[j]>>8)*p[cp[2]+j];
@@ -2031,6 +3091,18 @@ void Predictor::update0(int y) {
         assert(cr.cxt+m<=cr.cm.size());
         int err=(y*32767-squash(p[i]))*cp[4]>>4;
         int* wt=(int*)&cr.cm[cr.cxt];
+#ifdef MIXHW_X86
+        if (m>=8 && cpuMix()>=2) {
+          mixTrainAVX2(wt, &p[cp[2]], m, err);
+          break;
+        }
+#endif
+#ifdef MIXHW_ARM
+        if (m>=4) {
+          mixTrainNEON(wt, &p[cp[2]], m, err);
+          break;
+        }
+#endif
         for (int j=0; j<m; ++j)
           wt[j]=clamp512k(wt[j]+((err*p[cp[2]+j]+(1<<12))>>13));
       }
@@ -2096,7 +3168,25 @@ size_t Predictor::find(Array<U8>& ht, int sizebits, U32 cxt) {
 
 Decoder::Decoder(ZPAQL& z):
     in(0), low(1), high(0xFFFFFFFF), curr(0), rpos(0), wpos(0),
-    pr(z), buf(BUFSIZE) {
+    pr(z), buf(BUFSIZE), bp(&buf[0]) {
+}
+
+// Read the next input into bp[0..wpos-1], in place if in supports it
+void Decoder::fill() {
+  rpos=wpos=0;
+  if (!in) return;
+  const char* p=0;
+  const int n=in->view(&p, BUFSIZE);
+  if (n>=0) {
+    assert(n<=BUFSIZE);
+    bp=p;
+    wpos=n;
+  }
+  else {
+    bp=&buf[0];
+    wpos=in->read(&buf[0], BUFSIZE);
+  }
+  assert(wpos<=BUFSIZE);
 }
 
 void Decoder::init() {
@@ -2105,6 +3195,16 @@ void Decoder::init() {
   else low=high=curr=0;
 }
 
+// Start decoding a segment of the model in from, discarding any input
+// read ahead
+void Decoder::prime(Predictor& from) {
+  pr.copyFrom(from);
+  assert(pr.isModeled());
+  low=1, high=0xFFFFFFFF, curr=0;
+  rpos=wpos=0;
+  bp=&buf[0];
+}
+
 // Return next bit of decoded input, which has 16 bit probability p of being 1
 int Decoder::decode(int p) {
   assert(pr.isModeled());
@@ -2187,14 +3287,182 @@ int Decoder::skip() {
 
 ////////////////////// PostProcessor //////////////////////
 
+// Return the PCOMP bytecode that makeConfig() writes for method
+static std::string pcompCode(const char* method) {
+  int args[9]={0};
+  std::string cfg=makeConfig(method, args);
+  ZPAQL hz, pz;
+  Compiler(cfg.c_str(), args, hz, pz, 0);
+  return std::string((const char*)&pz.header[pz.hbegin], pz.hend-pz.hbegin);
+}
+
+// Return 1 if the PCOMP in z is the IBWT of makeConfig() for blocks of
+// up to 16 MB, 2 if it is the IBWT+E8E9 of those, else 0.
+static int ibwtType(ZPAQL& z) {
+  static const std::string code[2]={pcompCode("x4.3"), pcompCode("x4.7")};
+  const int n=z.hend-z.hbegin;
+  for (int i=0; i<2; ++i)
+    if (int(code[i].size())==n && !memcmp(&z.header[z.hbegin], code[i].data(), n))
+      return i+1;
+  return 0;
+}
+
+// Append to out what the IBWT PCOMP outputs for input b: the BWT with
+// 255 at the EOS row, then that row LSB first. If e8 then undo E8E9 as
+// the IBWT+E8E9 PCOMP does. Return false and append nothing if b is not
+// a transform that this handles. The PCOMP walks the list of rows one
+// dependent cache miss at a time. Here each row r with r%K==0 is a
+// sample. Walks from all samples to the next sample run G at a time, so
+// their misses overlap, then the pieces are written in list order,
+// again G at a time.
+static bool inverseBWT(const std::string& b, bool e8, std::string& out) {
+  const U8* B=(const U8*)b.data();
+  if (b.size()<5 || b.size()-4>=(1u<<24)) return false;
+  const U32 n=b.size()-4;
+  const U32 idx=B[n]|B[n+1]<<8|B[n+2]<<16|U32(B[n+3])<<24;
+  if (idx>=n || B[idx]!=255) return false;
+  if (idx==0) return true;
+
+  // h[r] = next row << 8 | byte output on reaching row r
+  U32 C[256]={0};
+  for (U32 i=0; i<n; ++i) ++C[B[i]];
+  --C[255];  // EOS
+  for (U32 i=0, s=1; i<256; ++i) s+=C[i], C[i]=s-C[i];
+  std::vector<U32> h(B, B+n);
+  for (U32 i=0; i<n; ++i)
+    if (i!=idx) h[C[B[i]]++]|=i<<8;
+
+  // Walk from samples 1..ns-1 and from idx (as ns) to the next sample.
+  // nxt[j] = that sample, len[j] = rows to it.
+  const U32 K=256, G=16, ns=(n+K-1)/K;
+  std::vector<U32> nxt(ns+1), len(ns+1);
+  U32 r[G], who[G], cnt[G], j=1, steps=0;
+  int act=0;
+  auto start=[&](int w) {
+    if (j==ns && idx%K==0) ++j;
+    if (j>ns) return false;
+    who[w]=j++;
+    r[w]=who[w]<ns ? who[w]*K : idx;
+    cnt[w]=0;
+    return true;
+  };
+  while (act<int(G) && start(act)) ++act;
+  while (act>0) {
+    for (int w=0; w<act; ++w) {
+      r[w]=h[r[w]]>>8;
+      ++cnt[w];
+      if (++steps>n) return false;  // not one list
+      if (r[w]%K==0) {
+        len[who[w]]=cnt[w];
+        nxt[who[w]]=r[w]/K;
+        if (!start(w)) {
+          --act;
+          r[w]=r[act], who[w]=who[act], cnt[w]=cnt[act];
+          --w;
+        }
+      }
+    }
+  }
+
+  // List the pieces from idx to row 0 and where each one goes
+  std::vector<U32> piece, off;
+  U32 total=0;
+  for (U32 p=idx%K ? ns : idx/K; p; p=nxt[p]) {
+    if (piece.size()>ns) return false;
+    piece.push_back(p);
+    off.push_back(total);
+    total+=len[p];
+  }
+
+  // Write the pieces
+  const size_t base=out.size();
+  out.resize(base+total);
+  U8* o=(U8*)&out[base];
+  U32 pos[G], rem[G];
+  size_t k=0;
+  act=0;
+  auto next=[&](int w) {
+    if (k>=piece.size()) return false;
+    const U32 p=piece[k];
+    r[w]=p<ns ? p*K : idx;
+    pos[w]=off[k++];
+    rem[w]=len[p];
+    return true;
+  };
+  while (act<int(G) && next(act)) ++act;
+  while (act>0) {
+    for (int w=0; w<act; ++w) {
+      r[w]=h[r[w]]>>8;
+      o[pos[w]++]=h[r[w]];
+      if (--rem[w]==0 && !next(w)) {
+        --act;
+        r[w]=r[act], pos[w]=pos[act], rem[w]=rem[act];
+        --w;
+      }
+    }
+  }
+
+  // Undo E8E9 in place
+  if (e8) {
+    for (U32 i=0; i+4<total; ++i) {
+      if ((o[i]&254)==232 && ((o[i+4]+1)&254)==0) {
+        U32 a=(o[i+3]<<16|o[i+2]<<8|o[i+1])-i;
+        o[i+1]=a;
+        o[i+2]=a>>8;
+        o[i+3]=a>>16;
+      }
+    }
+  }
+  return true;
+}
+
 // Copy ph, pm from block header
 void PostProcessor::init(int h, int m) {
   state=hsize=0;
   ph=h;
   pm=m;
+  ibwt=0;
+  ibuf.clear();
   z.clear();
 }
 
+// Output the inverse BWT of ibuf at EOS, or run the PCOMP if the
+// native one does not handle it
+void PostProcessor::runIBWT() {
+  std::string out;
+  const uint64_t n=ibuf.size();
+  if (ph<40 && pm<40 && n<(uint64_t(1)<<pm) && n+252<=(uint64_t(1)<<ph)
+      && inverseBWT(ibuf, ibwt==2, out)) {
+    if (z.output) z.output->write(out.data(), out.size());
+    if (z.sha1) z.sha1->write(out.data(), out.size());
+    ibwt=-ibwt;
+    return;
+  }
+  ibwt=0;
+  z.initp();
+  for (size_t i=0; i<ibuf.size(); ++i) z.run(U8(ibuf[i]));
+  ibuf.clear();
+  z.run(-1);
+  z.flush();
+}
+
+// Bring z to the state that running the PCOMP on ibuf would leave,
+// for a segment after a natively decoded one
+void PostProcessor::replay() {
+  Writer* out=z.output;
+  SHA1* sha1=z.sha1;
+  z.output=0;
+  z.sha1=0;
+  ibwt=0;
+  z.initp();
+  for (size_t i=0; i<ibuf.size(); ++i) z.run(U8(ibuf[i]));
+  ibuf.clear();
+  z.run(-1);
+  z.flush();
+  z.output=out;
+  z.sha1=sha1;
+}
+
 // (PASS=0 | PROG=1 psize[0..1] pcomp[0..psize-1]) data... EOB=-1
 // Return state: 1=PASS, 2..4=loading PROG, 5=PROG loaded
 int PostProcessor::write(int c) {
@@ -2233,11 +3501,18 @@ int PostProcessor::write(int c) {
         hsize=z.cend-2+z.hend-z.hbegin;
         z.header[0]=hsize&255;  // header size with empty COMP
         z.header[1]=hsize>>8;
-        z.initp();
+        ibwt=ibwtType(z);
+        if (!ibwt) z.initp();
         state=5;
       }
       break;
     case 5:  // PROG ... data
+      if (ibwt>0) {
+        if (c>=0) ibuf+=char(c);
+        else runIBWT();
+        break;
+      }
+      if (ibwt<0) replay();
       z.run(c);
       if (c<0) z.flush();
       break;
@@ -2401,9 +3676,20 @@ void Encoder::init() {
   high=0xFFFFFFFF;
   pr.init();
   bits=0;
+  ebits=0;
   if (!pr.isModeled()) low=0, buf.resize(1<<16);
 }
 
+// Start encoding a segment of the model in from
+void Encoder::prime(Predictor& from) {
+  pr.copyFrom(from);
+  assert(pr.isModeled());
+  low=1;
+  high=0xFFFFFFFF;
+  bits=0;
+  ebits=0;
+}
+
 // compress bit y having probability p/64K
 void Encoder::encode(int y, int p) {
   assert(out);
@@ -2421,10 +3707,40 @@ void Encoder::encode(int y, int p) {
   }
 }
 
+// Ideal code length in bits of a bit of probability q/65536, where q
+// is odd as the p of compress()
+static double codeLength(U32 q) {
+  struct Table {
+    float t[32768];
+    Table() {
+      for (int i=0; i<32768; ++i)
+        t[i]=float(-std::log((i*2+1)/65536.0)/std::log(2.0));
+    }
+  };
+  static const Table table;
+  assert(q>0 && q<65536 && (q&1));
+  return table.t[q>>1];
+}
+
 // compress byte c (0..255 or -1=EOS)
 void Encoder::compress(int c) {
   assert(out);
-  if (pr.isModeled()) {
+  if (estimate && pr.isModeled()) {
+    if (c==-1) {
+      ebytes+=U64(ebits/8)+4;  // and the 4 bytes of the final flush
+      ebits=0;
+    }
+    else {
+      assert(c>=0 && c<=255);
+      for (int i=7; i>=0; --i) {
+        const U32 p=pr.predict()*2+1;
+        const int y=c>>i&1;
+        ebits+=codeLength(y ? p : 65536-p);
+        pr.update(y);
+      }
+    }
+  }
+  else if (pr.isModeled()) {
     if (c==-1)
       encode(1, 0);
     else {
@@ -2947,11 +4263,9 @@ bool Compressor::compress(int n) {
     for (int i=0; i<nr; ++i) {
       int ch=U8(buf[i]);
       enc.compress(ch);
-      if (verify) {
-        if (pz.hend) pz.run(ch);
-        else sha1.put(ch);
-      }
+      if (verify && pz.hend) pz.run(ch);
     }
+    if (verify && !pz.hend) sha1.write(buf, nr);
   }
   return true;
 }
@@ -3202,17 +4516,19 @@ static int oplen(const U8* hcomp) {
   return 1;
 }
 
-// Write k bytes of x to rcode[o++] MSB first
-static void put(U8* rcode, int n, int& o, U32 x, int k) {
-  while (k-->0) {
+// Write 4 bytes of x to rcode[o++] LSB first
+static void put4lsb(U8* rcode, int n, int& o, U32 x) {
+  for (int k=0; k<4; ++k) {
     if (o<n) rcode[o]=(x>>(k*8))&255;
     ++o;
   }
 }
 
-// Write 4 bytes of x to rcode[o++] LSB first
-static void put4lsb(U8* rcode, int n, int& o, U32 x) {
-  for (int k=0; k<4; ++k) {
+#ifndef __aarch64__
+
+// Write k bytes of x to rcode[o++] MSB first
+static void put(U8* rcode, int n, int& o, U32 x, int k) {
+  while (k-->0) {
     if (o<n) rcode[o]=(x>>(k*8))&255;
     ++o;
   }
@@ -3258,19 +4574,19 @@ int ZPAQL::assemble() {
   int done=0;  // number of instructions assembled (0..hlen)
   int o=5;  // rcode output index, reserve space for jmp
 
+  // x86-64 code is called with this as its argument, which it keeps at
+  // [rsp], so the same code runs any ZPAQL with the same program.
+#define offz(x) int((char*)&(x)-(char*)this)
+
   // Code for the halt instruction (restore registers and return)
   const int halt=o;
   if (S==8) {
-    put2l(0x48b9, &a);        // mov rcx, a
-    put2(0x8911);             // mov [rcx], edx
-    put2l(0x48b9, &b);        // mov rcx, b
-    put2(0x8931);             // mov [rcx], esi
-    put2l(0x48b9, &c);        // mov rcx, c
-    put2(0x8939);             // mov [rcx], edi
-    put2l(0x48b9, &d);        // mov rcx, d
-    put2(0x8929);             // mov [rcx], ebp
-    put2l(0x48b9, &f);        // mov rcx, f
-    put2(0x8919);             // mov [rcx], ebx
+    put4(0x488b0c24);         // mov rcx, [rsp] ; this
+    put2a(0x8991, offz(a));   // mov [rcx+&a], edx
+    put2a(0x89b1, offz(b));   // mov [rcx+&b], esi
+    put2a(0x89b9, offz(c));   // mov [rcx+&c], edi
+    put2a(0x89a9, offz(d));   // mov [rcx+&d], ebp
+    put2a(0x8999, offz(f));   // mov [rcx+&f], ebx
     put4(0x4883c408);         // add rsp, 8
     put2(0x415f);             // pop r15
     put2(0x415e);             // pop r14
@@ -3295,13 +4611,12 @@ int ZPAQL::assemble() {
   // Store a=edx at outbuf[bufptr++]. If full, call flush1().
   const int outlabel=o;
   if (S==8) {
-    put2l(0x48b8, &outbuf[0]);// mov rax, outbuf.p
-    put2l(0x49ba, &bufptr);   // mov r10, &bufptr
-    put3(0x418b0a);           // mov rcx, [r10]
-    put3(0x881408);           // mov [rax+rcx], dl
-    put2(0xffc1);             // inc rcx
-    put3(0x41890a);           // mov [r10], ecx
-    put2a(0x81f9, outbuf.size());  // cmp rcx, outbuf.size()
+    put5(0x4c8b5424, 0x08);   // mov r10, [rsp+8] ; this
+    put3a(0x418b8a, offz(bufptr));  // mov ecx, [r10+&bufptr]
+    put5(0x4188540d, 0x00);   // mov [r13+rcx], dl ; r13=outbuf.p
+    put2(0xffc1);             // inc ecx
+    put3a(0x41898a, offz(bufptr));  // mov [r10+&bufptr], ecx
+    put2a(0x81f9, outbuf.size());  // cmp ecx, outbuf.size()
     put2(0x7403);             // jz L1
     put2(0x31c0);             // xor eax, eax
     put1(0xc3);               // ret
@@ -3314,9 +4629,9 @@ int ZPAQL::assemble() {
     put3(0x4889e5);           // mov rbp, rsp
     put4(0x4883c570);         // add rbp, 112
 #if defined(unix) && !defined(__CYGWIN__)
-    put2l(0x48bf, this);      // mov rdi, this
+    put3(0x4c89d7);           // mov rdi, r10 ; this
 #else  // Windows
-    put2l(0x48b9, this);      // mov rcx, this
+    put3(0x4c89d1);           // mov rcx, r10 ; this
 #endif
     put2l(0x49bb, &flush1);   // mov r11, &flush1
     put3(0x41ffd3);           // call r11
@@ -3418,20 +4733,21 @@ int ZPAQL::assemble() {
     put2(0x4156);      // push r14
     put2(0x4157);      // push r15
     put4(0x4883ec08);  // sub rsp, 8
-    put2l(0x48b8, &a); // mov rax, a
-    put2(0x8b10);      // mov edx, [rax]
-    put2l(0x48b8, &b); // mov rax, b
-    put2(0x8b30);      // mov esi, [rax]
-    put2l(0x48b8, &c); // mov rax, c
-    put2(0x8b38);      // mov edi, [rax]
-    put2l(0x48b8, &d); // mov rax, d
-    put2(0x8b28);      // mov ebp, [rax]
-    put2l(0x48b8, &f); // mov rax, f
-    put2(0x8b18);      // mov ebx, [rax]
-    put2l(0x49bc, &h[0]);   // mov r12, h
-    put2l(0x49bd, &outbuf[0]); // mov r13, outbuf.p
-    put2l(0x49be, &r[0]);   // mov r14, r
-    put2l(0x49bf, &m[0]);   // mov r15, m
+#if defined(unix) && !defined(__CYGWIN__)
+    put3(0x4889f8);    // mov rax, rdi ; this
+#else  // Windows
+    put3(0x4889c8);    // mov rax, rcx ; this
+#endif
+    put4(0x48890424);  // mov [rsp], rax
+    put2a(0x8b90, offz(a));  // mov edx, [rax+&a]
+    put2a(0x8bb0, offz(b));  // mov esi, [rax+&b]
+    put2a(0x8bb8, offz(c));  // mov edi, [rax+&c]
+    put2a(0x8ba8, offz(d));  // mov ebp, [rax+&d]
+    put2a(0x8b98, offz(f));  // mov ebx, [rax+&f]
+    put3a(0x4c8ba0, offz(h));       // mov r12, [rax+&h] ; h.p
+    put3a(0x4c8ba8, offz(outbuf));  // mov r13, [rax+&outbuf] ; outbuf.p
+    put3a(0x4c8bb0, offz(r));       // mov r14, [rax+&r] ; r.p
+    put3a(0x4c8bb8, offz(m));       // mov r15, [rax+&m] ; m.p
   }
   else {
     put3(0x83ec0c);    // sub esp, 12
@@ -4413,84 +5729,1388 @@ int Predictor::assemble_p() {
         put2(0x31c0);                  // xor eax, eax
         put2a(0x8987, offc(a));        // mov [edi+&a], eax
 
-        // ht(limit)+=ht(limit)+y  (1E)
-        put2a(0x8b87, offc(limit));    // mov eax, [edi+&limit]
-        put4(0x0fb60c06);              // movzx, ecx, byte [esi+eax]
-        put2(0x01c9);                  // add ecx, ecx
-        put2(0x01e9);                  // add ecx, ebp
-        put3(0x880c06);                // mov [esi+eax], cl
+        // ht(limit)+=ht(limit)+y  (1E)
+        put2a(0x8b87, offc(limit));    // mov eax, [edi+&limit]
+        put4(0x0fb60c06);              // movzx, ecx, byte [esi+eax]
+        put2(0x01c9);                  // add ecx, ecx
+        put2(0x01e9);                  // add ecx, ebp
+        put3(0x880c06);                // mov [esi+eax], cl
+
+        // if (++cxt==8)
+        put2a(0x8b87, offc(cxt));      // mov eax, [edi+&cxt]
+        put2(0xffc0);                  // inc eax
+        put3(0x83e007);                // and eax,byte +0x7
+        put2a(0x8987, offc(cxt));      // mov [edi+&cxt],eax
+        put2a(0x0f85, 0x9b);           // jnz L8
+
+        // ++limit;
+        // limit&=bufsize-1;
+        put2a(0x8b87, offc(limit));    // mov eax,[edi+&limit]
+        put2(0xffc0);                  // inc eax
+        put1a(0x25, (1<<cp[2])-1);     // and eax, bufsize-1
+        put2a(0x8987, offc(limit));    // mov [edi+&limit],eax
+
+        // if (a==0)
+        put2a(0x8b87, offc(a));        // mov eax, [edi+&a]
+        put2(0x85c0);                  // test eax,eax
+        put2(0x755c);                  // jnz L6
+
+        //   b=limit-cm(h[i])
+        put2a(0x8b8f, off(h[i]));      // mov ecx,[edi+h[i]]
+        put2a(0x81e1, (1<<cp[1])-1);   // and ecx, size-1
+        put2a(0x8b87, offc(limit));    // mov eax,[edi-&limit]
+        put3(0x2b048b);                // sub eax,[ebx+ecx*4]
+        put2a(0x8987, offc(b));        // mov [edi+&b],eax
+
+        //   if (b&(bufsize-1))
+        put1a(0xa9, (1<<cp[2])-1);     // test eax, bufsize-1
+        put2(0x7448);                  // jz L7
+
+        //      while (a<255 && ht(limit-a-1)==ht(limit-a-b-1)) ++a;
+        put1(0x53);                    // push ebx
+        put2a(0x8b9f, offc(limit));    // mov ebx,[edi+&limit]
+        put2(0x89da);                  // mov edx,ebx
+        put2(0x29c3);                  // sub ebx,eax  ; limit-b
+        put2(0x31c9);                  // xor ecx,ecx  ; a=0
+        put2a(0x81f9, 0xff);           // L2: cmp ecx,0xff ; while
+        put2(0x741c);                  // jz L3 ; break
+        put2(0xffca);                  // dec edx
+        put2(0xffcb);                  // dec ebx
+        put2a(0x81e2, (1<<cp[2])-1);   // and edx, bufsize-1
+        put2a(0x81e3, (1<<cp[2])-1);   // and ebx, bufsize-1
+        put3(0x8a0416);                // mov al,[esi+edx]
+        put3(0x3a041e);                // cmp al,[esi+ebx]
+        put2(0x7504);                  // jnz L3 ; break
+        put2(0xffc1);                  // inc ecx
+        put2(0xebdc);                  // jmp short L2 ; end while
+        put1(0x5b);                    // L3: pop ebx
+        put2a(0x898f, offc(a));        // mov [edi+&a],ecx
+        put2(0xeb0e);                  // jmp short L7
+
+        // a+=(a<255)
+        put1a(0x3d, 0xff);             // L6: cmp eax, 0xff ; a
+        put3(0x83d000);                // adc eax, 0
+        put2a(0x8987, offc(a));        // mov [edi+&a],eax
+
+        // cm(h[i])=limit
+        put2a(0x8b87, off(h[i]));      // L7: mov eax,[edi+&h[i]]
+        put1a(0x25, (1<<cp[1])-1);     // and eax, size-1
+        put2a(0x8b8f, offc(limit));    // mov ecx,[edi+&limit]
+        put3(0x890c83);                // mov [ebx+eax*4],ecx
+                                       // L8:
+        break;
+
+      case AVG:  // j k wt
+        break;
+
+      case MIX2: // sizebits j k rate mask
+                 // cm=wt[size], cxt=input
+        // assert(cr.a16.size()==cr.c);
+        // assert(cr.cxt<cr.a16.size());
+        // int err=(y*32767-squash(p[i]))*cp[4]>>5;
+        // int w=cr.a16[cr.cxt];
+        // w+=(err*(p[cp[2]]-p[cp[3]])+(1<<12))>>13;
+        // if (w<0) w=0;
+        // if (w>65535) w=65535;
+        // cr.a16[cr.cxt]=w;
+
+        // set ecx=err
+        put2a(0x8b87, off(p[i]));      // mov eax, [edi+&p[i]]
+        put1a(0x05, 2048);             // add eax, 2048
+        put4a(0x0fb78447, off(squasht));//movzx eax, word [edi+eax*2+&squasht]
+        put2(0x89e9);                  // mov ecx, ebp ; y
+        put3(0xc1e10f);                // shl ecx, 15
+        put2(0x29e9);                  // sub ecx, ebp ; y*32767
+        put2(0x29c1);                  // sub ecx, eax
+        put2a(0x69c9, cp[4]);          // imul ecx, rate
+        put3(0xc1f905);                // sar ecx, 5  ; err
+
+        // Update w
+        put2a(0x8b87, offc(cxt));      // mov eax, [edi+&cxt]
+        if (S==8) put1(0x48);          // rex.w
+        put2a(0x8bb7, offc(a16));      // mov esi, [edi+&a16]
+        if (S==8) put1(0x48);          // rex.w
+        put3(0x8d3446);                // lea esi, [esi+eax*2] ; &w
+        put2a(0x8b87, off(p[cp[2]]));  // mov eax, [edi+&p[j]]
+        put2a(0x2b87, off(p[cp[3]]));  // sub eax, [edi+&p[k]] ; p[j]-p[k]
+        put3(0x0fafc1);                // imul eax, ecx  ; * err
+        put1a(0x05, 1<<12);            // add eax, 4096
+        put3(0xc1f80d);                // sar eax, 13
+        put3(0x0fb716);                // movzx edx, word [esi] ; w
+        put2(0x01d0);                  // add eax, edx
+        put1a(0xba, 0xffff);           // mov edx, 65535
+        put2(0x39d0);                  // cmp eax, edx
+        put3(0x0f4fc2);                // cmovg eax, edx
+        put2(0x31d2);                  // xor edx, edx
+        put2(0x39d0);                  // cmp eax, edx
+        put3(0x0f4cc2);                // cmovl eax, edx
+        put3(0x668906);                // mov word [esi], ax
+        break;
+
+      case MIX: { // sizebits j m rate mask
+                  // cm=wt[size][m], cxt=input
+        // int m=cp[3];
+        // assert(m>0 && m<=i);
+        // assert(cr.cm.size()==m*cr.c);
+        // assert(cr.cxt+m<=cr.cm.size());
+        // int err=(y*32767-squash(p[i]))*cp[4]>>4;
+        // int* wt=(int*)&cr.cm[cr.cxt];
+        // for (int j=0; j<m; ++j)
+        //   wt[j]=clamp512k(wt[j]+((err*p[cp[2]+j]+(1<<12))>>13));
+
+        // set ecx=err
+        put2a(0x8b87, off(p[i]));      // mov eax, [edi+&p[i]]
+        put1a(0x05, 2048);             // add eax, 2048
+        put4a(0x0fb78447, off(squasht));//movzx eax, word [edi+eax*2+&squasht]
+        put2(0x89e9);                  // mov ecx, ebp ; y
+        put3(0xc1e10f);                // shl ecx, 15
+        put2(0x29e9);                  // sub ecx, ebp ; y*32767
+        put2(0x29c1);                  // sub ecx, eax
+        put2a(0x69c9, cp[4]);          // imul ecx, rate
+        put3(0xc1f904);                // sar ecx, 4  ; err
+
+        // set esi=wt
+        put2a(0x8b87, offc(cxt));      // mov eax, [edi+&cxt] ; cxt
+        if (S==8) put1(0x48);          // rex.w
+        put2a(0x8bb7, offc(cm));       // mov esi, [edi+&cm]
+        if (S==8) put1(0x48);          // rex.w
+        put3(0x8d3486);                // lea esi, [esi+eax*4] ; wt
+
+        // With SSE4.1, update 4 weights at a time
+#ifdef MIXHW_X86
+        const bool sse41=cpuMix()>=1;
+#else
+        const bool sse41=false;
+#endif
+        int k=0;
+        if (cp[3]>=4 && sse41) {
+          put4(0x660f6ee9);            // movd xmm5, ecx
+          put5(0x660f70ed, 0);         // pshufd xmm5, xmm5, 0 ; err
+          put1a(0xb8, 1<<12);          // mov eax, 1<<12
+          put4(0x660f6ee0);            // movd xmm4, eax
+          put5(0x660f70e4, 0);         // pshufd xmm4, xmm4, 0
+          put1a(0xb8, (1<<19)-1);      // mov eax, (1<<19)-1
+          put4(0x660f6ed8);            // movd xmm3, eax
+          put5(0x660f70db, 0);         // pshufd xmm3, xmm3, 0
+          put1a(0xb8, 0xfff80000);     // mov eax, -1<<19
+          put4(0x660f6ed0);            // movd xmm2, eax
+          put5(0x660f70d2, 0);         // pshufd xmm2, xmm2, 0
+          for (; k+4<=cp[3]; k+=4) {
+            put4a(0xf30f6f87, off(p[cp[2]+k]));// movdqu xmm0, [edi+&p[j+k]]
+            put5(0x660f3840, 0xc5);    // pmulld xmm0, xmm5
+            put4(0x660ffec4);          // paddd xmm0, xmm4
+            put5(0x660f72e0, 13);      // psrad xmm0, 13
+            put4a(0xf30f6f8e, k*4);    // movdqu xmm1, [esi+k*4]
+            put4(0x660ffec1);          // paddd xmm0, xmm1
+            put5(0x660f3839, 0xc3);    // pminsd xmm0, xmm3
+            put5(0x660f383d, 0xc2);    // pmaxsd xmm0, xmm2
+            put4a(0xf30f7f86, k*4);    // movdqu [esi+k*4], xmm0
+          }
+          if (k<cp[3]) {
+            if (S==8) put1(0x48);      // rex.w
+            put2a(0x81c6, k*4);        // add esi, k*4
+          }
+        }
+
+        for (; k<cp[3]; ++k) {
+          put2a(0x8b87,off(p[cp[2]+k]));//mov eax, [edi+&p[cp[2]+k]
+          put3(0x0fafc1);              // imul eax, ecx
+          put1a(0x05, 1<<12);          // add eax, 1<<12
+          put3(0xc1f80d);              // sar eax, 13
+          put2(0x0306);                // add eax, [esi]
+          put1a(0x3d, (1<<19)-1);      // cmp eax, (1<<19)-1
+          put2(0x7e05);                // jge L1
+          put1a(0xb8, (1<<19)-1);      // mov eax, (1<<19)-1
+          put1a(0x3d, 0xfff80000);     // cmp eax, -1<<19
+          put2(0x7d05);                // jle L2
+          put1a(0xb8, 0xfff80000);     // mov eax, -1<<19
+          put2(0x8906);                // L2: mov [esi], eax
+          if (k<cp[3]-1) {
+            if (S==8) put1(0x48);      // rex.w
+            put3(0x83c604);            // add esi, 4
+          }
+        }
+      }
+        break;
+
+      default:
+        error("invalid ZPAQ component");
+    }
+  }
+
+  // return from update()
+  put1(0x5f);                 // pop edi
+  put1(0x5e);                 // pop esi
+  put1(0x5d);                 // pop ebp
+  put1(0x5b);                 // pop ebx
+  put1(0xc3);                 // ret
+
+  return o;
+}
+
+#else // __aarch64__
+
+/*
+AArch64 code generation. assemble() and assemble_p() translate the same
+ZPAQL and COMP code as the x86 versions, with the registers mapped as
+follows:
+
+  w19 = a, w20 = b, w21 = c, w22 = d, w23 = f (1 for true, 0 for false)
+  x24 = h, x25 = this, x26 = r, x27 = m
+  w9  = source sss from *b, *c, *d or n
+  x10 = pointer to destination *b, *c, *d
+  w11, x16, x17 = scratch
+
+run() is called with this in x0, so the code does not depend on where
+the machine state is stored. It saves x19-x30, loads a, b, c, d, f and
+the array pointers, and executes the translated instructions. halt
+restores them and returns 0, or the error code in w0.
+
+predict() and update() are leaf functions called with the Predictor
+address in x0 and (for update) the bit y in w1. They use only the
+scratch registers w2-w17.
+
+Every instruction is 4 bytes written LSB first with put4lsb().
+*/
+
+#define a64(x) put4lsb(rcode, rcode_size, o, (x))
+
+// Put mov rd, x using movz and a movk for each other nonzero 16 bit
+// half. If sf then rd is a 64 bit register.
+static void putmov(U8* rcode, int n, int& o, int rd, U64 x, bool sf) {
+  put4lsb(rcode, n, o, (sf?0xd2800000:0x52800000)|U32(x&0xffff)<<5|rd);
+  for (int k=1; k<(sf?4:2); ++k)
+    if ((x>>(k*16))&0xffff)
+      put4lsb(rcode, n, o, (sf?0xf2800000:0x72800000)|k<<21
+              |U32((x>>(k*16))&0xffff)<<5|rd);
+}
+
+// Put a load or store of rt at [xn+off] where op is the unsigned
+// offset form of LDR/STR for an access of 1<<sz bytes. Compute the
+// address in x17 if off is not encodable.
+static void putmem(U8* rcode, int n, int& o, U32 op, int sz, int rt,
+                   int rn, int off) {
+  assert(off>=0);
+  if (off%(1<<sz)==0 && (off>>sz)<4096)
+    put4lsb(rcode, n, o, op|(off>>sz)<<10|rn<<5|rt);
+  else {
+    putmov(rcode, n, o, 17, off, true);          // mov x17, off
+    put4lsb(rcode, n, o, 0x8b110011|rn<<5);      // add x17, xn, x17
+    put4lsb(rcode, n, o, op|17<<5|rt);           // op rt, [x17]
+  }
+}
+
+// Put add xd, xn, off
+static void putaddx(U8* rcode, int n, int& o, int rd, int rn, int off) {
+  assert(off>=0);
+  if (off<4096)
+    put4lsb(rcode, n, o, 0x91000000|off<<10|rn<<5|rd);
+  else {
+    putmov(rcode, n, o, 17, off, true);          // mov x17, off
+    put4lsb(rcode, n, o, 0x8b110000|rn<<5|rd);   // add xd, xn, x17
+  }
+}
+
+// Put the logical immediate op wd, wn, #mask where mask is a run of
+// k ones starting at bit lo, 0 < k < 32. op is AND, ORR, EOR or ANDS.
+static void putlogic(U8* rcode, int n, int& o, U32 op, int rd, int rn,
+                     int lo, int k) {
+  assert(k>0 && k<32 && lo>=0 && lo<32);
+  put4lsb(rcode, n, o, op|((32-lo)&31)<<16|(k-1)<<10|rn<<5|rd);
+}
+
+// Put and wd, wn, #mask where mask+1 is a power of 2
+static void putand(U8* rcode, int n, int& o, int rd, int rn, U32 mask) {
+  int k=0;
+  while (k<32 && (mask>>k)) ++k;
+  if (k==0)
+    put4lsb(rcode, n, o, 0x2a1f03e0|rd);         // mov wd, wzr
+  else if (k==32) {
+    if (rd!=rn)
+      put4lsb(rcode, n, o, 0x2a0003e0|rn<<16|rd);// mov wd, wn
+  }
+  else
+    putlogic(rcode, n, o, 0x12000000, rd, rn, 0, k);
+}
+
+// Set the target of the branch at rcode[j] to rcode[o]. Return false
+// if it is out of range.
+static bool a64patch(U8* rcode, int n, int j, int o) {
+  if (j<0 || j+4>n) return true;
+  U32 x=rcode[j]|rcode[j+1]<<8|rcode[j+2]<<16|U32(rcode[j+3])<<24;
+  const int d=(o-j)/4;
+  if ((x>>26)==0x05 || (x>>26)==0x25)  // b, bl
+    x=(x&0xfc000000)|(d&0x3ffffff);
+  else {  // b.cond, cbz, cbnz
+    if (d<-(1<<18) || d>=(1<<18)) return false;
+    x=(x&0xff00001f)|(d&0x7ffff)<<5;
+  }
+  put4lsb(rcode, n, j, x);
+  return true;
+}
+
+#define a64mov(rd,x)   putmov(rcode, rcode_size, o, rd, x, false)
+#define a64movx(rd,x)  putmov(rcode, rcode_size, o, rd, x, true)
+#define a64ldr(rt,rn,x)  putmem(rcode, rcode_size, o, 0xb9400000, 2, rt,rn,x)
+#define a64str(rt,rn,x)  putmem(rcode, rcode_size, o, 0xb9000000, 2, rt,rn,x)
+#define a64ldrx(rt,rn,x) putmem(rcode, rcode_size, o, 0xf9400000, 3, rt,rn,x)
+#define a64strx(rt,rn,x) putmem(rcode, rcode_size, o, 0xf9000000, 3, rt,rn,x)
+#define a64addx(rd,rn,x) putaddx(rcode, rcode_size, o, rd, rn, x)
+#define a64and(rd,rn,x)  putand(rcode, rcode_size, o, rd, rn, x)
+#define a64eor(rd,rn,lo,k) \
+  putlogic(rcode, rcode_size, o, 0x52000000, rd, rn, lo, k)
+#define a64fix(j) a64patch(rcode, rcode_size, j, o)
+
+// Assemble ZPAQL in the HCOMP section of header to rcode as AArch64
+// code, but do not write beyond rcode_size. Return the number of
+// bytes output or that would have been output.
+int ZPAQL::assemble() {
+
+  // little-endian 64 bit? (not foolproof)
+  U32 t=0x12345678;
+  if (*(char*)&t!=0x78 || sizeof(char*)!=8)
+    error("JIT supported only for little-endian AArch64");
+
+  const U8* hcomp=&header[hbegin];
+  const int hlen=hend-hbegin+2;
+  const U32 msize=m.size();
+  const U32 hsize=h.size();
+  static const int regcode[4]={19,20,21,22}; // a,b,c,d -> w19..w22
+  Array<int> it(hlen);            // hcomp -> rcode locations
+  int done=0;  // number of instructions assembled (0..hlen)
+  int o=4;  // rcode output index, reserve space for b start
+
+  // Conditional branches reach +-1 MB. Each ZPAQL byte translates to at
+  // most 32 bytes, so for longer programs branch over an unconditional
+  // b instead.
+  const bool far=hlen>=(1<<15)-1024;
+#define offz(x) int((char*)&(x)-(char*)this)
+
+  // Code for the halt instruction (save registers and return w0)
+  const int halt=o;
+  a64str(19, 25, offz(a));    // str w19, [x25+&a]
+  a64str(20, 25, offz(b));    // str w20, [x25+&b]
+  a64str(21, 25, offz(c));    // str w21, [x25+&c]
+  a64str(22, 25, offz(d));    // str w22, [x25+&d]
+  a64str(23, 25, offz(f));    // str w23, [x25+&f]
+  a64(0xa9416bf9);            // ldp x25, x26, [sp, #16]
+  a64(0xa94273fb);            // ldp x27, x28, [sp, #32]
+  a64(0xa94353f3);            // ldp x19, x20, [sp, #48]
+  a64(0xa9445bf5);            // ldp x21, x22, [sp, #64]
+  a64(0xa94563f7);            // ldp x23, x24, [sp, #80]
+  a64(0xa8c67bfd);            // ldp x29, x30, [sp], #96
+  a64(0xd65f03c0);            // ret
+
+  // Code for the out instruction, called with bl.
+  // Store a=w19 at outbuf[bufptr++]. If full, call flush1(this).
+  const int outlabel=o;
+  a64ldr(9, 25, offz(bufptr));    // ldr w9, [x25+&bufptr]
+  a64ldrx(10, 25, offz(outbuf));  // ldr x10, [x25+&outbuf] ; outbuf.p
+  a64(0x38294953);            // strb w19, [x10, w9, uxtw]
+  a64(0x11000529);            // add w9, w9, #1
+  a64str(9, 25, offz(bufptr));    // str w9, [x25+&bufptr]
+  a64mov(11, outbuf.size());  // mov w11, outbuf.size()
+  a64(0x6b0b013f);            // cmp w9, w11
+  a64(0x54000060);            // b.eq L1
+  a64(0x52800000);            // mov w0, #0
+  a64(0xd65f03c0);            // ret
+  a64(0xa9bf27fe);            // L1: stp x30, x9, [sp, #-16]!
+  a64(0xaa1903e0);            // mov x0, x25
+  a64movx(16, U64(size_t(&flush1)));  // mov x16, &flush1
+  a64(0xd63f0200);            // blr x16
+  a64(0xa8c127fe);            // ldp x30, x9, [sp], #16
+  a64(0xd65f03c0);            // ret
+
+  // Set it[i]=1 for each ZPAQL instruction reachable from the previous
+  // instruction + 2 if reachable by a jump (or 3 if both).
+  it[0]=2;
+  assert(hlen>0 && hcomp[hlen-1]==0);  // ends with error
+  do {
+    done=0;
+    const int NONE=0x80000000;
+    for (int i=0; i<hlen; ++i) {
+      int op=hcomp[i];
+      if (it[i]) {
+        int next1=i+oplen(hcomp+i), next2=NONE; // next and jump targets
+        if (iserr(op)) next1=NONE;  // error
+        if (op==56) next1=NONE, next2=0;  // halt
+        if (op==255) next1=NONE, next2=hcomp[i+1]+256*hcomp[i+2]; // lj
+        if (op==39||op==47||op==63)next2=i+2+(hcomp[i+1]<<24>>24);// jt,jf,jmp
+        if (op==63) next1=NONE;  // jmp
+        if ((next2<0 || next2>=hlen) && next2!=NONE) next2=hlen-1; // error
+        if (next1>=0 && next1<hlen && !(it[next1]&1)) it[next1]|=1, ++done;
+        if (next2>=0 && next2<hlen && !(it[next2]&2)) it[next2]|=2, ++done;
+      }
+    }
+  } while (done>0);
+
+  // Set it[i] bits 2-3 to 4, 8, or 12 if a comparison
+  //  (==, <, > respectively) does not need to save the result in f,
+  // or if a conditional jump (jt, jf) does not need to read f.
+  // This is the same analysis as for x86, using NZCV instead of
+  // CF, ZF.
+  for (int i=0; i<hlen; ++i) {
+    const int op1=hcomp[i]; // 216..239 = comparison
+    const int i2=i+1+(op1%8==7);  // address of next instruction
+    const int op2=hcomp[i2];  // 39,47 = jt,jf
+    if (it[i] && op1>=216 && op1<240 && (op2==39 || op2==47)
+        && it[i2]==1 && (i2==i+1 || it[i+1]==0)) {
+      int code=(op1-208)/8*4; // 4,8,12 is ==,<,>
+      it[i2]+=code;  // OK to test NZCV instead of f
+      for (int j=0; j<2 && code; ++j) {  // trace each path from i2
+        int k=i2+2; // branch not taken
+        if (j==1) k=i2+2+(hcomp[i2+1]<<24>>24);  // branch taken
+        for (int l=0; l<hlen && code; ++l) {  // trace at most hlen steps
+          if (k<0 || k>=hlen) break;  // out of bounds, pass
+          const int op=hcomp[k];
+          if (op==39 || op==47) code=0;  // jt,jf, fail
+          else if (op>=216 && op<240) break;  // ==,<,>, pass
+          else if (iserr(op)) break;  // error, pass
+          else if (op==255) k=hcomp[k+1]+256*hcomp[k+2]; // lj
+          else if (op==63) k=k+2+(hcomp[k+1]<<24>>24);  // jmp
+          else if (op==56) k=0;  // halt
+          else k=k+1+(op%8==7);  // ordinary instruction
+        }
+      }
+      it[i]+=code;  // if > 0 then OK to not save flags in f (w23)
+    }
+  }
+
+  // Start of run(): Save AArch64 and load ZPAQL registers
+  const int start=o;
+  assert(start>=16);
+  a64(0xa9ba7bfd);            // stp x29, x30, [sp, #-96]!
+  a64(0x910003fd);            // mov x29, sp
+  a64(0xa9016bf9);            // stp x25, x26, [sp, #16]
+  a64(0xa90273fb);            // stp x27, x28, [sp, #32]
+  a64(0xa90353f3);            // stp x19, x20, [sp, #48]
+  a64(0xa9045bf5);            // stp x21, x22, [sp, #64]
+  a64(0xa90563f7);            // stp x23, x24, [sp, #80]
+  a64(0xaa0003f9);            // mov x25, x0 ; this
+  a64ldr(19, 25, offz(a));    // ldr w19, [x25+&a]
+  a64ldr(20, 25, offz(b));    // ldr w20, [x25+&b]
+  a64ldr(21, 25, offz(c));    // ldr w21, [x25+&c]
+  a64ldr(22, 25, offz(d));    // ldr w22, [x25+&d]
+  a64ldr(23, 25, offz(f));    // ldr w23, [x25+&f]
+  a64ldrx(24, 25, offz(h));   // ldr x24, [x25+&h] ; h.p
+  a64ldrx(26, 25, offz(r));   // ldr x26, [x25+&r] ; r.p
+  a64ldrx(27, 25, offz(m));   // ldr x27, [x25+&m] ; m.p
+
+  // Assemble in multiple passes until every byte of hcomp has a translation
+  for (int istart=0; istart<hlen; ++istart) {
+    int inc=0;
+    for (int i=istart; i<hlen && it[i]; i+=inc) {
+      const int code=it[i];
+      inc=oplen(hcomp+i);
+
+      // If already assembled, then assemble a jump to it
+      assert(it.isize()>i);
+      assert(i>=0 && i<hlen);
+      if (code>=16) {
+        if (i>istart)
+          a64(0x14000000|((code-o)/4&0x3ffffff));  // b code
+        break;
+      }
+
+      // Else assemble the instruction at hcomp[i] to rcode[o]
+      else {
+        assert(i>=0 && i<it.isize());
+        assert(it[i]>0 && it[i]<16);
+        assert(o>=16);
+        it[i]=o;
+        ++done;
+        const int op=hcomp[i];
+        const int arg=hcomp[i+1]+((op==255)?256*hcomp[i+2]:0);
+        const int ddd=op/8%8;
+        const int sss=op%8;
+
+        // error instruction: return 1
+        if (iserr(op)) {
+          a64(0x52800020);                       // mov w0, #1
+          a64(0x14000000|((halt-o)/4&0x3ffffff));// b halt
+          continue;
+        }
+
+        // Load source *b, *c, *d or n into w9, or set src to the
+        // register holding a, b, c, d. hash (op 59) reads *b.
+        int src=9;
+        if (op>=64 && op<240 && sss<4) src=regcode[sss];
+        else if ((op>=64 && op<240 && (sss==4 || sss==5)) || op==59) {
+          a64and(9, regcode[op==59?1:sss-3], msize-1); // and w9, {b,c}, msize-1
+          a64(0x38694b69);                       // ldrb w9, [x27, w9, uxtw]
+        }
+        else if (op>=64 && op<240 && sss==6) {
+          a64and(9, 22, hsize-1);                // and w9, w22, hsize-1
+          a64(0xb8695b09);                       // ldr w9, [x24, w9, uxtw #2]
+        }
+        else if (op>=64 && op<240 && sss==7)
+          a64mov(9, arg);                        // mov w9, n
+
+        // Load destination address *b, *c, *d or hashd (*d) into x10
+        if ((op>=32 && op<56 && op%8<5) || (op>=96 && op<120) || op==60) {
+          if (ddd==6 || op==60) {
+            a64and(10, 22, hsize-1);             // and w10, w22, hsize-1
+            a64(0x8b2a4b0a);                     // add x10, x24, w10, uxtw #2
+          }
+          else {
+            a64and(10, regcode[ddd-3], msize-1); // and w10, {b,c}, msize-1
+            a64(0x8b2a436a);                     // add x10, x27, w10, uxtw
+          }
+        }
+
+        // Translate by opcode
+        const int rd=regcode[ddd&3];
+        switch((op/8)&31) {
+          case 0:  // ddd = a
+          case 1:  // ddd = b
+          case 2:  // ddd = c
+          case 3:  // ddd = d
+            switch(sss) {
+              case 0:  // ddd<>a (swap)
+                a64(0x2a0003e9|rd<<16);          // mov w9, ddd
+                a64(0x2a1303e0|rd);              // mov ddd, w19
+                a64(0x2a0903f3);                 // mov w19, w9
+                break;
+              case 1:  // ddd++
+                a64(0x11000000|inc<<10|rd<<5|rd);// add ddd, ddd, inc
+                break;
+              case 2:  // ddd--
+                a64(0x51000000|inc<<10|rd<<5|rd);// sub ddd, ddd, inc
+                break;
+              case 3:  // ddd!
+                a64(0x2a2003e0|rd<<16|rd);       // mvn ddd, ddd
+                break;
+              case 4:  // ddd=0
+                a64(0x2a1f03e0|rd);              // mov ddd, wzr
+                break;
+              case 7:  // ddd=r n
+                a64ldr(rd, 26, arg*4);           // ldr ddd, [x26+n*4]
+                break;
+            }
+            break;
+          case 4:  // ddd = *b
+          case 5:  // ddd = *c
+            switch(sss) {
+              case 0:  // ddd<>a (swap)
+                a64(0x39400149);                 // ldrb w9, [x10]
+                a64(0x39000153);                 // strb w19, [x10]
+                a64(0x33001d33);                 // bfxil w19, w9, #0, #8
+                break;
+              case 1:  // ddd++
+                a64(0x39400149);                 // ldrb w9, [x10]
+                a64(0x11000129|inc<<10);         // add w9, w9, inc
+                a64(0x39000149);                 // strb w9, [x10]
+                break;
+              case 2:  // ddd--
+                a64(0x39400149);                 // ldrb w9, [x10]
+                a64(0x51000129|inc<<10);         // sub w9, w9, inc
+                a64(0x39000149);                 // strb w9, [x10]
+                break;
+              case 3:  // ddd!
+                a64(0x39400149);                 // ldrb w9, [x10]
+                a64(0x2a2903e9);                 // mvn w9, w9
+                a64(0x39000149);                 // strb w9, [x10]
+                break;
+              case 4:  // ddd=0
+                a64(0x3900015f);                 // strb wzr, [x10]
+                break;
+              case 7:  // jt, jf
+              {
+                assert(code>=0 && code<16);
+                static const int ctab[4]={0,0,3,8}; // f,eq,lo,hi
+                const bool jt=(op==39);
+                if (far) {  // branch over b n if the jump is not taken
+                  if (code<4) a64((jt?0x34000057:0x35000057)); // cbz/cbnz w23, +8
+                  else a64(0x54000040|(ctab[code/4]^jt));  // b.!cond +8
+                  a64(0x14000000);               // b n (fill in target later)
+                }
+                else if (code<4)
+                  a64(jt?0x35000017:0x34000017); // cbnz/cbz w23, n
+                else
+                  a64(0x54000000|(ctab[code/4]^!jt)); // b.cond n
+                break;
+              }
+            }
+            break;
+          case 6:  // ddd = *d
+            switch(sss) {
+              case 0:  // ddd<>a (swap)
+                a64(0xb9400149);                 // ldr w9, [x10]
+                a64(0xb9000153);                 // str w19, [x10]
+                a64(0x2a0903f3);                 // mov w19, w9
+                break;
+              case 1:  // ddd++
+                a64(0xb9400149);                 // ldr w9, [x10]
+                a64(0x11000129|inc<<10);         // add w9, w9, inc
+                a64(0xb9000149);                 // str w9, [x10]
+                break;
+              case 2:  // ddd--
+                a64(0xb9400149);                 // ldr w9, [x10]
+                a64(0x51000129|inc<<10);         // sub w9, w9, inc
+                a64(0xb9000149);                 // str w9, [x10]
+                break;
+              case 3:  // ddd!
+                a64(0xb9400149);                 // ldr w9, [x10]
+                a64(0x2a2903e9);                 // mvn w9, w9
+                a64(0xb9000149);                 // str w9, [x10]
+                break;
+              case 4:  // ddd=0
+                a64(0xb900015f);                 // str wzr, [x10]
+                break;
+              case 7:  // r=a n
+                a64str(19, 26, arg*4);           // str w19, [x26+n*4]
+                break;
+            }
+            break;
+          case 7:  // special
+            switch(op) {
+              case 56: // halt
+                a64(0x52800000);                 // mov w0, #0 ; return 0
+                a64(0x14000000|((halt-o)/4&0x3ffffff)); // b halt
+                break;
+              case 57:  // out
+                a64(0x94000000|((outlabel-o)/4&0x3ffffff)); // bl outlabel
+                if (far) {
+                  a64(0x34000040);               // cbz w0, +8
+                  a64(0x14000000|((halt-o)/4&0x3ffffff)); // b halt
+                }
+                else
+                  a64(0x35000000|((halt-o)/4&0x7ffff)<<5); // cbnz w0, halt
+                break;
+              case 59:  // hash: a = (a + *b + 512) * 773
+                a64(0x0b090273);                 // add w19, w19, w9
+                a64(0x11080273);                 // add w19, w19, #512
+                a64mov(11, 773);                 // mov w11, #773
+                a64(0x1b0b7e73);                 // mul w19, w19, w11
+                break;
+              case 60:  // hashd: *d = (*d + a + 512) * 773
+                a64(0xb9400149);                 // ldr w9, [x10]
+                a64(0x0b130129);                 // add w9, w9, w19
+                a64(0x11080129);                 // add w9, w9, #512
+                a64mov(11, 773);                 // mov w11, #773
+                a64(0x1b0b7d29);                 // mul w9, w9, w11
+                a64(0xb9000149);                 // str w9, [x10]
+                break;
+              case 63:  // jmp
+                a64(0x14000000);                 // b n (fill in target later)
+                break;
+            }
+            break;
+          case 8:   // a=
+          case 9:   // b=
+          case 10:  // c=
+          case 11:  // d=
+            if (src!=rd) a64(0x2a0003e0|src<<16|rd); // mov ddd, src
+            break;
+          case 12:  // *b=
+          case 13:  // *c=
+            a64(0x39000140|src);                 // strb src, [x10]
+            break;
+          case 14:  // *d=
+            a64(0xb9000140|src);                 // str src, [x10]
+            break;
+          case 15: break; // not used
+          case 16:  // a+=
+            a64(0x0b000273|src<<16);             // add w19, w19, src
+            break;
+          case 17:  // a-=
+            a64(0x4b000273|src<<16);             // sub w19, w19, src
+            break;
+          case 18:  // a*=
+            a64(0x1b007e73|src<<16);             // mul w19, w19, src
+            break;
+          case 19:  // a/= (udiv by 0 gives 0 as required)
+            a64(0x1ac00a73|src<<16);             // udiv w19, w19, src
+            break;
+          case 20:  // a%=
+            a64(0x1ac00a6b|src<<16);             // udiv w11, w19, src
+            a64(0x1b00cd6b|src<<16);             // msub w11, w11, src, w19
+            a64(0x7100001f|src<<5);              // cmp src, #0
+            a64(0x1a8b03f3);                     // csel w19, wzr, w11, eq
+            break;
+          case 21:  // a&=
+            a64(0x0a000273|src<<16);             // and w19, w19, src
+            break;
+          case 22:  // a&~
+            a64(0x0a200273|src<<16);             // bic w19, w19, src
+            break;
+          case 23:  // a|=
+            a64(0x2a000273|src<<16);             // orr w19, w19, src
+            break;
+          case 24:  // a^=
+            a64(0x4a000273|src<<16);             // eor w19, w19, src
+            break;
+          case 25:  // a<<= (lslv uses src%32)
+            a64(0x1ac02273|src<<16);             // lsl w19, w19, src
+            break;
+          case 26:  // a>>=
+            a64(0x1ac02673|src<<16);             // lsr w19, w19, src
+            break;
+          case 27:  // a==
+          case 28:  // a<
+          case 29:  // a>
+            a64(0x6b00027f|src<<16);             // cmp w19, src
+            if (code<4) {
+              if (op/8==27) a64(0x1a9f17f7);     // cset w23, eq
+              if (op/8==28) a64(0x1a9f27f7);     // cset w23, lo
+              if (op/8==29) a64(0x1a9f97f7);     // cset w23, hi
+            }
+            break;
+          case 30:  // not used
+          case 31:  // 255 = lj
+            if (op==255) a64(0x14000000);        // b n (fill in target later)
+            break;
+        }
+      }
+    }
+  }
+
+  // Finish first pass
+  const int rsize=o;
+  if (o>rcode_size) return rsize;
+
+  // Fill in jump addresses (second pass)
+  for (int i=0; i<hlen; ++i) {
+    if (it[i]<16) continue;
+    int op=hcomp[i];
+    if (op==39 || op==47 || op==63 || op==255) {  // jt, jf, jmp, lj
+      int target=hcomp[i+1];
+      if (op==255) target+=hcomp[i+2]*256;  // lj
+      else {
+        if (target>=128) target-=256;
+        target+=i+2;
+      }
+      if (target<0 || target>=hlen) target=hlen-1;  // runtime ZPAQL error
+      o=it[i];
+      if (far && (op==39 || op==47)) o+=4;  // skip branch over b
+      assert(o>=16 && o+4<=rcode_size);
+      assert(it[target]>=16);
+      if (!a64patch(rcode, rcode_size, o, it[target]))
+        error("Cannot code AArch64 branch");
+    }
+  }
+
+  // Jump to start
+  o=0;
+  a64(0x14000000|(start/4));  // b start
+  return rsize;
+}
+
+//////////////////////// Predictor::assemble_p() /////////////////////
+
+// Assemble the ZPAQL code in the HCOMP section of z.header to pcomp and
+// return the number of bytes of AArch64 code written, or that would
+// be written if pcomp were large enough. The code for predict() begins
+// at pr.pcomp[0] and update() at pr.pcomp[4], both as b instructions.
+
+// The assembled code is equivalent to int predict(Predictor*)
+// and void update(Predictor*, int y); The Predictor address is in x0
+// and the update bit y is in w1.
+
+int Predictor::assemble_p() {
+  Predictor& pr=*this;
+  U8* rcode=pr.pcode;         // AArch64 output array
+  int rcode_size=pcode_size;  // output size
+  int o=0;                    // output index in pcode
+  U8* hcomp=&pr.z.header[0];  // The code to translate
+#define off(x)  int((char*)&(pr.x)-(char*)&pr)
+#define offc(x) int((char*)&(pr.comp[i].x)-(char*)&pr)
+
+  // test for little-endian 64 bit
+  U32 t=0x12345678;
+  if (*(char*)&t!=0x78 || sizeof(char*)!=8)
+    error("JIT supported only for little-endian AArch64");
+
+  // Initialize for predict(). Keep table pointers for stretch() in x12,
+  // squash() in x13 and dt2k in x14.
+  a64(0x14000002);            // b predict
+  a64(0);                     // reserve space for b update
+  a64addx(12, 0, off(stretcht));  // add x12, x0, &stretcht
+  a64addx(13, 0, off(squasht));   // add x13, x0, &squasht
+  a64addx(14, 0, off(dt2k));      // add x14, x0, &dt2k
+
+  // Code predict() for each component
+  const int n=hcomp[6];  // number of components
+  U8* cp=hcomp+7;
+  for (int i=0; i<n; ++i, cp+=compsize[cp[0]]) {
+    if (cp-hcomp>=pr.z.cend) error("comp too big");
+    if (cp[0]<1 || cp[0]>9) error("invalid component");
+    assert(compsize[cp[0]]>0 && compsize[cp[0]]<8);
+    switch (cp[0]) {
+
+      case CONS:  // c
+        break;
+
+      case CM:  // sizebits limit
+        // Component& cr=comp[i];
+        // cr.cxt=h[i]^hmap4;
+        // p[i]=stretch(cr.cm(cr.cxt)>>17);
+
+        a64ldr(2, 0, off(h[i]));               // ldr w2, [x0+&h[i]]
+        a64ldr(3, 0, off(hmap4));              // ldr w3, [x0+&hmap4]
+        a64(0x4a030042);                       // eor w2, w2, w3
+        a64and(2, 2, (1u<<cp[1])-1);           // and w2, w2, size-1
+        a64strx(2, 0, offc(cxt));              // str x2, [x0+&cxt]
+        a64ldrx(3, 0, offc(cm));               // ldr x3, [x0+&cm]
+        a64(0xb8625862);                       // ldr w2, [x3, w2, uxtw #2]
+        a64(0x53117c42);                       // lsr w2, w2, #17
+        a64(0x78e25982);                       // ldrsh w2, [x12, w2, uxtw #1]
+        a64str(2, 0, off(p[i]));               // str w2, [x0+&p[i]]
+        break;
+
+      case ISSE:  // sizebits j -- c=hi, cxt=bh
+        // assert((hmap4&15)>0);
+        // if (c8==1 || (c8&0xf0)==16)
+        //   cr.c=find(cr.ht, cp[1]+2, h[i]+16*c8);
+        // cr.cxt=cr.ht[cr.c+(hmap4&15)];  // bit history
+        // int *wt=(int*)&cr.cm[cr.cxt*2];
+        // p[i]=clamp2k((wt[0]*p[cp[2]]+wt[1]*64)>>16);
+
+      case ICM: // sizebits
+        // assert((hmap4&15)>0);
+        // if (c8==1 || (c8&0xf0)==16) cr.c=find(cr.ht, cp[1]+2, h[i]+16*c8);
+        // cr.cxt=cr.ht[cr.c+(hmap4&15)];
+        // p[i]=stretch(cr.cm(cr.cxt)>>8);
+        //
+        // find() is inlined as in the x86 code and leaves the row in w7.
+      {
+        const int sb=cp[1]+2;  // sizebits of ht rows
+        a64ldrx(4, 0, offc(ht));               // ldr x4, [x0+&ht]
+        a64ldr(2, 0, off(c8));                 // ldr w2, [x0+&c8]
+        a64(0x7100045f);                       // cmp w2, #1
+        const int j1=o;
+        a64(0x54000000);                       // b.eq L1
+        putlogic(rcode, rcode_size, o, 0x12000000, 3, 2, 4, 4); // and w3, w2, #0xf0
+        a64(0x7100407f);                       // cmp w3, #16
+        const int j2=o;
+        a64(0x54000001);                       // b.ne L2 ; skip find()
+        a64fix(j1);                            // L1: ; find cxt in ht
+        a64ldr(5, 0, off(h[i]));               // ldr w5, [x0+&h[i]]
+        a64(0x0b0210a5);                       // add w5, w5, w2, lsl #4 ; cxt
+        a64(0x53007ca6|(sb&31)<<16);           // lsr w6, w5, #sizebits
+        a64(0x12001cc6);                       // and w6, w6, #255 ; chk
+        a64(0x53000000|28<<16|((sb<28?sb:28)-1)<<10|5<<5|7);
+                                               // ubfiz w7, w5, #4 ; h0
+        a64(0x38674888);                       // ldrb w8, [x4, w7, uxtw]
+        a64(0x6b06011f);                       // cmp w8, w6
+        const int j3=o;
+        a64(0x54000000);                       // b.eq L3 ; match h0
+        a64eor(7, 7, 4, 1);                    // eor w7, w7, #16 ; h1
+        a64(0x38674888);                       // ldrb w8, [x4, w7, uxtw]
+        a64(0x6b06011f);                       // cmp w8, w6
+        const int j4=o;
+        a64(0x54000000);                       // b.eq L3 ; match h1
+        a64eor(7, 7, 4, 2);                    // eor w7, w7, #48 ; h2
+        a64(0x38674888);                       // ldrb w8, [x4, w7, uxtw]
+        a64(0x6b06011f);                       // cmp w8, w6
+        const int j5=o;
+        a64(0x54000000);                       // b.eq L3 ; match h2
+          // No checksum match, so replace the lowest priority among h0,h1,h2
+        a64eor(8, 7, 5, 1);                    // eor w8, w7, #32 ; h0
+        a64eor(9, 7, 4, 2);                    // eor w9, w7, #48 ; h1
+        a64(0x8b28408a);                       // add x10, x4, w8, uxtw
+        a64(0x3940054a);                       // ldrb w10, [x10, #1] ; ht[h0+1]
+        a64(0x8b29408b);                       // add x11, x4, w9, uxtw
+        a64(0x3940056b);                       // ldrb w11, [x11, #1] ; ht[h1+1]
+        a64(0x8b27408f);                       // add x15, x4, w7, uxtw
+        a64(0x394005ef);                       // ldrb w15, [x15, #1] ; ht[h2+1]
+        a64(0x6b0f017f);                       // cmp w11, w15
+        a64(0x1a873127);                       // csel w7, w9, w7, lo ; h1 or h2
+        a64(0x6b0b015f);                       // cmp w10, w11
+        const int j6=o;
+        a64(0x54000008);                       // b.hi L7 ; h0 is not lowest
+        a64(0x6b0f015f);                       // cmp w10, w15
+        const int j7=o;
+        a64(0x54000008);                       // b.hi L7
+        a64(0x2a0803e7);                       // mov w7, w8 ; h0
+        a64fix(j6);                            // L7:
+        a64fix(j7);
+        a64(0x8b274089);                       // add x9, x4, w7, uxtw
+        a64(0xa9007d3f);                       // stp xzr, xzr, [x9] ; clear row
+        a64(0x39000126);                       // strb w6, [x9] ; chk
+        a64fix(j3);                            // L3: ; save row (in w7) in c
+        a64fix(j4);
+        a64fix(j5);
+        a64strx(7, 0, offc(c));                // str x7, [x0+&c]
+        const int j8=o;
+        a64(0x14000000);                       // b L8
+        a64fix(j2);                            // L2: ; get row
+        a64ldrx(7, 0, offc(c));                // ldr x7, [x0+&c]
+        a64fix(j8);                            // L8: ; row is in w7
+        a64ldr(2, 0, off(hmap4));              // ldr w2, [x0+&hmap4]
+        a64(0x12000c42);                       // and w2, w2, #15
+        a64(0x0b0200e7);                       // add w7, w7, w2 ; c+(hmap4&15)
+        a64(0x38674882);                       // ldrb w2, [x4, w7, uxtw] ; bh
+        a64strx(2, 0, offc(cxt));              // str x2, [x0+&cxt] ; cxt=bh
+        a64ldrx(3, 0, offc(cm));               // ldr x3, [x0+&cm]
+
+        // x3 points to cm[256] (ICM) or cm[512] (ISSE) with 23 bit
+        // prediction (ICM) or a pair of 20 bit signed weights (ISSE).
+        // cxt = bit history bh (0..255) is in w2.
+        if (cp[0]==ICM) {
+          a64(0xb8625862);                     // ldr w2, [x3, w2, uxtw #2]
+          a64(0x53087c42);                     // lsr w2, w2, #8
+          a64(0x78e25982);                     // ldrsh w2, [x12, w2, uxtw #1]
+        }
+        else {  // ISSE
+          a64(0x8b224c63);                     // add x3, x3, w2, uxtw #3 ; wt
+          a64(0xb9400065);                     // ldr w5, [x3] ; wt[0]
+          a64(0xb9400466);                     // ldr w6, [x3, #4] ; wt[1]
+          a64ldr(7, 0, off(p[cp[2]]));         // ldr w7, [x0+&p[j]]
+          a64(0x1b077ca5);                     // mul w5, w5, w7
+          a64(0x0b0618a5);                     // add w5, w5, w6, lsl #6
+          a64(0x13107ca2);                     // asr w2, w5, #16
+          a64mov(6, 2047);                     // mov w6, #2047
+          a64(0x6b06005f);                     // cmp w2, w6
+          a64(0x1a82c0c2);                     // csel w2, w6, w2, gt
+          a64(0x1280ffe6);                     // mov w6, #-2048
+          a64(0x6b06005f);                     // cmp w2, w6
+          a64(0x1a82b0c2);                     // csel w2, w6, w2, lt
+        }
+        a64str(2, 0, off(p[i]));               // str w2, [x0+&p[i]]
+        break;
+      }
+
+      case MATCH: // sizebits bufbits: a=len, b=offset, c=bit, cxt=bitpos,
+                  //                   ht=buf, limit=pos
+        // if (cr.a==0) p[i]=0;
+        // else {
+        //   cr.c=(cr.ht(cr.limit-cr.b)>>(7-cr.cxt))&1; // predicted bit
+        //   p[i]=stretch(dt2k[cr.a]*(cr.c*-2+1)&32767);
+        // }
+      {
+        a64ldrx(4, 0, offc(ht));       // ldr x4, [x0+&ht]
+
+        // If match length (a) is 0 then p[i]=0
+        a64ldrx(2, 0, offc(a));        // ldr x2, [x0+&a]
+        const int j1=o;
+        a64(0x34000002);               // cbz w2, L2 ; p[i]=0
+
+        // Else put predicted bit in c
+        a64ldrx(3, 0, offc(limit));    // ldr x3, [x0+&limit]
+        a64ldrx(5, 0, offc(b));        // ldr x5, [x0+&b]
+        a64(0x4b050063);               // sub w3, w3, w5
+        a64and(3, 3, (1u<<cp[2])-1);   // and w3, w3, ht.size()-1
+        a64(0x38634883);               // ldrb w3, [x4, w3, uxtw]
+        a64ldrx(5, 0, offc(cxt));      // ldr x5, [x0+&cxt]
+        a64(0x528000e6);               // mov w6, #7
+        a64(0x4b0500c5);               // sub w5, w6, w5
+        a64(0x1ac52463);               // lsr w3, w3, w5
+        a64(0x12000063);               // and w3, w3, #1 ; predicted bit
+        a64strx(3, 0, offc(c));        // str x3, [x0+&c]
+
+        // p[i]=stretch(dt2k[cr.a]*(cr.c*-2+1)&32767);
+        a64(0xb86259c2);               // ldr w2, [x14, w2, uxtw #2] ; dt2k[a]
+        a64(0x7100007f);               // cmp w3, #0
+        a64(0x5a820442);               // cneg w2, w2, ne
+        a64(0x12003842);               // and w2, w2, #32767
+        a64(0x78e25982);               // ldrsh w2, [x12, w2, uxtw #1]
+        a64fix(j1);                    // L2:
+        a64str(2, 0, off(p[i]));       // str w2, [x0+&p[i]]
+        break;
+      }
+
+      case AVG: // j k wt
+        // p[i]=(p[cp[1]]*cp[3]+p[cp[2]]*(256-cp[3]))>>8;
+
+        a64ldr(2, 0, off(p[cp[1]]));   // ldr w2, [x0+&p[j]]
+        a64ldr(3, 0, off(p[cp[2]]));   // ldr w3, [x0+&p[k]]
+        a64(0x4b030042);               // sub w2, w2, w3
+        a64mov(5, cp[3]);              // mov w5, wt
+        a64(0x1b057c42);               // mul w2, w2, w5
+        a64(0x13087c42);               // asr w2, w2, #8
+        a64(0x0b030042);               // add w2, w2, w3
+        a64str(2, 0, off(p[i]));       // str w2, [x0+&p[i]]
+        break;
+
+      case MIX2:   // sizebits j k rate mask
+                   // c=size cm=wt[size] cxt=input
+        // cr.cxt=((h[i]+(c8&cp[5]))&(cr.c-1));
+        // int w=cr.a16[cr.cxt];
+        // p[i]=(w*p[cp[2]]+(65536-w)*p[cp[3]])>>16;
+
+        a64ldr(2, 0, off(c8));         // ldr w2, [x0+&c8]
+        a64mov(5, cp[5]);              // mov w5, mask
+        a64(0x0a050042);               // and w2, w2, w5
+        a64ldr(3, 0, off(h[i]));       // ldr w3, [x0+&h[i]]
+        a64(0x0b030042);               // add w2, w2, w3
+        a64and(2, 2, (1u<<cp[1])-1);   // and w2, w2, size-1
+        a64strx(2, 0, offc(cxt));      // str x2, [x0+&cxt] ; cxt
+        a64ldrx(4, 0, offc(a16));      // ldr x4, [x0+&a16]
+        a64(0x78625885);               // ldrh w5, [x4, w2, uxtw #1] ; w
+        a64ldr(6, 0, off(p[cp[2]]));   // ldr w6, [x0+&p[j]]
+        a64ldr(7, 0, off(p[cp[3]]));   // ldr w7, [x0+&p[k]]
+        a64(0x4b0700c6);               // sub w6, w6, w7
+        a64(0x1b057cc6);               // mul w6, w6, w5
+        a64(0x0b0740c6);               // add w6, w6, w7, lsl #16
+        a64(0x13107cc6);               // asr w6, w6, #16
+        a64str(6, 0, off(p[i]));       // str w6, [x0+&p[i]]
+        break;
+
+      case MIX: {  // sizebits j m rate mask
+                   // c=size cm=wt[size][m] cxt=index of wt in cm
+        // int m=cp[3];
+        // cr.cxt=h[i]+(c8&cp[5]);
+        // cr.cxt=(cr.cxt&(cr.c-1))*m; // pointer to row of weights
+        // int* wt=(int*)&cr.cm[cr.cxt];
+        // p[i]=0;
+        // for (int j=0; j<m; ++j)
+        //   p[i]+=(wt[j]>>8)*p[cp[2]+j];
+        // p[i]=clamp2k(p[i]>>8);
+
+        a64ldr(2, 0, off(c8));                 // ldr w2, [x0+&c8]
+        a64mov(5, cp[5]);                      // mov w5, mask
+        a64(0x0a050042);                       // and w2, w2, w5
+        a64ldr(3, 0, off(h[i]));               // ldr w3, [x0+&h[i]]
+        a64(0x0b030042);                       // add w2, w2, w3
+        a64and(2, 2, (1u<<cp[1])-1);           // and w2, w2, size-1
+        a64mov(5, cp[3]);                      // mov w5, m
+        a64(0x1b057c42);                       // mul w2, w2, w5
+        a64strx(2, 0, offc(cxt));              // str x2, [x0+&cxt] ; cxt
+        a64ldrx(4, 0, offc(cm));               // ldr x4, [x0+&cm]
+        a64(0x8b224884);                       // add x4, x4, w2, uxtw #2 ; wt
+
+        // Unroll summation loop: x4=wt[0..m-1], sum in w3. With NEON,
+        // sum 4 products at a time in v2 first.
+#ifdef MIXHW_ARM
+        const int m4=cp[3]&~3;
+#else
+        const int m4=0;
+#endif
+        if (m4>0) {
+          a64addx(7, 0, off(p[cp[2]]));        // add x7, x0, &p[j]
+          for (int k=0; k<m4; k+=4) {
+            a64(0x4cdf7880);                   // ld1 {v0.4s}, [x4], #16
+            a64(0x4cdf78e1);                   // ld1 {v1.4s}, [x7], #16
+            a64(0x4f380400);                   // sshr v0.4s, v0.4s, #8
+            if (k==0) a64(0x4ea19c02);         // mul v2.4s, v0.4s, v1.4s
+            else a64(0x4ea19402);              // mla v2.4s, v0.4s, v1.4s
+          }
+          a64(0x4eb1b842);                     // addv s2, v2.4s
+          a64(0x0e043c43);                     // mov w3, v2.s[0]
+        }
+        for (int k=m4; k<cp[3]; ++k) {
+          a64ldr(5, 4, (k-m4)*4);              // ldr w5, [x4+(k-m4)*4]
+          a64(0x13087ca5);                     // asr w5, w5, #8
+          a64ldr(6, 0, off(p[cp[2]+k]));       // ldr w6, [x0+&p[j+k]]
+          if (k==0) a64(0x1b067ca3);           // mul w3, w5, w6
+          else a64(0x1b060ca3);                // madd w3, w5, w6, w3
+        }
+        a64(0x13087c62);                       // asr w2, w3, #8
+        a64mov(6, 2047);                       // mov w6, #2047
+        a64(0x6b06005f);                       // cmp w2, w6
+        a64(0x1a82c0c2);                       // csel w2, w6, w2, gt
+        a64(0x1280ffe6);                       // mov w6, #-2048
+        a64(0x6b06005f);                       // cmp w2, w6
+        a64(0x1a82b0c2);                       // csel w2, w6, w2, lt
+        a64str(2, 0, off(p[i]));               // str w2, [x0+&p[i]]
+      }
+        break;
+
+      case SSE:  // sizebits j start limit
+        // cr.cxt=(h[i]+c8)*32;
+        // int pq=p[cp[2]]+992;
+        // if (pq<0) pq=0;
+        // if (pq>1983) pq=1983;
+        // int wt=pq&63;
+        // pq>>=6;
+        // cr.cxt+=pq;
+        // p[i]=stretch(((cr.cm(cr.cxt)>>10)*(64-wt)       // p0
+        //               +(cr.cm(cr.cxt+1)>>10)*wt)>>13);  // p1
+        // // p = p0*(64-wt)+p1*wt = (p1-p0)*wt + p0*64
+        // cr.cxt+=wt>>5;
+
+        a64ldr(2, 0, off(h[i]));       // ldr w2, [x0+&h[i]]
+        a64ldr(3, 0, off(c8));         // ldr w3, [x0+&c8]
+        a64(0x0b030042);               // add w2, w2, w3
+        a64and(2, 2, (1u<<cp[1])-1);   // and w2, w2, size-1
+        a64(0x531b6842);               // lsl w2, w2, #5 ; cxt
+        a64ldr(3, 0, off(p[cp[2]]));   // ldr w3, [x0+&p[j]] ; pq
+        a64(0x110f8063);               // add w3, w3, #992
+        a64(0x7100007f);               // cmp w3, #0
+        a64(0x1a83b3e3);               // csel w3, wzr, w3, lt
+        a64mov(5, 1983);               // mov w5, #1983
+        a64(0x6b05007f);               // cmp w3, w5
+        a64(0x1a83c0a3);               // csel w3, w5, w3, gt ; pq in 0..1983
+        a64(0x12001465);               // and w5, w3, #63 ; wt in 0..63
+        a64(0x53067c63);               // lsr w3, w3, #6 ; pq in 0..30
+        a64(0x0b030042);               // add w2, w2, w3 ; cxt
+        a64ldrx(4, 0, offc(cm));       // ldr x4, [x0+&cm]
+        a64(0x8b224886);               // add x6, x4, w2, uxtw #2
+        a64(0xb94000c7);               // ldr w7, [x6] ; cm[cxt]
+        a64(0xb94004c8);               // ldr w8, [x6, #4] ; cm[cxt+1]
+        a64(0x0b451442);               // add w2, w2, w5, lsr #5 ; cxt+=wt>>5
+        a64strx(2, 0, offc(cxt));      // str x2, [x0+&cxt] ; cxt saved
+        a64(0x530a7ce7);               // lsr w7, w7, #10 ; p0
+        a64(0x530a7d08);               // lsr w8, w8, #10 ; p1
+        a64(0x4b070108);               // sub w8, w8, w7 ; p1-p0
+        a64(0x1b057d08);               // mul w8, w8, w5 ; (p1-p0)*wt
+        a64(0x0b071907);               // add w7, w8, w7, lsl #6
+        a64(0x530d7ce7);               // lsr w7, w7, #13 ; p in 0..32767
+        a64(0x78e75987);               // ldrsh w7, [x12, w7, uxtw #1]
+        a64str(7, 0, off(p[i]));       // str w7, [x0+&p[i]]
+        break;
+
+      default:
+        error("invalid ZPAQ component");
+    }
+  }
+
+  // return squash(p[n-1])
+  a64ldr(2, 0, off(p[n-1]));           // ldr w2, [x0+&p[n-1]]
+  a64(0x11200042);                     // add w2, w2, #2048
+  a64(0x786259a0);                     // ldrh w0, [x13, w2, uxtw #1]
+  a64(0xd65f03c0);                     // ret
+
+  // Initialize for update(). Keep table pointers for squash() in x12,
+  // dt in x13 and st in x14.
+  int save_o=o;
+  o=4;
+  a64(0x14000000|((save_o-4)/4)); // b update
+  o=save_o;
+  a64addx(12, 0, off(squasht));    // add x12, x0, &squasht
+  a64addx(13, 0, off(dt));         // add x13, x0, &dt
+  a64addx(14, 0, off(st));         // add x14, x0, &st
+
+  // Code update() for each component
+  cp=hcomp+7;
+  for (int i=0; i<n; ++i, cp+=compsize[cp[0]]) {
+    assert(cp-hcomp<pr.z.cend);
+    assert (cp[0]>=1 && cp[0]<=9);
+    assert(compsize[cp[0]]>0 && compsize[cp[0]]<8);
+    switch (cp[0]) {
+
+      case CONS:  // c
+        break;
+
+      case SSE:  // sizebits j start limit
+      case CM:   // sizebits limit
+        // train(cr, y);
+        //
+        // reduce prediction error in cr.cm
+        // void train(Component& cr, int y) {
+        //   assert(y==0 || y==1);
+        //   U32& pn=cr.cm(cr.cxt);
+        //   U32 count=pn&0x3ff;
+        //   int error=y*32767-(cr.cm(cr.cxt)>>17);
+        //   pn+=(error*dt[count]&-1024)+(count<cr.limit);
+
+        a64ldrx(4, 0, offc(cm));       // ldr x4, [x0+&cm]
+        a64ldrx(2, 0, offc(cxt));      // ldr x2, [x0+&cxt]
+        a64and(2, 2, U32(pr.comp[i].cm.size()-1));  // and w2, w2, size-1
+        a64(0x8b224884);               // add x4, x4, w2, uxtw #2 ; &cm[cxt]
+        a64(0xb9400085);               // ldr w5, [x4] ; pn
+        a64(0x53117ca6);               // lsr w6, w5, #17
+        a64(0x53114027);               // lsl w7, w1, #15
+        a64(0x4b0100e7);               // sub w7, w7, w1 ; y*32767
+        a64(0x4b0600e7);               // sub w7, w7, w6 ; error
+        a64(0x120024a6);               // and w6, w5, #1023 ; count
+        a64(0xb86659a8);               // ldr w8, [x13, w6, uxtw #2] ; dt[count]
+        a64(0x1b087ce7);               // mul w7, w7, w8
+        putlogic(rcode, rcode_size, o, 0x12000000, 7, 7, 10, 22);
+                                       // and w7, w7, #-1024
+        a64(0x7100001f|(cp[2+2*(cp[0]==SSE)]*4)<<10|6<<5);
+                                       // cmp w6, limit*4
+        a64(0x1a8724e7);               // cinc w7, w7, lo
+        a64(0x0b0700a5);               // add w5, w5, w7
+        a64(0xb9000085);               // str w5, [x4] ; pn+=...
+        break;
+
+      case ICM:   // sizebits: cxt=bh, ht[c][0..15]=bh row
+        // cr.ht[cr.c+(hmap4&15)]=st.next(cr.ht[cr.c+(hmap4&15)], y);
+        // U32& pn=cr.cm(cr.cxt);
+        // pn+=int(y*32767-(pn>>8))>>2;
+
+      case ISSE:  // sizebits j  -- c=hi, cxt=bh
+        // assert(cr.cxt==cr.ht[cr.c+(hmap4&15)]);
+        // int err=y*32767-squash(p[i]);
+        // int *wt=(int*)&cr.cm[cr.cxt*2];
+        // wt[0]=clamp512k(wt[0]+((err*p[cp[2]]+(1<<12))>>13));
+        // wt[1]=clamp512k(wt[1]+((err+16)>>5));
+        // cr.ht[cr.c+(hmap4&15)]=st.next(cr.cxt, y);
+
+        // update bit history bh to next(bh,y=w1) in ht[c+(hmap4&15)]
+        a64ldr(2, 0, off(hmap4));      // ldr w2, [x0+&hmap4]
+        a64(0x12000c42);               // and w2, w2, #15
+        a64ldrx(3, 0, offc(c));        // ldr x3, [x0+&c]
+        a64(0x0b030042);               // add w2, w2, w3 ; index of bh
+        a64ldrx(4, 0, offc(ht));       // ldr x4, [x0+&ht]
+        a64(0x38624883);               // ldrb w3, [x4, w2, uxtw] ; bh
+        a64(0x0b030825);               // add w5, w1, w3, lsl #2 ; index to st
+        a64(0x386549c5);               // ldrb w5, [x14, w5, uxtw] ; next bh
+        a64(0x38224885);               // strb w5, [x4, w2, uxtw] ; save next bh
+        a64ldrx(4, 0, offc(cm));       // ldr x4, [x0+&cm]
+
+        // ICM: update cm[cxt=w3=bit history] to reduce prediction error
+        if (cp[0]==ICM) {
+          a64(0x8b234884);             // add x4, x4, w3, uxtw #2 ; &cm[bh]
+          a64(0xb9400085);             // ldr w5, [x4] ; pn
+          a64(0x53087ca6);             // lsr w6, w5, #8 ; pn>>8
+          a64(0x53114027);             // lsl w7, w1, #15
+          a64(0x4b0100e7);             // sub w7, w7, w1 ; y*32767
+          a64(0x4b0600e7);             // sub w7, w7, w6
+          a64(0x0b8708a5);             // add w5, w5, w7, asr #2
+          a64(0xb9000085);             // str w5, [x4]
+        }
+
+        // ISSE: update weights. w3=cxt=bit history (0..255), x4=cm[512]
+        else {
+          a64(0x8b234c84);             // add x4, x4, w3, uxtw #3 ; wt
+          a64ldr(5, 0, off(p[i]));     // ldr w5, [x0+&p[i]]
+          a64(0x112000a5);             // add w5, w5, #2048
+          a64(0x78655985);             // ldrh w5, [x12, w5, uxtw #1] ; squash
+          a64(0x53114026);             // lsl w6, w1, #15
+          a64(0x4b0100c6);             // sub w6, w6, w1 ; y*32767
+          a64(0x4b0500c6);             // sub w6, w6, w5 ; err
+          a64mov(9, (1<<19)-1);        // mov w9, (1<<19)-1
+          a64mov(10, 0xfff80000);      // mov w10, -1<<19
+          a64ldr(7, 0, off(p[cp[2]])); // ldr w7, [x0+&p[j]]
+          a64(0x1b067ce7);             // mul w7, w7, w6
+          a64(0x114004e7);             // add w7, w7, #4096
+          a64(0x130d7ce7);             // asr w7, w7, #13
+          a64(0xb9400088);             // ldr w8, [x4] ; wt[0]
+          a64(0x0b0800e7);             // add w7, w7, w8
+          a64(0x6b0900ff);             // cmp w7, w9
+          a64(0x1a87c127);             // csel w7, w9, w7, gt
+          a64(0x6b0a00ff);             // cmp w7, w10
+          a64(0x1a87b147);             // csel w7, w10, w7, lt
+          a64(0xb9000087);             // str w7, [x4]
+          a64(0x110040c6);             // add w6, w6, #16
+          a64(0x13057cc6);             // asr w6, w6, #5
+          a64(0xb9400488);             // ldr w8, [x4, #4] ; wt[1]
+          a64(0x0b0800c6);             // add w6, w6, w8
+          a64(0x6b0900df);             // cmp w6, w9
+          a64(0x1a86c126);             // csel w6, w9, w6, gt
+          a64(0x6b0a00df);             // cmp w6, w10
+          a64(0x1a86b146);             // csel w6, w10, w6, lt
+          a64(0xb9000486);             // str w6, [x4, #4]
+        }
+        break;
+
+      case MATCH: // sizebits bufbits:
+                  //   a=len, b=offset, c=bit, cm=index, cxt=bitpos
+                  //   ht=buf, limit=pos
+        // if (int(cr.c)!=y) cr.a=0;  // mismatch?
+        // cr.ht(cr.limit)+=cr.ht(cr.limit)+y;
+        // if (++cr.cxt==8) {
+        //   cr.cxt=0;
+        //   ++cr.limit;
+        //   cr.limit&=(1<<cp[2])-1;
+        //   if (cr.a==0) {  // look for a match
+        //     cr.b=cr.limit-cr.cm(h[i]);
+        //     if (cr.b&(cr.ht.size()-1))
+        //       while (cr.a<255
+        //              && cr.ht(cr.limit-cr.a-1)==cr.ht(cr.limit-cr.a-cr.b-1))
+        //         ++cr.a;
+        //   }
+        //   else cr.a+=cr.a<255;
+        //   cr.cm(h[i])=cr.limit;
+        // }
+      {
+        const U32 bufmask=(1u<<cp[2])-1;
+
+        // Set pointers x4=&ht, x5=&cm
+        a64ldrx(4, 0, offc(ht));       // ldr x4, [x0+&ht]
+        a64ldrx(5, 0, offc(cm));       // ldr x5, [x0+&cm]
+
+        // if (c!=y) a=0;
+        a64ldrx(2, 0, offc(c));        // ldr x2, [x0+&c]
+        a64(0x6b01005f);               // cmp w2, w1 ; y
+        const int j1=o;
+        a64(0x54000000);               // b.eq L1
+        a64strx(31, 0, offc(a));       // str xzr, [x0+&a]
+        a64fix(j1);                    // L1:
+
+        // ht(limit)+=ht(limit)+y
+        a64ldrx(2, 0, offc(limit));    // ldr x2, [x0+&limit]
+        a64(0x38624883);               // ldrb w3, [x4, w2, uxtw]
+        a64(0x0b030423);               // add w3, w1, w3, lsl #1
+        a64(0x38224883);               // strb w3, [x4, w2, uxtw]
 
         // if (++cxt==8)
-        put2a(0x8b87, offc(cxt));      // mov eax, [edi+&cxt]
-        put2(0xffc0);                  // inc eax
-        put3(0x83e007);                // and eax,byte +0x7
-        put2a(0x8987, offc(cxt));      // mov [edi+&cxt],eax
-        put2a(0x0f85, 0x9b);           // jnz L8
+        a64ldrx(3, 0, offc(cxt));      // ldr x3, [x0+&cxt]
+        a64(0x11000463);               // add w3, w3, #1
+        a64(0x12000863);               // and w3, w3, #7
+        a64strx(3, 0, offc(cxt));      // str x3, [x0+&cxt]
+        const int j8=o;
+        a64(0x35000003);               // cbnz w3, L8
 
         // ++limit;
         // limit&=bufsize-1;
-        put2a(0x8b87, offc(limit));    // mov eax,[edi+&limit]
-        put2(0xffc0);                  // inc eax
-        put1a(0x25, (1<<cp[2])-1);     // and eax, bufsize-1
-        put2a(0x8987, offc(limit));    // mov [edi+&limit],eax
+        a64(0x11000442);               // add w2, w2, #1
+        a64and(2, 2, bufmask);         // and w2, w2, bufsize-1
+        a64strx(2, 0, offc(limit));    // str x2, [x0+&limit]
 
         // if (a==0)
-        put2a(0x8b87, offc(a));        // mov eax, [edi+&a]
-        put2(0x85c0);                  // test eax,eax
-        put2(0x755c);                  // jnz L6
+        a64ldrx(6, 0, offc(a));        // ldr x6, [x0+&a]
+        const int j6=o;
+        a64(0x35000006);               // cbnz w6, L6
 
         //   b=limit-cm(h[i])
-        put2a(0x8b8f, off(h[i]));      // mov ecx,[edi+h[i]]
-        put2a(0x81e1, (1<<cp[1])-1);   // and ecx, size-1
-        put2a(0x8b87, offc(limit));    // mov eax,[edi-&limit]
-        put3(0x2b048b);                // sub eax,[ebx+ecx*4]
-        put2a(0x8987, offc(b));        // mov [edi+&b],eax
+        a64ldr(7, 0, off(h[i]));       // ldr w7, [x0+&h[i]]
+        a64and(7, 7, (1u<<cp[1])-1);   // and w7, w7, size-1
+        a64(0xb86758a8);               // ldr w8, [x5, w7, uxtw #2]
+        a64(0x4b080048);               // sub w8, w2, w8
+        a64strx(8, 0, offc(b));        // str x8, [x0+&b]
 
         //   if (b&(bufsize-1))
-        put1a(0xa9, (1<<cp[2])-1);     // test eax, bufsize-1
-        put2(0x7448);                  // jz L7
+        int j7a=-1;
+        if (bufmask) {
+          putlogic(rcode, rcode_size, o, 0x72000000, 31, 8, 0, cp[2]);
+                                       // tst w8, bufsize-1
+          j7a=o;
+          a64(0x54000000);             // b.eq L7
+        }
+        else {
+          j7a=o;
+          a64(0x14000000);             // b L7
+        }
 
         //      while (a<255 && ht(limit-a-1)==ht(limit-a-b-1)) ++a;
-        put1(0x53);                    // push ebx
-        put2a(0x8b9f, offc(limit));    // mov ebx,[edi+&limit]
-        put2(0x89da);                  // mov edx,ebx
-        put2(0x29c3);                  // sub ebx,eax  ; limit-b
-        put2(0x31c9);                  // xor ecx,ecx  ; a=0
-        put2a(0x81f9, 0xff);           // L2: cmp ecx,0xff ; while
-        put2(0x741c);                  // jz L3 ; break
-        put2(0xffca);                  // dec edx
-        put2(0xffcb);                  // dec ebx
-        put2a(0x81e2, (1<<cp[2])-1);   // and edx, bufsize-1
-        put2a(0x81e3, (1<<cp[2])-1);   // and ebx, bufsize-1
-        put3(0x8a0416);                // mov al,[esi+edx]
-        put3(0x3a041e);                // cmp al,[esi+ebx]
-        put2(0x7504);                  // jnz L3 ; break
-        put2(0xffc1);                  // inc ecx
-        put2(0xebdc);                  // jmp short L2 ; end while
-        put1(0x5b);                    // L3: pop ebx
-        put2a(0x898f, offc(a));        // mov [edi+&a],ecx
-        put2(0xeb0e);                  // jmp short L7
+        a64(0x2a0203ea);               // mov w10, w2 ; limit
+        a64(0x4b08004b);               // sub w11, w2, w8 ; limit-b
+        const int l2=o;
+        a64(0x7103fcdf);               // L2: cmp w6, #255 ; while
+        const int j3a=o;
+        a64(0x54000000);               // b.eq L3 ; break
+        a64(0x5100054a);               // sub w10, w10, #1
+        a64(0x5100056b);               // sub w11, w11, #1
+        a64and(10, 10, bufmask);       // and w10, w10, bufsize-1
+        a64and(11, 11, bufmask);       // and w11, w11, bufsize-1
+        a64(0x386a488f);               // ldrb w15, [x4, w10, uxtw]
+        a64(0x386b4890);               // ldrb w16, [x4, w11, uxtw]
+        a64(0x6b1001ff);               // cmp w15, w16
+        const int j3b=o;
+        a64(0x54000001);               // b.ne L3 ; break
+        a64(0x110004c6);               // add w6, w6, #1
+        a64(0x14000000|((l2-o)/4&0x3ffffff)); // b L2 ; end while
+        a64fix(j3a);                   // L3:
+        a64fix(j3b);
+        a64strx(6, 0, offc(a));        // str x6, [x0+&a]
+        const int j7b=o;
+        a64(0x14000000);               // b L7
 
         // a+=(a<255)
-        put1a(0x3d, 0xff);             // L6: cmp eax, 0xff ; a
-        put3(0x83d000);                // adc eax, 0
-        put2a(0x8987, offc(a));        // mov [edi+&a],eax
+        a64fix(j6);                    // L6:
+        a64(0x7103fcdf);               // cmp w6, #255 ; a
+        a64(0x1a8624c6);               // cinc w6, w6, lo
+        a64strx(6, 0, offc(a));        // str x6, [x0+&a]
 
         // cm(h[i])=limit
-        put2a(0x8b87, off(h[i]));      // L7: mov eax,[edi+&h[i]]
-        put1a(0x25, (1<<cp[1])-1);     // and eax, size-1
-        put2a(0x8b8f, offc(limit));    // mov ecx,[edi+&limit]
-        put3(0x890c83);                // mov [ebx+eax*4],ecx
-                                       // L8:
+        a64fix(j7a);                   // L7:
+        a64fix(j7b);
+        a64ldr(7, 0, off(h[i]));       // ldr w7, [x0+&h[i]]
+        a64and(7, 7, (1u<<cp[1])-1);   // and w7, w7, size-1
+        a64(0xb82758a2);               // str w2, [x5, w7, uxtw #2]
+        a64fix(j8);                    // L8:
         break;
+      }
 
       case AVG:  // j k wt
         break;
 
       case MIX2: // sizebits j k rate mask
                  // cm=wt[size], cxt=input
-        // assert(cr.a16.size()==cr.c);
-        // assert(cr.cxt<cr.a16.size());
         // int err=(y*32767-squash(p[i]))*cp[4]>>5;
         // int w=cr.a16[cr.cxt];
         // w+=(err*(p[cp[2]]-p[cp[3]])+(1<<12))>>13;
@@ -4498,86 +7118,103 @@ int Predictor::assemble_p() {
         // if (w>65535) w=65535;
         // cr.a16[cr.cxt]=w;
 
-        // set ecx=err
-        put2a(0x8b87, off(p[i]));      // mov eax, [edi+&p[i]]
-        put1a(0x05, 2048);             // add eax, 2048
-        put4a(0x0fb78447, off(squasht));//movzx eax, word [edi+eax*2+&squasht]
-        put2(0x89e9);                  // mov ecx, ebp ; y
-        put3(0xc1e10f);                // shl ecx, 15
-        put2(0x29e9);                  // sub ecx, ebp ; y*32767
-        put2(0x29c1);                  // sub ecx, eax
-        put2a(0x69c9, cp[4]);          // imul ecx, rate
-        put3(0xc1f905);                // sar ecx, 5  ; err
+        // set w3=err
+        a64ldr(2, 0, off(p[i]));       // ldr w2, [x0+&p[i]]
+        a64(0x11200042);               // add w2, w2, #2048
+        a64(0x78625982);               // ldrh w2, [x12, w2, uxtw #1] ; squash
+        a64(0x53114023);               // lsl w3, w1, #15
+        a64(0x4b010063);               // sub w3, w3, w1 ; y*32767
+        a64(0x4b020063);               // sub w3, w3, w2
+        a64mov(5, cp[4]);              // mov w5, rate
+        a64(0x1b057c63);               // mul w3, w3, w5
+        a64(0x13057c63);               // asr w3, w3, #5 ; err
 
         // Update w
-        put2a(0x8b87, offc(cxt));      // mov eax, [edi+&cxt]
-        if (S==8) put1(0x48);          // rex.w
-        put2a(0x8bb7, offc(a16));      // mov esi, [edi+&a16]
-        if (S==8) put1(0x48);          // rex.w
-        put3(0x8d3446);                // lea esi, [esi+eax*2] ; &w
-        put2a(0x8b87, off(p[cp[2]]));  // mov eax, [edi+&p[j]]
-        put2a(0x2b87, off(p[cp[3]]));  // sub eax, [edi+&p[k]] ; p[j]-p[k]
-        put3(0x0fafc1);                // imul eax, ecx  ; * err
-        put1a(0x05, 1<<12);            // add eax, 4096
-        put3(0xc1f80d);                // sar eax, 13
-        put3(0x0fb716);                // movzx edx, word [esi] ; w
-        put2(0x01d0);                  // add eax, edx
-        put1a(0xba, 0xffff);           // mov edx, 65535
-        put2(0x39d0);                  // cmp eax, edx
-        put3(0x0f4fc2);                // cmovg eax, edx
-        put2(0x31d2);                  // xor edx, edx
-        put2(0x39d0);                  // cmp eax, edx
-        put3(0x0f4cc2);                // cmovl eax, edx
-        put3(0x668906);                // mov word [esi], ax
+        a64ldrx(2, 0, offc(cxt));      // ldr x2, [x0+&cxt]
+        a64ldrx(4, 0, offc(a16));      // ldr x4, [x0+&a16]
+        a64(0x8b224484);               // add x4, x4, w2, uxtw #1 ; &w
+        a64ldr(5, 0, off(p[cp[2]]));   // ldr w5, [x0+&p[j]]
+        a64ldr(6, 0, off(p[cp[3]]));   // ldr w6, [x0+&p[k]]
+        a64(0x4b0600a5);               // sub w5, w5, w6 ; p[j]-p[k]
+        a64(0x1b037ca5);               // mul w5, w5, w3 ; * err
+        a64(0x114004a5);               // add w5, w5, #4096
+        a64(0x130d7ca5);               // asr w5, w5, #13
+        a64(0x79400086);               // ldrh w6, [x4] ; w
+        a64(0x0b0600a5);               // add w5, w5, w6
+        a64(0x710000bf);               // cmp w5, #0
+        a64(0x1a85b3e5);               // csel w5, wzr, w5, lt
+        a64mov(6, 65535);              // mov w6, #65535
+        a64(0x6b0600bf);               // cmp w5, w6
+        a64(0x1a85c0c5);               // csel w5, w6, w5, gt
+        a64(0x79000085);               // strh w5, [x4]
         break;
 
-      case MIX: // sizebits j m rate mask
-                // cm=wt[size][m], cxt=input
+      case MIX: { // sizebits j m rate mask
+                  // cm=wt[size][m], cxt=input
         // int m=cp[3];
-        // assert(m>0 && m<=i);
-        // assert(cr.cm.size()==m*cr.c);
-        // assert(cr.cxt+m<=cr.cm.size());
         // int err=(y*32767-squash(p[i]))*cp[4]>>4;
         // int* wt=(int*)&cr.cm[cr.cxt];
         // for (int j=0; j<m; ++j)
         //   wt[j]=clamp512k(wt[j]+((err*p[cp[2]+j]+(1<<12))>>13));
 
-        // set ecx=err
-        put2a(0x8b87, off(p[i]));      // mov eax, [edi+&p[i]]
-        put1a(0x05, 2048);             // add eax, 2048
-        put4a(0x0fb78447, off(squasht));//movzx eax, word [edi+eax*2+&squasht]
-        put2(0x89e9);                  // mov ecx, ebp ; y
-        put3(0xc1e10f);                // shl ecx, 15
-        put2(0x29e9);                  // sub ecx, ebp ; y*32767
-        put2(0x29c1);                  // sub ecx, eax
-        put2a(0x69c9, cp[4]);          // imul ecx, rate
-        put3(0xc1f904);                // sar ecx, 4  ; err
-
-        // set esi=wt
-        put2a(0x8b87, offc(cxt));      // mov eax, [edi+&cxt] ; cxt
-        if (S==8) put1(0x48);          // rex.w
-        put2a(0x8bb7, offc(cm));       // mov esi, [edi+&cm]
-        if (S==8) put1(0x48);          // rex.w
-        put3(0x8d3486);                // lea esi, [esi+eax*4] ; wt
-
-        for (int k=0; k<cp[3]; ++k) {
-          put2a(0x8b87,off(p[cp[2]+k]));//mov eax, [edi+&p[cp[2]+k]
-          put3(0x0fafc1);              // imul eax, ecx
-          put1a(0x05, 1<<12);          // add eax, 1<<12
-          put3(0xc1f80d);              // sar eax, 13
-          put2(0x0306);                // add eax, [esi]
-          put1a(0x3d, (1<<19)-1);      // cmp eax, (1<<19)-1
-          put2(0x7e05);                // jge L1
-          put1a(0xb8, (1<<19)-1);      // mov eax, (1<<19)-1
-          put1a(0x3d, 0xfff80000);     // cmp eax, -1<<19
-          put2(0x7d05);                // jle L2
-          put1a(0xb8, 0xfff80000);     // mov eax, -1<<19
-          put2(0x8906);                // L2: mov [esi], eax
-          if (k<cp[3]-1) {
-            if (S==8) put1(0x48);      // rex.w
-            put3(0x83c604);            // add esi, 4
+        // set w3=err
+        a64ldr(2, 0, off(p[i]));       // ldr w2, [x0+&p[i]]
+        a64(0x11200042);               // add w2, w2, #2048
+        a64(0x78625982);               // ldrh w2, [x12, w2, uxtw #1] ; squash
+        a64(0x53114023);               // lsl w3, w1, #15
+        a64(0x4b010063);               // sub w3, w3, w1 ; y*32767
+        a64(0x4b020063);               // sub w3, w3, w2
+        a64mov(5, cp[4]);              // mov w5, rate
+        a64(0x1b057c63);               // mul w3, w3, w5
+        a64(0x13047c63);               // asr w3, w3, #4 ; err
+
+        // set x4=wt
+        a64ldrx(2, 0, offc(cxt));      // ldr x2, [x0+&cxt] ; cxt
+        a64ldrx(4, 0, offc(cm));       // ldr x4, [x0+&cm]
+        a64(0x8b224884);               // add x4, x4, w2, uxtw #2 ; wt
+        a64mov(9, (1<<19)-1);          // mov w9, (1<<19)-1
+        a64mov(10, 0xfff80000);        // mov w10, -1<<19
+
+        // With NEON, update 4 weights at a time
+#ifdef MIXHW_ARM
+        const int m4=cp[3]&~3;
+#else
+        const int m4=0;
+#endif
+        if (m4>0) {
+          a64addx(7, 0, off(p[cp[2]]));// add x7, x0, &p[j]
+          a64(0x4e040c65);             // dup v5.4s, w3 ; err
+          a64mov(5, 1<<12);            // mov w5, 1<<12
+          a64(0x4e040ca4);             // dup v4.4s, w5
+          a64(0x4e040d23);             // dup v3.4s, w9
+          a64(0x4e040d42);             // dup v2.4s, w10
+          for (int k=0; k<m4; k+=4) {
+            a64(0x4cdf78e0);           // ld1 {v0.4s}, [x7], #16
+            a64(0x4ea59c00);           // mul v0.4s, v0.4s, v5.4s
+            a64(0x4ea48400);           // add v0.4s, v0.4s, v4.4s
+            a64(0x4f330400);           // sshr v0.4s, v0.4s, #13
+            a64(0x4c407881);           // ld1 {v1.4s}, [x4]
+            a64(0x4ea18400);           // add v0.4s, v0.4s, v1.4s
+            a64(0x4ea36c00);           // smin v0.4s, v0.4s, v3.4s
+            a64(0x4ea26400);           // smax v0.4s, v0.4s, v2.4s
+            a64(0x4c9f7880);           // st1 {v0.4s}, [x4], #16
           }
         }
+
+        for (int k=m4; k<cp[3]; ++k) {
+          a64ldr(5, 0, off(p[cp[2]+k]));// ldr w5, [x0+&p[cp[2]+k]]
+          a64(0x1b037ca5);             // mul w5, w5, w3
+          a64(0x114004a5);             // add w5, w5, #4096
+          a64(0x130d7ca5);             // asr w5, w5, #13
+          a64ldr(6, 4, (k-m4)*4);      // ldr w6, [x4+(k-m4)*4]
+          a64(0x0b0600a5);             // add w5, w5, w6
+          a64(0x6b0900bf);             // cmp w5, w9
+          a64(0x1a85c125);             // csel w5, w9, w5, gt
+          a64(0x6b0a00bf);             // cmp w5, w10
+          a64(0x1a85b145);             // csel w5, w10, w5, lt
+          a64str(5, 4, (k-m4)*4);      // str w5, [x4+(k-m4)*4]
+        }
+      }
         break;
 
       default:
@@ -4586,15 +7223,13 @@ int Predictor::assemble_p() {
   }
 
   // return from update()
-  put1(0x5f);                 // pop edi
-  put1(0x5e);                 // pop esi
-  put1(0x5d);                 // pop ebp
-  put1(0x5b);                 // pop ebx
-  put1(0xc3);                 // ret
+  a64(0xd65f03c0);            // ret
 
   return o;
 }
 
+#endif // __aarch64__
+
 #endif // ifndef NOJIT
 
 // Return a prediction of the next bit in range 0..32767
@@ -4603,6 +7238,10 @@ int Predictor::predict() {
 #ifdef NOJIT
   return predict0();
 #else
+  if (!pcode && (pjit=jitFind(pkey))!=0) {
+    pcode=pjit->p;
+    pcode_size=pjit->n;
+  }
   if (!pcode) {
     allocx(pcode, pcode_size, (z.cend*100+4096)&-4096);
     int n=assemble_p();
@@ -4612,10 +7251,18 @@ int Predictor::predict() {
     }
     if (!pcode || n<15 || pcode_size<15)
       error("run JIT failed");
+    syncx(pcode, pcode_size);
+    pjit=jitAdd(pkey, pcode, pcode_size);
+    pcode=pjit->p;
+    pcode_size=pjit->n;
   }
   assert(pcode && pcode[0]);
+#ifdef __aarch64__
+  return ((int(*)(Predictor*))&pcode[0])(this);
+#else
   return ((int(*)(Predictor*))&pcode[10])(this);
 #endif
+#endif
 }
 
 // Update the model with bit y = 0..1
@@ -4623,9 +7270,14 @@ int Predictor::predict() {
 void Predictor::update(int y) {
 #ifdef NOJIT
   update0(y);
+#else
+#ifdef __aarch64__
+  assert(pcode && pcode[4]);
+  ((void(*)(Predictor*, int))&pcode[4])(this, y);
 #else
   assert(pcode && pcode[5]);
   ((void(*)(Predictor*, int))&pcode[5])(this, y);
+#endif
 
   // Save bit y in c8, hmap4 (not implemented in JIT)
   c8+=c8+y;
@@ -4648,6 +7300,10 @@ void ZPAQL::run(U32 input) {
 #ifdef NOJIT
   run0(input);
 #else
+  if (!rcode && sizeof(char*)==8 && (rjit=jitFind(rkey))!=0) {
+    rcode=rjit->p;
+    rcode_size=rjit->n;
+  }
   if (!rcode) {
     allocx(rcode, rcode_size, (hend*10+4096)&-4096);
     int n=assemble();
@@ -4657,9 +7313,15 @@ void ZPAQL::run(U32 input) {
     }
     if (!rcode || n<10 || rcode_size<10)
       error("run JIT failed");
+    syncx(rcode, rcode_size);
+    if (sizeof(char*)==8) {
+      rjit=jitAdd(rkey, rcode, rcode_size);
+      rcode=rjit->p;
+      rcode_size=rjit->n;
+    }
   }
   a=input;
-  const U32 rc=((int(*)())(&rcode[0]))();
+  const U32 rc=((int(*)(ZPAQL*))(&rcode[0]))(this);
   if (rc==0) return;
   else if (rc==1) libzpaq::error("Bad ZPAQL opcode");
   else if (rc==2) libzpaq::error("Out of memory");
@@ -6084,23 +8746,16 @@ trsort(int *ISA, int *SA, int n, int depth) {
 
 /*---------------------------------------------------------------------------*/
 
-/* Sorts suffixes of type B*. */
+/* Sorts suffixes of type B*. The buckets are sorted by sssort on up to
+   threads threads, each with its own part of the free space of SA. */
 static
 int
 sort_typeBstar(const unsigned char *T, int *SA,
                int *bucket_A, int *bucket_B,
-               int n) {
+               int n, int threads) {
   int *PAb, *ISAb, *buf;
-#ifdef _OPENMP
-  int *curbuf;
-  int l;
-#endif
   int i, j, k, t, m, bufsize;
   int c0, c1;
-#ifdef _OPENMP
-  int d0, d1;
-  int tmp;
-#endif
 
   /* Initialize bucket arrays. */
   for(i = 0; i < BUCKET_A_SIZE; ++i) { bucket_A[i] = 0; }
@@ -6152,47 +8807,46 @@ note:
     SA[--BUCKET_BSTAR(c0, c1)] = m - 1;
 
     /* Sort the type B* substrings using sssort. */
-#ifdef _OPENMP
-    tmp = omp_get_max_threads();
-    buf = SA + m, bufsize = (n - (2 * m)) / tmp;
-    c0 = ALPHABET_SIZE - 2, c1 = ALPHABET_SIZE - 1, j = m;
-#pragma omp parallel default(shared) private(curbuf, k, l, d0, d1, tmp)
-    {
-      tmp = omp_get_thread_num();
-      curbuf = buf + tmp * bufsize;
-      k = 0;
-      for(;;) {
-        #pragma omp critical(sssort_lock)
-        {
-          if(0 < (l = j)) {
-            d0 = c0, d1 = c1;
-            do {
-              k = BUCKET_BSTAR(d0, d1);
-              if(--d1 <= d0) {
-                d1 = ALPHABET_SIZE - 1;
-                if(--d0 < 0) { break; }
-              }
-            } while(((l - k) <= 1) && (0 < (l = k)));
-            c0 = d0, c1 = d1, j = k;
+    if((1 < threads) && (65536 <= m)) {
+      std::mutex mu;
+      buf = SA + m, bufsize = (n - (2 * m)) / threads;
+      c0 = ALPHABET_SIZE - 2, c1 = ALPHABET_SIZE - 1, j = m;
+      parallelFor(threads, threads, [&](int id) {
+        int *curbuf = buf + id * bufsize;
+        int d0, d1, l, k = 0;
+        for(;;) {
+          {
+            /* Take the next bucket with more than one suffix */
+            std::lock_guard<std::mutex> lock(mu);
+            if(0 < (l = j)) {
+              d0 = c0, d1 = c1;
+              do {
+                k = BUCKET_BSTAR(d0, d1);
+                if(--d1 <= d0) {
+                  d1 = ALPHABET_SIZE - 1;
+                  if(--d0 < 0) { break; }
+                }
+              } while(((l - k) <= 1) && (0 < (l = k)));
+              c0 = d0, c1 = d1, j = k;
+            }
           }
+          if(l == 0) { break; }
+          sssort(T, PAb, SA + k, SA + l,
+                 curbuf, bufsize, 2, n, *(SA + k) == (m - 1));
         }
-        if(l == 0) { break; }
-        sssort(T, PAb, SA + k, SA + l,
-               curbuf, bufsize, 2, n, *(SA + k) == (m - 1));
-      }
-    }
-#else
-    buf = SA + m, bufsize = n - (2 * m);
-    for(c0 = ALPHABET_SIZE - 2, j = m; 0 < j; --c0) {
-      for(c1 = ALPHABET_SIZE - 1; c0 < c1; j = i, --c1) {
-        i = BUCKET_BSTAR(c0, c1);
-        if(1 < (j - i)) {
-          sssort(T, PAb, SA + i, SA + j,
-                 buf, bufsize, 2, n, *(SA + i) == (m - 1));
+      });
+    } else {
+      buf = SA + m, bufsize = n - (2 * m);
+      for(c0 = ALPHABET_SIZE - 2, j = m; 0 < j; --c0) {
+        for(c1 = ALPHABET_SIZE - 1; c0 < c1; j = i, --c1) {
+          i = BUCKET_BSTAR(c0, c1);
+          if(1 < (j - i)) {
+            sssort(T, PAb, SA + i, SA + j,
+                   buf, bufsize, 2, n, *(SA + i) == (m - 1));
+          }
         }
       }
     }
-#endif
 
     /* Compute ranks of type B* substrings. */
     for(i = m - 1; 0 <= i; --i) {
@@ -6381,7 +9035,7 @@ construct_BWT(const unsigned char *T, int *SA,
 /*- Function -*/
 
 int
-divsufsort(const unsigned char *T, int *SA, int n) {
+divsufsort(const unsigned char *T, int *SA, int n, int threads=1) {
   int *bucket_A, *bucket_B;
   int m;
   int err = 0;
@@ -6397,7 +9051,7 @@ divsufsort(const unsigned char *T, int *SA, int n) {
 
   /* Suffixsort. */
   if((bucket_A != NULL) && (bucket_B != NULL)) {
-    m = sort_typeBstar(T, SA, bucket_A, bucket_B, n);
+    m = sort_typeBstar(T, SA, bucket_A, bucket_B, n, threads);
     construct_SA(T, SA, bucket_A, bucket_B, n, m);
   } else {
     err = -2;
@@ -6425,7 +9079,7 @@ divbwt(const unsigned char *T, unsigned char *U, int *A, int n) {
 
   /* Burrows-Wheeler Transform. */
   if((B != NULL) && (bucket_A != NULL) && (bucket_B != NULL)) {
-    m = sort_typeBstar(T, B, bucket_A, bucket_B, n);
+    m = sort_typeBstar(T, B, bucket_A, bucket_B, n, 1);
     pidx = construct_BWT(T, B, bucket_A, bucket_B, n, m);
 
     /* Copy to output string. */
@@ -6482,6 +9136,7 @@ void e8e9(unsigned char* buf, int n) {
 // sap is pointer to external suffix array of inbuf or 0. If supplied and
 //   args[0]=5..7 then it is assumed that E8E9 was already applied to
 //   both the input and sap and the input buffer is not modified.
+// threads is the number of threads to build the suffix array with.
 
 class LZBuffer: public libzpaq::Reader {
   libzpaq::Array<unsigned> ht;// hash table, confirm in low bits, or SA+ISA
@@ -6539,7 +9194,8 @@ class LZBuffer: public libzpaq::Reader {
   }
 
 public:
-  LZBuffer(StringBuffer& inbuf, int args[], const unsigned* sap=0);
+  LZBuffer(StringBuffer& inbuf, int args[], const unsigned* sap=0,
+           int threads=1);
 
   // return 1 byte of compressed output (overrides Reader)
   int get() {
@@ -6593,6 +9249,48 @@ int nbits(unsigned x) {
   return r;
 }
 
+// Return the least l in l..lim-1 with a[l]!=b[l], or lim if none.
+// Compare 16 bytes at a time with SSE2, else 8 bytes at a time on
+// little-endian machines, and find the first difference from the
+// trailing zeros of the difference.
+static inline unsigned matchLength(const unsigned char* a,
+    const unsigned char* b, unsigned l, unsigned lim) {
+#if defined(__SSE2__) && (defined(__GNUC__) || defined(__clang__))
+  for (; l+16<=lim; l+=16) {
+    const __m128i x=_mm_loadu_si128((const __m128i*)(a+l));
+    const __m128i y=_mm_loadu_si128((const __m128i*)(b+l));
+    const unsigned m=_mm_movemask_epi8(_mm_cmpeq_epi8(x, y))^0xffff;
+    if (m) return l+__builtin_ctz(m);
+  }
+#endif
+#if (defined(__GNUC__) || defined(__clang__)) \
+    && __BYTE_ORDER__==__ORDER_LITTLE_ENDIAN__
+  for (; l+8<=lim; l+=8) {
+    U64 x, y;
+    memcpy(&x, a+l, 8);
+    memcpy(&y, b+l, 8);
+    if (x!=y) return l+__builtin_ctzll(x^y)/8;
+  }
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_ARM64))
+  for (; l+8<=lim; l+=8) {
+    U64 x, y;
+    memcpy(&x, a+l, 8);
+    memcpy(&y, b+l, 8);
+    unsigned long r;
+    if (_BitScanForward64(&r, x^y)) return l+r/8;
+  }
+#endif
+  while (l<lim && a[l]==b[l]) ++l;
+  return l;
+}
+
+// Start loading the cache line of ht[h]
+#if defined(__GNUC__) || defined(__clang__)
+#define LZ_PREFETCH(p) __builtin_prefetch(p)
+#else
+#define LZ_PREFETCH(p)
+#endif
+
 // Read n bytes of compressed output into p and return number of
 // bytes read in 0..n. 0 signals EOF (overrides Reader).
 int LZBuffer::read(char* p, int n) {
@@ -6606,7 +9304,8 @@ int LZBuffer::read(char* p, int n) {
   return nr;
 }
 
-LZBuffer::LZBuffer(StringBuffer& inbuf, int args[], const unsigned* sap):
+LZBuffer::LZBuffer(StringBuffer& inbuf, int args[], const unsigned* sap,
+                   int threads):
     ht((args[1]&3)==3 ? (inbuf.size()+1)*!sap      // for BWT suffix array
         : args[5]-args[0]<21 ? 1u<<args[5]         // for LZ77 hash table
         : (inbuf.size()*!sap)+(1u<<17<<args[0])),  // for LZ77 SA and ISA
@@ -6647,7 +9346,7 @@ LZBuffer::LZBuffer(StringBuffer& inbuf, int args[], const unsigned* sap):
       assert(ht.size()>=n);
       assert(ht.size()>0);
       sa=&ht[0];
-      if (n>0) divsufsort((const unsigned char*)in, (int*)sa, n);
+      if (n>0) divsufsort((const unsigned char*)in, (int*)sa, n, threads);
     }
     if (level<3) {
       assert(ht.size()>=(n*(sap==0))+(1u<<17<<args[0]));
@@ -6682,6 +9381,7 @@ void LZBuffer::fill() {
     unsigned bp=0;  // pointer to best match
     unsigned blit=0;  // literals before best match
     int bscore=0;  // best cost
+    const unsigned lim=MIN(n-i, maxMatch);  // longest possible match
 
     // Look up contexts in suffix array
     if (isa) {
@@ -6699,7 +9399,7 @@ void LZBuffer::fill() {
             if (q+j*k<n && (p=sa[q+j*k]-h)<i) {
               assert(p<n);
               unsigned l, l1;  // length of match, leading literals
-              for (l=h; i+l<n && l<maxMatch && in[p+l]==in[i+l]; ++l);
+              l=matchLength(in+p, in+i, h, lim);
               for (l1=h; l1>0 && in[p+l1-1]==in[i+l1-1]; --l1);
               int score=int(l-l1)*8-lg(i-p)-4*(lit==0 && l1>0)-11;
               for (unsigned a=0; a<h; ++a) score=score*5/8;
@@ -6722,8 +9422,8 @@ void LZBuffer::fill() {
           if (p && (p&mask)==(in[i+3]&mask)) {
             p>>=checkbits;
             if (p<i && i+blen<=n && in[p+blen-1]==in[i+blen-1]) {
-              unsigned l;  // match length from lookahead
-              for (l=lookahead; i+l<n && l<maxMatch && in[p+l]==in[i+l]; ++l);
+              // match length from lookahead
+              const unsigned l=matchLength(in+p, in+i, lookahead, lim);
               if (l>=minMatch2+lookahead) {
                 int l1;  // length back from lookahead
                 for (l1=lookahead; l1>0 && in[p+l1-1]==in[i+l1-1]; --l1);
@@ -6744,8 +9444,7 @@ void LZBuffer::fill() {
           if (p && i+3<n && (p&mask)==(in[i+3]&mask)) {
             p>>=checkbits;
             if (p<i && i+blen<=n && in[p+blen-1]==in[i+blen-1]) {
-              unsigned l;
-              for (l=0; i+l<n && l<maxMatch && in[p+l]==in[i+l]; ++l);
+              const unsigned l=matchLength(in+p, in+i, 0, lim);
               int score=l*8-lg(i-p)-2*(lit>0)-11;
               if (score>bscore) blen=l, bp=p, blit=0, bscore=score;
             }
@@ -6785,9 +9484,11 @@ void LZBuffer::fill() {
             ht[h2^ih]=p;
             h2=(((h2*9)<<shift2)
                 +(in[i+minMatch2+lookahead]+1)*23456789u)&(htsize-1);
+            LZ_PREFETCH(&ht[h2]);
           }
           ht[h1^ih]=p;
           h1=(((h1*5)<<shift1)+(in[i+minMatch]+1)*123456791u)&(htsize-1);
+          LZ_PREFETCH(&ht[h1]);
         }
         ++i;
       }
@@ -7547,35 +10248,239 @@ std::string makeConfig(const char* method, int args[]) {
   return hdr+itos(ncomp)+"\n"+comp+hcomp+"halt\n"+pcomp;
 }
 
+// Counts the bytes written to it
+struct CountWriter: public Writer {
+  int64_t n;
+  CountWriter(): n(0) {}
+  void put(int) {++n;}
+  void write(const char*, int k) {n+=k;}
+};
+
+// Choose a level for in from method "aN1[sN][rN][,N2,N3]" by compressing
+// up to 256 KB of it, taken from 4 places, with levels 1..5 until one is
+// too slow for sN or meets rN. Return "LN1,N2,N3" for the chosen level L.
+std::string autoMethod(StringBuffer* in, const char* method, int threads) {
+  assert(in);
+  assert(method && method[0]=='a');
+  const char* p=method+1;
+  std::string bs;  // block size
+  while (isdigit(*p)) bs+=*p++;
+  int speed=0, ratio=0;  // targets in MB/s and percent
+  while (*p && *p!=',') {
+    const char c=*p++;
+    int v=0;
+    while (isdigit(*p)) v=v*10+*p++-'0';
+    if (c=='s') speed=v;
+    else if (c=='r') ratio=v;
+    else error("auto method options are s and r");
+  }
+  const std::string hints=p;  // ",N2,N3" or ""
+  if (!speed && !ratio) speed=10;
+
+  // Store random data as level 1..4 would
+  const unsigned n=in->size();
+  if (hints!="" && atoi(hints.c_str()+1)<3) return "0"+bs+hints;
+  if (n==0) return "0"+bs+hints;
+
+  // Sample pieces from the start, the end and evenly in between
+  const unsigned SAMPLE=1<<18, PIECES=4;
+  StringBuffer sample(MIN(n, SAMPLE));
+  if (n<=SAMPLE) sample.write(in->c_str(), n);
+  else {
+    for (unsigned i=0; i<PIECES; ++i)
+      sample.write(in->c_str()+uint64_t(n-SAMPLE/PIECES)*i/(PIECES-1),
+                   SAMPLE/PIECES);
+  }
+  const int64_t size=sample.size();
+
+  // Try the levels from fastest to slowest
+  int best=0;  // level 0 stores
+  int64_t bestsize=size;
+  for (int level=1; level<=5; ++level) {
+    StringBuffer trial(size);  // a copy, because E8E9 changes its input
+    trial.write(sample.c_str(), size);
+    CountWriter cw;
+    const std::string m=itos(level)+bs+hints;
+    const std::chrono::steady_clock::time_point start=
+        std::chrono::steady_clock::now();
+    compressBlock(&trial, &cw, m.c_str(), 0, 0, false, 0, threads);
+    const double secs=std::chrono::duration<double>(
+        std::chrono::steady_clock::now()-start).count();
+    if (speed && size<speed*1048576.0*secs) break;  // this and higher
+    if (cw.n<bestsize) best=level, bestsize=cw.n;
+    if (ratio && cw.n*100<=int64_t(ratio)*size) {
+      best=level;
+      break;
+    }
+  }
+  return itos(best)+bs+hints;
+}
+
+// Expand a level method "LB,R,t" to the "x" method that compressBlock()
+// uses for the n bytes at p. If modelOnly then always choose a context
+// model with no LZ77, BWT or E8E9 preprocessing.
+static std::string expandMethod(std::string method, const unsigned char* p,
+                                unsigned n, bool modelOnly) {
+  assert(isdigit(method[0]));
+  const int arg0=MAX(lg(n+4095)-20, 0);  // block size
+  assert((1u<<(arg0+20))>=n+4096);
+
+  // Get type from method "LB,R,t" where L is level 0..5, B is block
+  // size 0..11, R is redundancy 0..255, t = 0..3 = binary, text, exe, both.
+  unsigned type=0;
+  int commas=0, arg[4]={0};
+  for (int i=1; i<int(method.size()) && commas<4; ++i) {
+    if (method[i]==',' || method[i]=='.') ++commas;
+    else if (isdigit(method[i])) arg[commas]=arg[commas]*10+method[i]-'0';
+  }
+  if (commas==0) type=512;
+  else type=arg[1]*4+arg[2];
+
+  const int level=method[0]-'0';
+  assert(level>=0 && level<=9);
+
+  // build models
+  const int doe8=modelOnly ? 0 : (type&2)*2;
+  method="x"+itos(arg0);
+  std::string htsz=","+itos(19+arg0+(arg0<=6));  // lz77 hash table size
+  std::string sasz=","+itos(21+arg0);            // lz77 suffix array size
+
+  // A model without preprocessing: the fast CM of level 4 for levels
+  // up to 4, else the slow CM below
+  if (modelOnly && level<=4) {
+    method+=",0ci1,1,1,1,2a";
+    if (type&1) method+="w";
+    method+="m";
+  }
+
+  // store uncompressed
+  else if (level==0)
+    method="0"+itos(arg0)+",0";
+
+  // LZ77, no model. Store if hard to compress
+  else if (level==1) {
+    if (type<40) method+=",0";
+    else {
+      method+=","+itos(1+doe8)+",";
+      if      (type<80)  method+="4,0,1,15";
+      else if (type<128) method+="4,0,2,16";
+      else if (type<256) method+="4,0,2"+htsz;
+      else if (type<960) method+="5,0,3"+htsz;
+      else               method+="6,0,3"+htsz;
+    }
+  }
+
+  // LZ77 with longer search
+  else if (level==2) {
+    if (type<32) method+=",0";
+    else {
+      method+=","+itos(1+doe8)+",";
+      if (type<64) method+="4,0,3"+htsz;
+      else method+="4,0,7"+sasz+",1";
+    }
+  }
+
+  // LZ77 with CM depending on redundancy
+  else if (level==3) {
+    if (type<20)  // store if not compressible
+      method+=",0";
+    else if (type<48)  // fast LZ77 if barely compressible
+      method+=","+itos(1+doe8)+",4,0,3"+htsz;
+    else if (type>=640 || (type&1))  // BWT if text or highly compressible
+      method+=","+itos(3+doe8)+"ci1";
+    else  // LZ77 with O0-1 compression of up to 12 literals
+      method+=","+itos(2+doe8)+",12,0,7"+sasz+",1c0,0,511i2";
+  }
+
+  // LZ77+CM, fast CM, or BWT depending on type
+  else if (level==4) {
+    if (type<12)
+      method+=",0";
+    else if (type<24)
+      method+=","+itos(1+doe8)+",4,0,3"+htsz;
+    else if (type<48)
+      method+=","+itos(2+doe8)+",5,0,7"+sasz+"1c0,0,511";
+    else if (type<900) {
+      method+=","+itos(doe8)+"ci1,1,1,1,2a";
+      if (type&1) method+="w";
+      method+="m";
+    }
+    else
+      method+=","+itos(3+doe8)+"ci1";
+  }
+
+  // Slow CM with lots of models
+  else {  // 5..9
+
+    // Model text files
+    method+=","+itos(doe8);
+    if (type&1) method+="w2c0,1010,255i1";
+    else method+="w1i1";
+    method+="c256ci1,1,1,1,1,1,2a";
+
+    // Analyze the data
+    const int NR=1<<12;
+    int pt[256]={0};  // position of last occurrence
+    int r[NR]={0};    // count repetition gaps of length r
+    if (level>0) {
+      for (unsigned i=0; i<n; ++i) {
+        const int k=i-pt[p[i]];
+        if (k>0 && k<NR) ++r[k];
+        pt[p[i]]=i;
+      }
+    }
+
+    // Add periodic models
+    int n1=n-r[1]-r[2]-r[3];
+    for (int i=0; i<2; ++i) {
+      int period=0;
+      double score=0;
+      int t=0;
+      for (int j=5; j<NR && t<n1; ++j) {
+        const double s=r[j]/(256.0+n1-t);
+        if (s>score) score=s, period=j;
+        t+=r[j];
+      }
+      if (period>4 && score>0.1) {
+        method+="c0,0,"+itos(999+period)+",255i1";
+        if (period<=255)
+          method+="c0,"+itos(period)+"i1";
+        n1-=r[period];
+        r[period]=0;
+      }
+      else
+        break;
+    }
+    method+="c0,2,0,255i1c0,3,0,0,255i1c0,4,0,0,0,255i1mm16ts19t0";
+  }
+  return method;
+}
+
 // Compress from in to out in 1 segment in 1 block using the algorithm
 // descried in method. If method begins with a digit then choose
-// a method depending on type. Save filename and comment
+// a method depending on type, and if it begins with "a" then choose
+// the level with autoMethod(). Save filename and comment
 // in the segment header. If comment is 0 then the default is the input size
 // as a decimal string, plus " jDC\x01" for a journaling method (method[0]
-// is not 's'). Write the generated method to methodOut if not 0.
+// is not 's'). Write the level method used to methodOut if not 0.
+// Build suffix arrays for LZ77 and BWT on up to threads threads.
 void compressBlock(StringBuffer* in, Writer* out, const char* method_,
-                   const char* filename, const char* comment, bool dosha1) {
+                   const char* filename, const char* comment, bool dosha1,
+                   Compressor* cop, int threads, std::string* methodOut) {
+  if (!cop) {
+    Compressor co;
+    compressBlock(in, out, method_, filename, comment, dosha1, &co, threads,
+                  methodOut);
+    return;
+  }
   assert(in);
   assert(out);
   assert(method_);
   assert(method_[0]);
   std::string method=method_;
+  if (method[0]=='a') method=autoMethod(in, method_, threads);
+  if (methodOut) *methodOut=method;
   const unsigned n=in->size();  // input size
-  const int arg0=MAX(lg(n+4095)-20, 0);  // block size
-  assert((1u<<(arg0+20))>=n+4096);
-
-  // Get type from method "LB,R,t" where L is level 0..5, B is block
-  // size 0..11, R is redundancy 0..255, t = 0..3 = binary, text, exe, both.
-  unsigned type=0;
-  if (isdigit(method[0])) {
-    int commas=0, arg[4]={0};
-    for (int i=1; i<int(method.size()) && commas<4; ++i) {
-      if (method[i]==',' || method[i]=='.') ++commas;
-      else if (isdigit(method[i])) arg[commas]=arg[commas]*10+method[i]-'0';
-    }
-    if (commas==0) type=512;
-    else type=arg[1]*4+arg[2];
-  }
 
   // Get hash of input
   libzpaq::SHA1 sha1;
@@ -7590,125 +10495,14 @@ void compressBlock(StringBuffer* in, Writer* out, const char* method_,
   }
 
   // Expand default methods
-  if (isdigit(method[0])) {
-    const int level=method[0]-'0';
-    assert(level>=0 && level<=9);
-
-    // build models
-    const int doe8=(type&2)*2;
-    method="x"+itos(arg0);
-    std::string htsz=","+itos(19+arg0+(arg0<=6));  // lz77 hash table size
-    std::string sasz=","+itos(21+arg0);            // lz77 suffix array size
-
-    // store uncompressed
-    if (level==0)
-      method="0"+itos(arg0)+",0";
-
-    // LZ77, no model. Store if hard to compress
-    else if (level==1) {
-      if (type<40) method+=",0";
-      else {
-        method+=","+itos(1+doe8)+",";
-        if      (type<80)  method+="4,0,1,15";
-        else if (type<128) method+="4,0,2,16";
-        else if (type<256) method+="4,0,2"+htsz;
-        else if (type<960) method+="5,0,3"+htsz;
-        else               method+="6,0,3"+htsz;
-      }
-    }
-
-    // LZ77 with longer search
-    else if (level==2) {
-      if (type<32) method+=",0";
-      else {
-        method+=","+itos(1+doe8)+",";
-        if (type<64) method+="4,0,3"+htsz;
-        else method+="4,0,7"+sasz+",1";
-      }
-    }
-
-    // LZ77 with CM depending on redundancy
-    else if (level==3) {
-      if (type<20)  // store if not compressible
-        method+=",0";
-      else if (type<48)  // fast LZ77 if barely compressible
-        method+=","+itos(1+doe8)+",4,0,3"+htsz;
-      else if (type>=640 || (type&1))  // BWT if text or highly compressible
-        method+=","+itos(3+doe8)+"ci1";
-      else  // LZ77 with O0-1 compression of up to 12 literals
-        method+=","+itos(2+doe8)+",12,0,7"+sasz+",1c0,0,511i2";
-    }
-
-    // LZ77+CM, fast CM, or BWT depending on type
-    else if (level==4) {
-      if (type<12)
-        method+=",0";
-      else if (type<24)
-        method+=","+itos(1+doe8)+",4,0,3"+htsz;
-      else if (type<48)
-        method+=","+itos(2+doe8)+",5,0,7"+sasz+"1c0,0,511";
-      else if (type<900) {
-        method+=","+itos(doe8)+"ci1,1,1,1,2a";
-        if (type&1) method+="w";
-        method+="m";
-      }
-      else
-        method+=","+itos(3+doe8)+"ci1";
-    }
-
-    // Slow CM with lots of models
-    else {  // 5..9
-
-      // Model text files
-      method+=","+itos(doe8);
-      if (type&1) method+="w2c0,1010,255i1";
-      else method+="w1i1";
-      method+="c256ci1,1,1,1,1,1,2a";
-
-      // Analyze the data
-      const int NR=1<<12;
-      int pt[256]={0};  // position of last occurrence
-      int r[NR]={0};    // count repetition gaps of length r
-      const unsigned char* p=in->data();
-      if (level>0) {
-        for (unsigned i=0; i<n; ++i) {
-          const int k=i-pt[p[i]];
-          if (k>0 && k<NR) ++r[k];
-          pt[p[i]]=i;
-        }
-      }
-
-      // Add periodic models
-      int n1=n-r[1]-r[2]-r[3];
-      for (int i=0; i<2; ++i) {
-        int period=0;
-        double score=0;
-        int t=0;
-        for (int j=5; j<NR && t<n1; ++j) {
-          const double s=r[j]/(256.0+n1-t);
-          if (s>score) score=s, period=j;
-          t+=r[j];
-        }
-        if (period>4 && score>0.1) {
-          method+="c0,0,"+itos(999+period)+",255i1";
-          if (period<=255)
-            method+="c0,"+itos(period)+"i1";
-          n1-=r[period];
-          r[period]=0;
-        }
-        else
-          break;
-      }
-      method+="c0,2,0,255i1c0,3,0,0,255i1c0,4,0,0,0,255i1mm16ts19t0";
-    }
-  }
+  if (isdigit(method[0])) method=expandMethod(method, in->data(), n, false);
 
   // Compress
   std::string config;
   int args[9]={0};
   config=makeConfig(method.c_str(), args);
   assert(n<=(0x100000u<<args[0])-4096);
-  libzpaq::Compressor co;
+  libzpaq::Compressor& co=*cop;
   co.setOutput(out);
 #ifdef DEBUG
   co.setVerify(true);
@@ -7720,7 +10514,7 @@ void compressBlock(StringBuffer* in, Writer* out, const char* method_,
   if (comment) cs=cs+" "+comment;
   co.startSegment(filename, cs.c_str());
   if (args[1]>=1 && args[1]<=7 && args[1]!=4) {  // LZ77 or BWT
-    LZBuffer lz(*in, args);
+    LZBuffer lz(*in, args, 0, threads);
     co.setInput(&lz);
     co.compress();
   }
@@ -7743,4 +10537,98 @@ void compressBlock(StringBuffer* in, Writer* out, const char* method_,
   co.endBlock();
 }
 
+/////////////////////////// PrimedModel /////////////////////
+
+// Build the model of method and run dict[0..n-1] through it
+PrimedModel::PrimedModel(const char* method, const char* dict, size_t n):
+    pr(z), mid(0) {
+  if (!method || !(isdigit(method[0]) || method[0]=='x'))
+    error("primed model needs a level or x method");
+  if (n>0x7fffffff) error("dictionary too big");
+  expanded=method;
+  if (isdigit(method[0]))
+    expanded=expandMethod(method, (const unsigned char*)dict, n, true);
+  int args[9]={0};
+  std::string config=makeConfig(expanded.c_str(), args);
+  ZPAQL pz;
+  Compiler(config.c_str(), args, z, pz, 0);
+  if (pz.hend) error("primed model cannot use preprocessing");
+  if (z.header[6]==0) error("primed model needs a context model");
+  pr.init();
+  for (size_t i=0; i<n; ++i) {
+    const int c=U8(dict[i]);
+    for (int j=7; j>=0; --j) {
+      pr.predict();
+      pr.update(c>>j&1);
+    }
+  }
+  SHA1 sha1;
+  sha1.write((const char*)&z.header[0], z.header.size());
+  sha1.write(dict, n);
+  const char* r=sha1.result();
+  mid=U32(U8(r[0]))<<24|U32(U8(r[1]))<<16|U32(U8(r[2]))<<8|U8(r[3]);
+}
+
+// Write the model id and the coded bytes of in to EOF. The 4 zero bytes
+// that end a ZPAQ segment are left out and supplied when decoding.
+void PrimedCoder::compress(Reader* in, Writer* out) {
+  assert(in);
+  assert(out);
+  for (int i=24; i>=0; i-=8) out->put(model.mid>>i&255);
+  enc.out=out;
+  enc.prime(model.pr);
+  char buf[1<<14];
+  int nr;
+  while ((nr=in->read(buf, sizeof(buf)))>0)
+    for (int i=0; i<nr; ++i) enc.compress(U8(buf[i]));
+  enc.compress(-1);
+  enc.out=0;
+}
+
+// Reads in, then n zero bytes
+class ZeroPadReader: public Reader {
+  Reader* in;
+  int pad;
+public:
+  ZeroPadReader(Reader* r, int n): in(r), pad(n) {}
+  int get() {
+    const int c=in->get();
+    if (c>=0 || pad==0) return c;
+    --pad;
+    return 0;
+  }
+  int read(char* buf, int n) {
+    int r=in->read(buf, n);
+    if (r>0) return r;
+    for (r=0; r<n && pad>0; ++r, --pad) buf[r]=0;
+    return r;
+  }
+};
+
+// Decode one record from in. It must be from a model with the same id.
+void PrimedCoder::decompress(Reader* in, Writer* out) {
+  assert(in);
+  U32 id=0;
+  for (int i=0; i<4; ++i) {
+    const int c=in->get();
+    if (c<0) error("unexpected end of record");
+    id=id<<8|c;
+  }
+  if (id!=model.mid) error("record is from another primed model");
+  ZeroPadReader zin(in, 4);
+  dec.in=&zin;
+  dec.prime(model.pr);
+  char buf[1<<14];
+  int n=0, c;
+  while ((c=dec.decompress())>=0) {
+    buf[n++]=c;
+    if (n==int(sizeof(buf))) {
+      if (out) out->write(buf, n);
+      n=0;
+    }
+  }
+  if (out && n>0) out->write(buf, n);
+  dec.in=0;
+}
+
 }  // end namespace libzpaq
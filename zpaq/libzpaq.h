@@ -16,7 +16,11 @@ and link to libzpaq.cpp (and advapi32.lib in Windows/VC++).
 libzpaq recognizes the following options:
 
   -DDEBUG   Turn on assertion checks (slower).
-  -DNOJIT   Don't assume x86-32 or x86-64 with SSE2 (slower).
+  -DNOJIT   Don't assume x86-32, x86-64 with SSE2, or AArch64 (slower).
+  -DNOSHAHW Don't use the x86 SHA-NI or AArch64 SHA instructions for
+            SHA1 and SHA256 even if the CPU has them (slower).
+  -DNOAESHW Don't use the x86 AES-NI or AArch64 AES instructions for
+            AES_CTR even if the CPU has them (slower).
   -Dunix    Without -DNOJIT, assume Unix (Linux, Mac) rather than Windows.
 
 The application must provide an error handling function and derived
@@ -70,6 +74,16 @@ number of times. For example:
   // Write buf[0..n-1]
   void Out::write(char* buf, int n) {fwrite(buf, 1, n, stdout);}
 
+A Reader whose input is already in memory (such as a memory mapped
+file) may also override view() to let the decompresser read it in
+place instead of copying it into its own buffer:
+
+  // Point *p at up to n bytes at the current position and skip them.
+  // Return the number of bytes, 0 at EOF, or -1 if not supported
+  // (the default), in which case read() is called instead. The bytes
+  // must remain valid until the Reader is destroyed.
+  int In::view(const char** p, int n);
+
 By default, compress() divides the input into blocks with one segment
 each. The segment filename field is empty. The comment field of each
 block is the uncompressed size as a decimal string. The checksum
@@ -87,12 +101,13 @@ The method string has the general form of a concatenation of single
 character commands each possibly followed by a list of decimal
 numeric arguments separated by commas or periods:
 
-  {012345xciawmst}[N1[{.,}N2]...]...
+  {012345axciawmst}[N1[{.,}N2]...]...
 
 For example "1" or "14,128,0" or "x6.3ci1m".
 
 Only the first command can be a digit 0..5. If it is, then it selects
-a compression level and the other commands are ignored. Otherwise,
+a compression level and the other commands are ignored. If it is "a",
+compressBlock() selects the level (see below). Otherwise,
 if it is "x" then the arguments and remaining commands describe
 the compression method. Any other letter as the first command is
 interpreted the same as "x". 
@@ -113,6 +128,17 @@ or 255 if the data is easily compressed (for example, all zero bytes).
 Most compression methods will simply store random data with no
 compression. The default is "14,128,0".
 
+If the first command is "a" then the level is chosen for each block by
+compressing a sample of it (up to 256 KB) with levels 1, 2, ... in turn.
+The command is "a", the block size N1 as above, optionally "s" and a
+target speed in MB/s and "r" and a target size in percent of the
+input, then N2 and N3 as above, for example "a4s20" or "a4r30,64,1".
+With sN, the level is the one that compresses the sample best of those
+that compress it at least N MB/s on one thread (0 if none does). With rN,
+it is the lowest level that compresses it to N% or less, or the best
+one tried if none does. With both, a level must meet sN and then rN.
+The default is "s10". A block with N2 below 3 is stored without trials.
+
 If the first command is "x" then the string describes the exact
 compression method. The arguments to "x" describe the pre/post
 processing (LZ77, BWT, E8E9), and remaining commands describe the
@@ -350,6 +376,66 @@ swap() swaps 2 StringBuffers efficiently, but does not change their
 initial allocations.
 
 
+MEMORY POOL
+
+Arrays (model tables, hash tables, suffix arrays) and StringBuffers get
+their memory from poolAlloc() and return it with poolFree(). By default
+this is calloc() or malloc() and free(). After
+
+  size_t old=libzpaq::setPoolLimit(n);
+
+freed allocations of 64 KB or more are kept, up to n bytes, and handed
+out again (zeroed for an Array) to the next request of the same size,
+so that compressing or decompressing many blocks with the same method
+does not fault in and zero new pages for every block. Kept memory is
+released to the OS when a new request would bring the pooled memory in
+use plus kept over n, or when the limit is lowered. The pool is shared
+by all threads. addPoolLimit(d) adds d (which may be negative) to the
+limit, for callers that want some pooling only while they run.
+poolStats() reports bytes in use and kept and the number of requests
+that were and were not met from the pool.
+
+  int old=libzpaq::setHugePages(mode, min);
+
+backs new Arrays of min bytes or more (4 MB by default) with huge pages,
+which cuts the TLB misses of the random table lookups of context models.
+mode 1 maps them with madvise(MADV_HUGEPAGE) (transparent huge pages,
+Linux). mode 2 first tries explicit huge pages (MAP_HUGETLB on Linux,
+which need pages reserved in /proc/sys/vm/nr_hugepages, or MEM_LARGE_PAGES
+on Windows, which needs the "Lock pages in memory" right), then falls back
+to mode 1. If neither is available the Array is allocated as usual.
+mode 0 (the default) turns this off. poolStats() reports the bytes
+obtained each way and how many allocations fell back to normal pages.
+Whether the kernel actually uses huge pages for advised memory is shown
+by AnonHugePages in /proc/self/smaps.
+
+
+PRIMED MODELS
+
+Short records compressed one at a time each start with an empty model,
+so they compress poorly. A PrimedModel runs a dictionary (a sample of
+typical records) through a context model once and keeps the result.
+A PrimedCoder then codes each record starting from a copy of that
+state, as if the record were a segment following the dictionary in
+the same block:
+
+  libzpaq::PrimedModel model("4", dict, dict_size);
+  libzpaq::PrimedCoder coder(model);
+  coder.compress(&record, &out);      // one record
+  coder.decompress(&in, &record2);    // one record back
+
+The method is a level ("0".."9", where levels up to 4 use the fast
+context model of level 4) or an "x" method with no preprocessing, and
+is expanded for the dictionary. A compressed record is the 4 byte
+model id() (a hash of the model and dictionary) followed by the
+arithmetic coded bytes, and can only be decompressed with a model
+built from the same method and dictionary. It is not a ZPAQ block.
+Copying the state costs one pass over the model tables, so small
+models suit small records best. A PrimedModel can be shared by the
+PrimedCoders of several threads. A PrimedCoder is used by one thread
+at a time and keeps its tables and JIT code between records.
+
+
 DECOMPRESSER
 
 decompress() will decompress any valid ZPAQ stream, which may contain
@@ -420,7 +506,9 @@ size() returns the number of bytes read as a double, and usize() as a
 64 bit integer. result() returns a pointer to the 20 byte hash and
 resets the size to 0. The hash (not just the pointer) should be copied
 before the next call to result() if you want to save it. You can also
-call sha1.write(buffer, n) to hash n bytes of char* buffer.
+call sha1.write(buffer, n) to hash n bytes of char* buffer. write() hashes
+whole 64 byte blocks directly from buffer, so it is faster than calling
+put() for each byte.
 
 
 COMPRESSOR
@@ -471,6 +559,16 @@ read to EOF and return false.
 endSegment() writes a provided SHA-1 cryptographic hash checksum of the
 input segment before any preprocessing. It may be omitted.
 
+setEstimate(true) makes the Compressor only estimate the size of the
+modeled data. The model predicts and learns from each bit as usual,
+but instead of arithmetic coding it, the ideal code length -log2(p) is
+added up from a table. Nothing is written for modeled segments; their
+estimated size in bytes, usually within a few bytes of the coded size,
+accumulates in estimatedBytes() instead. Headers and
+unmodeled (stored or LZ77 only) data are written as usual, so the
+estimated size of a block is the bytes written plus estimatedBytes().
+setEstimate() also resets estimatedBytes() to 0.
+
 
 ZPAQL
 
@@ -718,7 +816,7 @@ If there are input errors, then error() will report the error. If the
 string contains newlines, it will report the line number of the error.
 
 ZPAQL is compiled internally into a byte code, and then to native x86
-32 or 64 bit code (unless compiled with -DNOJIT, in which case the
+32 or 64 bit or AArch64 code (unless compiled with -DNOJIT, in which case the
 byte code is interpreted). You can also specify the algorithm directly
 in byte code, although this is less convenient because it requires two
 steps:
@@ -777,8 +875,8 @@ compiled with -DDEBUG, then bounds are checked at run time.
 
 ENCRYPTION
 
-There is a class libzpaq::SHA256 with put(), result(), size(), and usize()
-as in SHA1. result() returns a 32 byte SHA-256 hash. It is used by scrypt.
+There is a class libzpaq::SHA256 with put(), write(), result(), size(),
+and usize() as in SHA1. result() returns a 32 byte SHA-256 hash. It is used by scrypt.
 
 The libzpaq::AES_CTR class allows encryption in CTR mode with 128, 192,
 or 256 bit keys. The public members are:
@@ -815,6 +913,13 @@ Generate a 32 byte key out[0..31] from key[0..31] and salt[0..31]
 using scrypt(key, salt, N=16384, r=8, p=1). key[0..31] should be
 the SHA-256 hash of the password. With these parameters, the function
 uses 0.1 to 0.3 seconds and 16 MiB memory.
+
+libzpaq::stretchKeys(char* out, const char* in, const char* salt,
+                     int n, int threads);
+
+Stretches n keys in[32*i..32*i+31] with salt[32*i..32*i+31] to
+out[32*i..32*i+31] like stretchKey(), using up to threads threads
+(each using 16 MiB), for example to open many encrypted archives.
 Scrypt is defined in http://www.tarsnap.com/scrypt/scrypt.pdf
 
 void random(char* buf, int n);
@@ -866,6 +971,7 @@ class Reader {
 public:
   virtual int get() = 0;  // should return 0..255, or -1 at EOF
   virtual int read(char* buf, int n); // read to buf[n], return no. read
+  virtual int view(const char**, int) {return -1;}  // in-place read
   virtual ~Reader() {}
 };
 
@@ -879,6 +985,25 @@ public:
 // Read 16 bit little-endian number
 int toU16(const char* p);
 
+// Memory pool for Array and StringBuffer. See MEMORY POOL above.
+void* poolAlloc(size_t n, bool zero);  // like calloc(n, 1) or malloc(n)
+void poolFree(void* p, size_t n);      // n as passed to poolAlloc()
+void* poolRealloc(void* p, size_t n, size_t m);  // like realloc(p, m)
+size_t setPoolLimit(size_t n);         // bytes to keep, returns old limit
+void addPoolLimit(int64_t d);          // add d to the limit
+int setHugePages(int mode, size_t min=size_t(4)<<20);  // returns old mode
+struct PoolStats {
+  size_t used;    // bytes of 64 KB or larger allocations in use
+  size_t kept;    // bytes freed and kept for reuse
+  size_t limit;   // used+kept is held at or below this by the pool
+  int64_t hits;   // allocations met from the pool
+  int64_t misses; // allocations of 64 KB or more not met, while pooling
+  size_t huge;    // bytes in use or kept on explicit huge pages
+  size_t advised; // bytes in use or kept advised as transparent huge pages
+  int64_t hugeFallbacks;  // Arrays that asked for huge pages but got none
+};
+PoolStats poolStats();
+
 // An Array of T is cleared and aligned on a 64 byte address
 //   with no constructors called. No copy or assignment.
 // Array<T> a(n, ex=0);  - creates n<<ex elements of type T
@@ -911,10 +1036,18 @@ void Array<T>::resize(size_t sz, int ex) {
     if (sz>sz*2) error("Array too big");
     sz*=2, --ex;
   }
+
+  // Same size: zero in place and keep the memory. Larger arrays are
+  // reallocated, as calloc() gets them from mmap() already zeroed,
+  // or taken from the pool (see setPoolLimit()) if that is enabled.
+  if (sz==n && n>0 && n<=(size_t(32)<<20)/sizeof(T)) {
+    memset(data, 0, n*sizeof(T));
+    return;
+  }
   if (n>0) {
     assert(offset>0 && offset<=64);
     assert((char*)data-offset);
-    ::free((char*)data-offset);
+    poolFree((char*)data-offset, 128+n*sizeof(T));
   }
   n=0;
   offset=0;
@@ -922,7 +1055,7 @@ void Array<T>::resize(size_t sz, int ex) {
   n=sz;
   const size_t nb=128+n*sizeof(T);  // test for overflow
   if (nb<=128 || (nb-128)/sizeof(T)!=n) n=0, error("Array too big");
-  data=(T*)::calloc(nb, 1);
+  data=(T*)poolAlloc(nb, true);
   if (!data) n=0, error("Out of memory");
   offset=64-(((char*)data-(char*)0)&63);
   assert(offset>0 && offset<=64);
@@ -966,6 +1099,7 @@ public:
     if (!(len0+=8)) ++len1;
     if ((len0&511)==0) process();
   }
+  void write(const char* buf, int64_t n); // hash buf[0..n-1]
   double size() const {return len0/8+len1*536870912.0;} // size in bytes
   uint64_t usize() const {return len0/8+(U64(len1)<<29);} //size in bytes
   const char* result();  // get hash and reset
@@ -987,6 +1121,7 @@ private:
 class AES_CTR {
   U32 Te0[256], Te1[256], Te2[256], Te3[256], Te4[256]; // encryption tables
   U32 ek[60];  // round key
+  U8 ekb[240];  // ek as big-endian bytes for AES instructions
   int Nr;  // number of rounds (10, 12, 14 for AES 128, 192, 256)
   U32 iv0, iv1;  // first 8 bytes in CTR mode
 public:
@@ -1000,15 +1135,21 @@ public:
 
 // Strengthen password pw[0..pwlen-1] and salt[0..saltlen-1]
 // to produce key buf[0..buflen-1]. Uses O(n*r*p) time and 128*r*n bytes
-// of memory. n must be a power of 2 and r <= 8.
+// of memory. n must be a power of 2 and r <= 8. Mixes the p blocks
+// on up to threads threads.
 void scrypt(const char* pw, int pwlen,
             const char* salt, int saltlen,
-            int n, int r, int p, char* buf, int buflen);
+            int n, int r, int p, char* buf, int buflen, int threads=1);
 
 // Generate a strong key out[0..31] key[0..31] and salt[0..31].
 // Calls scrypt(key, 32, salt, 32, 16384, 8, 1, out, 32);
 void stretchKey(char* out, const char* key, const char* salt);
 
+// Generate n keys out[32*i..32*i+31] from key[32*i..] and salt[32*i..]
+// as stretchKey(), using up to threads threads.
+void stretchKeys(char* out, const char* key, const char* salt, int n,
+                 int threads);
+
 //////////////////////////// random //////////////////////////
 
 // Fill buf[0..n-1] with n cryptographic random bytes. The first
@@ -1021,6 +1162,7 @@ void random(char* buf, int n);
 typedef enum {NONE,CONS,CM,ICM,MATCH,AVG,MIX2,MIX,ISSE,SSE} CompType;
 extern const int compsize[256];
 class Decoder;  // forward
+struct JITCode; // assembled code shared between instances
 
 // A ZPAQL machine COMP+HCOMP or PCOMP.
 class ZPAQL {
@@ -1039,6 +1181,7 @@ public:
   Writer* output;         // Destination for OUT instruction, or 0 to suppress
   SHA1* sha1;             // Points to checksum computer
   U32 H(int i) {return h(i);}  // get element of h
+  void copyState(ZPAQL& from);  // copy H, M and registers of same program
 
   void flush();           // write outbuf[0..bufptr-1] to output and sha1
   void outc(int ch) {     // output byte ch (0..255) or -1 at EOS
@@ -1062,9 +1205,12 @@ private:
   int pc;             // program counter
   int rcode_size;     // length of rcode
   U8* rcode;          // JIT code for run()
+  JITCode* rjit;      // rcode if shared through the JIT cache, else 0
+  std::string rkey;   // program and layout that rcode is assembled for
 
   // Support code
   int assemble();  // put JIT code in rcode
+  void freex();    // free or release rcode
   void init(int hbits, int mbits);  // initialize H and M sizes
   int execute();  // interpret 1 instruction, return 0 after HALT, else 1
   void run0(U32 input);  // default run() if not JIT
@@ -1126,6 +1272,7 @@ public:
     assert(z.header.isize()>6);
     return z.header[6]!=0;
   }
+  void copyFrom(Predictor& from);  // take the model and state of from
 private:
 
   // Predictor state
@@ -1147,6 +1294,8 @@ private:
   StateTable st;        // next, cminit functions
   U8* pcode;            // JIT code for predict() and update()
   int pcode_size;       // length of pcode
+  JITCode* pjit;        // pcode if shared through the JIT cache, else 0
+  std::string pkey;     // COMP section that pcode is assembled for
 
   // reduce prediction error in cr.cm
   void train(Component& cr, int y) {
@@ -1190,6 +1339,7 @@ private:
 
   // Put JIT code in pcode
   int assemble_p();
+  void freex();  // free or release pcode
 };
 
 //////////////////////////// Decoder /////////////////////////
@@ -1202,23 +1352,22 @@ public:
   int decompress();  // return a byte or EOF
   int skip();        // skip to the end of the segment, return next byte
   void init();       // initialize at start of block
+  void prime(Predictor& from);  // start a segment with a copy of from
   int stat(int x) {return pr.stat(x);}
   int get() {        // return 1 byte of buffered input or EOF
-    if (rpos==wpos) {
-      rpos=0;
-      wpos=in ? in->read(&buf[0], BUFSIZE) : 0;
-      assert(wpos<=BUFSIZE);
-    }
-    return rpos<wpos ? U8(buf[rpos++]) : -1;
+    if (rpos==wpos) fill();
+    return rpos<wpos ? U8(bp[rpos++]) : -1;
   }
   int buffered() {return wpos-rpos;}  // how far read ahead?
 private:
   U32 low, high;     // range
   U32 curr;          // last 4 bytes of archive or remaining bytes in subblock
-  U32 rpos, wpos;    // read, write position in buf
+  U32 rpos, wpos;    // read, write position in bp
   Predictor pr;      // to get p
   enum {BUFSIZE=1<<16};
   Array<char> buf;   // input buffer of size BUFSIZE bytes
+  const char* bp;    // buf, or input viewed in place by in->view()
+  void fill();       // refill bp
   int decode(int p); // return decoded bit (0..1) with prob. p (0..65535)
 };
 
@@ -1228,9 +1377,13 @@ class PostProcessor {
   int state;   // input parse state: 0=INIT, 1=PASS, 2..4=loading, 5=POST
   int hsize;   // header size
   int ph, pm;  // sizes of H and M in z
+  int ibwt;    // PCOMP run natively: 1=IBWT, 2=IBWT+E8E9, <0 done, 0=no
+  std::string ibuf;  // input of a native IBWT
+  void runIBWT();    // at EOS of ibuf
+  void replay();     // run ibuf through z without output
 public:
   ZPAQL z;     // holds PCOMP
-  PostProcessor(): state(0), hsize(0), ph(0), pm(0) {}
+  PostProcessor(): state(0), hsize(0), ph(0), pm(0), ibwt(0) {}
   void init(int h, int m);  // ph, pm sizes of H and M
   int write(int c);  // Input a byte, return state
   int getState() const {return state;}
@@ -1274,17 +1427,24 @@ void decompress(Reader* in, Writer* out);
 class Encoder {
 public:
   Encoder(ZPAQL& z, int size=0):
-    out(0), low(1), high(0xFFFFFFFF), pr(z) {}
+    out(0), low(1), high(0xFFFFFFFF), pr(z), bits(0), estimate(false),
+    ebits(0), ebytes(0) {}
   void init();
+  void prime(Predictor& from);  // start a segment with a copy of from
   void compress(int c);  // c is 0..255 or EOF
   int stat(int x) {return pr.stat(x);}
   double bitCount() const {return bits;}
+  void setEstimate(bool e) {estimate=e, ebits=0, ebytes=0;}
+  U64 estimatedBytes() const {return ebytes;}
   Writer* out;  // destination
 private:
   U32 low, high; // range
   Predictor pr;  // to get p
   Array<char> buf; // unmodeled input
   double bits; // cumulative ideal code length in bits
+  bool estimate;  // model only, don't code
+  double ebits;   // estimated code length of this segment in bits
+  U64 ebytes;     // estimated bytes of ended segments not written to out
   void encode(int y, int p); // encode bit y (0..1) with prob. p (0..65535)
 };
 
@@ -1361,6 +1521,8 @@ public:
   char* endSegmentChecksum(int64_t* size = 0, bool dosha1=true);
   int64_t getSize() {return sha1.usize();}
   double getEncodedBits() const {return enc.bitCount();}
+  void setEstimate(bool e) {enc.setEstimate(e);}  // size only, see below
+  U64 estimatedBytes() const {return enc.estimatedBytes();}
   const char* getChecksum() {return sha1.result();}
   void endBlock();
   int stat(int x) {return enc.stat(x);}
@@ -1374,6 +1536,35 @@ private:
   bool verify;  // if true then test by postprocessing
 };
 
+/////////////////////////// PrimedModel //////////////////////
+
+// A context model that has seen a dictionary (see PRIMED MODELS)
+class PrimedModel {
+public:
+  PrimedModel(const char* method, const char* dict, size_t n);
+  U32 id() const {return mid;}  // identifies method and dictionary
+  const std::string& method() const {return expanded;}
+  friend class PrimedCoder;
+private:
+  ZPAQL z;
+  Predictor pr;
+  U32 mid;
+  std::string expanded;  // "x" method
+};
+
+// Compresses and decompresses records starting from a PrimedModel
+class PrimedCoder {
+public:
+  PrimedCoder(PrimedModel& m): model(m), enc(ze), dec(zd) {}
+  void compress(Reader* in, Writer* out);    // in to EOF as 1 record
+  void decompress(Reader* in, Writer* out);  // 1 record
+private:
+  PrimedModel& model;
+  ZPAQL ze, zd;  // hash machines of enc and dec
+  Encoder enc;
+  Decoder dec;
+};
+
 /////////////////////////// StringBuffer /////////////////////
 
 // For (de)compressing to/from a string. Writing appends bytes
@@ -1391,7 +1582,8 @@ class StringBuffer: public libzpaq::Reader, public libzpaq::Writer {
     assert(!al==!p);
     if (a<=al) return;
     unsigned char* q=0;
-    if (a>0) q=(unsigned char*)(p ? realloc(p, a) : malloc(a));
+    if (a>0 && p) q=(unsigned char*)poolRealloc(p, al, a);
+    else if (a>0) q=(unsigned char*)poolAlloc(a, false);
     if (a>0 && !q) error("Out of memory");
     p=q;
     al=a;
@@ -1424,7 +1616,7 @@ public:
   void setLimit(size_t n) {limit=n;}
 
   // Free memory
-  ~StringBuffer() {if (p) free(p);}
+  ~StringBuffer() {if (p) poolFree(p, al);}
 
   // Return number of bytes written.
   size_t size() const {return wpos;}
@@ -1434,7 +1626,7 @@ public:
 
   // Reset size to 0 and free memory.
   void reset() {
-    if (p) free(p);
+    if (p) poolFree(p, al);
     p=0;
     al=rpos=wpos=0;
   }
@@ -1509,8 +1701,19 @@ void compress(Reader* in, Writer* out, const char* method,
 std::string makeConfig(const char* method, int args[]);
 
 // Same as compress() but output is 1 block, ignoring block size parameter.
+// If co is not 0 then use it instead of a new Compressor, so that its
+// tables and JIT code are reused when the model is the same as last time.
+// The suffix array of an LZ77 or BWT method is built on up to threads
+// threads. The output does not depend on threads. If methodOut is not 0
+// it receives the method used: for an "a" method, the level method
+// chosen for in, else method.
 void compressBlock(StringBuffer* in, Writer* out, const char* method,
-     const char* filename=0, const char* comment=0, bool dosha1=true);
+     const char* filename=0, const char* comment=0, bool dosha1=true,
+     Compressor* co=0, int threads=1, std::string* methodOut=0);
+
+// Return the level method "LN1,N2,N3" that compressBlock() uses for in
+// with method "aN1...". Trials run on up to threads threads.
+std::string autoMethod(StringBuffer* in, const char* method, int threads=1);
 
 }  // namespace libzpaq
 
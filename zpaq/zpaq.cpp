@@ -45,8 +45,7 @@ Possible options:
   -DPTHREAD  Use Pthreads instead of Windows threads. Requires pthreadGC2.dll
              or pthreadVC2.dll from http://sourceware.org/pthreads-win32/
   -Dunixtest To make -Dunix work in Windows with MinGW.
-  -fopenmp   Parallel divsufsort (faster, implies -pthread, broken in MinGW).
-  -pthread   Required in Linux, implied by -fopenmp.
+  -pthread   Required in Linux.
   -O3 or /O2 Optimize (faster).
   -o         Name of output executable.
   /EHsc      Enable exception handing in VC++ (required).
@@ -58,7 +57,9 @@ Possible options:
 #define UNICODE  // For Windows
 #endif
 #include "libzpaq.h"
+#include "jidac.h"
 #include <stdio.h>
+#include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
@@ -69,6 +70,12 @@ Possible options:
 #include <map>
 #include <algorithm>
 #include <stdexcept>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <atomic>
+#include <chrono>
 #include <fcntl.h>
 
 #ifndef DEBUG
@@ -91,6 +98,7 @@ Possible options:
 #include <dirent.h>
 #include <utime.h>
 #include <errno.h>
+#include <sys/mman.h>
 #ifdef BSD
 #include <sys/sysctl.h>
 #endif
@@ -126,6 +134,132 @@ void libzpaq::error(const char* msg) {
 }
 using libzpaq::error;
 
+// Counters of a command whose statistics are requested, one for each
+// field of zpaq_jidac_stats. STAT(f) is the index of field f.
+#define STAT(f) (offsetof(zpaq_jidac_stats, f)/sizeof(int64_t))
+struct CmdStats {
+  enum {N=sizeof(zpaq_jidac_stats)/sizeof(int64_t)};
+  std::atomic<int64_t> v[N];
+  CmdStats() {for (int i=0; i<N; ++i) v[i]=0;}
+  void get(zpaq_jidac_stats& s) const {
+    int64_t a[N];
+    for (int i=0; i<N; ++i) a[i]=v[i].load(std::memory_order_relaxed);
+    memcpy(&s, a, sizeof(s));
+  }
+};
+
+// A running command: where its console output goes and when it started.
+// Threads started with run() inherit the Cmd of the thread that starts
+// them. Output is written with zprintf(), zfprintf(stderr, ...) and
+// zflush() in place of printf(), fprintf() and fflush(stdout).
+struct Cmd {
+  const zpaq_console* con;  // sinks, or NULL for stdout and stderr
+  int64_t start;            // mtime() at start
+  std::mutex mu;            // one sink or progress call at a time
+  const zpaq_jidac_monitor* mon;  // where statistics go, or NULL
+  CmdStats* stats;          // counters, or NULL if not counting
+  const std::atomic<int>* cancel;  // stop if nonzero, or NULL
+  Cmd(const zpaq_console* c, int64_t t, const zpaq_jidac_monitor* m,
+      CmdStats* st, const std::atomic<int>* cn):
+      con(c), start(t), mon(m), stats(st), cancel(cn) {}
+};
+thread_local Cmd* cmd=0;
+
+// Has the running command been cancelled?
+inline bool cancelled() {
+  return cmd && cmd->cancel && cmd->cancel->load(std::memory_order_relaxed);
+}
+
+// Stop the running command with an error if it has been cancelled
+inline void checkCancel() {
+  if (cancelled()) error("cancelled");
+}
+
+// Add n to counter i=STAT(field) of the running command
+inline void addstat(size_t i, int64_t n) {
+  if (cmd && cmd->stats) cmd->stats->v[i].fetch_add(n, std::memory_order_relaxed);
+}
+
+// Steady clock in ns, or 0 if the running command does not count
+inline int64_t stattime() {
+  if (!cmd || !cmd->stats) return 0;
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Adds the time from construction to stop() or destruction to counter i
+class StatTimer {
+  size_t i;
+  int64_t t0;
+public:
+  explicit StatTimer(size_t f): i(f), t0(stattime()) {}
+  ~StatTimer() {stop();}
+  void stop() {
+    if (t0) addstat(i, stattime()-t0), t0=0;
+  }
+};
+
+// Thrown in place of exit(code) to end a command
+struct ExitCommand {
+  int code;
+};
+
+// Return the sink for f (stdout or stderr) or NULL to write to f
+zpaq_text_fn sinkof(FILE* f) {
+  if (!cmd || !cmd->con) return 0;
+  return f==stderr ? cmd->con->err : cmd->con->out;
+}
+
+// Write s[0..n-1] to f or its sink
+void zwrite(FILE* f, const char* s, size_t n) {
+  zpaq_text_fn sink=sinkof(f);
+  if (!sink) {
+    fwrite(s, 1, n, f);
+    return;
+  }
+  std::lock_guard<std::mutex> lock(cmd->mu);
+  sink(cmd->con->ctx, s, n);
+}
+
+int zvfprintf(FILE* f, const char* fmt, va_list ap) {
+  if (!sinkof(f)) return vfprintf(f, fmt, ap);
+  char buf[1024];
+  va_list ap2;
+  va_copy(ap2, ap);
+  int n=vsnprintf(buf, sizeof(buf), fmt, ap);
+  if (n>=int(sizeof(buf))) {
+    string s(n+1, 0);
+    n=vsnprintf(&s[0], n+1, fmt, ap2);
+    if (n>0) zwrite(f, s.c_str(), n);
+  }
+  else if (n>0) zwrite(f, buf, n);
+  va_end(ap2);
+  return n;
+}
+
+// Like fprintf() with f = stdout or stderr
+int zfprintf(FILE* f, const char* fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  const int n=zvfprintf(f, fmt, ap);
+  va_end(ap);
+  return n;
+}
+
+// Like printf()
+int zprintf(const char* fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  const int n=zvfprintf(stdout, fmt, ap);
+  va_end(ap);
+  return n;
+}
+
+// Like fflush(stdout)
+void zflush() {
+  if (!sinkof(stdout)) fflush(stdout);
+}
+
 // Portable thread types and functions for Windows and Linux. Use like this:
 //
 // // Create mutex for locking thread-unsafe code
@@ -153,8 +287,21 @@ using libzpaq::error;
 #include <pthread.h>
 typedef void* ThreadReturn;                                // job return type
 typedef pthread_t ThreadID;                                // job ID type
-void run(ThreadID& tid, ThreadReturn(*f)(void*), void* arg)// start job
-  {pthread_create(&tid, NULL, f, arg);}
+struct RunArg {ThreadReturn(*f)(void*); void* arg; Cmd* cmd;};
+ThreadReturn runThread(void* p) {                          // set cmd, run f
+  RunArg a=*(RunArg*)p;
+  delete (RunArg*)p;
+  cmd=a.cmd;
+  return a.f(a.arg);
+}
+void run(ThreadID& tid, ThreadReturn(*f)(void*), void* arg) { // start job
+  RunArg* a=new RunArg;
+  a->f=f, a->arg=arg, a->cmd=cmd;
+  if (pthread_create(&tid, NULL, runThread, a)) {
+    delete a;
+    error("pthread_create failed");
+  }
+}
 void join(ThreadID tid) {pthread_join(tid, NULL);}         // wait for job
 typedef pthread_mutex_t Mutex;                             // mutex type
 void init_mutex(Mutex& m) {pthread_mutex_init(&m, 0);}     // init mutex
@@ -203,9 +350,21 @@ private:
 #else  // Windows
 typedef DWORD ThreadReturn;
 typedef HANDLE ThreadID;
+struct RunArg {ThreadReturn(*f)(void*); void* arg; Cmd* cmd;};
+DWORD WINAPI runThread(LPVOID p) {  // set cmd, run f
+  RunArg a=*(RunArg*)p;
+  delete (RunArg*)p;
+  cmd=a.cmd;
+  return a.f(a.arg);
+}
 void run(ThreadID& tid, ThreadReturn(*f)(void*), void* arg) {
-  tid=CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE)f, arg, 0, NULL);
-  if (tid==NULL) error("CreateThread failed");
+  RunArg* a=new RunArg;
+  a->f=f, a->arg=arg, a->cmd=cmd;
+  tid=CreateThread(NULL, 0, runThread, a, 0, NULL);
+  if (tid==NULL) {
+    delete a;
+    error("CreateThread failed");
+  }
 }
 void join(ThreadID& tid) {WaitForSingleObject(tid, INFINITE);}
 typedef HANDLE Mutex;
@@ -272,6 +431,10 @@ std::wstring utow(const char* ss, char slash='\\') {
 void printUTF8(const char* s, FILE* f=stdout) {
   assert(f);
   assert(s);
+  if (sinkof(f)) {
+    zwrite(f, s, strlen(s));
+    return;
+  }
 #ifdef unix
   fprintf(f, "%s", s);
 #else
@@ -467,36 +630,73 @@ bool delete_file(const char* filename) {
 #endif
 }
 
+// Write n bytes of buf at offset off of fp without moving the file
+// pointer, so that threads may write one file at once. Return true if OK.
+bool writeat(FP fp, const char* buf, size_t n, int64_t off) {
+#ifdef unix
+  const int fd=fileno(fp);
+  while (n>0) {
+    const ssize_t r=pwrite(fd, buf, n, off);
+    if (r<0 && errno==EINTR) continue;
+    if (r<=0) return false;
+    buf+=r;
+    n-=r;
+    off+=r;
+  }
+  return true;
+#else
+  OVERLAPPED ov;
+  memset(&ov, 0, sizeof(ov));
+  ov.Offset=DWORD(off);
+  ov.OffsetHigh=DWORD(uint64_t(off)>>32);
+  DWORD r=0;
+  return WriteFile(fp, buf, n, &r, &ov) && r==n;
+#endif
+}
+
+// Set the length of fp to size. Return true if OK.
+bool setsize(FP fp, int64_t size) {
+#ifdef unix
+  return ftruncate(fileno(fp), size)==0;
+#else
+  LARGE_INTEGER li;
+  li.QuadPart=size;
+  return SetFilePointerEx(fp, li, NULL, FILE_BEGIN) && SetEndOfFile(fp);
+#endif
+}
+
 #ifdef unix
 
 // Print last error message
 void printerr(const char* filename) {
-  perror(filename);
+  const int err=errno;
+  zflush();
+  zfprintf(stderr, "%s: %s\n", filename, strerror(err));
 }
 
 #else
 
 // Print last error message
 void printerr(const char* filename) {
-  fflush(stdout);
+  zflush();
   int err=GetLastError();
   printUTF8(filename, stderr);
   if (err==ERROR_FILE_NOT_FOUND)
-    fprintf(stderr, ": file not found\n");
+    zfprintf(stderr, ": file not found\n");
   else if (err==ERROR_PATH_NOT_FOUND)
-    fprintf(stderr, ": path not found\n");
+    zfprintf(stderr, ": path not found\n");
   else if (err==ERROR_ACCESS_DENIED)
-    fprintf(stderr, ": access denied\n");
+    zfprintf(stderr, ": access denied\n");
   else if (err==ERROR_SHARING_VIOLATION)
-    fprintf(stderr, ": sharing violation\n");
+    zfprintf(stderr, ": sharing violation\n");
   else if (err==ERROR_BAD_PATHNAME)
-    fprintf(stderr, ": bad pathname\n");
+    zfprintf(stderr, ": bad pathname\n");
   else if (err==ERROR_INVALID_NAME)
-    fprintf(stderr, ": invalid name\n");
+    zfprintf(stderr, ": invalid name\n");
   else if (err==ERROR_NETNAME_DELETED)
-    fprintf(stderr, ": network name no longer available\n");
+    zfprintf(stderr, ": network name no longer available\n");
   else
-    fprintf(stderr, ": Windows error %d\n", err);
+    zfprintf(stderr, ": Windows error %d\n", err);
 }
 
 #endif
@@ -627,15 +827,19 @@ public:
   bool isopen() {return fp!=FPNULL;}
 };
 
-// An InputArchive supports encrypted reading
+// An InputArchive supports encrypted reading. An unencrypted single
+// part archive is memory mapped where possible and read in place.
 class InputArchive: public ArchiveBase, public libzpaq::Reader {
   vector<int64_t> sz;  // part sizes
   int64_t off;  // current offset
   string fn;  // filename, possibly multi-part with wildcards
+  const char* map;  // mapped archive or NULL
+  int64_t mapsize;  // size of map
 public:
 
   // Open filename. If password then decrypt input.
   InputArchive(const char* filename, const char* password=0);
+  ~InputArchive();
 
   // Read and return 1 byte or -1 (EOF)
   int get() {
@@ -646,6 +850,12 @@ public:
   // Read up to len bytes into obuf at current offset. Return 0..len bytes
   // actually read. 0 indicates EOF.
   int read(char* obuf, int len) {
+    if (map) {
+      const char* p=0;
+      const int nr=view(&p, len);
+      memcpy(obuf, p, nr);
+      return nr;
+    }
     int nr=fread(obuf, 1, len, fp);
     if (nr==0) {
       seek(0, SEEK_CUR);
@@ -657,6 +867,20 @@ public:
     return nr;
   }
 
+  // Point *p at up to len mapped bytes at the current offset without
+  // copying. Return -1 if not mapped.
+  int view(const char** p, int len) {
+    if (!map) return -1;
+    int64_t nr=off<mapsize ? mapsize-off : 0;
+    if (nr>len) nr=len;
+    *p=map+off;
+    off+=nr;
+    return int(nr);
+  }
+
+  // Hint that bytes p..p+n-1 will be read soon, in order.
+  void willneed(int64_t p, int64_t n);
+
   // Like fseeko()
   void seek(int64_t p, int whence);
 
@@ -666,6 +890,22 @@ public:
   }
 };
 
+InputArchive::~InputArchive() {
+#ifdef unix
+  if (map) munmap((void*)map, mapsize);
+#endif
+}
+
+void InputArchive::willneed(int64_t p, int64_t n) {
+#ifdef unix
+  if (!map || p<0 || p>=mapsize || n<=0) return;
+  const int64_t page=sysconf(_SC_PAGESIZE);
+  const int64_t start=p-p%page;
+  if (n>mapsize-p) n=mapsize-p;
+  posix_madvise((void*)(map+start), p+n-start, POSIX_MADV_WILLNEED);
+#endif
+}
+
 // Like fseeko. If p is out of range then close file.
 void InputArchive::seek(int64_t p, int whence) {
   if (!isopen()) return;
@@ -679,6 +919,7 @@ void InputArchive::seek(int64_t p, int whence) {
   }
 
   // Optimization for single file to avoid close and reopen
+  if (map) return;
   if (sz.size()==1) {
     fseeko(fp, off, SEEK_SET);
     return;
@@ -704,7 +945,7 @@ void InputArchive::seek(int64_t p, int whence) {
 // and read their concatenation.
 
 InputArchive::InputArchive(const char* filename, const char* password):
-    off(0), fn(filename) {
+    off(0), fn(filename), map(0), mapsize(0) {
   assert(filename);
 
   // Get file sizes
@@ -733,6 +974,18 @@ InputArchive::InputArchive(const char* filename, const char* password):
     aes=new libzpaq::AES_CTR(key, 32, salt);
     off=32;
   }
+
+  // Map the whole archive. Reading falls back to fread() if this fails.
+#ifdef unix
+  if (!aes && sz.size()==1 && sz[0]>0 && int64_t(size_t(sz[0]))==sz[0]) {
+    void* p=mmap(0, size_t(sz[0]), PROT_READ, MAP_SHARED, fileno(fp), 0);
+    if (p!=MAP_FAILED) {
+      map=(const char*)p;
+      mapsize=sz[0];
+      posix_madvise(p, size_t(mapsize), POSIX_MADV_SEQUENTIAL);
+    }
+  }
+#endif
 }
 
 // An Archive is a file supporting encryption
@@ -940,6 +1193,11 @@ int64_t btol(const char* &s) {
   return r+(uint64_t(btoi(s))<<32);
 }
 
+// Append n bytes of x to sb in LSB order
+inline void puti(libzpaq::StringBuffer& sb, uint64_t x, int n) {
+  for (; n>0; --n) sb.put(x&255), x>>=8;
+}
+
 /////////////////////////////// Jidac /////////////////////////////////
 
 // A Jidac object represents an archive contents: a list of file
@@ -961,16 +1219,397 @@ struct HT {
   }
 };
 
+// Memory that is handed out in pieces and freed all at once.
+// Pieces never move, so pointers to them stay valid.
+template <class T> class Arena {
+  vector<T*> blocks;  // allocated memory
+  T* top;             // next free element in the last block
+  size_t left;        // free elements at top
+  size_t total;       // elements allocated
+  enum {BLOCK=(1<<20)/sizeof(T)};  // elements per block
+  Arena(const Arena&);
+  Arena& operator=(const Arena&);
+public:
+  Arena(): top(0), left(0), total(0) {}
+  ~Arena() {clear();}
+  void clear() {
+    for (unsigned i=0; i<blocks.size(); ++i) delete[] blocks[i];
+    blocks.clear();
+    top=0;
+    left=0;
+    total=0;
+  }
+
+  // Exchange contents with x
+  void swap(Arena& x) {
+    blocks.swap(x.blocks);
+    std::swap(top, x.top);
+    std::swap(left, x.left);
+    std::swap(total, x.total);
+  }
+
+  // Return the number of elements allocated in all blocks
+  size_t size() const {return total;}
+
+  // Return n zeroed elements
+  T* alloc(size_t n) {
+    if (n>left) {
+      const size_t sz=n>size_t(BLOCK) ? n : size_t(BLOCK);
+      blocks.push_back(new T[sz]());
+      top=blocks.back();
+      left=sz;
+      total+=sz;
+    }
+    T* r=top;
+    top+=n;
+    left-=n;
+    return r;
+  }
+
+  // If p[0..n-1] is the last piece handed out and there is room,
+  // grow it by 1 and return true
+  bool extend(T* p, size_t n) {
+    if (p+n!=top || left==0) return false;
+    ++top;
+    --left;
+    return true;
+  }
+};
+
+// A filename in a DTMap, used like a const string. s[n] is 0.
+class Name {
+  const char* s;
+  unsigned n;
+public:
+  Name(): s(""), n(0) {}
+  Name(const char* p, unsigned len): s(p), n(len) {}
+  const char* c_str() const {return s;}
+  size_t size() const {return n;}
+  const char* begin() const {return s;}
+  const char* end() const {return s+n;}
+  char operator[](size_t i) const {return s[i];}
+  string substr(size_t i, size_t len) const {
+    assert(i<=n);
+    return string(s+i, len<n-i ? len : n-i);
+  }
+  operator string() const {return string(s, n);}
+};
+
+// Compare strings a[0..an-1] and b[0..bn-1] like string::compare()
+inline int namecmp(const char* a, size_t an, const char* b, size_t bn) {
+  const int r=memcmp(a, b, an<bn ? an : bn);
+  if (r) return r;
+  return an<bn ? -1 : an>bn;
+}
+inline bool operator<(const Name& a, const Name& b) {
+  return namecmp(a.c_str(), a.size(), b.c_str(), b.size())<0;
+}
+inline bool operator==(const Name& a, const Name& b) {
+  return a.size()==b.size() && !memcmp(a.c_str(), b.c_str(), a.size());
+}
+inline bool operator==(const Name& a, const string& b) {
+  return a.size()==b.size() && !memcmp(a.c_str(), b.c_str(), a.size());
+}
+inline bool operator==(const Name& a, const char* b) {
+  return a.size()==strlen(b) && !memcmp(a.c_str(), b, a.size());
+}
+inline bool operator!=(const Name& a, const Name& b) {return !(a==b);}
+inline bool operator!=(const Name& a, const string& b) {return !(a==b);}
+inline bool operator!=(const string& a, const Name& b) {return !(b==a);}
+inline bool operator!=(const Name& a, const char* b) {return !(a==b);}
+
+// A list of fragment IDs in a DTMap, used like a const vector<unsigned>.
+// The elements may be changed but not the size.
+class FragList {
+  unsigned* p;
+  unsigned n;
+  unsigned cap;  // elements allocated at p
+  friend class DTMap;
+public:
+  FragList(): p(0), n(0), cap(0) {}
+  size_t size() const {return n;}
+  unsigned operator[](size_t i) const {assert(i<n); return p[i];}
+  unsigned& operator[](size_t i) {assert(i<n); return p[i];}
+  const unsigned* begin() const {return p;}
+  const unsigned* end() const {return p+n;}
+};
+inline bool operator==(const FragList& a, const FragList& b) {
+  return a.size()==b.size()
+      && (a.size()==0 || !memcmp(a.begin(), b.begin(), a.size()*4));
+}
+inline bool operator!=(const FragList& a, const FragList& b) {
+  return !(a==b);
+}
+inline bool operator<(const FragList& a, const FragList& b) {
+  return std::lexicographical_compare(a.begin(), a.end(),
+                                      b.begin(), b.end());
+}
+
 // filename entry
 struct DT {
   int64_t date;          // decimal YYYYMMDDHHMMSS (UT) or 0 if deleted
   int64_t size;          // size or -1 if unknown
   int64_t attr;          // first 8 attribute bytes
   int64_t data;          // sort key or frags written. -1 = do not write
-  vector<unsigned> ptr;  // fragment list
+  FragList ptr;          // fragment list
   DT(): date(0), size(0), attr(0), data(0) {}
 };
-typedef map<string, DT> DTMap;
+
+// A DTMap is a table of files, filename -> DT, used like a
+// map<string, DT> that can only grow. Filenames and fragment lists
+// are packed in arenas, entries in blocks that don't move, and a hash
+// table of entry numbers finds names. Iterators visit the entries in
+// filename order, which is sorted when first needed after an insert.
+// A hash table rather than a search of the sorted order because
+// read_archive() looks up or inserts every file of every version in
+// archive order, and keeping a sorted vector sorted would move entries
+// on each insert. Fragment lists that are replaced or moved leave
+// garbage in their arena, which is compacted when it is over half.
+class DTMap {
+public:
+  struct value_type {
+    Name first;
+    DT second;
+  };
+  class iterator {
+    DTMap* m;
+    unsigned i;  // entry number or NONE at end
+    friend class DTMap;
+  public:
+    typedef std::bidirectional_iterator_tag iterator_category;
+    typedef DTMap::value_type value_type;
+    typedef ptrdiff_t difference_type;
+    typedef value_type* pointer;
+    typedef value_type& reference;
+    iterator(DTMap* mp=0, unsigned e=NONE): m(mp), i(e) {}
+    value_type& operator*() const {return m->entry(i);}
+    value_type* operator->() const {return &m->entry(i);}
+    iterator& operator++() {i=m->next(i, 1); return *this;}
+    iterator& operator--() {i=m->next(i, -1); return *this;}
+    iterator operator++(int) {iterator r=*this; ++*this; return r;}
+    iterator operator--(int) {iterator r=*this; --*this; return r;}
+    bool operator==(const iterator& x) const {return m==x.m && i==x.i;}
+    bool operator!=(const iterator& x) const {return !(*this==x);}
+  };
+  typedef iterator const_iterator;
+  typedef std::reverse_iterator<iterator> reverse_iterator;
+
+  DTMap(): count(0), nsorted(0), garbage(0) {}
+  DTMap(const DTMap& x): count(0), nsorted(0), garbage(0) {*this=x;}
+  DTMap& operator=(const DTMap& x);
+  ~DTMap() {clear();}
+  void clear();
+  size_t size() const {return count;}
+  iterator begin() {sort(); return iterator(this, count ? order[0] : NONE);}
+  iterator end() {return iterator(this);}
+  reverse_iterator rbegin() {return reverse_iterator(end());}
+  reverse_iterator rend() {return reverse_iterator(begin());}
+  iterator find(const string& s) {return iterator(this, lookup(s, false));}
+  DT& operator[](const string& s) {return entry(lookup(s, true)).second;}
+
+  // Return a list of n zero fragment IDs
+  FragList newlist(unsigned n) {
+    FragList f;
+    if (n) f.p=frags.alloc(n), f.n=f.cap=n;
+    return f;
+  }
+
+  // Replace the list f of an entry with n zero fragment IDs, in place
+  // if it has room. Other lists may move.
+  void assign(FragList& f, unsigned n) {
+    if (n>f.cap) {
+      garbage+=f.cap;
+      f=newlist(n);
+      collect();
+    }
+    else {
+      if (n) memset(f.p, 0, n*4);
+      f.n=n;
+    }
+  }
+
+  // Append x to the list f of an entry. When f is full, grow it in place
+  // if it is the last piece of the arena, else move it to a piece
+  // 1.5 times as big. Other lists may move.
+  void push(FragList& f, unsigned x) {
+    if (f.n==f.cap) {
+      if (f.n && frags.extend(f.p, f.n)) ++f.cap;
+      else {
+        const unsigned cap=f.n+f.n/2+1;
+        unsigned* p=frags.alloc(cap);
+        if (f.n) memcpy(p, f.p, f.n*4);
+        garbage+=f.cap;
+        f.p=p;
+        f.cap=cap;
+        f.p[f.n++]=x;
+        collect();
+        return;
+      }
+    }
+    f.p[f.n++]=x;
+  }
+
+  // Return the bytes allocated for fragment lists
+  size_t fragBytes() const {return frags.size()*sizeof(unsigned);}
+
+private:
+  enum {NONE=~0u, EBITS=12};  // end, log2 entries per block
+  vector<value_type*> blocks;  // entries in insertion order
+  unsigned count;              // number of entries
+  Arena<char> names;           // filenames, 0 terminated
+  Arena<unsigned> frags;       // fragment lists
+  vector<unsigned> hash;       // entry number or NONE, size 2^k
+  vector<unsigned> order;      // entry numbers in filename order
+  vector<unsigned> rank;       // entry number -> position in order
+  unsigned nsorted;            // entries in order
+  size_t garbage;              // elements of frags no longer in a list
+
+  value_type& entry(unsigned i) {
+    assert(i<count);
+    return blocks[i>>EBITS][i&((1u<<EBITS)-1)];
+  }
+  unsigned lookup(const string& s, bool insert);
+  unsigned next(unsigned i, int dir);
+  void sort();
+
+  // Compact frags if over half of it and at least 1 MB is garbage
+  void collect() {
+    if (garbage>=(1u<<18) && garbage*2>frags.size()) compact();
+  }
+  void compact();
+};
+
+// Replace contents with a copy of x
+DTMap& DTMap::operator=(const DTMap& x) {
+  if (&x==this) return *this;
+  clear();
+  DTMap& y=const_cast<DTMap&>(x);
+  for (unsigned i=0; i<y.count; ++i) {
+    const value_type& v=y.entry(i);
+    DT& d=(*this)[v.first];
+    d=v.second;
+    d.ptr=newlist(v.second.ptr.size());
+    for (unsigned j=0; j<d.ptr.size(); ++j) d.ptr[j]=v.second.ptr[j];
+  }
+  return *this;
+}
+
+void DTMap::clear() {
+  for (unsigned i=0; i<blocks.size(); ++i) delete[] blocks[i];
+  blocks.clear();
+  count=nsorted=0;
+  garbage=0;
+  names.clear();
+  frags.clear();
+  hash.clear();
+  order.clear();
+  rank.clear();
+}
+
+// Copy the fragment lists of all entries into a new arena without gaps
+void DTMap::compact() {
+  Arena<unsigned> a;
+  for (unsigned i=0; i<count; ++i) {
+    FragList& f=entry(i).second.ptr;
+    if (f.n) {
+      unsigned* p=a.alloc(f.n);
+      memcpy(p, f.p, f.n*4);
+      f.p=p;
+    }
+    else f.p=0;
+    f.cap=f.n;
+  }
+  frags.swap(a);
+  garbage=0;
+}
+
+size_t jidac_test_fraglist(unsigned n) {
+  DTMap m;
+  DT& d=m["file"];
+  DT& e=m["other"];
+  for (unsigned i=0; i<n; ++i) {
+    m.push(d.ptr, i+1);
+    if (i%1000==0) m.push(e.ptr, i);  // interleave another list
+  }
+  if (d.ptr.size()!=n) return 0;
+  for (unsigned i=0; i<n; ++i)
+    if (d.ptr[i]!=i+1) return 0;
+  return m.fragBytes();
+}
+
+// Return the entry number of filename s, or NONE if not found
+// unless insert, in which case add it with an empty DT.
+unsigned DTMap::lookup(const string& s, bool insert) {
+  unsigned h=2166136261u;  // FNV-1a hash of s
+  for (unsigned i=0; i<s.size(); ++i) h=(h^(s[i]&255))*16777619u;
+  if (hash.size()) {
+    for (unsigned i=h&(hash.size()-1);; i=(i+1)&(hash.size()-1)) {
+      const unsigned e=hash[i];
+      if (e==NONE) break;
+      if (entry(e).first==s) return e;
+    }
+  }
+  if (!insert) return NONE;
+  if (count>=NONE-1 || s.size()>=NONE) error("too many files");
+
+  // Add an entry
+  if ((count&((1u<<EBITS)-1))==0) blocks.push_back(new value_type[1u<<EBITS]);
+  char* p=names.alloc(s.size()+1);
+  memcpy(p, s.c_str(), s.size());
+  const unsigned e=count++;
+  entry(e).first=Name(p, s.size());
+
+  // Put it in the hash table, doubling it if half full
+  if (count*2>hash.size()) {
+    hash.assign(hash.size() ? hash.size()*2 : 1024, NONE);
+    for (unsigned i=0; i<count; ++i) {
+      const Name& n=entry(i).first;
+      unsigned g=2166136261u;
+      for (unsigned j=0; j<n.size(); ++j) g=(g^(n[j]&255))*16777619u;
+      unsigned k=g&(hash.size()-1);
+      while (hash[k]!=NONE) k=(k+1)&(hash.size()-1);
+      hash[k]=i;
+    }
+  }
+  else {
+    unsigned k=h&(hash.size()-1);
+    while (hash[k]!=NONE) k=(k+1)&(hash.size()-1);
+    hash[k]=e;
+  }
+  return e;
+}
+
+// Compare entry numbers by filename
+struct CompareEntry {
+  DTMap::value_type* const* blocks;
+  unsigned ebits;
+  const Name& name(unsigned i) const {
+    return blocks[i>>ebits][i&((1u<<ebits)-1)].first;
+  }
+  bool operator()(unsigned a, unsigned b) const {
+    return name(a)<name(b);
+  }
+};
+
+// Sort entries added since the last sort into order
+void DTMap::sort() {
+  if (nsorted==count) return;
+  CompareEntry c={&blocks[0], EBITS};
+  for (unsigned i=nsorted; i<count; ++i) order.push_back(i);
+  std::sort(order.begin()+nsorted, order.end(), c);
+  std::inplace_merge(order.begin(), order.begin()+nsorted, order.end(), c);
+  rank.resize(count);
+  for (unsigned i=0; i<count; ++i) rank[order[i]]=i;
+  nsorted=count;
+}
+
+// Return the entry after (dir=1) or before (dir=-1) entry i or NONE
+unsigned DTMap::next(unsigned i, int dir) {
+  sort();
+  if (i==NONE) return dir<0 && count ? order[count-1] : NONE;
+  const unsigned r=rank[i]+dir;
+  return r<count ? order[r] : NONE;
+}
 
 // list of blocks to extract
 struct Block {
@@ -1018,6 +1657,10 @@ public:
   friend ThreadReturn decompressThread(void* arg);
   friend ThreadReturn testThread(void* arg);
   friend struct ExtractJob;
+  friend int jidac_command(int argc, const char** argv,
+      const zpaq_console* con, zpaq_jidac_summary* summary, string* err,
+      const zpaq_jidac_monitor* mon);
+  friend size_t jidac_test_archive_fraglists(const char* arc);
 private:
 
   // Command line arguments
@@ -1035,6 +1678,9 @@ private:
   vector<string> notfiles;  // list of prefixes to exclude
   string nottype;           // -not =...
   vector<string> onlyfiles; // list of prefixes to include
+  int hugepages;            // -hugepages mode, or -1 to leave it
+  int pool;                 // -pool MB
+  int readahead;            // -readahead MB
   const char* repack;       // -repack output file
   char new_password_string[32]; // -repack hashed password
   const char* new_password; // points to new_password_string or NULL
@@ -1044,6 +1690,8 @@ private:
   vector<string> tofiles;   // -to option
   int64_t date;             // now as decimal YYYYMMDDHHMMSS (UT)
   int64_t version;          // version number or 14 digit date
+  bool cache;               // -cache option
+  bool estimate;            // -estimate option
 
   // Archive state
   int64_t dhsize;           // total size of D blocks according to H blocks
@@ -1053,6 +1701,10 @@ private:
   DTMap edt;                // set of external files to add or compare
   vector<Block> block;      // list of data blocks to extract
   vector<VER> ver;          // version info
+  zpaq_jidac_summary sum;   // results of the command
+  int64_t cache_end;        // archive offset arc.jdx is valid to, or -1
+  int64_t cache_size;       // bytes of records in arc.jdx
+  string jdx;               // records to append to arc.jdx
 
   // Commands
   int add();                // add, return 1 if error else 0
@@ -1063,6 +1715,17 @@ private:
   // Support functions
   string rename(string name);           // rename from -to
   int64_t read_archive(const char* arc, int *errors=0);  // read arc
+  bool read_jidac(char type, int64_t fdate, int64_t num, const char* s,
+                  size_t n, int64_t block_offset, int64_t& data_offset,
+                  unsigned& files);     // read a c, h or i block
+  bool cacheable(const char* arc);      // -cache applies to arc?
+  bool read_cache(const char* arc, InputArchive& in, int64_t& block_offset,
+                  int64_t& data_offset, unsigned& files);  // read arc.jdx
+  void put_cache(char type, int64_t fdate, int64_t num,
+                 int64_t block_offset, int64_t data_offset,
+                 const char* s, size_t n);  // add a block to jdx
+  void write_cache(const char* arc, InputArchive& in, int64_t end,
+                   int64_t last, int64_t data_offset);  // append jdx
   bool isselected(const char* filename, bool rn=false);// files, -only, -not
   void scandir(string filename);        // scan dirs to dt
   void addfile(string filename, int64_t edate, int64_t esize,
@@ -1074,7 +1737,7 @@ private:
 
 // Print help message
 void Jidac::usage() {
-  printf(
+  zprintf(
 "Usage: zpaq command archive[.zpaq] files... -options...\n"
 "Files... may be directory trees. Default is the whole archive.\n"
 "Use * or \?\?\?\? in archive name for multi-part or \"\" for empty.\n"
@@ -1084,17 +1747,24 @@ void Jidac::usage() {
 "   l  list        List or compare external files to archive by dates.\n"
 "Options:\n"
 "  -all [N]        Extract/list versions in N [4] digit directories.\n"
+"  -cache          Keep the archive index in archive.jdx to read faster.\n"
+"  -estimate       Add to archive \"\": estimate the compressed size.\n"
 "  -f -force       Add: append files if contents have changed.\n"
 "                  Extract: overwrite existing output files.\n"
 "                  List: compare file contents instead of dates.\n"
+"  -hugepages N    Put model tables on huge pages: 1=transparent, 2=explicit.\n"
 "  -index F        Extract: create index F for archive.\n"
 "                  Add: create suffix for archive indexed by F, update F.\n"
 "  -key X          Create or access encrypted archive with password X.\n"
 "  -mN  -method N  Compress level N (0..5 = faster..better, default 1).\n"
+"  -method aB[sN][rN] Choose the level of each block: the best at N MB/s\n"
+"                  (default s10) or the fastest to N%% of the input size.\n"
 "  -noattributes   Ignore/don't save file attributes or permissions.\n"
 "  -not files...   Exclude. * and ? match any string or char.\n"
 "       =[+-#^?]   List: exclude by comparison result.\n"
 "  -only files...  Include only matches (default: *).\n"
+"  -pool N         Reuse up to N MB of freed block memory (default: 1024).\n"
+"  -readahead N    Add: read N MB of input ahead of the scan (default: 16).\n"
 "  -repack F [X]   Extract to new archive F with key X (default: none).\n"
 "  -sN -summary N  List: show top N sorted by size. -1: show frag IDs.\n"
 "                  Add/Extract: if N > 0 show brief progress.\n"
@@ -1126,7 +1796,7 @@ void Jidac::usage() {
 "  t8,24: MIX2 last 2 models, N1 context bits, learning rate N2.\n"
 #endif
   , threads, dateToString(date).c_str());
-  exit(1);
+  throw ExitCommand{1};
 }
 
 // return a/b such that there is exactly one "/" in between, and
@@ -1161,8 +1831,28 @@ string Jidac::rename(string name) {
   return name;
 }
 
+// Let libzpaq keep up to mb more MB of freed block memory while in scope.
+// Commands running at the same time each add their own share.
+class PoolReserve {
+  int64_t n;
+public:
+  PoolReserve(int mb): n(int64_t(mb>0 ? mb : 0)<<20) {
+    libzpaq::addPoolLimit(n);}
+  ~PoolReserve() {libzpaq::addPoolLimit(-n);}
+};
+
+// Set the libzpaq huge page mode while in scope, unless mode is -1
+class HugePages {
+  int old;
+public:
+  HugePages(int mode): old(-1) {
+    if (mode>=0) old=libzpaq::setHugePages(mode);}
+  ~HugePages() {if (old>=0) libzpaq::setHugePages(old);}
+};
+
 // Parse the command line. Return 1 if error else 0.
 int Jidac::doCommand(int argc, const char** argv) {
+  memset(&sum, 0, sizeof(sum));
 
   // Initialize options to default values
   command=0;
@@ -1173,6 +1863,9 @@ int Jidac::doCommand(int argc, const char** argv) {
   index=0;
   method="";  // 0..5
   noattributes=false;
+  hugepages=-1;
+  pool=1024;
+  readahead=16;
   repack=0;
   new_password=0;
   summary=0; // detailed: -1
@@ -1180,8 +1873,12 @@ int Jidac::doCommand(int argc, const char** argv) {
   threads=0; // 0 = auto-detect
   version=DEFAULT_VERSION;
   date=0;
+  cache=false;
+  estimate=false;
+  cache_end=-1;
+  cache_size=0;
 
-  printf("zpaq v" ZPAQ_VERSION " journaling archiver, compiled "
+  zprintf("zpaq v" ZPAQ_VERSION " journaling archiver, compiled "
          __DATE__ "\n");
 
   // Init archive state
@@ -1216,6 +1913,7 @@ int Jidac::doCommand(int argc, const char** argv) {
       all=4;
       if (i<argc-1 && isdigit(argv[i+1][0])) all=atoi(argv[++i]);
     }
+    else if (opt=="-cache") cache=true;
     else if (opt=="-force" || opt=="-f") force=true;
     else if (opt=="-fragment" && i<argc-1) fragment=atoi(argv[++i]);
     else if (opt=="-index" && i<argc-1) index=argv[++i];
@@ -1240,6 +1938,10 @@ int Jidac::doCommand(int argc, const char** argv) {
         onlyfiles.push_back(argv[i]);
       --i;
     }
+    else if (opt=="-estimate") estimate=true;
+    else if (opt=="-pool" && i<argc-1) pool=atoi(argv[++i]);
+    else if (opt=="-hugepages" && i<argc-1) hugepages=atoi(argv[++i]);
+    else if (opt=="-readahead" && i<argc-1) readahead=atoi(argv[++i]);
     else if (opt=="-repack" && i<argc-1) {
       repack=argv[++i];
       if (i<argc-1 && argv[i+1][0]!='-') {
@@ -1296,17 +1998,17 @@ int Jidac::doCommand(int argc, const char** argv) {
         version=version*100+59;
       if (version>9999999) {
         if (version<19000101000000LL || version>29991231235959LL) {
-          fflush(stdout);
-          fprintf(stderr,
+          zflush();
+          zfprintf(stderr,
             "Version date %1.0f must be 19000101000000 to 29991231235959\n",
              double(version));
-          exit(1);
+          throw ExitCommand{1};
         }
         date=version;
       }
     }
     else {
-      printf("Unknown option ignored: %s\n", argv[i]);
+      zprintf("Unknown option ignored: %s\n", argv[i]);
       usage();
     }
   }
@@ -1324,7 +2026,7 @@ int Jidac::doCommand(int argc, const char** argv) {
     jidac.version=DEFAULT_VERSION;
     jidac.read_archive(archive.c_str());
     version+=jidac.ver.size()-1;
-    printf("Version %1.0f\n", version+.0);
+    zprintf("Version %1.0f\n", version+.0);
   }
 
   // Load dynamic functions in Windows Vista and later
@@ -1338,10 +2040,12 @@ int Jidac::doCommand(int argc, const char** argv) {
       (FindNextStreamW_t)GetProcAddress(h, "FindNextStreamW");
   }
   if (!findFirstStreamW || !findNextStreamW)
-    printf("Alternate streams not supported in Windows XP.\n");
+    zprintf("Alternate streams not supported in Windows XP.\n");
 #endif
 
   // Execute command
+  PoolReserve reserve(pool);
+  HugePages huge(hugepages);
   if (command=='a' && files.size()>0) return add();
   else if (command=='x') return extract();
   else if (command=='l') list();
@@ -1363,17 +2067,17 @@ int64_t Jidac::read_archive(const char* arc, int *errors) {
   InputArchive in(arc, password);
   if (!in.isopen()) {
     if (command!='a') {
-      fflush(stdout);
+      zflush();
       printUTF8(arc, stderr);
-      fprintf(stderr, " not found.\n");
+      zfprintf(stderr, " not found.\n");
       if (errors) ++*errors;
     }
     return 0;
   }
   printUTF8(arc);
-  if (version==DEFAULT_VERSION) printf(": ");
-  else printf(" -until %1.0f: ", version+0.0);
-  fflush(stdout);
+  if (version==DEFAULT_VERSION) zprintf(": ");
+  else zprintf(" -until %1.0f: ", version+0.0);
+  zflush();
 
   // Test password
   {
@@ -1394,12 +2098,25 @@ int64_t Jidac::read_archive(const char* arc, int *errors) {
   bool first=true;         // first segment in archive?
   StringBuffer os(32832);  // decompressed block
   const bool renamed=command=='l' || command=='a';
+  bool done=false;
+  bool rollback=false;     // stopped at a c block?
+  bool streaming=false;    // found streaming format?
+  bool skipped=false;      // skipped a bad block?
+
+  // Start with the blocks in the cache, if any
+  const bool usecache=cacheable(arc);
+  int64_t cache_last=-1;   // offset of the last block put in the cache
+  cache_end=-1;
+  jdx="";
+  if (usecache) {
+    done=rollback=!read_cache(arc, in, block_offset, data_offset, files);
+    if (cache_size>0 || rollback) found_data=true, first=false;
+  }
 
   // Detect archive format and read the filenames, fragment sizes,
   // and hashes. In JIDAC format, these are in the index blocks, allowing
   // data to be skipped. Otherwise the whole archive is scanned to get
   // this information from the segment headers and trailers.
-  bool done=false;
   while (!done) {
     libzpaq::Decompresser d;
     try {
@@ -1466,122 +2183,28 @@ int64_t Jidac::read_archive(const char* arc, int *errors) {
             else
               d.readSegmentEnd();
 
-            // Transaction header (type c).
-            // If in the future then stop here, else read 8 byte data size
-            // from input and jump over it.
-            if (filename.s[17]=='c') {
-              if (os.size()<8) error("c block too small");
-              data_offset=in.tell()+1-d.buffered();
-              const char* s=os.c_str();
-              int64_t jmp=btol(s);
-              if (jmp<0) printf("Incomplete transaction ignored\n");
-              if (jmp<0
-                  || (version<19000000000000LL && int64_t(ver.size())>version)
-                  || (version>=19000000000000LL && version<fdate)) {
-                done=true;  // roll back to here
+            // Apply the c, h or i block. Skip the d blocks after a c block.
+            const char type=filename.s[17];
+            if (strchr("chi", type)) {
+              if (type=='c') data_offset=in.tell()+1-d.buffered();
+              const int64_t doff=data_offset;
+              if (!read_jidac(type, fdate, num, os.c_str(), os.size(),
+                              block_offset, data_offset, files)) {
+                done=rollback=true;  // roll back to here
                 goto endblock;
               }
-              else {
-                dcsize+=jmp;
-                if (jmp) in.seek(data_offset+jmp, SEEK_SET);
-                ver.push_back(VER());
-                ver.back().firstFragment=ht.size();
-                ver.back().offset=block_offset;
-                ver.back().data_offset=data_offset;
-                ver.back().date=ver.back().lastdate=fdate;
-                ver.back().csize=jmp;
-                if (all) {
-                  string fn=itos(ver.size()-1, all)+"/";
-                  if (renamed) fn=rename(fn);
-                  if (isselected(fn.c_str(), false))
-                    dt[fn].date=fdate;
-                }
-                if (jmp) goto endblock;
-              }
-            }
-
-            // Fragment table (type h).
-            // Contents is bsize[4] (sha1[20] usize[4])... for fragment N...
-            // where bsize is the compressed block size.
-            // Store in ht[].{sha1,usize}. Set ht[].csize to block offset
-            // assuming N in ascending order.
-            else if (filename.s[17]=='h') {
-              assert(ver.size()>0);
-              if (fdate>ver.back().lastdate) ver.back().lastdate=fdate;
-              if (os.size()%24!=4) error("bad h block size");
-              const unsigned n=(os.size()-4)/24;
-              if (num<1 || num+n>0xffffffff) error("bad h fragment");
-              const char* s=os.c_str();
-              const unsigned bsize=btoi(s);
-              dhsize+=bsize;
-              assert(ver.size()>0);
-              if (int64_t(ht.size())>num) {
-                fflush(stdout);
-                fprintf(stderr,
-                  "Unordered fragment tables: expected >= %d found %1.0f\n",
-                  int(ht.size()), double(num));
+              if (usecache) {
+                put_cache(type, fdate, num, block_offset, doff,
+                          os.c_str(), os.size());
+                cache_last=block_offset;
               }
-              for (unsigned i=0; i<n; ++i) {
-                if (i==0) {
-                  block.push_back(Block(num, data_offset));
-                  block.back().usize=8;
-                  block.back().bsize=bsize;
-                  block.back().frags=os.size()/24;
-                }
-                while (int64_t(ht.size())<=num+i) ht.push_back(HT());
-                memcpy(ht[num+i].sha1, s, 20);
-                s+=20;
-                assert(block.size()>0);
-                unsigned f=btoi(s);
-                if (f>0x7fffffff) error("fragment too big");
-                block.back().usize+=(ht[num+i].usize=f)+4u;
+              if (type=='c' && ver.back().csize) {
+                in.seek(data_offset+ver.back().csize, SEEK_SET);
+                goto endblock;
               }
-              data_offset+=bsize;
             }
-
-            // Index (type i)
-            // Contents is: 0[8] filename 0 (deletion)
-            // or:       date[8] filename 0 na[4] attr[na] ni[4] ptr[ni][4]
-            // Read into DT
-            else if (filename.s[17]=='i') {
-              assert(ver.size()>0);
-              if (fdate>ver.back().lastdate) ver.back().lastdate=fdate;
-              const char* s=os.c_str();
-              const char* const end=s+os.size();
-              while (s+9<=end) {
-                DT dtr;
-                dtr.date=btol(s);  // date
-                if (dtr.date) ++ver.back().updates;
-                else ++ver.back().deletes;
-                const int64_t len=strlen(s);
-                if (len>65535) error("filename too long");
-                string fn=s;  // filename renamed
-                if (all) fn=append_path(itos(ver.size()-1, all), fn);
-                const bool issel=isselected(fn.c_str(), renamed);
-                s+=len+1;  // skip filename
-                if (s>end) error("filename too long");
-                if (dtr.date) {
-                  ++files;
-                  if (s+4>end) error("missing attr");
-                  unsigned na=btoi(s);  // attr bytes
-                  if (s+na>end || na>65535) error("attr too long");
-                  for (unsigned i=0; i<na; ++i, ++s)  // read attr
-                    if (i<8) dtr.attr+=int64_t(*s&255)<<(i*8);
-                  if (noattributes) dtr.attr=0;
-                  if (s+4>end) error("missing ptr");
-                  unsigned ni=btoi(s);  // ptr list size
-                  if (ni>(end-s)/4u) error("ptr list too long");
-                  if (issel) dtr.ptr.resize(ni);
-                  for (unsigned i=0; i<ni; ++i) {  // read ptr
-                    const unsigned j=btoi(s);
-                    if (issel) dtr.ptr[i]=j;
-                  }
-                }
-                if (issel) dt[fn]=dtr;
-              }  // end while more files
-            }  // end if 'i'
             else {
-              printf("Skipping %s %s\n",
+              zprintf("Skipping %s %s\n",
                   filename.s.c_str(), comment.s.c_str());
               error("Unexpected journaling block");
             }
@@ -1591,6 +2214,7 @@ int64_t Jidac::read_archive(const char* arc, int *errors) {
           else {
 
             // If previous version does not exist, start a new one
+            streaming=true;
             if (ver.size()==1) {
               if (version<1) {
                 done=true;
@@ -1613,10 +2237,10 @@ int64_t Jidac::read_archive(const char* arc, int *errors) {
                 ++files;
                 dtr.date=date;
                 dtr.attr=0;
-                dtr.ptr.resize(0);
+                dt.assign(dtr.ptr, 0);
                 ++ver.back().updates;
               }
-              dtr.ptr.push_back(ht.size());
+              dt.push(dtr.ptr, ht.size());
             }
             assert(ver.size()>0);
             if (segs==0 || block.size()==0)
@@ -1634,19 +2258,27 @@ int64_t Jidac::read_archive(const char* arc, int *errors) {
     }  // end try
     catch (std::exception& e) {
       in.seek(-d.buffered(), SEEK_CUR);
-      fflush(stdout);
-      fprintf(stderr, "Skipping block at %1.0f: %s\n", double(block_offset),
+      zflush();
+      zfprintf(stderr, "Skipping block at %1.0f: %s\n", double(block_offset),
               e.what());
       if (errors) ++*errors;
+      skipped=true;
     }
 endblock:;
   }  // end while !done
   if (in.tell()>32*(password!=0) && !found_data)
     error("archive contains no data");
-  printf("%d versions, %u files, %u fragments, %1.6f MB\n", 
+  zprintf("%d versions, %u files, %u fragments, %1.6f MB\n", 
       int(ver.size()-1), files, unsigned(ht.size())-1,
       block_offset/1000000.0);
 
+  // Add the new blocks to the cache. Don't cache a trailing c block whose
+  // data is missing.
+  if (usecache && found_data && !rollback && !streaming && !skipped
+      && (cache_end<0 || jdx.size()>0) && block_offset>cache_last)
+    write_cache(arc, in, block_offset, ver.size()>1 ? ver.back().offset : 0,
+                data_offset);
+
   // Calculate file sizes
   for (DTMap::iterator p=dt.begin(); p!=dt.end(); ++p) {
     for (unsigned i=0; i<p->second.ptr.size(); ++i) {
@@ -1657,9 +2289,321 @@ endblock:;
       }
     }
   }
+  sum.versions=ver.size()-1;
+  sum.archive_size=block_offset;
   return block_offset;
 }
 
+// Read journaling block type c, h, or i named jDC<fdate><type><num> with
+// contents s[0..n-1] into ver, ht, dt, and block. block_offset is the
+// start of the last block. data_offset is the end of a c block, or the
+// start of the d block described by an h block, which advances it.
+// Count files read. Return false to stop reading at a c block.
+bool Jidac::read_jidac(char type, int64_t fdate, int64_t num,
+                       const char* s, size_t n, int64_t block_offset,
+                       int64_t& data_offset, unsigned& files) {
+  const char* const end=s+n;
+  const bool renamed=command=='l' || command=='a';
+
+  // Transaction header (type c).
+  // If in the future then stop here, else read 8 byte data size.
+  if (type=='c') {
+    if (n<8) error("c block too small");
+    int64_t jmp=btol(s);
+    if (jmp<0) zprintf("Incomplete transaction ignored\n");
+    if (jmp<0
+        || (version<19000000000000LL && int64_t(ver.size())>version)
+        || (version>=19000000000000LL && version<fdate))
+      return false;
+    dcsize+=jmp;
+    ver.push_back(VER());
+    ver.back().firstFragment=ht.size();
+    ver.back().offset=block_offset;
+    ver.back().data_offset=data_offset;
+    ver.back().date=ver.back().lastdate=fdate;
+    ver.back().csize=jmp;
+    if (all) {
+      string fn=itos(ver.size()-1, all)+"/";
+      if (renamed) fn=rename(fn);
+      if (isselected(fn.c_str(), false))
+        dt[fn].date=fdate;
+    }
+  }
+
+  // Fragment table (type h).
+  // Contents is bsize[4] (sha1[20] usize[4])... for fragment N...
+  // where bsize is the compressed block size.
+  // Store in ht[].{sha1,usize}. Set ht[].csize to block offset
+  // assuming N in ascending order.
+  else if (type=='h') {
+    assert(ver.size()>0);
+    if (fdate>ver.back().lastdate) ver.back().lastdate=fdate;
+    if (n%24!=4) error("bad h block size");
+    const unsigned nf=(n-4)/24;
+    if (num<1 || num+nf>0xffffffff) error("bad h fragment");
+    const unsigned bsize=btoi(s);
+    dhsize+=bsize;
+    assert(ver.size()>0);
+    if (int64_t(ht.size())>num) {
+      zflush();
+      zfprintf(stderr,
+        "Unordered fragment tables: expected >= %d found %1.0f\n",
+        int(ht.size()), double(num));
+    }
+    for (unsigned i=0; i<nf; ++i) {
+      if (i==0) {
+        block.push_back(Block(num, data_offset));
+        block.back().usize=8;
+        block.back().bsize=bsize;
+        block.back().frags=n/24;
+      }
+      while (int64_t(ht.size())<=num+i) ht.push_back(HT());
+      memcpy(ht[num+i].sha1, s, 20);
+      s+=20;
+      assert(block.size()>0);
+      unsigned f=btoi(s);
+      if (f>0x7fffffff) error("fragment too big");
+      block.back().usize+=(ht[num+i].usize=f)+4u;
+    }
+    data_offset+=bsize;
+  }
+
+  // Index (type i)
+  // Contents is: 0[8] filename 0 (deletion)
+  // or:       date[8] filename 0 na[4] attr[na] ni[4] ptr[ni][4]
+  // Read into DT
+  else if (type=='i') {
+    assert(ver.size()>0);
+    if (fdate>ver.back().lastdate) ver.back().lastdate=fdate;
+    while (s+9<=end) {
+      DT dtr;
+      dtr.date=btol(s);  // date
+      if (dtr.date) ++ver.back().updates;
+      else ++ver.back().deletes;
+      const int64_t len=strlen(s);
+      if (len>65535) error("filename too long");
+      string fn=s;  // filename renamed
+      if (all) fn=append_path(itos(ver.size()-1, all), fn);
+      DT* const dp=isselected(fn.c_str(), renamed) ? &dt[fn] : 0;
+      s+=len+1;  // skip filename
+      if (s>end) error("filename too long");
+      if (dtr.date) {
+        ++files;
+        if (s+4>end) error("missing attr");
+        unsigned na=btoi(s);  // attr bytes
+        if (s+na>end || na>65535) error("attr too long");
+        for (unsigned i=0; i<na; ++i, ++s)  // read attr
+          if (i<8) dtr.attr+=int64_t(*s&255)<<(i*8);
+        if (noattributes) dtr.attr=0;
+        if (s+4>end) error("missing ptr");
+        unsigned ni=btoi(s);  // ptr list size
+        if (ni>(end-s)/4u) error("ptr list too long");
+        if (dp) dt.assign(dp->ptr, ni);  // reuse the old list's memory
+        for (unsigned i=0; i<ni; ++i) {  // read ptr
+          const unsigned j=btoi(s);
+          if (dp) dp->ptr[i]=j;
+        }
+      }
+      else if (dp) dt.assign(dp->ptr, 0);
+      if (dp) {
+        dtr.ptr=dp->ptr;
+        *dp=dtr;
+      }
+    }  // end while more files
+  }  // end if 'i'
+  return true;
+}
+
+// With -cache, the c, h and i blocks of an unencrypted single part
+// archive arc are also saved in arc.jdx ("jDC index"), which read_archive()
+// reads instead of finding and decompressing them. It contains:
+//   "jDCcach2" end[8] last[8] data_offset[8] size[8] check[20]
+//   records[size]
+// where records are the blocks in archive order, each as
+//   type[1] date[8] num[4] block_offset[8] data_offset[8] n[4] contents[n]
+// with the read_jidac() arguments, end is the archive offset after them,
+// last is the block_offset of the last c record (the last transaction
+// header) or 0 if none, data_offset is its value at end, and check is
+// the SHA-1 of the (up to) 4096 bytes at the start, at last and before
+// end. The cache is used if the archive is at least end bytes, last
+// matches the records and check matches. Blocks after end are read from
+// the archive and appended.
+const int CACHE_HEADER=60;  // bytes before records
+
+// Return the cache check of in with the last transaction at last
+// before end, or "" if it can't be read
+string cache_check(InputArchive& in, int64_t end, int64_t last) {
+  libzpaq::SHA1 sha1;
+  char buf[4096];
+  const int64_t at[3]={0, last, end<4096 ? 0 : end-4096};
+  for (int i=0; i<3; ++i) {
+    const int64_t n=end-at[i]<4096 ? end-at[i] : 4096;
+    in.seek(at[i], SEEK_SET);
+    for (int64_t j=0; j<n;) {
+      const int nr=in.read(buf+j, n-j);
+      if (nr<=0) return "";
+      j+=nr;
+    }
+    sha1.write(buf, n);
+  }
+  return string(sha1.result(), 20);
+}
+
+// A read-only view of a whole file, memory mapped in Unix if possible
+class FileView {
+  const char* p;  // contents
+  int64_t n;      // size
+  string buf;     // contents if not mapped
+  bool mapped;
+public:
+  FileView(const char* filename);
+  ~FileView() {
+#ifdef unix
+    if (mapped) munmap((void*)p, n);
+#endif
+  }
+  const char* data() const {return p;}
+  int64_t size() const {return n;}
+};
+
+FileView::FileView(const char* filename): p(0), n(0), mapped(false) {
+  FP fp=fopen(filename, RB);
+  if (fp==FPNULL) return;
+  fseeko(fp, 0, SEEK_END);
+  const int64_t sz=ftello(fp);
+#ifdef unix
+  if (sz>0 && int64_t(size_t(sz))==sz) {
+    void* m=mmap(0, size_t(sz), PROT_READ, MAP_SHARED, fileno(fp), 0);
+    if (m!=MAP_FAILED) p=(const char*)m, n=sz, mapped=true;
+  }
+#endif
+  if (!mapped && sz>0) {
+    buf.resize(sz);
+    fseeko(fp, 0, SEEK_SET);
+    if (int64_t(fread(&buf[0], 1, sz, fp))==sz) p=buf.c_str(), n=sz;
+  }
+  fclose(fp);
+}
+
+// Return true if -cache applies to archive arc
+bool Jidac::cacheable(const char* arc) {
+  return cache && !password && subpart(arc, 1)==arc;
+}
+
+// Append a record for a block to jdx
+void Jidac::put_cache(char type, int64_t fdate, int64_t num,
+                      int64_t block_offset, int64_t data_offset,
+                      const char* s, size_t n) {
+  StringBuffer r;
+  r.put(type);
+  puti(r, fdate, 8);
+  puti(r, num, 4);
+  puti(r, block_offset, 8);
+  puti(r, data_offset, 8);
+  puti(r, n, 4);
+  jdx.append(r.c_str(), r.size());
+  jdx.append(s, n);
+}
+
+// Read the blocks in the cache of arc if it matches in. Set block_offset
+// and data_offset to continue reading from in after them, and set
+// cache_end and cache_size. Return false if a c block stops reading.
+bool Jidac::read_cache(const char* arc, InputArchive& in,
+                       int64_t& block_offset, int64_t& data_offset,
+                       unsigned& files) {
+  cache_end=-1;
+  cache_size=0;
+  FileView v((string(arc)+".jdx").c_str());
+  const char* s=v.data();
+  if (v.size()<CACHE_HEADER || memcmp(s, "jDCcach2", 8)) return true;
+  s+=8;
+  const int64_t end=btol(s);
+  const int64_t last=btol(s);
+  const int64_t doff=btol(s);
+  const int64_t size=btol(s);
+  const string check(s, 20);
+  s+=20;
+  in.seek(0, SEEK_END);
+  const bool ok=size>=0 && size<=v.size()-CACHE_HEADER && end>0
+      && end<=in.tell() && last>=0 && last<end
+      && cache_check(in, end, last)==check;
+  in.seek(block_offset, SEEK_SET);
+  if (!ok) return true;
+
+  // Check the record sizes and the last c record before using any
+  const char* const e=s+size;
+  int64_t lastc=0;
+  for (const char* q=s; q<e;) {
+    if (e-q<33 || !strchr("chi", *q)) return true;
+    const char type=*q;
+    q+=13;
+    const int64_t offset=btol(q);
+    if (type=='c') lastc=offset;
+    q+=8;
+    const unsigned n=btoi(q);
+    if (n>e-q) return true;
+    q+=n;
+  }
+  if (lastc!=last) return true;
+
+  // Read the blocks
+  while (s<e) {
+    const char type=*s++;
+    const int64_t fdate=btol(s);
+    const unsigned num=btoi(s);
+    const int64_t offset=btol(s);
+    int64_t doff1=btol(s);
+    const unsigned n=btoi(s);
+    if (!read_jidac(type, fdate, num, s, n, offset, doff1, files)) {
+      block_offset=offset;
+      return false;
+    }
+    s+=n;
+  }
+  block_offset=end;
+  data_offset=doff;
+  cache_end=end;
+  cache_size=size;
+  in.seek(end, SEEK_SET);
+  return true;
+}
+
+// Append the records in jdx to the cache of arc, or replace it if
+// cache_end<0. Set its end to end, its last transaction to last and
+// data offset to data_offset.
+void Jidac::write_cache(const char* arc, InputArchive& in, int64_t end,
+                        int64_t last, int64_t data_offset) {
+  const string fn=string(arc)+".jdx";
+  if (cache_end<0) cache_size=0;
+  StringBuffer h;
+  h.write("jDCcach2", 8);
+  puti(h, end, 8);
+  puti(h, last, 8);
+  puti(h, data_offset, 8);
+  puti(h, cache_size+jdx.size(), 8);
+  const string check=cache_check(in, end, last);
+  h.write(check.c_str(), check.size());
+  FP fp=check.size()==20 ? fopen(fn.c_str(), cache_end<0 ? WB : RBPLUS)
+                         : FPNULL;
+  bool ok=fp!=FPNULL;
+  if (ok) {
+    fseeko(fp, CACHE_HEADER+cache_size, SEEK_SET);
+    ok=fwrite(jdx.c_str(), 1, jdx.size(), fp)==jdx.size();
+    fseeko(fp, 0, SEEK_SET);
+    ok=fwrite(h.c_str(), 1, CACHE_HEADER, fp)==size_t(CACHE_HEADER) && ok;
+    ok=fclose(fp)==0 && ok;
+  }
+  if (ok) {
+    cache_end=end;
+    cache_size+=jdx.size();
+  }
+  else {
+    cache_end=-1;
+    printerr(fn.c_str());
+  }
+  jdx="";
+}
+
 // Test whether filename and attributes are selected by files, -only, and -not
 // If rn then test renamed filename.
 bool Jidac::isselected(const char* filename, bool rn) {
@@ -1812,19 +2756,25 @@ void Jidac::addfile(string filename, int64_t edate,
 
 //////////////////////////////// add //////////////////////////////////
 
-// Append n bytes of x to sb in LSB order
-inline void puti(libzpaq::StringBuffer& sb, uint64_t x, int n) {
-  for (; n>0; --n) sb.put(x&255), x>>=8;
-}
-
 // Print percent done (td/ts) and estimated time remaining
 void print_progress(int64_t ts, int64_t td, int sum) {
   if (td>ts) td=ts;
+  if (cmd && cmd->stats) {  // pass the counters to the progress callback
+    cmd->stats->v[STAT(total_bytes)]=ts;
+    cmd->stats->v[STAT(done_bytes)]=td;
+    if (cmd->mon->progress) {
+      zpaq_jidac_stats st;
+      cmd->stats->get(st);
+      std::lock_guard<std::mutex> lock(cmd->mu);
+      cmd->mon->progress(cmd->mon->ctx, &st);
+    }
+  }
   if (td>=1000000) {
-    double eta=0.001*(mtime()-global_start)*(ts-td)/(td+1.0);
-    printf("%5.2f%% %d:%02d:%02d ", td*100.0/(ts+0.5),
+    const int64_t start=cmd ? cmd->start : global_start;
+    double eta=0.001*(mtime()-start)*(ts-td)/(td+1.0);
+    zprintf("%5.2f%% %d:%02d:%02d ", td*100.0/(ts+0.5),
        int(eta/3600), int(eta/60)%60, int(eta)%60);
-    if (sum>0) printf("\r"), fflush(stdout);
+    if (sum>0) zprintf("\r"), zflush();
   }
 }
 
@@ -1843,28 +2793,44 @@ struct CJ {
   string filename;       // to write in filename field
   string comment;        // if "" use default
   string method;         // compression level or "" to mark end of data
+  int64_t estimated;     // estimated bytes not in out
   Semaphore full;        // 1 if in is FULL of data ready to compress
   Semaphore compressed;  // 1 if out contains COMPRESSED data
-  CJ(): state(EMPTY) {}
+  CJ(): state(EMPTY), estimated(0) {}
 };
 
+ThreadReturn compressThread(void* arg);
+ThreadReturn writeThread(void* arg);
+
 // Instructions to a compression job
 class CompressJob {
 public:
   Mutex mutex;           // protects state changes
 private:
   int job;               // number of jobs
+  int threads;           // number of compressors
   CJ* q;                 // buffer queue
   unsigned qsize;        // number of elements in q
   int front;             // next to remove from queue
-  libzpaq::Writer* out;  // archive
+  OutputArchive* out;    // archive
   Semaphore empty;       // number of empty buffers ready to fill
   Semaphore compressors; // number of compressors available to run
+  vector<ThreadID> tid;  // compressThreads, one per buffer
+  ThreadID wid;          // writeThread
+  bool running;          // threads started and not joined
+  std::exception_ptr ex; // first error of a compressThread or writeThread
+  std::atomic<bool> failed;  // ex is set
+  void fail();           // set ex to the current exception if not set
+  bool stopped() {return failed.load() || cancelled();}
 public:
+  bool verbose;          // show the levels chosen by "a" methods
+  bool estimate;         // estimate the modeled data instead of coding it
   friend ThreadReturn compressThread(void* arg);
   friend ThreadReturn writeThread(void* arg);
-  CompressJob(int threads, int buffers, libzpaq::Writer* f):
-      job(0), q(0), qsize(buffers), front(0), out(f) {
+  CompressJob(int threads, int buffers, OutputArchive* f):
+      job(0), threads(threads), q(0), qsize(buffers), front(0), out(f),
+      tid(buffers), running(false), failed(false), verbose(false),
+      estimate(false) {
     q=new CJ[buffers];
     if (!q) throw std::bad_alloc();
     init_mutex(mutex);
@@ -1876,6 +2842,10 @@ public:
     }
   }
   ~CompressJob() {
+    try {
+      if (running) finish();  // leaving add() early: stop the threads
+    }
+    catch (...) {}
     for (int i=qsize-1; i>=0; --i) {
       q[i].compressed.destroy();
       q[i].full.destroy();
@@ -1885,16 +2855,49 @@ public:
     destroy_mutex(mutex);
     delete[] q;
   }      
+  void start();   // start the threads
   void write(StringBuffer& s, const char* filename, string method,
              const char* comment=0);
+  void finish();  // end the input, wait for the threads, throw any error
   vector<int> csize;  // compressed block sizes
 };
 
+void CompressJob::start() {
+  for (unsigned i=0; i<tid.size(); ++i) run(tid[i], compressThread, this);
+  run(wid, writeThread, this);
+  running=true;
+}
+
+void CompressJob::fail() {
+  lock(mutex);
+  if (!ex) ex=std::current_exception();
+  failed=true;
+  release(mutex);
+}
+
+// Signal the end of input and wait for the threads. Then rethrow the
+// first error of a thread: its block was not written.
+void CompressJob::finish() {
+  StringBuffer end;
+  running=false;
+  write(end, 0, "");
+  for (unsigned i=0; i<tid.size(); ++i) join(tid[i]);
+  join(wid);
+  if (ex) std::rethrow_exception(ex);
+  checkCancel();
+}
+
 // Write s at the back of the queue. Signal end of input with method=""
 void CompressJob::write(StringBuffer& s, const char* fn, string method,
                         const char* comment) {
+  if (method!="") {
+    checkCancel();
+    if (failed) finish();  // throws the error
+  }
   for (unsigned k=(method=="")?qsize:1; k>0; --k) {
+    StatTimer wait(STAT(queue_wait_ns));
     empty.wait();
+    wait.stop();
     lock(mutex);
     unsigned i, j;
     for (i=0; i<qsize; ++i) {
@@ -1915,80 +2918,114 @@ void CompressJob::write(StringBuffer& s, const char* fn, string method,
 }
 
 // Compress data in the background, one per buffer
+// An error stops the job with CompressJob::fail() instead of the process:
+// later blocks are passed on to writeThread without being compressed.
 ThreadReturn compressThread(void* arg) {
   CompressJob& job=*(CompressJob*)arg;
-  int jobNumber=0;
-  try {
 
-    // Get job number = assigned position in queue
+  // Get job number = assigned position in queue
+  lock(job.mutex);
+  const int jobNumber=job.job++;
+  assert(jobNumber>=0 && jobNumber<int(job.qsize));
+  CJ& cj=job.q[jobNumber];
+  release(job.mutex);
+  libzpaq::Compressor co;  // reused by -estimate
+
+  // Work until done
+  while (true) {
+    cj.full.wait();
     lock(job.mutex);
-    jobNumber=job.job++;
-    assert(jobNumber>=0 && jobNumber<int(job.qsize));
-    CJ& cj=job.q[jobNumber];
-    release(job.mutex);
 
-    // Work until done
-    while (true) {
-      cj.full.wait();
-      lock(job.mutex);
+    // Check for end of input
+    if (cj.method=="") {
+      cj.compressed.signal();
+      release(job.mutex);
+      return 0;
+    }
+
+    // Compress
+    assert(cj.state==CJ::FULL);
+    cj.state=CJ::COMPRESSING;
+    release(job.mutex);
+    StatTimer wait(STAT(compressor_wait_ns));
+    job.compressors.wait();
+    wait.stop();
 
-      // Check for end of input
-      if (cj.method=="") {
-        cj.compressed.signal();
+    // Sort with the threads not needed by other blocks
+    lock(job.mutex);
+    int sathreads=job.threads+1;
+    for (unsigned i=0; i<job.qsize; ++i)
+      if (job.q[i].state==CJ::COMPRESSING
+          || (job.q[i].state==CJ::FULL && job.q[i].method!=""))
+        --sathreads;
+    release(job.mutex);
+    if (!job.stopped()) {
+      try {
+        addstat(STAT(compress_in_bytes), cj.in.size());
+        StatTimer timer(STAT(compress_ns));
+        string chosen;  // level of an "a" method
+        if (job.estimate) co.setEstimate(true);
+        libzpaq::compressBlock(&cj.in, &cj.out, cj.method.c_str(),
+            cj.filename.c_str(), cj.comment=="" ? 0 : cj.comment.c_str(),
+            true, job.estimate ? &co : 0, max(sathreads, 1),
+            cj.method[0]=='a' ? &chosen : 0);
+        cj.estimated=job.estimate ? co.estimatedBytes() : 0;
+        timer.stop();
+        if (job.verbose && chosen!="" && cj.filename.size()>18)
+          zprintf("[%d] -method %s\n", atoi(cj.filename.c_str()+18),
+              chosen.c_str());
+        addstat(STAT(compress_out_bytes), cj.out.size()+cj.estimated);
+        addstat(STAT(blocks_compressed), 1);
+      }
+      catch (std::exception& e) {
+        lock(job.mutex);
+        zflush();
+        zfprintf(stderr, "job %d: %s\n", jobNumber+1, e.what());
         release(job.mutex);
-        return 0;
+        job.fail();
       }
-
-      // Compress
-      assert(cj.state==CJ::FULL);
-      cj.state=CJ::COMPRESSING;
-      release(job.mutex);
-      job.compressors.wait();
-      libzpaq::compressBlock(&cj.in, &cj.out, cj.method.c_str(),
-          cj.filename.c_str(), cj.comment=="" ? 0 : cj.comment.c_str());
-      cj.in.resize(0);
-      lock(job.mutex);
-      cj.state=CJ::COMPRESSED;
-      cj.compressed.signal();
-      job.compressors.signal();
-      release(job.mutex);
     }
-  }
-  catch (std::exception& e) {
+    cj.in.resize(0);
     lock(job.mutex);
-    fflush(stdout);
-    fprintf(stderr, "job %d: %s\n", jobNumber+1, e.what());
+    cj.state=CJ::COMPRESSED;
+    cj.compressed.signal();
+    job.compressors.signal();
     release(job.mutex);
-    exit(1);
   }
   return 0;
 }
 
-// Write compressed data to the archive in the background
+// Write compressed data to the archive in the background. After an
+// error or when cancelled, blocks are discarded until the end of input.
 ThreadReturn writeThread(void* arg) {
   CompressJob& job=*(CompressJob*)arg;
-  try {
 
-    // work until done
-    while (true) {
+  // work until done
+  while (true) {
 
-      // wait for something to write
-      CJ& cj=job.q[job.front];  // no other threads move front
-      cj.compressed.wait();
+    // wait for something to write
+    CJ& cj=job.q[job.front];  // no other threads move front
+    StatTimer stall(STAT(write_stall_ns));
+    cj.compressed.wait();
+    stall.stop();
 
-      // Quit if end of input
-      lock(job.mutex);
-      if (cj.method=="") {
-        release(job.mutex);
-        return 0;
-      }
+    // Quit if end of input
+    lock(job.mutex);
+    if (cj.method=="") {
+      release(job.mutex);
+      return 0;
+    }
 
-      // Write to archive
-      assert(cj.state==CJ::COMPRESSED);
-      cj.state=CJ::WRITING;
-      job.csize.push_back(cj.out.size());
-      if (job.out && cj.out.size()>0) {
-        release(job.mutex);
+    // Write to archive
+    assert(cj.state==CJ::COMPRESSED);
+    cj.state=CJ::WRITING;
+    job.csize.push_back(cj.out.size()+cj.estimated);
+    if (job.out && cj.estimated>0 && !job.stopped())
+      job.out->seek(cj.estimated, SEEK_CUR);  // archive "" only counts
+    if (job.out && cj.out.size()>0 && !job.stopped()) {
+      release(job.mutex);
+      try {
+        StatTimer timer(STAT(write_ns));
         assert(cj.out.c_str());
         const char* p=cj.out.c_str();
         int64_t n=cj.out.size();
@@ -1999,19 +3036,371 @@ ThreadReturn writeThread(void* arg) {
           n-=N;
         }
         job.out->write(p, n);
-        lock(job.mutex);
       }
-      cj.out.resize(0);
-      cj.state=CJ::EMPTY;
-      job.front=(job.front+1)%job.qsize;
-      job.empty.signal();
-      release(job.mutex);
+      catch (...) {
+        job.fail();
+      }
+      lock(job.mutex);
     }
+    cj.out.resize(0);
+    cj.estimated=0;
+    cj.state=CJ::EMPTY;
+    job.front=(job.front+1)%job.qsize;
+    job.empty.signal();
+    release(job.mutex);
   }
-  catch (std::exception& e) {
-    fflush(stdout);
-    fprintf(stderr, "zpaq exiting from writeThread: %s\n", e.what());
-    exit(1);
+  return 0;
+}
+
+//////////////////////////// ScanJob ////////////////////////////////
+
+// A ScanJob splits the files to add into fragments on a set of
+// scanThreads, several files at a time, while add() looks up, packs
+// and compresses the fragments in file order. Each scanThread takes the
+// next file, finds its fragment boundaries with the rolling hash,
+// hashes each fragment with SHA-1 and measures the order 1 statistics
+// that don't depend on the fragments before it. Scanned data waits in
+// memory up to a limit, except for the file that add() is reading.
+// In Unix, the OS is asked to read the next readahead bytes of each
+// file, and of the files after it, in the background.
+
+// A scanned fragment
+struct ScanFrag {
+  string data;            // fragment contents
+  char sha1[20];          // hash of data
+  unsigned char o1[256];  // order 1 context -> predicted byte
+  unsigned hits;          // redundancy estimate (tests 1-3 in analyze())
+  int text, exe;          // 1 if data looks like text or x86
+  bool last;              // last fragment of the file
+  ScanFrag(): hits(0), text(0), exe(0), last(true) {
+    memset(sha1, 0, sizeof(sha1));
+    memset(o1, 0, sizeof(o1));
+  }
+};
+
+// Sizes of the fragments of add with -fragment fragment and blocks of
+// blocksize bytes. A fragment ends after maxfrag bytes, or after at least
+// minfrag bytes where the rolling hash of FragmentHash is below
+// 2^(22-fragment).
+static void fragmentLimits(int fragment, unsigned blocksize,
+                           unsigned& minfrag, unsigned& maxfrag) {
+  maxfrag=fragment>19 || (8128u<<fragment)>blocksize-12
+      ? blocksize-12 : 8128u<<fragment;
+  minfrag=fragment>25 || (64u<<fragment)>maxfrag ? maxfrag : 64u<<fragment;
+}
+
+// Rolling hash of the bytes of a fragment for finding its end. It mixes
+// in each byte with a multiplier that depends on whether the order 1
+// context o1 predicted it, so the hash depends only on the bytes since
+// the last boundary.
+struct FragmentHash {
+  unsigned h;         // hash
+  int c1;             // previous byte
+  unsigned char* o1;  // order 1 context -> predicted byte
+  unsigned hits;      // correct o1 predictions
+  FragmentHash(unsigned char* o): h(0), c1(0), o1(o), hits(0) {}
+  void update(int c) {
+    if (c==o1[c1]) h=(h+c+1)*314159265u, ++hits;
+    else h=(h+c+1)*271828182u;
+    o1[c1]=c;
+    c1=c;
+  }
+  // Should a fragment of sz bytes end here?
+  bool end(unsigned sz, int fragment, unsigned minfrag, unsigned maxfrag)
+      const {
+    return sz>=maxfrag
+        || (fragment<=22 && h<(1u<<(22-fragment)) && sz>=minfrag);
+  }
+};
+
+// Analyze fragment f of f.data.size() bytes and f.hits correct o1
+// predictions for redundancy, x86, text.
+// Test for text: letters, digits, '.' and ',' followed by spaces
+//   and no invalid UTF-8.
+// Test for exe: 139 (mov reg, r/m) in lots of contexts.
+// 4 tests for redundancy, measured as hits/sz. Take the highest of:
+//   1. Successful prediction count in o1.
+//   2. Non-uniform distribution in o1 (counted in o2).
+//   3. Fraction of zeros in o1 (bytes never seen).
+//   4. Fraction of matches between o1 and previous o1 (o1prev).
+// Test 4 depends on earlier fragments and is done by add().
+void analyze(ScanFrag& f) {
+  const unsigned char* o1=f.o1;
+  const int64_t sz=f.data.size();
+  int text1=0, exe1=0;
+  int64_t h1=sz;
+  unsigned char o1ct[256]={0};  // counts of bytes in o1
+  static const unsigned char dt[256]={  // 32768/((i+1)*204)
+    160,80,53,40,32,26,22,20,17,16,14,13,12,11,10,10,
+      9, 8, 8, 8, 7, 7, 6, 6, 6, 6, 5, 5, 5, 5, 5, 5,
+      4, 4, 4, 4, 4, 4, 4, 4, 3, 3, 3, 3, 3, 3, 3, 3,
+      3, 3, 3, 3, 3, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
+      2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
+      1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+      1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+      1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+      1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+      1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1};
+  for (int i=0; i<256; ++i) {
+    if (o1ct[o1[i]]<255) h1-=(sz*dt[o1ct[o1[i]]++])>>15;
+    if (o1[i]==' ' && (isalnum(i) || i=='.' || i==',')) ++text1;
+    if (o1[i] && (i<9 || i==11 || i==12 || (i>=14 && i<=31) || i>=240))
+      --text1;
+    if (i>=192 && i<240 && o1[i] && (o1[i]<128 || o1[i]>=192))
+      --text1;
+    if (o1[i]==139) ++exe1;
+  }
+  f.text=(text1>=3);
+  f.exe=(exe1>=5);
+  if (sz>0) h1=h1*h1/sz; // Test 2: near 0 if random.
+  unsigned h2=h1;
+  if (h2>f.hits) f.hits=h2;
+  h2=o1ct[0]*sz/256;  // Test 3: bytes never seen or that predict 0.
+  if (h2>f.hits) f.hits=h2;
+}
+
+// The scan of one file
+struct ScanFile {
+  enum {WAITING, OPEN, FAILED} state;
+  int err;                // errno (GetLastError() in Windows) if FAILED
+  std::deque<ScanFrag> q; // fragments not yet taken by add()
+  ScanFile(): state(WAITING), err(0) {}
+};
+
+ThreadReturn scanThread(void* arg);
+
+class ScanJob {
+public:
+  ScanJob(const vector<DTMap::iterator>& v, int threads, int fragment,
+          unsigned minfrag, unsigned maxfrag, int64_t ahead);
+  ~ScanJob() {finish();}
+  int open(unsigned fi);  // wait for file fi to open. Return 0 or err
+  void get(ScanFrag& f);  // remove the next fragment of the open file
+  friend ThreadReturn scanThread(void* arg);
+private:
+  void finish();
+  const vector<DTMap::iterator>& vf;  // files to scan
+  vector<ScanFile> files;  // results by file index
+  vector<ThreadID> tid;    // scanThreads
+  const int fragment;      // log2 average fragment size in KB
+  const unsigned MIN_FRAGMENT, MAX_FRAGMENT;
+  const int64_t readahead; // bytes to prefetch, or 0
+  vector<int64_t> start;   // total size of the files before each file
+  std::mutex mu;           // protects the members below
+  std::condition_variable cv;  // signals any change
+  unsigned next;           // next file to scan
+  unsigned head;           // file read by add()
+  unsigned prefetched;     // files before this one are prefetched
+  int64_t queued;          // bytes of fragments in files[].q
+  int64_t limit;           // queued bytes above which scans wait
+  bool stop;               // set to end the scan early
+  std::exception_ptr ex;   // first error in a scanThread
+};
+
+// Scan files in v on up to threads threads
+ScanJob::ScanJob(const vector<DTMap::iterator>& v, int threads,
+                 int frag, unsigned minfrag, unsigned maxfrag, int64_t ahead):
+    vf(v), files(v.size()), fragment(frag), MIN_FRAGMENT(minfrag),
+    MAX_FRAGMENT(maxfrag), readahead(ahead>0 ? ahead : 0), start(1, 0),
+    next(0), head(0), prefetched(0), queued(0),
+    limit(int64_t(threads)<<24), stop(false) {
+  for (unsigned i=0; i<vf.size(); ++i)
+    start.push_back(start.back()+vf[i]->second.size);
+  if (limit<(1<<26)) limit=1<<26;
+  if (threads>int(vf.size())) threads=vf.size();
+  tid.resize(threads);
+  for (unsigned i=0; i<tid.size(); ++i) {
+    try {
+      run(tid[i], scanThread, this);
+    }
+    catch (...) {
+      tid.resize(i);
+      finish();
+      throw;
+    }
+  }
+}
+
+// Stop any scans still running and wait for them
+void ScanJob::finish() {
+  {
+    std::lock_guard<std::mutex> lk(mu);
+    stop=true;
+  }
+  cv.notify_all();
+  for (unsigned i=0; i<tid.size(); ++i) join(tid[i]);
+  tid.clear();
+}
+
+int ScanJob::open(unsigned fi) {
+  assert(fi<files.size());
+  StatTimer wait(STAT(scan_wait_ns));
+  std::unique_lock<std::mutex> lk(mu);
+  head=fi;
+  cv.notify_all();
+  while (!ex && files[fi].state==ScanFile::WAITING) cv.wait(lk);
+  wait.stop();
+  if (ex) std::rethrow_exception(ex);
+  return files[fi].state==ScanFile::FAILED ? files[fi].err : 0;
+}
+
+void ScanJob::get(ScanFrag& f) {
+  StatTimer wait(STAT(scan_wait_ns));
+  std::unique_lock<std::mutex> lk(mu);
+  assert(files[head].state==ScanFile::OPEN);
+  std::deque<ScanFrag>& q=files[head].q;
+  while (!ex && q.empty()) cv.wait(lk);
+  wait.stop();
+  if (ex) std::rethrow_exception(ex);
+  std::swap(f, q.front());
+  q.pop_front();
+  queued-=f.data.size()+sizeof(ScanFrag);
+  lk.unlock();
+  cv.notify_all();
+}
+
+#ifdef unix
+// Ask the OS to read n>0 bytes of file fd at offset off in the background
+void prefetch(int fd, int64_t off, int64_t n) {
+#if defined(POSIX_FADV_WILLNEED)
+  posix_fadvise(fd, off, n, POSIX_FADV_WILLNEED);
+#elif defined(F_RDADVISE)
+  struct radvisory ra;
+  ra.ra_offset=off;
+  ra.ra_count=n<(1<<30) ? n : 1<<30;
+  fcntl(fd, F_RDADVISE, &ra);
+#endif
+}
+#endif
+
+// Scan files until there are none left
+ThreadReturn scanThread(void* arg) {
+  ScanJob& job=*(ScanJob*)arg;
+  FP in=FPNULL;
+  try {
+    const int BUFSIZE=1<<20;  // input buffer
+    libzpaq::Array<char> buf(BUFSIZE);
+    libzpaq::Array<char> fragbuf(job.MAX_FRAGMENT);
+    while (true) {
+
+      // Take the next file and open it
+      unsigned fi;
+      unsigned pf=0, pfend=0;  // files to prefetch
+      {
+        std::lock_guard<std::mutex> lk(job.mu);
+        if (job.stop || job.next>=job.vf.size()) break;
+        fi=job.next++;
+        pf=job.prefetched>fi+1 ? job.prefetched : fi+1;
+        if (job.readahead>0)
+          while (job.prefetched<job.vf.size()
+              && job.start[job.prefetched]-job.start[fi+1]<job.readahead)
+            ++job.prefetched;
+        pfend=job.prefetched;
+      }
+#ifdef unix
+      for (; pf<pfend; ++pf) {  // start reading the files after fi
+        const int64_t size=job.vf[pf]->second.size;
+        if (size<=0) continue;
+        const int fd=::open(job.vf[pf]->first.c_str(), O_RDONLY);
+        if (fd<0) continue;
+        prefetch(fd, 0, size<job.readahead ? size : job.readahead);
+        ::close(fd);
+      }
+#endif
+      in=fopen(job.vf[fi]->first.c_str(), RB);
+      {
+        std::lock_guard<std::mutex> lk(job.mu);
+        if (in==FPNULL) {
+#ifdef unix
+          job.files[fi].err=errno;
+#else
+          job.files[fi].err=GetLastError();
+#endif
+          if (!job.files[fi].err) job.files[fi].err=-1;
+          job.files[fi].state=ScanFile::FAILED;
+        }
+        else
+          job.files[fi].state=ScanFile::OPEN;
+      }
+      job.cv.notify_all();
+      if (in==FPNULL) continue;
+
+      // Read fragments
+      int bufptr=0, buflen=0;  // read pointer and limit
+      int c=0;  // current byte
+#ifdef unix
+      int64_t pos=0, ahead=0;  // bytes read and prefetched
+#ifdef POSIX_FADV_SEQUENTIAL
+      posix_fadvise(fileno(in), 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+      if (job.readahead>0)
+        prefetch(fileno(in), 0, job.readahead), ahead=job.readahead;
+#endif
+      while (c!=EOF) {
+        StatTimer timer(STAT(scan_ns));
+        ScanFrag f;
+        unsigned sz=0;  // fragment size
+        FragmentHash fh(f.o1);
+        while (true) {
+          if (bufptr>=buflen) {
+            bufptr=0;
+            buflen=fread(&buf[0], 1, BUFSIZE, in);
+            if (buflen>0) addstat(STAT(bytes_read), buflen);
+#ifdef unix
+            pos+=buflen;
+            if (job.readahead>0 && buflen>0 && pos+job.readahead/2>ahead) {
+              prefetch(fileno(in), ahead, job.readahead);
+              ahead+=job.readahead;
+            }
+#endif
+          }
+          if (bufptr>=buflen) c=EOF;
+          else c=(unsigned char)buf[bufptr++];
+          if (c!=EOF) {
+            fh.update(c);
+            fragbuf[sz++]=c;
+          }
+          if (c==EOF
+              || fh.end(sz, job.fragment, job.MIN_FRAGMENT, job.MAX_FRAGMENT))
+            break;
+        }
+        assert(sz<=job.MAX_FRAGMENT);
+        f.hits=fh.hits;
+        f.data.assign(&fragbuf[0], sz);
+        f.last=(c==EOF);
+        libzpaq::SHA1 sha1;
+        sha1.write(&fragbuf[0], sz);
+        assert(uint64_t(sz)==sha1.usize());
+        memcpy(f.sha1, sha1.result(), 20);
+        analyze(f);
+        timer.stop();
+        addstat(STAT(fragments), 1);
+
+        // Queue it. Wait if too much is queued unless add() is waiting
+        // for it: the file add() reads from has nothing queued.
+        std::unique_lock<std::mutex> lk(job.mu);
+        while (!job.stop && job.queued>=job.limit
+            && !(fi==job.head && job.files[fi].q.empty()))
+          job.cv.wait(lk);
+        if (job.stop) break;
+        job.queued+=sz+sizeof(ScanFrag);
+        job.files[fi].q.push_back(ScanFrag());
+        std::swap(job.files[fi].q.back(), f);
+        lk.unlock();
+        job.cv.notify_all();
+      }
+      fclose(in);
+      in=FPNULL;
+    }
+  }
+  catch (...) {
+    if (in!=FPNULL) fclose(in);
+    {
+      std::lock_guard<std::mutex> lk(job.mu);
+      if (!job.ex) job.ex=std::current_exception();
+      job.stop=true;
+    }
+    job.cv.notify_all();
   }
   return 0;
 }
@@ -2080,6 +3469,58 @@ public:
   }    
 };
 
+//////////////////////////// Fragments ////////////////////////////
+
+void jidac_fragments(const char* data, size_t n, int fragment,
+                     unsigned blocksize, std::vector<size_t>& ends) {
+  if (fragment<0) fragment=0;
+  if (blocksize<4096) blocksize=4096;
+  unsigned minfrag, maxfrag;
+  fragmentLimits(fragment, blocksize, minfrag, maxfrag);
+  size_t i=0;
+  while (i<n) {
+    unsigned char o1[256]={0};
+    FragmentHash fh(o1);
+    unsigned sz=0;
+    while (i<n) {
+      fh.update((unsigned char)data[i++]);
+      if (fh.end(++sz, fragment, minfrag, maxfrag)) break;
+    }
+    ends.push_back(i);
+  }
+}
+
+struct JidacFragmentTable::Impl {
+  vector<HT> ht;  // fragments, ht[0] unused
+  HTIndex index;  // sha1 -> ID
+  Impl(): ht(1), index(ht, 0) {}
+};
+
+JidacFragmentTable::JidacFragmentTable(): p(new Impl) {}
+
+JidacFragmentTable::~JidacFragmentTable() {delete p;}
+
+unsigned JidacFragmentTable::size() const {return p->ht.size()-1;}
+
+unsigned JidacFragmentTable::find(const char* sha1) {
+  return p->index.find(sha1);
+}
+
+unsigned JidacFragmentTable::add(const char* sha1, int usize) {
+  p->ht.push_back(HT(sha1, usize));
+  p->index.update();
+  return p->ht.size()-1;
+}
+
+void JidacFragmentTable::truncate(unsigned n) {
+  if (n>=size()) return;
+  Impl* q=new Impl;
+  q->ht.assign(p->ht.begin(), p->ht.begin()+n+1);
+  q->index.update();
+  delete p;
+  p=q;
+}
+
 // Sort by sortkey, then by full path
 bool compareFilename(DTMap::iterator ap, DTMap::iterator bp) {
   if (ap->second.data!=bp->second.data)
@@ -2103,6 +3544,7 @@ struct WriterPair: public libzpaq::Writer {
 
 // Add or delete files from archive. Return 1 if error else 0.
 int Jidac::add() {
+  if (estimate && archive!="") error("-estimate needs archive \"\"");
 
   // Read archive or index into ht, dt, ver.
   int errors=0;
@@ -2128,7 +3570,7 @@ int Jidac::add() {
     arcname=subpart(archive, ver.size());
     if (exists(arcname.c_str())) {
       printUTF8(arcname.c_str(), stderr);
-      fprintf(stderr, ": archive exists\n");
+      zfprintf(stderr, ": archive exists\n");
       error("archive exists");
     }
     if (password) {  // derive archive salt from index
@@ -2174,10 +3616,10 @@ int Jidac::add() {
       }
     }
   }
-  if (exists(arcname.c_str())) printf("Updating ");
-  else printf("Creating ");
+  if (exists(arcname.c_str())) zprintf("Updating ");
+  else zprintf("Creating ");
   printUTF8(arcname.c_str());
-  printf(" at offset %1.0f + %1.0f\n", double(header_pos), double(offset));
+  zprintf(" at offset %1.0f + %1.0f\n", double(header_pos), double(offset));
 
   // Set method
   if (method=="") method="1";
@@ -2185,8 +3627,8 @@ int Jidac::add() {
     if (method[0]>='2' && method[0]<='9') method+="6";
     else method+="4";
   }
-  if (strchr("0123456789xs", method[0])==0)
-    error("-method must begin with 0..5, x, s");
+  if (strchr("0123456789axs", method[0])==0)
+    error("-method must begin with 0..5, a, x, s");
   assert(method.size()>=2);
   if (method[0]=='s' && index) error("cannot index in streaming mode");
 
@@ -2195,10 +3637,8 @@ int Jidac::add() {
   const int log_blocksize=20+atoi(method.c_str()+1);
   if (log_blocksize<20 || log_blocksize>31) error("blocksize must be 0..11");
   const unsigned blocksize=(1u<<log_blocksize)-4096;
-  const unsigned MAX_FRAGMENT=fragment>19 || (8128u<<fragment)>blocksize-12
-      ? blocksize-12 : 8128u<<fragment;
-  const unsigned MIN_FRAGMENT=fragment>25 || (64u<<fragment)>MAX_FRAGMENT
-      ? MAX_FRAGMENT : 64u<<fragment;
+  unsigned MIN_FRAGMENT, MAX_FRAGMENT;
+  fragmentLimits(fragment, blocksize, MIN_FRAGMENT, MAX_FRAGMENT);
 
   // Don't mix streaming and journaling
   for (unsigned i=0; i<block.size(); ++i) {
@@ -2229,7 +3669,7 @@ int Jidac::add() {
 
       // Key by first 5 bytes of filename extension, case insensitive
       int sp=0;  // sortkey byte position
-      for (string::const_iterator q=p->first.begin(); q!=p->first.end(); ++q){
+      for (const char* q=p->first.begin(); q!=p->first.end(); ++q) {
         uint64_t c=*q&255;
         if (c>='A' && c<='Z') c+='a'-'A';
         if (c=='/') sp=0, p->second.data=0;
@@ -2255,15 +3695,14 @@ int Jidac::add() {
   out.seek(header_pos, SEEK_SET);
 
   // Start compress and write jobs
-  vector<ThreadID> tid(threads*2-1);
-  ThreadID wid;
-  CompressJob job(threads, tid.size(), &out);
-  printf(
+  CompressJob job(threads, threads*2-1, &out);
+  job.verbose=summary<=0;
+  job.estimate=estimate;
+  zprintf(
       "Adding %1.6f MB in %d files -method %s -threads %d at %s.\n",
       total_size/1000000.0, int(vf.size()), method.c_str(), threads,
       dateToString(date).c_str());
-  for (unsigned i=0; i<tid.size(); ++i) run(tid[i], compressThread, &job);
-  run(wid, writeThread, &job);
+  job.start();
 
   // Append in streaming mode. Each file is a separate block. Large files
   // are split into blocks of size blocksize.
@@ -2271,12 +3710,13 @@ int Jidac::add() {
   if (method[0]=='s') {
     StringBuffer sb(blocksize+4096-128);
     for (unsigned fi=0; fi<vf.size(); ++fi) {
+      checkCancel();
       DTMap::iterator p=vf[fi];
       print_progress(total_size, total_done, summary);
       if (summary<=0) {
-        printf("+ ");
+        zprintf("+ ");
         printUTF8(p->first.c_str());
-        printf(" %1.0f\n", p->second.size+0.0);
+        zprintf(" %1.0f\n", p->second.size+0.0);
       }
       FP in=fopen(p->first.c_str(), RB);
       if (in==FPNULL) {
@@ -2314,26 +3754,28 @@ int Jidac::add() {
     }
 
     // Wait for jobs to finish
-    job.write(sb, 0, "");  // signal end of input
-    for (unsigned i=0; i<tid.size(); ++i) join(tid[i]);
-    join(wid);
+    job.finish();
 
     // Done
     const int64_t outsize=out.tell();
-    printf("%1.0f + (%1.0f -> %1.0f) = %1.0f\n",
+    zprintf("%1.0f + (%1.0f -> %1.0f) = %1.0f\n",
         double(header_pos),
         double(total_size),
         double(outsize-header_pos),
         double(outsize));
     out.close();
+    sum.header_size=header_pos;
+    sum.input_size=total_size;
+    sum.archive_size=outsize;
+    sum.errors=errors;
     return errors>0;
   }  // end if streaming
 
   // Adjust date to maintain sequential order
   if (ver.size() && ver.back().lastdate>=date) {
     const int64_t newdate=decimal_time(unix_time(ver.back().lastdate)+1);
-    fflush(stdout);
-    fprintf(stderr, "Warning: adjusting date from %s to %s\n",
+    zflush();
+    zfprintf(stderr, "Warning: adjusting date from %s to %s\n",
       dateToString(date).c_str(), dateToString(newdate).c_str());
     assert(newdate>date);
     date=newdate;
@@ -2356,25 +3798,29 @@ int Jidac::add() {
   unsigned exe=0;      // number of fragments containing x86 (exe, dll)
   const int ON=4;      // number of order-1 tables to save
   unsigned char o1prev[ON*256]={0};  // last ON order 1 predictions
-  libzpaq::Array<char> fragbuf(MAX_FRAGMENT);
   vector<unsigned> blocklist;  // list of starting fragments
 
+  // Fragment and hash the files in the background
+  ScanJob scan(vf, threads, fragment, MIN_FRAGMENT, MAX_FRAGMENT,
+      int64_t(readahead)<<20);
+
   // For each file to be added
   for (unsigned fi=0; fi<=vf.size(); ++fi) {
-    FP in=FPNULL;
-    const int BUFSIZE=4096;  // input buffer
-    char buf[BUFSIZE];
-    int bufptr=0, buflen=0;  // read pointer and limit
     if (fi<vf.size()) {
+      checkCancel();
       assert(vf[fi]->second.ptr.size()==0);
       DTMap::iterator p=vf[fi];
 
-      // Open input file
-      bufptr=buflen=0;
-      in=fopen(p->first.c_str(), RB);
-      if (in==FPNULL) {  // skip if not found
+      // Wait for the scan to open the input file
+      const int err=scan.open(fi);
+      if (err) {  // skip if not found
         p->second.date=0;
         total_size-=p->second.size;
+#ifdef unix
+        errno=err;
+#else
+        SetLastError(err);
+#endif
         printerr(p->first.c_str());
         ++errors;
         continue;
@@ -2385,86 +3831,26 @@ int Jidac::add() {
     // Read fragments
     int64_t fsize=0;  // file size after dedupe
     for (unsigned fj=0; true; ++fj) {
-      int64_t sz=0;  // fragment size;
-      unsigned hits=0;  // correct prediction count
-      int c=EOF;  // current byte
+      ScanFrag f;  // empty after the last file
       unsigned htptr=0;  // fragment index
-      char sha1result[20]={0};  // fragment hash
-      unsigned char o1[256]={0};  // order 1 context -> predicted byte
       if (fi<vf.size()) {
-        int c1=0;  // previous byte
-        unsigned h=0;  // rolling hash for finding fragment boundaries
-        libzpaq::SHA1 sha1;
-        assert(in!=FPNULL);
-        while (true) {
-          if (bufptr>=buflen) bufptr=0, buflen=fread(buf, 1, BUFSIZE, in);
-          if (bufptr>=buflen) c=EOF;
-          else c=(unsigned char)buf[bufptr++];
-          if (c!=EOF) {
-            if (c==o1[c1]) h=(h+c+1)*314159265u, ++hits;
-            else h=(h+c+1)*271828182u;
-            o1[c1]=c;
-            c1=c;
-            sha1.put(c);
-            fragbuf[sz++]=c;
-          }
-          if (c==EOF
-              || sz>=MAX_FRAGMENT
-              || (fragment<=22 && h<(1u<<(22-fragment)) && sz>=MIN_FRAGMENT))
-            break;
-        }
-        assert(sz<=MAX_FRAGMENT);
-        total_done+=sz;
+        scan.get(f);
+        total_done+=f.data.size();
 
         // Look for matching fragment
-        assert(uint64_t(sz)==sha1.usize());
-        memcpy(sha1result, sha1.result(), 20);
-        htptr=htinv.find(sha1result);
+        htptr=htinv.find(f.sha1);
+        addstat(htptr ? STAT(dedupe_hits) : STAT(dedupe_misses), 1);
       }  // end if fi<vf.size()
+      const int64_t sz=f.data.size();  // fragment size
+      const unsigned char* o1=f.o1;  // order 1 context -> predicted byte
 
       if (htptr==0) {  // not matched or last block
 
-        // Analyze fragment for redundancy, x86, text.
-        // Test for text: letters, digits, '.' and ',' followed by spaces
-        //   and no invalid UTF-8.
-        // Test for exe: 139 (mov reg, r/m) in lots of contexts.
-        // 4 tests for redundancy, measured as hits/sz. Take the highest of:
-        //   1. Successful prediction count in o1.
-        //   2. Non-uniform distribution in o1 (counted in o2).
-        //   3. Fraction of zeros in o1 (bytes never seen).
-        //   4. Fraction of matches between o1 and previous o1 (o1prev).
-        int text1=0, exe1=0;
-        int64_t h1=sz;
-        unsigned char o1ct[256]={0};  // counts of bytes in o1
-        static const unsigned char dt[256]={  // 32768/((i+1)*204)
-          160,80,53,40,32,26,22,20,17,16,14,13,12,11,10,10,
-            9, 8, 8, 8, 7, 7, 6, 6, 6, 6, 5, 5, 5, 5, 5, 5,
-            4, 4, 4, 4, 4, 4, 4, 4, 3, 3, 3, 3, 3, 3, 3, 3,
-            3, 3, 3, 3, 3, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
-            2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
-            1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
-            1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
-            1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
-            1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
-            1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1};
-        for (int i=0; i<256; ++i) {
-          if (o1ct[o1[i]]<255) h1-=(sz*dt[o1ct[o1[i]]++])>>15;
-          if (o1[i]==' ' && (isalnum(i) || i=='.' || i==',')) ++text1;
-          if (o1[i] && (i<9 || i==11 || i==12 || (i>=14 && i<=31) || i>=240))
-            --text1;
-          if (i>=192 && i<240 && o1[i] && (o1[i]<128 || o1[i]>=192))
-            --text1;
-          if (o1[i]==139) ++exe1;
-        }
-        text1=(text1>=3);
-        exe1=(exe1>=5);
-        if (sz>0) h1=h1*h1/sz; // Test 2: near 0 if random.
-        unsigned h2=h1;
-        if (h2>hits) hits=h2;
-        h2=o1ct[0]*sz/256;  // Test 3: bytes never seen or that predict 0.
-        if (h2>hits) hits=h2;
-        h2=0;
-        for (int i=0; i<256*ON; ++i)  // Test 4: compare to previous o1.
+        // Finish the analysis in analyze() with test 4:
+        // compare to previous o1.
+        unsigned hits=f.hits;
+        unsigned h2=0;
+        for (int i=0; i<256*ON; ++i)
           h2+=o1prev[i]==o1[i&255];
         h2=h2*sz/(256*ON);
         if (h2>hits) hits=h2;
@@ -2499,13 +3885,13 @@ int Jidac::add() {
           puti(sb, 0, 4); // omit first frag ID to make block movable
           puti(sb, frags, 4);  // number of frags
           string m=method;
-          if (isdigit(method[0]))
+          if (isdigit(method[0]) || method[0]=='a')
             m+=","+itos(redundancy/(sb.size()/256+1))
                  +","+itos((exe>frags)*2+(text>frags));
           string fn="jDC"+itos(date, 14)+"d"+itos(ht.size()-frags, 10);
           print_progress(total_size, total_done, summary);
           if (summary<=0)
-            printf("[%u..%u] %u -method %s\n",
+            zprintf("[%u..%u] %u -method %s\n",
                 unsigned(ht.size())-frags, unsigned(ht.size())-1,
                 unsigned(sb.size()), m.c_str());
           if (method[0]!='i')
@@ -2520,13 +3906,13 @@ int Jidac::add() {
           memset(o1prev, 0, sizeof(o1prev));
         }
 
-        // Append fragbuf to sb and update block statistics
+        // Append the fragment to sb and update block statistics
         assert(sz==0 || fi<vf.size());
-        sb.write(&fragbuf[0], sz);
+        sb.write(f.data.data(), sz);
         ++frags;
         redundancy+=hits;
-        exe+=exe1*4;
-        text+=text1*2;
+        exe+=f.exe*4;
+        text+=f.text*2;
         if (sz>=MIN_FRAGMENT) {
           memmove(o1prev, o1prev+256, 256*(ON-1));
           memcpy(o1prev+256*(ON-1), o1, 256);
@@ -2537,13 +3923,13 @@ int Jidac::add() {
       if (fi<vf.size()) {
         if (htptr==0) {
           htptr=ht.size();
-          ht.push_back(HT(sha1result, sz));
+          ht.push_back(HT(f.sha1, sz));
           htinv.update();
           fsize+=sz;
         }
-        vf[fi]->second.ptr.push_back(htptr);
+        edt.push(vf[fi]->second.ptr, htptr);
       }
-      if (c==EOF) break;
+      if (f.last) break;
     }  // end for each fragment fj
     if (fi<vf.size()) {
       dedupesize+=fsize;
@@ -2552,28 +3938,23 @@ int Jidac::add() {
       if (summary<=0) {
         string newname=rename(p->first.c_str());
         DTMap::iterator a=dt.find(newname);
-        if (a==dt.end() || a->second.date==0) printf("+ ");
-        else printf("# ");
+        if (a==dt.end() || a->second.date==0) zprintf("+ ");
+        else zprintf("# ");
         printUTF8(p->first.c_str());
         if (newname!=p->first) {
-          printf(" -> ");
+          zprintf(" -> ");
           printUTF8(newname.c_str());
         }
-        printf(" %1.0f", p->second.size+0.0);
-        if (fsize!=p->second.size) printf(" -> %1.0f", fsize+0.0);
-        printf("\n");
+        zprintf(" %1.0f", p->second.size+0.0);
+        if (fsize!=p->second.size) zprintf(" -> %1.0f", fsize+0.0);
+        zprintf("\n");
       }
-      assert(in!=FPNULL);
-      fclose(in);
-      in=FPNULL;
     }
   }  // end for each file fi
   assert(sb.size()==0);
 
   // Wait for jobs to finish
-  job.write(sb, 0, "");  // signal end of input
-  for (unsigned i=0; i<tid.size(); ++i) join(tid[i]);
-  join(wid);
+  job.finish();
 
   // Open index
   salt[0]^='7'^'z';
@@ -2586,6 +3967,21 @@ int Jidac::add() {
   // Append compressed fragment tables to archive
   int64_t cdatasize=out.tell()-header_end;
   StringBuffer is;
+
+  // Record the c, h and i blocks for the cache with the offsets that
+  // read_archive() will see: block_offset is only updated after a c
+  // block without data.
+  const bool usecache=cacheable(archive.c_str()) && !index
+      && (!archive_exists || cache_end==header_pos);
+  int64_t block_offset=cdatasize ? header_pos : header_end;
+  int64_t data_offset=header_end;  // start of next d block
+  jdx="";
+  if (usecache) {
+    puti(is, cdatasize, 8);
+    put_cache('c', date, htsize, header_pos, header_end,
+              is.c_str(), is.size());
+    is.resize(0);
+  }
   assert(blocklist.size()==job.csize.size());
   blocklist.push_back(ht.size());
   for (unsigned i=0; i<job.csize.size(); ++i) {
@@ -2595,9 +3991,14 @@ int Jidac::add() {
         is.write((const char*)ht[j].sha1, 20);
         puti(is, ht[j].usize, 4);
       }
+      if (usecache)
+        put_cache('h', date, blocklist[i], block_offset, data_offset,
+                  is.c_str(), is.size());
+      data_offset+=job.csize[i];
       libzpaq::compressBlock(&is, &wp, "0",
           ("jDC"+itos(date, 14)+"h"+itos(blocklist[i], 10)).c_str(),
           "jDC\x01");
+      block_offset=out.tell();
       is.resize(0);
     }
   }
@@ -2611,14 +4012,20 @@ int Jidac::add() {
       is.write(p->first.c_str(), strlen(p->first.c_str()));
       is.put(0);
       if (summary<=0) {
-        printf("- ");
+        zprintf("- ");
         printUTF8(p->first.c_str());
-        printf("\n");
+        zprintf("\n");
       }
       ++removed;
       if (is.size()>16000) {
+        if (usecache)
+          put_cache('i', date, ++dtcount, block_offset, data_offset,
+                    is.c_str(), is.size());
+        else
+          ++dtcount;
         libzpaq::compressBlock(&is, &wp, "1",
-            ("jDC"+itos(date)+"i"+itos(++dtcount, 10)).c_str(), "jDC\x01");
+            ("jDC"+itos(date)+"i"+itos(dtcount, 10)).c_str(), "jDC\x01");
+        block_offset=out.tell();
         is.resize(0);
       }
     }
@@ -2636,14 +4043,14 @@ int Jidac::add() {
          || a->second.size!=p->second.size  // size change
          || (p->second.data && a->second.ptr!=p->second.ptr))) { // content
         if (summary<=0 && p->second.data==0) {  // not compressed?
-          if (a==dt.end() || a->second.date==0) printf("+ ");
-          else printf("# ");
+          if (a==dt.end() || a->second.date==0) zprintf("+ ");
+          else zprintf("# ");
           printUTF8(p->first.c_str());
           if (filename!=p->first) {
-            printf(" -> ");
+            zprintf(" -> ");
             printUTF8(filename.c_str());
           }
-          printf("\n");
+          zprintf("\n");
         }
         ++added;
         puti(is, p->second.date, 8);
@@ -2665,13 +4072,19 @@ int Jidac::add() {
       }
     }
     if (is.size()>16000 || (is.size()>0 && p==edt.end())) {
+      if (usecache)
+        put_cache('i', date, ++dtcount, block_offset, data_offset,
+                  is.c_str(), is.size());
+      else
+        ++dtcount;
       libzpaq::compressBlock(&is, &wp, "1",
-          ("jDC"+itos(date)+"i"+itos(++dtcount, 10)).c_str(), "jDC\x01");
+          ("jDC"+itos(date)+"i"+itos(dtcount, 10)).c_str(), "jDC\x01");
+      block_offset=out.tell();
       is.resize(0);
     }
     if (p==edt.end()) break;
   }
-  printf("%d +added, %d -removed.\n", added, removed);
+  zprintf("%d +added, %d -removed.\n", added, removed);
   assert(is.size()==0);
 
   // Back up and write the header
@@ -2689,23 +4102,39 @@ int Jidac::add() {
       archive_end=header_pos;
     if (archive_end<archive_size) {
       if (archive_end>0) {
-        printf("truncating archive from %1.0f to %1.0f\n",
+        zprintf("truncating archive from %1.0f to %1.0f\n",
             double(archive_size), double(archive_end));
         if (truncate(arcname.c_str(), archive_end)) printerr(archive.c_str());
       }
       else if (archive_end==0) {
         if (delete_file(arcname.c_str())) {
-          printf("deleted ");
+          zprintf("deleted ");
           printUTF8(arcname.c_str());
-          printf("\n");
+          zprintf("\n");
         }
       }
     }
   }
-  fflush(stdout);
-  fprintf(stderr, "\n%1.6f + (%1.6f -> %1.6f -> %1.6f) = %1.6f MB\n",
+
+  // Append the new blocks to the cache. A cache past a rolled back
+  // version is no longer valid.
+  if (usecache && archive_end>header_pos) {
+    InputArchive in(archive.c_str());
+    write_cache(archive.c_str(), in, archive_end, header_pos, data_offset);
+  }
+  else if (cacheable(archive.c_str()) && !index && cache_end!=header_pos)
+    delete_file((archive+".jdx").c_str());
+  zflush();
+  zfprintf(stderr, "\n%1.6f + (%1.6f -> %1.6f -> %1.6f) = %1.6f MB\n",
       header_pos/1000000.0, total_size/1000000.0, dedupesize/1000000.0,
       (archive_end-header_pos)/1000000.0, archive_end/1000000.0);
+  sum.header_size=header_pos;
+  sum.input_size=total_size;
+  sum.dedupe_size=dedupesize;
+  sum.archive_size=archive_end;
+  sum.files=added;
+  sum.removed=removed;
+  sum.errors=errors;
   return errors>0;
 }
 
@@ -2769,19 +4198,31 @@ bool Jidac::equal(DTMap::const_iterator p, const char* filename) {
 // A block is extracted to memory up to the last fragment that has a file
 // pointing to it. Then the checksums are verified. Then for each file
 // pointing to the block, each of the fragments that it points to within
-// the block are written in order.
+// the block are written at their offsets in the file. Threads write
+// at the same time, to different files or to different parts of one.
+
+// An output file that is being extracted
+struct ExtractFile {
+  std::mutex mu;            // one thread opens fp
+  FP fp;                    // open file or FPNULL
+  bool created;             // the file was created
+  bool failed;              // the file could not be opened or written
+  int users;                // threads writing it, protected by write_mutex
+  ExtractFile(): fp(FPNULL), created(false), failed(false), users(0) {}
+};
 
 struct ExtractJob {         // list of jobs
   Mutex mutex;              // protects state
-  Mutex write_mutex;        // protects writing to disk
+  Mutex write_mutex;        // protects files, nopen and dt data counts
   int job;                  // number of jobs started
   Jidac& jd;                // what to extract
-  FP outf;                  // currently open output file
-  DTMap::iterator lastdt;   // currently open output file name
+  map<DT*, ExtractFile> files;  // files being written
+  int nopen;                // open files in files
   double maxMemory;         // largest memory used by any block (test mode)
   int64_t total_size;       // bytes to extract
   int64_t total_done;       // bytes extracted so far
-  ExtractJob(Jidac& j): job(0), jd(j), outf(FPNULL), lastdt(j.dt.end()),
+  enum {MAXOPEN=128};       // close idle files when more are open
+  ExtractJob(Jidac& j): job(0), jd(j), nopen(0),
       maxMemory(0), total_size(0), total_done(0) {
     init_mutex(mutex);
     init_mutex(write_mutex);
@@ -2790,8 +4231,110 @@ struct ExtractJob {         // list of jobs
     destroy_mutex(mutex);
     destroy_mutex(write_mutex);
   }
+  ExtractFile* get(DTMap::iterator p);
+  bool open(DTMap::iterator p, ExtractFile& f);
+  void done(DTMap::iterator p, ExtractFile& f, unsigned frags);
 };
 
+// Return the output file of p to write, or 0 if it is not extracted
+// or complete
+ExtractFile* ExtractJob::get(DTMap::iterator p) {
+  lock(write_mutex);
+  ExtractFile* f=0;
+  if (p->second.date && p->second.data>=0
+      && p->second.data<int64_t(p->second.ptr.size())) {
+    f=&files[&p->second];
+    ++f->users;
+  }
+  release(write_mutex);
+  return f;
+}
+
+// Create the output file of p the first time, then reopen it if it
+// was closed. Set the final size when created, so writes past the end
+// never extend it. Return false if it cannot be written.
+bool ExtractJob::open(DTMap::iterator p, ExtractFile& f) {
+  std::lock_guard<std::mutex> lk(f.mu);
+  if (f.failed) return false;
+  if (f.fp!=FPNULL || (jd.dotest && f.created)) return true;
+  string filename=jd.rename(p->first);
+  if (!f.created) {
+    f.created=true;
+    if (!jd.dotest) makepath(filename);
+    if (jd.summary<=0) {
+      lock(mutex);
+      print_progress(total_size, total_done, jd.summary);
+      if (jd.summary<=0) {
+        zprintf("> ");
+        printUTF8(filename.c_str());
+        zprintf("\n");
+      }
+      release(mutex);
+    }
+    if (jd.dotest) return true;
+    f.fp=fopen(filename.c_str(), WB);
+    if (f.fp==FPNULL) {
+      lock(mutex);
+      printerr(filename.c_str());
+      release(mutex);
+    }
+    else {
+#ifndef unix
+      if ((p->second.attr&0x200ff)==0x20000+'w') {  // sparse?
+        DWORD br=0;
+        if (!DeviceIoControl(f.fp, FSCTL_SET_SPARSE,
+            NULL, 0, NULL, 0, &br, NULL))  // set sparse attribute
+          printerr(filename.c_str());
+      }
+#endif
+      if (p->second.size>0) setsize(f.fp, p->second.size);
+    }
+  }
+  else
+    f.fp=fopen(filename.c_str(), RBPLUS);  // update existing file
+  if (f.fp==FPNULL) {
+    f.failed=true;
+    return false;
+  }
+  lock(write_mutex);
+  ++nopen;
+  release(write_mutex);
+  return true;
+}
+
+// Count frags more fragments of p written to f. When all are written,
+// close the file and set its date and attributes. Otherwise close it if
+// no thread is writing it and too many files are open.
+void ExtractJob::done(DTMap::iterator p, ExtractFile& f, unsigned frags) {
+  lock(write_mutex);
+  p->second.data+=frags;
+  assert(p->second.data<=int64_t(p->second.ptr.size()));
+  --f.users;
+  FP fp=FPNULL;
+  const bool last=p->second.data==int64_t(p->second.ptr.size());
+  if (last) {
+    assert(f.users==0);
+    fp=f.fp;
+    files.erase(&p->second);
+  }
+  else if (f.users==0 && f.fp!=FPNULL && nopen>MAXOPEN) {
+    fp=f.fp;
+    f.fp=FPNULL;
+  }
+  if (fp!=FPNULL) --nopen;
+  release(write_mutex);
+
+  // Do not set read-only attribute in Windows yet.
+  if (last && !jd.dotest) {
+    string fn=jd.rename(p->first);
+    int64_t attr=p->second.attr;
+    if ((attr&0x1ff)=='w'+256) attr=0;  // read-only?
+    close(fn.c_str(), p->second.date, attr, fp);
+  }
+  else if (fp!=FPNULL)
+    fclose(fp);
+}
+
 // Decompress blocks in a job until none are READY
 ThreadReturn decompressThread(void* arg) {
   ExtractJob& job=*(ExtractJob*)arg;
@@ -2810,6 +4353,7 @@ ThreadReturn decompressThread(void* arg) {
   // Look for next READY job.
   int next=0;  // current job
   while (true) {
+    if (cancelled()) return 0;
     lock(job.mutex);
     for (unsigned i=0; i<=job.jd.block.size(); ++i) {
       unsigned k=i+next;
@@ -2839,11 +4383,13 @@ ThreadReturn decompressThread(void* arg) {
 
     // Decompress
     double mem=0;  // how much memory used to decompress
+    StatTimer timer(STAT(decompress_ns));
     try {
       assert(b.start>0);
       assert(b.start<job.jd.ht.size());
       assert(b.size>0);
       assert(b.start+b.size<=job.jd.ht.size());
+      in.willneed(b.offset, b.bsize);
       in.seek(b.offset, SEEK_SET);
       libzpaq::Decompresser d;
       d.setInput(&in);
@@ -2860,7 +4406,7 @@ ThreadReturn decompressThread(void* arg) {
         lock(job.mutex);
         print_progress(job.total_size, job.total_done, job.jd.summary);
         if (job.jd.summary<=0)
-          printf("[%d..%d] -> %1.0f\n", b.start, b.start+b.size-1,
+          zprintf("[%d..%d] -> %1.0f\n", b.start, b.start+b.size-1,
               out.size()+0.0);
         release(job.mutex);
         if (out.size()>=output_size) break;
@@ -2868,8 +4414,8 @@ ThreadReturn decompressThread(void* arg) {
       }
       if (out.size()<output_size) {
         lock(job.mutex);
-        fflush(stdout);
-        fprintf(stderr, "output [%d..%d] %d of %d bytes\n",
+        zflush();
+        zfprintf(stderr, "output [%d..%d] %d of %d bytes\n",
              b.start, b.start+b.size-1, int(out.size()), output_size);
         release(job.mutex);
         error("unexpected end of compressed data");
@@ -2891,21 +4437,23 @@ ThreadReturn decompressThread(void* arg) {
         q+=job.jd.ht[j].usize;
         if (memcmp(sha1result, job.jd.ht[j].sha1, 20)) {
           lock(job.mutex);
-          fflush(stdout);
-          fprintf(stderr, "Job %d: fragment %u size %d checksum failed\n",
+          zflush();
+          zfprintf(stderr, "Job %d: fragment %u size %d checksum failed\n",
                  jobNumber, j, job.jd.ht[j].usize);
           release(job.mutex);
           error("bad checksum");
         }
         ++b.extracted;
       }
+      addstat(STAT(blocks_decompressed), 1);
+      addstat(STAT(decompress_bytes), out.size());
     }
 
     // If out of memory, let another thread try
     catch (std::bad_alloc& e) {
       lock(job.mutex);
-      fflush(stdout);
-      fprintf(stderr, "Job %d killed: %s\n", jobNumber, e.what());
+      zflush();
+      zfprintf(stderr, "Job %d killed: %s\n", jobNumber, e.what());
       b.state=Block::READY;
       b.extracted=0;
       out.resize(0);
@@ -2916,24 +4464,25 @@ ThreadReturn decompressThread(void* arg) {
     // Other errors: assume bad input
     catch (std::exception& e) {
       lock(job.mutex);
-      fflush(stdout);
-      fprintf(stderr, "Job %d: skipping [%u..%u] at %1.0f: %s\n",
+      zflush();
+      zfprintf(stderr, "Job %d: skipping [%u..%u] at %1.0f: %s\n",
               jobNumber, b.start+b.extracted, b.start+b.size-1,
               b.offset+0.0, e.what());
       release(job.mutex);
       continue;
     }
 
+    timer.stop();
+
     // Write the files in dt that point to this block
-    lock(job.write_mutex);
     for (unsigned ip=0; ip<b.files.size(); ++ip) {
       DTMap::iterator p=b.files[ip];
-      if (p->second.date==0 || p->second.data<0
-          || p->second.data>=int64_t(p->second.ptr.size()))
-        continue;  // don't write
+      ExtractFile* f=job.get(p);
+      if (!f) continue;  // don't write
+      unsigned frags=0;  // fragments written
 
       // Look for pointers to this block
-      const vector<unsigned>& ptr=p->second.ptr;
+      const FragList& ptr=p->second.ptr;
       int64_t offset=0;  // write offset
       for (unsigned j=0; j<ptr.size(); ++j) {
         if (ptr[j]<b.start || ptr[j]>=b.start+b.extracted) {
@@ -2941,59 +4490,8 @@ ThreadReturn decompressThread(void* arg) {
           continue;
         }
 
-        // Close last opened file if different
-        if (p!=job.lastdt) {
-          if (job.outf!=FPNULL) {
-            assert(job.lastdt!=job.jd.dt.end());
-            assert(job.lastdt->second.date);
-            assert(job.lastdt->second.data
-                   <int64_t(job.lastdt->second.ptr.size()));
-            fclose(job.outf);
-            job.outf=FPNULL;
-          }
-          job.lastdt=job.jd.dt.end();
-        }
-
         // Open file for output
-        if (job.lastdt==job.jd.dt.end()) {
-          string filename=job.jd.rename(p->first);
-          assert(job.outf==FPNULL);
-          if (p->second.data==0) {
-            if (!job.jd.dotest) makepath(filename);
-            if (job.jd.summary<=0) {
-              lock(job.mutex);
-              print_progress(job.total_size, job.total_done, job.jd.summary);
-              if (job.jd.summary<=0) {
-                printf("> ");
-                printUTF8(filename.c_str());
-                printf("\n");
-              }
-              release(job.mutex);
-            }
-            if (!job.jd.dotest) {
-              job.outf=fopen(filename.c_str(), WB);
-              if (job.outf==FPNULL) {
-                lock(job.mutex);
-                printerr(filename.c_str());
-                release(job.mutex);
-              }
-#ifndef unix
-              else if ((p->second.attr&0x200ff)==0x20000+'w') {  // sparse?
-                DWORD br=0;
-                if (!DeviceIoControl(job.outf, FSCTL_SET_SPARSE,
-                    NULL, 0, NULL, 0, &br, NULL))  // set sparse attribute
-                  printerr(filename.c_str());
-              }
-#endif
-            }
-          }
-          else if (!job.jd.dotest)
-            job.outf=fopen(filename.c_str(), RBPLUS);  // update existing file
-          if (!job.jd.dotest && job.outf==FPNULL) break;  // skip errors
-          job.lastdt=p;
-          assert(job.jd.dotest || job.outf!=FPNULL);
-        }
-        assert(job.lastdt==p);
+        if (!job.open(p, *f)) break;  // skip errors
 
         // Find block offset of fragment
         uint64_t q=0;  // fragment offset from start of block
@@ -3008,7 +4506,7 @@ ThreadReturn decompressThread(void* arg) {
 
         // Combine consecutive fragments into a single write
         assert(offset>=0);
-        ++p->second.data;
+        unsigned n=1;  // fragments in the write
         uint64_t usize=job.jd.ht[ptr[j]].usize;
         assert(usize<=0x7fffffff);
         assert(b.start+b.size<=job.jd.ht.size());
@@ -3016,8 +4514,7 @@ ThreadReturn decompressThread(void* arg) {
                && ptr[j+1]<b.start+b.size
                && job.jd.ht[ptr[j+1]].usize>=0
                && usize+job.jd.ht[ptr[j+1]].usize<=0x7fffffff) {
-          ++p->second.data;
-          assert(p->second.data<=int64_t(ptr.size()));
+          ++n;
           assert(job.jd.ht[ptr[j+1]].usize>=0);
           usize+=job.jd.ht[ptr[++j]].usize;
         }
@@ -3028,39 +4525,23 @@ ThreadReturn decompressThread(void* arg) {
         // does not include the last fragment.
         uint64_t nz=q;  // first nonzero byte in fragments to be written
         while (nz<q+usize && out.c_str()[nz]==0) ++nz;
-        if (!job.jd.dotest && (nz<q+usize || j+1==ptr.size())) {
-          fseeko(job.outf, offset, SEEK_SET);
-          fwrite(out.c_str()+q, 1, usize, job.outf);
+        if (!job.jd.dotest && (nz<q+usize || j+1==ptr.size())
+            && !writeat(f->fp, out.c_str()+q, usize, offset)) {
+          std::lock_guard<std::mutex> lk(f->mu);
+          lock(job.mutex);
+          printerr(job.jd.rename(p->first).c_str());
+          release(job.mutex);
+          f->failed=true;
+          break;
         }
+        frags+=n;
         offset+=usize;
         lock(job.mutex);
         job.total_done+=usize;
         release(job.mutex);
-
-        // Close file. If this is the last fragment then set date and attr.
-        // Do not set read-only attribute in Windows yet.
-        if (p->second.data==int64_t(ptr.size())) {
-          assert(p->second.date);
-          assert(job.lastdt!=job.jd.dt.end());
-          assert(job.jd.dotest || job.outf!=FPNULL);
-          if (!job.jd.dotest) {
-            assert(job.outf!=FPNULL);
-            string fn=job.jd.rename(p->first);
-            int64_t attr=p->second.attr;
-            int64_t date=p->second.date;
-            if ((p->second.attr&0x1ff)=='w'+256) attr=0;  // read-only?
-            if (p->second.data!=int64_t(p->second.ptr.size()))
-              date=attr=0;  // not last frag
-            close(fn.c_str(), date, attr, job.outf);
-            job.outf=FPNULL;
-          }
-          job.lastdt=job.jd.dt.end();
-        }
       } // end for j
+      job.done(p, *f, frags);
     } // end for ip
-
-    // Last file
-    release(job.write_mutex);
   } // end while true
 
   // Last block
@@ -3116,9 +4597,9 @@ int Jidac::extract() {
     OutputArchive out(repack, new_password, salt, 0);
     copy(in, out);
     printUTF8(archive.c_str());
-    printf(" %1.0f ", in.tell()+.0);
+    zprintf(" %1.0f ", in.tell()+.0);
     printUTF8(repack);
-    printf(" -> %1.0f\n", out.tell()+.0);
+    zprintf(" -> %1.0f\n", out.tell()+.0);
     out.close();
     return 0;
   }
@@ -3161,7 +4642,7 @@ int Jidac::extract() {
       if (in.tell()!=ver[i].offset) error("I'm lost");
 
       // Read C block. Assume uncompressed and hash is present
-      static char hdr[256]={0};  // Read C block
+      char hdr[256]={0};  // Read C block
       int hsize=ver[i].data_offset-ver[i].offset;
       if (hsize<70 || hsize>255) error("bad C block size");
       if (in.read(hdr, hsize)!=hsize) error("EOF in header");
@@ -3169,8 +4650,8 @@ int Jidac::extract() {
           || (hdr[hsize-22]&255)!=253  // start of SHA1 marker
           || (hdr[hsize-1]&255)!=255) {  // end of block marker
         for (int j=0; j<hsize; ++j)
-          printf("%d%c", hdr[j]&255, j%10==9 ? '\n' : ' ');
-        printf("at %1.0f\n", ver[i].offset+.0);
+          zprintf("%d%c", hdr[j]&255, j%10==9 ? '\n' : ' ');
+        zprintf("at %1.0f\n", ver[i].offset+.0);
         error("C block in weird format");
       }
       memcpy(hdr+hsize-34, 
@@ -3188,7 +4669,7 @@ int Jidac::extract() {
       if (copy(in, out, n)!=n) error("EOF");  // copy H and I blocks
     }
     printUTF8(index);
-    printf(" -> %1.0f\n", out.tell()+.0);
+    zprintf(" -> %1.0f\n", out.tell()+.0);
     out.close();
     return 0;
   }
@@ -3205,18 +4686,18 @@ int Jidac::extract() {
       const bool isdir=p->first[p->first.size()-1]=='/';
       if (!repack && !dotest && force && !isdir && equal(p, fn.c_str())) {
         if (summary<=0) {  // identical
-          printf("= ");
+          zprintf("= ");
           printUTF8(fn.c_str());
-          printf("\n");
+          zprintf("\n");
         }
         close(fn.c_str(), p->second.date, p->second.attr);
         ++skipped;
       }
       else if (!repack && !dotest && !force && exists(fn)) {  // exists, skip
         if (summary<=0) {
-          printf("? ");
+          zprintf("? ");
           printUTF8(fn.c_str());
-          printf("\n");
+          zprintf("\n");
         }
         ++skipped;
       }
@@ -3228,9 +4709,9 @@ int Jidac::extract() {
         for (unsigned i=0; p->second.data>=0 && i<p->second.ptr.size(); ++i) {
           unsigned j=p->second.ptr[i];  // fragment index
           if (j==0 || j>=ht.size() || ht[j].usize<-1) {
-            fflush(stdout);
+            zflush();
             printUTF8(p->first.c_str(), stderr);
-            fprintf(stderr, ": bad frag IDs, skipping...\n");
+            zfprintf(stderr, ": bad frag IDs, skipping...\n");
             p->second.data=-1;  // skip
             continue;
           }
@@ -3262,9 +4743,9 @@ int Jidac::extract() {
     }  // end if selected
   }  // end for
   if (!force && skipped>0)
-    printf("%d ?existing files skipped (-force overwrites).\n", skipped);
+    zprintf("%d ?existing files skipped (-force overwrites).\n", skipped);
   if (force && skipped>0)
-    printf("%d =identical files skipped.\n", skipped);
+    zprintf("%d =identical files skipped.\n", skipped);
 
   // Repack to new archive
   if (repack) {
@@ -3299,9 +4780,9 @@ int Jidac::extract() {
         copy(in, out, block[i].bsize);
       }
     }
-    printf("Data %1.0f -> ", csize+.0);
+    zprintf("Data %1.0f -> ", csize+.0);
     csize=out.tell()-dstart;
-    printf("%1.0f\n", csize+.0);
+    zprintf("%1.0f\n", csize+.0);
 
     // Re-create referenced H blocks using latest date
     for (unsigned i=0; i<block.size(); ++i) {
@@ -3354,9 +4835,9 @@ int Jidac::extract() {
 
     // Summarize result
     printUTF8(archive.c_str());
-    printf(" %1.0f -> ", sz+.0);
+    zprintf(" %1.0f -> ", sz+.0);
     printUTF8(repack);
-    printf(" %1.0f\n", out.tell()+.0);
+    zprintf(" %1.0f\n", out.tell()+.0);
 
     // Rewrite C block
     out.seek(cstart, SEEK_SET);
@@ -3366,7 +4847,7 @@ int Jidac::extract() {
   }
 
   // Decompress archive in parallel
-  printf("Extracting %1.6f MB in %d files -threads %d\n",
+  zprintf("Extracting %1.6f MB in %d files -threads %d\n",
       job.total_size/1000000.0, total_files, threads);
   vector<ThreadID> tid(threads);
   for (unsigned i=0; i<tid.size(); ++i) run(tid[i], decompressThread, &job);
@@ -3381,6 +4862,7 @@ int Jidac::extract() {
       if (block[i].usize<0 && block[i].size>0) {
         Block& b=block[i];
         try {
+          in.willneed(b.offset, b.bsize);
           in.seek(b.offset, SEEK_SET);
           libzpaq::Decompresser d;
           d.setInput(&in);
@@ -3407,9 +4889,9 @@ int Jidac::extract() {
                 dtptr=b.files[k];
                 lock(job.mutex);
                 if (summary<=0) {
-                  printf("> ");
+                  zprintf("> ");
                   printUTF8(outname.c_str());
-                  printf("\n");
+                  zprintf("\n");
                 }
                 if (!dotest) {
                   makepath(outname);
@@ -3449,18 +4931,24 @@ int Jidac::extract() {
         }
         catch(std::exception& e) {
           lock(job.mutex);
-          printf("Skipping block: %s\n", e.what());
+          zprintf("Skipping block: %s\n", e.what());
           release(job.mutex);
         }
       }
     }
     if (outf!=FPNULL) fclose(outf);
   }
-  if (segments>0) printf("%u streaming segments extracted\n", segments);
+  if (segments>0) zprintf("%u streaming segments extracted\n", segments);
 
   // Wait for threads to finish
   for (unsigned i=0; i<tid.size(); ++i) join(tid[i]);
 
+  // Close files that were not completely written
+  for (map<DT*, ExtractFile>::iterator p=job.files.begin();
+       p!=job.files.end(); ++p)
+    if (p->second.fp!=FPNULL) fclose(p->second.fp);
+  checkCancel();
+
   // Create empty directories and set file dates and attributes
   if (!dotest) {
     for (DTMap::reverse_iterator p=dt.rbegin(); p!=dt.rend(); ++p) {
@@ -3482,25 +4970,27 @@ int Jidac::extract() {
         && fn!="" && fn[fn.size()-1]!='/') {
       ++extracted;
       if (p->second.ptr.size()!=unsigned(p->second.data)) {
-        fflush(stdout);
+        zflush();
         if (++errors==1)
-          fprintf(stderr,
+          zfprintf(stderr,
           "\nFailed (extracted/total fragments, file):\n");
-        fprintf(stderr, "%u/%u ",
+        zfprintf(stderr, "%u/%u ",
                 int(p->second.data), int(p->second.ptr.size()));
         printUTF8(fn.c_str(), stderr);
-        fprintf(stderr, "\n");
+        zfprintf(stderr, "\n");
       }
     }
   }
   if (errors>0) {
-    fflush(stdout);
-    fprintf(stderr,
+    zflush();
+    zfprintf(stderr,
         "\nExtracted %u of %u files OK (%u errors)"
         " using %1.3f MB x %d threads\n",
         extracted-errors, extracted, errors, job.maxMemory/1000000,
         int(tid.size()));
   }
+  sum.files=extracted-errors;
+  sum.errors=errors;
   return errors>0;
 }
 
@@ -3531,8 +5021,8 @@ int Jidac::list() {
   // Read external files into edt
   for (unsigned i=0; i<files.size(); ++i)
     scandir(files[i].c_str());
-  if (files.size()) printf("%d external files.\n", int(edt.size()));
-  printf("\n");
+  if (files.size()) zprintf("%d external files.\n", int(edt.size()));
+  zprintf("\n");
 
   // Compute directory sizes as the sum of their contents
   DTMap* dp[2]={&dt, &edt};
@@ -3616,23 +5106,23 @@ int Jidac::list() {
     if (!strchr(nottype.c_str(), p->second.data)) {
       if (p->first!="" && p->first[p->first.size()-1]!='/')
         usize+=p->second.size;
-      printf("%c %s %12.0f ", char(p->second.data),
+      zprintf("%c %s %12.0f ", char(p->second.data),
           dateToString(p->second.date).c_str(), p->second.size+0.0);
       if (!noattributes)
-        printf("%s ", attrToString(p->second.attr).c_str());
+        zprintf("%s ", attrToString(p->second.attr).c_str());
       printUTF8(p->first.c_str());
       if (summary<0) {  // frag pointers
-        const vector<unsigned>& ptr=p->second.ptr;
+        const FragList& ptr=p->second.ptr;
         bool hyphen=false;
         for (int j=0; j<int(ptr.size()); ++j) {
           if (j==0 || j==int(ptr.size())-1 || ptr[j]!=ptr[j-1]+1
               || ptr[j]!=ptr[j+1]-1) {
-            if (!hyphen) printf(" ");
+            if (!hyphen) zprintf(" ");
             hyphen=false;
-            printf("%d", ptr[j]);
+            zprintf("%d", ptr[j]);
           }
           else {
-            if (!hyphen) printf("-");
+            if (!hyphen) zprintf("-");
             hyphen=true;
           }
         }
@@ -3640,13 +5130,13 @@ int Jidac::list() {
       unsigned v;  // list version updates, deletes, compressed size
       if (all>0 && p->first.size()==all+1u && (v=atoi(p->first.c_str()))>0
           && v<ver.size()) {  // version info
-        printf(" +%d -%d -> %1.0f", ver[v].updates, ver[v].deletes,
+        zprintf(" +%d -%d -> %1.0f", ver[v].updates, ver[v].deletes,
             (v+1<ver.size() ? ver[v+1].offset : csize)-ver[v].offset+0.0);
         if (summary<0)  // print fragment range
-          printf(" %u-%u", ver[v].firstFragment,
+          zprintf(" %u-%u", ver[v].firstFragment,
               v+1<ver.size()?ver[v+1].firstFragment-1:unsigned(ht.size())-1);
       }
-      printf("\n");
+      zprintf("\n");
     }
   }  // end for i = each file version
 
@@ -3674,24 +5164,27 @@ int Jidac::list() {
   }
 
   // Print archive statistics
-  printf("\n"
+  zprintf("\n"
       "%1.6f MB of %1.6f MB (%d files) shown\n"
       "  -> %1.6f MB (%u refs to %u of %u frags) after dedupe\n"
       "  -> %1.6f MB compressed.\n",
        usize/1000000.0, allsize/1000000.0, nfiles, 
        ddsize/1000000.0, refs, nfrags, unsigned(ht.size())-1,
        (csize+dhsize-dcsize)/1000000.0);
+  sum.input_size=usize;
+  sum.dedupe_size=ddsize;
+  sum.files=nfiles;
   if (unknown_frags)
-    printf("%d fragments have unknown size\n", unknown_frags);
+    zprintf("%d fragments have unknown size\n", unknown_frags);
   if (files.size())
-    printf(
+    zprintf(
        "%d =same, %d #different, %d +external, %d -internal\n",
         matches, mismatches, external, internal);
   if (summary>0)
-    printf("%d of largest %d files are ^duplicates\n",
+    zprintf("%d of largest %d files are ^duplicates\n",
         duplicates, summary);
   if (dhsize!=dcsize)  // index?
-    printf("Note: %1.0f of %1.0f compressed bytes are in archive\n",
+    zprintf("Note: %1.0f of %1.0f compressed bytes are in archive\n",
         dcsize+0.0, dhsize+0.0);
   return 0;
 }
@@ -3719,19 +5212,77 @@ int main() {
 #endif
 
   global_start=mtime();  // get start time
+  return jidac_command(argc, argv, 0, 0);
+}
+
+// Run one command with its own Jidac and console
+int jidac_command(int argc, const char** argv, const zpaq_console* con,
+                  zpaq_jidac_summary* summary, string* err,
+                  const zpaq_jidac_monitor* mon) {
+  CmdStats counters;
+  const bool counting=mon && (mon->stats || mon->progress);
+  Cmd c(con, mtime(), counting ? mon : 0, counting ? &counters : 0,
+      mon ? mon->cancel : 0);
+  Cmd* const outer=cmd;
+  cmd=&c;
   int errorcode=0;
+  bool exited=false;  // by ExitCommand, without the time line
+  zpaq_jidac_summary sum;
+  memset(&sum, 0, sizeof(sum));
   try {
+#ifndef unix
+    // Replace \ with / like wtou() does for main(), for callers that
+    // pass UTF-8 directly
+    vector<string> args(argv, argv+argc);
+    vector<const char*> argp(argc+1, (const char*)0);
+    for (int i=0; i<argc; ++i) {
+      std::replace(args[i].begin(), args[i].end(), '\\', '/');
+      argp[i]=args[i].c_str();
+    }
+    argv=&argp[0];
+#endif
     Jidac jidac;
-    errorcode=jidac.doCommand(argc, argv);
+    try {
+      errorcode=jidac.doCommand(argc, argv);
+    }
+    catch (ExitCommand& e) {
+      errorcode=e.code;
+      exited=true;
+    }
+    sum=jidac.sum;
   }
   catch (std::exception& e) {
-    fflush(stdout);
-    fprintf(stderr, "zpaq error: %s\n", e.what());
+    zflush();
+    zfprintf(stderr, "zpaq error: %s\n", e.what());
+    if (err) *err=e.what();
     errorcode=2;
   }
-  fflush(stdout);
-  fprintf(stderr, "%1.3f seconds %s\n", (mtime()-global_start)/1000.0,
-      errorcode>1 ? "(with errors)" :
-      errorcode>0 ? "(with warnings)" : "(all OK)");
+  zflush();
+  if (!exited)
+    zfprintf(stderr, "%1.3f seconds %s\n", (mtime()-c.start)/1000.0,
+        errorcode>1 ? "(with errors)" :
+        errorcode>0 ? "(with warnings)" : "(all OK)");
+  cmd=outer;
+  sum.exit_code=errorcode;
+  if (summary) *summary=sum;
+  if (counting && mon->stats) counters.get(*mon->stats);
   return errorcode;
 }
+
+static void discardText(void*, const char*, size_t) {}
+
+size_t jidac_test_archive_fraglists(const char* arc) {
+  static const zpaq_console quiet={discardText, discardText, 0};
+  Cmd c(&quiet, mtime(), 0, 0, 0);
+  Cmd* const outer=cmd;
+  cmd=&c;
+  size_t r=0;
+  try {
+    Jidac jidac;
+    const char* argv[]={"zpaq", "l", arc};
+    if (jidac.doCommand(3, argv)==0) r=jidac.dt.fragBytes();
+  }
+  catch (...) {}
+  cmd=outer;
+  return r;
+}
@@ -4,10 +4,16 @@
 #include <cstdint>
 #include <cstring>
 #include <exception>
+#include <memory>
 #include <new>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
 #include <condition_variable>
 #include <deque>
+#include <functional>
 #include <mutex>
 #include <string>
 #include <thread>
@@ -16,74 +22,8 @@
 #include <cstdio>
 #include <cstdlib>
 
-// Platform-specific headers for file descriptor operations
-#ifdef _WIN32
-    #include <io.h>      // for _dup, _dup2, _close, _fileno
-    #include <windows.h> // for LPWSTR
-    #define dup _dup
-    #define dup2 _dup2
-    #define close _close
-    #define fileno _fileno
-    #define DEV_NULL "NUL"
-    
-    // On Windows, wmain signature uses LPWSTR*
-    // This is renamed to zpaq_cli_main via preprocessor
-    int zpaq_cli_main(int argc, LPWSTR* argv);
-    
-    // Helper to convert UTF-8 to wide string
-    static std::wstring utf8_to_wide(const char* utf8) {
-        if (!utf8) return std::wstring();
-        int len = MultiByteToWideChar(CP_UTF8, 0, utf8, -1, nullptr, 0);
-        if (len == 0) return std::wstring();
-        std::wstring result(len - 1, 0);
-        MultiByteToWideChar(CP_UTF8, 0, utf8, -1, &result[0], len);
-        return result;
-    }
-    
-    // Wrapper to call zpaq_cli_main with char** arguments
-    static int zpaq_cli_main_wrapper(int argc, const char** argv) {
-        std::vector<std::wstring> wargs;
-        std::vector<LPWSTR> wargv;
-        wargs.reserve(argc);
-        wargv.reserve(argc);
-        
-        for (int i = 0; i < argc; ++i) {
-            wargs.push_back(utf8_to_wide(argv[i]));
-            wargv.push_back(&wargs.back()[0]);
-        }
-        
-        return zpaq_cli_main(argc, wargv.data());
-    }
-    
-    #define zpaq_cli_main zpaq_cli_main_wrapper
-#else
-    #include <unistd.h>  // for dup, dup2, close
-    #define DEV_NULL "/dev/null"
-    
-    // On UNIX, main signature uses const char**
-    // This is renamed to zpaq_cli_main via preprocessor
-    int zpaq_cli_main(int argc, const char** argv);
-#endif
-
-// Reverse-search helper:
-// - Use system memrchr where it is known to exist (GNU/Linux + BSDs).
-// - Use a local fallback on platforms where memrchr is typically unavailable
-//   (notably macOS and Windows). IF PORTING: Here may be a point to change!
-static inline const void* zpaq_memrchr(const void* s, int c, size_t n) {
-#if defined(__APPLE__) || defined(_WIN32)
-    if (!s || n == 0) return nullptr;
-    const unsigned char* begin = static_cast<const unsigned char*>(s);
-    const unsigned char* p = begin + n;
-    const unsigned char ch = static_cast<unsigned char>(c);
-    while (p != begin) {
-        --p;
-        if (*p == ch) return p;
-    }
-    return nullptr;
-#else
-    return ::memrchr(s, c, n);
-#endif
-}
+// zpaq.cpp commands, run in-process by zpaq_jidac_run() and friends
+#include "zpaq/jidac.h"
 
 namespace {
 
@@ -121,6 +61,34 @@ struct CountingWriter final : public libzpaq::Writer {
   }
 };
 
+// Write n bytes in pieces that fit libzpaq's int lengths.
+inline void write_all(libzpaq::Writer* out, const char* p, size_t n) {
+  while (n > 0) {
+    const int len = static_cast<int>(n < (1u << 30) ? n : (1u << 30));
+    out->write(p, len);
+    p += len;
+    n -= static_cast<size_t>(len);
+  }
+}
+
+// Reader that keeps a copy of everything read from `in`, used to cut the
+// input into whole blocks while a Decompresser skips over them.
+struct RecordingReader final : public libzpaq::Reader {
+  libzpaq::Reader* in = nullptr;
+  std::string rec;
+
+  int get() override {
+    const int c = in->get();
+    if (c >= 0) rec.push_back(static_cast<char>(c));
+    return c;
+  }
+  int read(char* buf, int n) override {
+    const int got = in->read(buf, n);
+    if (got > 0) rec.append(buf, static_cast<size_t>(got));
+    return got;
+  }
+};
+
 } // namespace
 
 namespace {
@@ -203,11 +171,16 @@ struct zpaq_writer {
       : ctx(c), put_cb(p), write_cb(w) {}
 };
 
-class RustReader final : public libzpaq::Reader {
+// Opaque handle types passed across the FFI boundary. A handle is either
+// backed by Rust callbacks or by memory owned on this side.
+class RustReader : public libzpaq::Reader {};
+class RustWriter : public libzpaq::Writer {};
+
+class CallbackReader final : public RustReader {
   zpaq_reader inner_;
 
 public:
-  RustReader(void* ctx, zpaq_get_fn get_cb, zpaq_read_fn read_cb)
+  CallbackReader(void* ctx, zpaq_get_fn get_cb, zpaq_read_fn read_cb)
       : inner_(ctx, get_cb, read_cb) {}
 
   int get() override {
@@ -236,7 +209,7 @@ public:
   }
 };
 
-class RustWriter final : public libzpaq::Writer {
+class CallbackWriter final : public RustWriter {
   zpaq_writer inner_;
   char buf_[kPutBufferSize];
   int used_ = 0;
@@ -256,10 +229,10 @@ class RustWriter final : public libzpaq::Writer {
   }
 
 public:
-  RustWriter(void* ctx, zpaq_put_fn put_cb, zpaq_write_fn write_cb)
+  CallbackWriter(void* ctx, zpaq_put_fn put_cb, zpaq_write_fn write_cb)
       : inner_(ctx, put_cb, write_cb) {}
 
-  ~RustWriter() override { flush_buf(); }
+  ~CallbackWriter() override { flush_buf(); }
 
   void put(int c) override {
     if (!inner_.write_cb && !inner_.put_cb) return;
@@ -278,407 +251,1462 @@ public:
     // fallback to per-byte put
     for (int i = 0; i < n; ++i) put(static_cast<unsigned char>(buf[i]));
   }
-};
+};
+
+// Reads a caller-owned byte range. The memory must outlive the reader.
+class MemoryReader final : public RustReader {
+  const char* p_;
+  size_t n_;
+  size_t pos_ = 0;
+
+public:
+  MemoryReader(const char* p, size_t n) : p_(p), n_(p ? n : 0) {}
+
+  int get() override {
+    if (pos_ >= n_) return -1;
+    return static_cast<unsigned char>(p_[pos_++]);
+  }
+
+  int read(char* buf, int n) override {
+    if (!buf || n <= 0) return 0;
+    size_t k = n_ - pos_;
+    if (k > static_cast<size_t>(n)) k = static_cast<size_t>(n);
+    if (k) std::memcpy(buf, p_ + pos_, k);
+    pos_ += k;
+    return static_cast<int>(k);
+  }
+
+  // Lets the decompresser decode straight from the caller's memory.
+  int view(const char** p, int n) override {
+    if (!p || n <= 0) return 0;
+    size_t k = n_ - pos_;
+    if (k > static_cast<size_t>(n)) k = static_cast<size_t>(n);
+    *p = p_ + pos_;
+    pos_ += k;
+    return static_cast<int>(k);
+  }
+};
+
+// Appends output to a growable buffer owned by the writer.
+class BufferWriter final : public RustWriter {
+  std::string buf_;
+
+public:
+  explicit BufferWriter(size_t initial) { buf_.reserve(initial); }
+
+  void put(int c) override { buf_.push_back(static_cast<char>(c)); }
+
+  void write(const char* buf, int n) override {
+    if (buf && n > 0) buf_.append(buf, static_cast<size_t>(n));
+  }
+
+  const char* data() const { return buf_.data(); }
+  size_t size() const { return buf_.size(); }
+  void clear() { buf_.clear(); }
+};
+
+// Opaque handles exposed to Rust.
+RustReader* zpaq_reader_new(void* ctx, zpaq_get_fn get_cb, zpaq_read_fn read_cb) {
+  clear_last_error();
+  try {
+    return new CallbackReader(ctx, get_cb, read_cb);
+  } catch (const std::exception& e) {
+    set_last_error(e.what());
+    return nullptr;
+  }
+}
+
+void zpaq_reader_free(RustReader* r) {
+  delete r;
+}
+
+RustWriter* zpaq_writer_new(void* ctx, zpaq_put_fn put_cb, zpaq_write_fn write_cb) {
+  clear_last_error();
+  try {
+    return new CallbackWriter(ctx, put_cb, write_cb);
+  } catch (const std::exception& e) {
+    set_last_error(e.what());
+    return nullptr;
+  }
+}
+
+void zpaq_writer_free(RustWriter* w) {
+  delete w;
+}
+
+RustReader* zpaq_reader_new_memory(const char* data, size_t len) {
+  clear_last_error();
+  try {
+    return new MemoryReader(data, len);
+  } catch (const std::exception& e) {
+    set_last_error(e.what());
+    return nullptr;
+  }
+}
+
+RustWriter* zpaq_writer_new_buffer(size_t initial) {
+  clear_last_error();
+  try {
+    return new BufferWriter(initial);
+  } catch (const std::exception& e) {
+    set_last_error(e.what());
+    return nullptr;
+  }
+}
+
+// Accessors for writers created by zpaq_writer_new_buffer. They return
+// null/0 for callback-backed writers.
+const char* zpaq_writer_buffer_data(RustWriter* w) {
+  auto* b = dynamic_cast<BufferWriter*>(w);
+  return b ? b->data() : nullptr;
+}
+
+size_t zpaq_writer_buffer_size(RustWriter* w) {
+  auto* b = dynamic_cast<BufferWriter*>(w);
+  return b ? b->size() : 0;
+}
+
+void zpaq_writer_buffer_clear(RustWriter* w) {
+  if (auto* b = dynamic_cast<BufferWriter*>(w)) b->clear();
+}
+
+// ---------------- Top-level convenience API ----------------
+
+int zpaq_compress(RustReader* in, RustWriter* out, const char* method, const char* filename,
+                 const char* comment, int dosha1) {
+  clear_last_error();
+  try {
+    libzpaq::compress(in, out, method, filename, comment, dosha1 != 0);
+    return 0;
+  } catch (const std::exception& e) {
+    set_last_error(e.what());
+    return -1;
+  }
+}
+
+int zpaq_decompress(RustReader* in, RustWriter* out) {
+  clear_last_error();
+  try {
+    libzpaq::decompress(in, out);
+    return 0;
+  } catch (const std::exception& e) {
+    set_last_error(e.what());
+    return -1;
+  }
+}
+
+static int method_block_size(const char* method) {
+  int bs = 4;
+  if (method && method[0] && method[1] >= '0' && method[1] <= '9') {
+    bs = method[1] - '0';
+    if (method[2] >= '0' && method[2] <= '9') bs = bs * 10 + (method[2] - '0');
+    if (bs > 11) bs = 11;
+  }
+  // Same formula as libzpaq::compress
+  const int block = (0x100000 << bs) - 4096;
+  return block > 0 ? block : (1 << 20);
+}
+
+int zpaq_compress_size(RustReader* in, const char* method, const char* filename, const char* comment, int dosha1,
+                      uint64_t* out_size) {
+  clear_last_error();
+  try {
+    CountingWriter out;
+    libzpaq::compress(in, &out, method, filename, comment, dosha1 != 0);
+    if (out_size) *out_size = out.n;
+    return 0;
+  } catch (const std::exception& e) {
+    set_last_error(e.what());
+    return -1;
+  }
+}
+
+int zpaq_decompress_size(RustReader* in, uint64_t* out_size) {
+  clear_last_error();
+  try {
+    CountingWriter out;
+    libzpaq::decompress(in, &out);
+    if (out_size) *out_size = out.n;
+    return 0;
+  } catch (const std::exception& e) {
+    set_last_error(e.what());
+    return -1;
+  }
+}
+
+// Compress in method_block_size() blocks on `threads` workers, like
+// libzpaq::compress(): only the first block carries filename and comment.
+// Input comes from `in`, or if `in` is null from src[0..src_len-1], which
+// the workers copy directly into their block buffers. The calling thread
+// writes finished blocks to `out` in input order. If `out` is null the
+// blocks are only counted. The total output size is stored in *out_size
+// if not null.
+//
+// At most threads+1 blocks are in flight: the reader waits for the oldest
+// block to be written before starting another. Block buffers are reused.
+static void compress_parallel(libzpaq::Reader* in, const char* src, size_t src_len,
+                              libzpaq::Writer* out, const char* method, const char* filename,
+                              const char* comment, bool dosha1, int threads, uint64_t* out_size) {
+  const int bs = method_block_size(method);
+  struct Block {
+    size_t idx = 0;
+    const char* src = nullptr;  // input not yet copied to data, or null
+    size_t len = 0;
+    libzpaq::StringBuffer* data = nullptr;    // input
+    libzpaq::StringBuffer* result = nullptr;  // output unless counting
+    uint64_t size = 0;
+    bool ready = false;
+  };
+
+  std::mutex mu;
+  std::condition_variable cv;
+  std::condition_variable cv_ready;
+  std::deque<Block*> q;
+  std::deque<std::unique_ptr<Block>> pending;  // in input order
+  bool done = false;
+  bool failed = false;
+  std::string fail_msg;
+  uint64_t total = 0;
+  int busy = 0;  // blocks being compressed
+
+  // Buffers are only taken and returned by the calling thread. bs+1
+  // makes StringBuffer allocate one block exactly instead of 3.
+  std::vector<std::unique_ptr<libzpaq::StringBuffer>> bufs;
+  std::vector<libzpaq::StringBuffer*> free_bufs;
+  auto take_buf = [&](size_t init) {
+    if (!free_bufs.empty()) {
+      libzpaq::StringBuffer* sb = free_bufs.back();
+      free_bufs.pop_back();
+      sb->resize(0);
+      return sb;
+    }
+    bufs.emplace_back(new libzpaq::StringBuffer(init));
+    return bufs.back().get();
+  };
+
+  auto worker = [&]() {
+    for (;;) {
+      Block* blk = nullptr;
+      int sa_threads = 1;  // threads to sort the block with
+      {
+        std::unique_lock<std::mutex> lock(mu);
+        cv.wait(lock, [&] { return failed || done || !q.empty(); });
+        if (failed) return;
+        if (q.empty()) {
+          if (done) return;
+          continue;
+        }
+        blk = q.front();
+        q.pop_front();
+        // Threads that no other block will use help build the suffix
+        // array of an LZ77 or BWT block, e.g. the last or only block.
+        sa_threads = std::max(threads - busy - static_cast<int>(q.size()), 1);
+        ++busy;
+      }
+
+      try {
+        if (blk->src) blk->data->write(blk->src, static_cast<int>(blk->len));
+        const char* fn = (blk->idx == 0) ? filename : nullptr;
+        const char* cm = (blk->idx == 0) ? comment : nullptr;
+        if (blk->result) {
+          libzpaq::compressBlock(blk->data, blk->result, method, fn, cm, dosha1, nullptr, sa_threads);
+          blk->size = blk->result->size();
+        } else {
+          CountingWriter counter;
+          libzpaq::compressBlock(blk->data, &counter, method, fn, cm, dosha1, nullptr, sa_threads);
+          blk->size = counter.n;
+        }
+
+        {
+          std::lock_guard<std::mutex> lock(mu);
+          blk->ready = true;
+          --busy;
+        }
+        cv_ready.notify_all();
+      } catch (const std::exception& e) {
+        {
+          std::lock_guard<std::mutex> lock(mu);
+          if (!failed) {
+            failed = true;
+            fail_msg = e.what();
+          }
+        }
+        cv.notify_all();
+        cv_ready.notify_all();
+        return;
+      }
+    }
+  };
+
+  // Write finished blocks at the front of pending and recycle their
+  // buffers until the front block is unfinished. If wait, first wait for
+  // it while more than keep blocks are pending. Return false if a worker
+  // failed.
+  auto drain = [&](bool wait, size_t keep) {
+    for (;;) {
+      Block* front = nullptr;
+      {
+        std::unique_lock<std::mutex> lock(mu);
+        if (wait && pending.size() > keep)
+          cv_ready.wait(lock, [&] { return failed || pending.front()->ready; });
+        if (failed) return false;
+        if (pending.empty() || !pending.front()->ready) return true;
+        front = pending.front().get();
+      }
+      if (front->result) write_all(out, front->result->c_str(), front->result->size());
+      total += front->size;
+      free_bufs.push_back(front->data);
+      if (front->result) free_bufs.push_back(front->result);
+      std::lock_guard<std::mutex> lock(mu);
+      pending.pop_front();
+    }
+  };
+
+  std::vector<std::thread> pool;
+  auto stop = [&]() {
+    {
+      std::lock_guard<std::mutex> lock(mu);
+      done = true;
+    }
+    cv.notify_all();
+    for (auto& t : pool) t.join();
+    pool.clear();
+  };
+
+  try {
+    const size_t max_inflight = static_cast<size_t>(threads) + 1;
+    pool.reserve(static_cast<size_t>(threads));
+    for (int i = 0; i < threads; ++i) pool.emplace_back(worker);
+
+    size_t idx = 0;
+    size_t pos = 0;
+    for (;;) {
+      if (!drain(true, max_inflight - 1)) break;
+
+      std::unique_ptr<Block> blk(new Block);
+      blk->idx = idx;
+      blk->data = take_buf(static_cast<size_t>(bs) + 1);
+      if (in) {
+        blk->data->write(nullptr, bs);
+        const int n = in->read(reinterpret_cast<char*>(blk->data->data()), bs);
+        if (n <= 0) {
+          free_bufs.push_back(blk->data);
+          break;
+        }
+        blk->data->resize(static_cast<size_t>(n));
+      } else {
+        if (pos >= src_len) {
+          free_bufs.push_back(blk->data);
+          break;
+        }
+        blk->src = src + pos;
+        blk->len = src_len - pos < static_cast<size_t>(bs) ? src_len - pos : static_cast<size_t>(bs);
+        pos += blk->len;
+      }
+      if (out) blk->result = take_buf(1 << 16);
+      ++idx;
+
+      {
+        std::lock_guard<std::mutex> lock(mu);
+        q.push_back(blk.get());
+        pending.push_back(std::move(blk));
+      }
+      cv.notify_one();
+      if (!drain(false, 0)) break;
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(mu);
+      done = true;
+    }
+    cv.notify_all();
+    drain(true, 0);
+  } catch (...) {
+    stop();
+    throw;
+  }
+  stop();
+
+  if (failed) throw LibZpaqError(fail_msg);
+  if (out_size) *out_size = total;
+}
+
+int zpaq_compress_parallel(RustReader* in, RustWriter* out, const char* method, const char* filename,
+                           const char* comment, int dosha1, int threads) {
+  clear_last_error();
+  try {
+    if (!in || !out) return -1;
+    if (threads <= 1) {
+      libzpaq::compress(in, out, method, filename, comment, dosha1 != 0);
+      return 0;
+    }
+    compress_parallel(in, nullptr, 0, out, method, filename, comment, dosha1 != 0, threads, nullptr);
+    return 0;
+  } catch (const std::exception& e) {
+    set_last_error(e.what());
+    return -1;
+  }
+}
+
+int zpaq_compress_size_parallel(RustReader* in, const char* method, const char* filename, const char* comment, int dosha1,
+                               int threads, uint64_t* out_size) {
+  clear_last_error();
+  try {
+    if (!in) return -1;
+    if (threads <= 1) {
+      CountingWriter out;
+      libzpaq::compress(in, &out, method, filename, comment, dosha1 != 0);
+      if (out_size) *out_size = out.n;
+      return 0;
+    }
+    compress_parallel(in, nullptr, 0, nullptr, method, filename, comment, dosha1 != 0, threads, out_size);
+    return 0;
+  } catch (const std::exception& e) {
+    set_last_error(e.what());
+    return -1;
+  }
+}
+
+// In-memory versions of zpaq_compress_parallel and
+// zpaq_compress_size_parallel. Workers read blocks straight from
+// data[0..len-1], with no reader callbacks.
+int zpaq_compress_buffer_parallel(const char* data, size_t len, RustWriter* out, const char* method,
+                                  const char* filename, const char* comment, int dosha1, int threads) {
+  clear_last_error();
+  try {
+    if ((!data && len) || !out) return -1;
+    compress_parallel(nullptr, data, len, out, method, filename, comment, dosha1 != 0,
+                      threads < 1 ? 1 : threads, nullptr);
+    return 0;
+  } catch (const std::exception& e) {
+    set_last_error(e.what());
+    return -1;
+  }
+}
+
+int zpaq_compress_size_buffer_parallel(const char* data, size_t len, const char* method,
+                                       const char* filename, const char* comment, int dosha1,
+                                       int threads, uint64_t* out_size) {
+  clear_last_error();
+  try {
+    if (!data && len) return -1;
+    compress_parallel(nullptr, data, len, nullptr, method, filename, comment, dosha1 != 0,
+                      threads < 1 ? 1 : threads, out_size);
+    return 0;
+  } catch (const std::exception& e) {
+    set_last_error(e.what());
+    return -1;
+  }
+}
+
+// ---------------- Size estimates ----------------
+
+struct zpaq_size_estimate {
+  uint64_t bytes;    // estimated compressed size
+  uint64_t error;    // 95% confidence bound on |bytes - estimate of all blocks|
+  uint64_t blocks;   // blocks in the input
+  uint64_t sampled;  // blocks estimated
+};
+
+// Estimate the size of libzpaq::compress(data[0..len-1]) with the
+// Compressor's estimate mode. Modeled data is not arithmetic coded and
+// SHA-1 is not computed (its 20 bytes per block are counted). If
+// 0 < fraction < 1, only an evenly spaced sample of ceil(fraction*blocks)
+// blocks (at least 2) is estimated and scaled to the whole input by its
+// ratio of estimated to input bytes, and error bounds the sampling error.
+int zpaq_estimate_size_buffer(const char* data, size_t len, const char* method, int threads,
+                              double fraction, zpaq_size_estimate* out) {
+  clear_last_error();
+  try {
+    if ((!data && len) || !method || !out) return -1;
+    const size_t bs = static_cast<size_t>(method_block_size(method));
+    const size_t nblocks = (len + bs - 1) / bs;
+    size_t m = nblocks;
+    if (fraction > 0 && fraction < 1) {
+      m = static_cast<size_t>(std::ceil(fraction * double(nblocks)));
+      if (m < 2) m = 2;
+      if (m > nblocks) m = nblocks;
+    }
+
+    // Block j of the sample and its estimated size
+    std::vector<size_t> pick(m);
+    for (size_t j = 0; j < m; ++j)
+      pick[j] = static_cast<size_t>((j + 0.5) * double(nblocks) / double(m));
+    std::vector<uint64_t> est(m);
+    auto block_len = [&](size_t j) {
+      const size_t pos = pick[j] * bs;
+      return len - pos < bs ? len - pos : bs;
+    };
+
+    std::atomic<size_t> next(0);
+    std::atomic<bool> failed(false);
+    std::mutex mu;
+    std::string fail_msg;
+    auto worker = [&]() {
+      try {
+        libzpaq::Compressor co;
+        libzpaq::StringBuffer sb;
+        for (size_t j; !failed.load() && (j = next.fetch_add(1)) < m;) {
+          sb.resize(0);
+          sb.write(data + pick[j] * bs, static_cast<int>(block_len(j)));
+          CountingWriter cw;
+          co.setEstimate(true);
+          libzpaq::compressBlock(&sb, &cw, method, nullptr, nullptr, false, &co);
+          est[j] = cw.n + co.estimatedBytes() + 20;
+        }
+      } catch (const std::exception& e) {
+        std::lock_guard<std::mutex> lock(mu);
+        if (!failed.exchange(true)) fail_msg = e.what();
+      }
+    };
+    size_t nthreads = threads < 1 ? 1 : static_cast<size_t>(threads);
+    if (nthreads > m) nthreads = m;
+    std::vector<std::thread> pool;
+    for (size_t i = 1; i < nthreads; ++i) pool.emplace_back(worker);
+    worker();
+    for (auto& t : pool) t.join();
+    if (failed) throw LibZpaqError(fail_msg);
+
+    out->blocks = nblocks;
+    out->sampled = m;
+    out->error = 0;
+    if (m == nblocks) {
+      uint64_t total = 0;
+      for (uint64_t e : est) total += e;
+      out->bytes = total;
+      return 0;
+    }
+
+    // Ratio estimator over block input sizes, with a 95% bound from the
+    // residuals of the sample
+    double x = 0, y = 0;
+    for (size_t j = 0; j < m; ++j) {
+      x += double(block_len(j));
+      y += double(est[j]);
+    }
+    const double ratio = y / x;
+    double ss = 0;
+    for (size_t j = 0; j < m; ++j) {
+      const double d = double(est[j]) - ratio * double(block_len(j));
+      ss += d * d;
+    }
+    const double var = (1 - double(m) / double(nblocks)) * (ss / double(m - 1)) / double(m);
+    out->bytes = static_cast<uint64_t>(ratio * double(len) + 0.5);
+    out->error = static_cast<uint64_t>(std::ceil(1.96 * double(nblocks) * std::sqrt(var)));
+    return 0;
+  } catch (const std::exception& e) {
+    set_last_error(e.what());
+    return -1;
+  }
+}
+
+// Decompress a stream of one or more blocks using `threads` workers.
+// The calling thread cuts the input at block boundaries by skipping each
+// segment without running its model, hands whole blocks to the workers,
+// and writes the decoded blocks to `out` in input order. At most
+// 2*threads blocks (compressed or decoded) are held at a time.
+static void decompress_parallel(libzpaq::Reader* in, libzpaq::Writer* out, int threads) {
+  if (threads <= 1) {
+    libzpaq::decompress(in, out);
+    return;
+  }
+
+  struct Block {
+    libzpaq::StringBuffer data;    // compressed block
+    libzpaq::StringBuffer result;  // decoded block
+    bool ready = false;
+    bool failed = false;
+    std::string fail_msg;
+  };
+
+  const size_t window_max = static_cast<size_t>(threads) * 2;
+  std::mutex mu;
+  std::condition_variable cv_work;
+  std::condition_variable cv_ready;
+  std::deque<Block*> todo;
+  bool done = false;
+
+  auto worker = [&]() {
+    std::unique_ptr<libzpaq::Decompresser> d(new libzpaq::Decompresser);
+    for (;;) {
+      Block* blk = nullptr;
+      {
+        std::unique_lock<std::mutex> lock(mu);
+        cv_work.wait(lock, [&] { return done || !todo.empty(); });
+        if (done) return;
+        blk = todo.front();
+        todo.pop_front();
+      }
+
+      bool failed = false;
+      std::string msg;
+      try {
+        d->setInput(&blk->data);
+        d->setOutput(&blk->result);
+        while (d->findBlock()) {
+          while (d->findFilename()) {
+            d->readComment();
+            d->decompress();
+            d->readSegmentEnd();
+          }
+        }
+      } catch (const std::exception& e) {
+        failed = true;
+        msg = e.what();
+        d.reset(new libzpaq::Decompresser);  // state is not recoverable
+      }
+      blk->data.reset();
+
+      {
+        std::lock_guard<std::mutex> lock(mu);
+        blk->ready = true;
+        blk->failed = failed;
+        blk->fail_msg = std::move(msg);
+      }
+      cv_ready.notify_all();
+    }
+  };
+
+  std::vector<std::thread> pool;
+  auto stop = [&]() {
+    {
+      std::lock_guard<std::mutex> lock(mu);
+      done = true;
+    }
+    cv_work.notify_all();
+    for (auto& t : pool) t.join();
+    pool.clear();
+  };
+
+  std::deque<std::unique_ptr<Block>> window;
+  RecordingReader rec;
+  rec.in = in;
+  libzpaq::Decompresser splitter;
+  splitter.setInput(&rec);
+  bool eof = false;
+
+  try {
+    pool.reserve(static_cast<size_t>(threads));
+    for (int i = 0; i < threads; ++i) pool.emplace_back(worker);
+
+    for (;;) {
+      while (!eof && window.size() < window_max) {
+        std::unique_ptr<Block> blk(new Block);
+        try {
+          if (!splitter.findBlock()) {
+            eof = true;
+            break;
+          }
+          while (splitter.findFilename()) {
+            splitter.readComment();
+            splitter.readSegmentEnd();  // skips the data
+          }
+        } catch (const std::exception& e) {
+          // Report the error after the blocks before it are written.
+          eof = true;
+          blk->ready = blk->failed = true;
+          blk->fail_msg = e.what();
+          window.push_back(std::move(blk));
+          break;
+        }
+        const size_t end = rec.rec.size() - static_cast<size_t>(splitter.buffered());
+        for (size_t i = 0; i < end;) {
+          const size_t len = end - i < (1u << 30) ? end - i : (1u << 30);
+          blk->data.write(rec.rec.data() + i, static_cast<int>(len));
+          i += len;
+        }
+        rec.rec.erase(0, end);
+        {
+          std::lock_guard<std::mutex> lock(mu);
+          todo.push_back(blk.get());
+        }
+        window.push_back(std::move(blk));
+        cv_work.notify_one();
+      }
+      if (window.empty()) break;
+
+      Block* front = window.front().get();
+      {
+        std::unique_lock<std::mutex> lock(mu);
+        cv_ready.wait(lock, [&] { return front->ready; });
+      }
+      if (front->failed) throw LibZpaqError(front->fail_msg);
+      if (out) write_all(out, front->result.c_str(), front->result.size());
+      window.pop_front();
+    }
+  } catch (...) {
+    stop();
+    throw;
+  }
+  stop();
+}
+
+int zpaq_decompress_parallel(RustReader* in, RustWriter* out, int threads) {
+  clear_last_error();
+  try {
+    if (!in) return -1;
+    decompress_parallel(in, out, threads);
+    return 0;
+  } catch (const std::exception& e) {
+    set_last_error(e.what());
+    return -1;
+  }
+}
+
+// ---------------- Reusable contexts ----------------
+
+// A Compressor, a Decompresser and a block buffer kept between calls.
+// libzpaq keeps component tables (zeroing them in place) and JIT code
+// when the next block uses the same model, so repeated calls with one
+// method only pay for the model once. Either object is recreated after
+// an error, since libzpaq leaves it in an unknown state.
+struct zpaq_context {
+  std::unique_ptr<libzpaq::Compressor> co;
+  std::unique_ptr<libzpaq::Decompresser> de;
+  libzpaq::StringBuffer sb;  // current input block
+};
+
+// Same as libzpaq::compress() using ctx. Input comes from `in`, or if `in`
+// is null from src[0..src_len-1].
+static void context_compress(zpaq_context* ctx, libzpaq::Reader* in, const char* src,
+                             size_t src_len, libzpaq::Writer* out, const char* method,
+                             const char* filename, const char* comment, bool dosha1) {
+  if (!ctx->co) ctx->co.reset(new libzpaq::Compressor());
+  const int bs = method_block_size(method);
+  libzpaq::StringBuffer& sb = ctx->sb;
+  try {
+    for (;;) {
+      sb.resize(0);
+      if (in) {
+        sb.write(nullptr, bs);
+        const int n = in->read(reinterpret_cast<char*>(sb.data()), bs);
+        if (n <= 0) break;
+        sb.resize(n);
+      } else {
+        if (!src_len) break;
+        const size_t n = src_len < size_t(bs) ? src_len : size_t(bs);
+        sb.write(src, static_cast<int>(n));
+        src += n;
+        src_len -= n;
+      }
+      libzpaq::compressBlock(&sb, out, method, filename, comment, dosha1, ctx->co.get());
+      filename = nullptr;
+      comment = nullptr;
+    }
+  } catch (...) {
+    ctx->co.reset();
+    sb.resize(0);
+    throw;
+  }
+  sb.resize(0);
+}
+
+zpaq_context* zpaq_context_new() {
+  clear_last_error();
+  try {
+    return new zpaq_context();
+  } catch (const std::exception& e) {
+    set_last_error(e.what());
+    return nullptr;
+  }
+}
+
+void zpaq_context_free(zpaq_context* ctx) { delete ctx; }
+
+int zpaq_context_compress(zpaq_context* ctx, RustReader* in, RustWriter* out, const char* method,
+                          const char* filename, const char* comment, int dosha1) {
+  clear_last_error();
+  try {
+    if (!ctx || !in || !out) return -1;
+    context_compress(ctx, in, nullptr, 0, out, method, filename, comment, dosha1 != 0);
+    return 0;
+  } catch (const std::exception& e) {
+    set_last_error(e.what());
+    return -1;
+  }
+}
+
+// In-memory versions of zpaq_context_compress. Blocks are copied straight
+// from data[0..len-1], with no reader callbacks.
+int zpaq_context_compress_buffer(zpaq_context* ctx, const char* data, size_t len, RustWriter* out,
+                                 const char* method, const char* filename, const char* comment,
+                                 int dosha1) {
+  clear_last_error();
+  try {
+    if (!ctx || (!data && len) || !out) return -1;
+    context_compress(ctx, nullptr, data, len, out, method, filename, comment, dosha1 != 0);
+    return 0;
+  } catch (const std::exception& e) {
+    set_last_error(e.what());
+    return -1;
+  }
+}
+
+int zpaq_context_compress_size_buffer(zpaq_context* ctx, const char* data, size_t len,
+                                      const char* method, const char* filename, const char* comment,
+                                      int dosha1, uint64_t* out_size) {
+  clear_last_error();
+  try {
+    if (!ctx || (!data && len)) return -1;
+    CountingWriter out;
+    context_compress(ctx, nullptr, data, len, &out, method, filename, comment, dosha1 != 0);
+    if (out_size) *out_size = out.n;
+    return 0;
+  } catch (const std::exception& e) {
+    set_last_error(e.what());
+    return -1;
+  }
+}
+
+// Set out[i] to the compressed size of data[i][0..lens[i]-1] for i in
+// 0..n-1, all with ctx. If estimate then the sizes are estimated as by
+// zpaq_estimate_size_buffer, with the modeled data never coded.
+int zpaq_context_compress_sizes(zpaq_context* ctx, const char* const* data, const size_t* lens,
+                                size_t n, const char* method, int estimate, uint64_t* out) {
+  clear_last_error();
+  try {
+    if (!ctx || (n && (!data || !lens || !out))) return -1;
+    const uint64_t bs = static_cast<uint64_t>(method_block_size(method));
+    struct Reset {  // leave ctx coding again
+      zpaq_context* ctx;
+      ~Reset() {
+        if (ctx->co) ctx->co->setEstimate(false);
+      }
+    } reset{ctx};
+    for (size_t i = 0; i < n; ++i) {
+      if (!data[i] && lens[i]) return -1;
+      if (!ctx->co) ctx->co.reset(new libzpaq::Compressor());
+      ctx->co->setEstimate(estimate != 0);
+      CountingWriter cw;
+      context_compress(ctx, nullptr, data[i], lens[i], &cw, method, nullptr, nullptr, estimate == 0);
+      out[i] = cw.n;
+      if (estimate) out[i] += ctx->co->estimatedBytes() + 20 * ((lens[i] + bs - 1) / bs);
+    }
+    return 0;
+  } catch (const std::exception& e) {
+    set_last_error(e.what());
+    return -1;
+  }
+}
+
+// Same as libzpaq::decompress() using ctx.
+int zpaq_context_decompress(zpaq_context* ctx, RustReader* in, RustWriter* out) {
+  clear_last_error();
+  try {
+    if (!ctx || !in || !out) return -1;
+    if (!ctx->de) ctx->de.reset(new libzpaq::Decompresser());
+    libzpaq::Decompresser& d = *ctx->de;
+    try {
+      d.setInput(in);
+      d.setOutput(out);
+      while (d.findBlock()) {
+        while (d.findFilename()) {
+          d.readComment();
+          d.decompress();
+          d.readSegmentEnd();
+        }
+      }
+      d.setInput(nullptr);
+      d.setOutput(nullptr);
+    } catch (...) {
+      ctx->de.reset();
+      throw;
+    }
+    return 0;
+  } catch (const std::exception& e) {
+    set_last_error(e.what());
+    return -1;
+  }
+}
+
+// ---------------- Primed models ----------------
+
+// A libzpaq::PrimedModel, shared by the coders made from it
+struct zpaq_primed_model {
+  libzpaq::PrimedModel m;
+  zpaq_primed_model(const char* method, const char* dict, size_t len) : m(method, dict, len) {}
+};
+
+// A libzpaq::PrimedCoder, recreated after an error like zpaq_context
+struct zpaq_primed_coder {
+  zpaq_primed_model* model;
+  std::unique_ptr<libzpaq::PrimedCoder> co;
+};
+
+zpaq_primed_model* zpaq_primed_model_new(const char* method, const char* dict, size_t len) {
+  clear_last_error();
+  try {
+    if (!method || (!dict && len)) return nullptr;
+    return new zpaq_primed_model(method, dict, len);
+  } catch (const std::exception& e) {
+    set_last_error(e.what());
+    return nullptr;
+  }
+}
+
+void zpaq_primed_model_free(zpaq_primed_model* m) { delete m; }
+
+uint32_t zpaq_primed_model_id(const zpaq_primed_model* m) { return m ? m->m.id() : 0; }
+
+// The expanded "x" method, valid until m is freed
+const char* zpaq_primed_model_method(const zpaq_primed_model* m) {
+  return m ? m->m.method().c_str() : "";
+}
+
+zpaq_primed_coder* zpaq_primed_coder_new(zpaq_primed_model* m) {
+  clear_last_error();
+  try {
+    if (!m) return nullptr;
+    std::unique_ptr<zpaq_primed_coder> c(new zpaq_primed_coder{m, nullptr});
+    c->co.reset(new libzpaq::PrimedCoder(m->m));
+    return c.release();
+  } catch (const std::exception& e) {
+    set_last_error(e.what());
+    return nullptr;
+  }
+}
+
+void zpaq_primed_coder_free(zpaq_primed_coder* c) { delete c; }
+
+// Compress data[0..len-1] as one record, or decompress the record in it
+int zpaq_primed_compress(zpaq_primed_coder* c, const char* data, size_t len, RustWriter* out) {
+  clear_last_error();
+  try {
+    if (!c || (!data && len) || !out) return -1;
+    if (!c->co) c->co.reset(new libzpaq::PrimedCoder(c->model->m));
+    MemoryReader in(data, len);
+    try {
+      c->co->compress(&in, out);
+    } catch (...) {
+      c->co.reset();
+      throw;
+    }
+    return 0;
+  } catch (const std::exception& e) {
+    set_last_error(e.what());
+    return -1;
+  }
+}
+
+int zpaq_primed_decompress(zpaq_primed_coder* c, const char* data, size_t len, RustWriter* out) {
+  clear_last_error();
+  try {
+    if (!c || (!data && len) || !out) return -1;
+    if (!c->co) c->co.reset(new libzpaq::PrimedCoder(c->model->m));
+    MemoryReader in(data, len);
+    try {
+      c->co->decompress(&in, out);
+    } catch (...) {
+      c->co.reset();
+      throw;
+    }
+    return 0;
+  } catch (const std::exception& e) {
+    set_last_error(e.what());
+    return -1;
+  }
+}
+
+// The first non-blank line of a failed command's stderr, as its error
+static std::string command_error(const std::string& err) {
+  const char* begin = err.c_str();
+  const char* end = begin + err.size();
+  while (begin < end && (*begin == '\n' || *begin == '\r' || *begin == ' ' || *begin == '\t')) ++begin;
+  const char* line_end = begin;
+  while (line_end < end && *line_end != '\n' && *line_end != '\r') ++line_end;
+  if (line_end > begin) return std::string(begin, static_cast<size_t>(line_end - begin));
+  return "zpaq command failed";
+}
+
+static void set_error_from_stderr_fallback() {
+  if (!g_last_error.empty()) return;
+  set_last_error(command_error(g_last_stderr).c_str());
+}
+
+// Console sinks that append a command's output to two strings.
+struct CaptureConsole {
+  std::string out, err;
+  zpaq_console con;
+
+  CaptureConsole() {
+    con.out = &CaptureConsole::put_out;
+    con.err = &CaptureConsole::put_err;
+    con.ctx = this;
+  }
+  static void put_out(void* ctx, const char* s, size_t n) {
+    static_cast<CaptureConsole*>(ctx)->out.append(s, n);
+  }
+  static void put_err(void* ctx, const char* s, size_t n) {
+    static_cast<CaptureConsole*>(ctx)->err.append(s, n);
+  }
+};
+
+// Run a zpaq.cpp command with output captured in g_last_stdout and
+// g_last_stderr. Commands on different threads run concurrently.
+static int jidac_capture(int argc, const char* const* argv, zpaq_jidac_summary* summary) {
+  CaptureConsole cap;
+  std::string err;
+  const int rc = jidac_command(argc, const_cast<const char**>(argv), &cap.con, summary, &err);
+  g_last_stdout.swap(cap.out);
+  g_last_stderr.swap(cap.err);
+  if (!err.empty()) set_last_error(err.c_str());
+  return rc;
+}
+
+int zpaq_jidac_run(int argc, const char* const* argv) {
+  clear_last_error();
+  clear_last_output();
+  try {
+    if (argc <= 0 || !argv) {
+      set_last_error("invalid argv");
+      return -1;
+    }
+    if (jidac_capture(argc, argv, nullptr) != 0) {
+      set_error_from_stderr_fallback();
+      return -1;
+    }
+    return 0;
+  } catch (const std::exception& e) {
+    set_last_error(e.what());
+    return -1;
+  }
+}
 
-// Opaque handles exposed to Rust.
-RustReader* zpaq_reader_new(void* ctx, zpaq_get_fn get_cb, zpaq_read_fn read_cb) {
+// Run a zpaq.cpp command with output sent to out and err (or discarded if
+// NULL) and its results stored in *summary. Warnings (exit code 1) are
+// not failures; the exit code is in summary->exit_code. If progress or
+// stats is not NULL the command counts its work: progress is called with
+// the counters as it goes (with ctx, one call at a time with the sinks)
+// and *stats receives the totals.
+int zpaq_jidac_command(int argc, const char* const* argv, zpaq_text_fn out, zpaq_text_fn err, void* ctx,
+                       zpaq_jidac_summary* summary, zpaq_progress_fn progress, zpaq_jidac_stats* stats) {
   clear_last_error();
   try {
-    return new RustReader(ctx, get_cb, read_cb);
+    if (argc <= 0 || !argv || !summary) {
+      set_last_error("invalid argv");
+      return -1;
+    }
+    struct Discard {
+      static void put(void*, const char*, size_t) {}
+    };
+    zpaq_console con;
+    con.out = out ? out : &Discard::put;
+    con.err = err ? err : &Discard::put;
+    con.ctx = ctx;
+    zpaq_jidac_monitor mon;
+    mon.stats = stats;
+    mon.progress = progress;
+    mon.ctx = ctx;
+    mon.cancel = nullptr;
+    std::string msg;
+    const int rc = jidac_command(argc, const_cast<const char**>(argv), &con, summary, &msg,
+                                 progress || stats ? &mon : nullptr);
+    if (rc > 1) {
+      set_last_error(msg.empty() ? "zpaq command failed" : msg.c_str());
+      return -1;
+    }
+    return 0;
   } catch (const std::exception& e) {
     set_last_error(e.what());
-    return nullptr;
+    return -1;
   }
 }
 
-void zpaq_reader_free(RustReader* r) {
-  delete r;
-}
-
-RustWriter* zpaq_writer_new(void* ctx, zpaq_put_fn put_cb, zpaq_write_fn write_cb) {
+static int jidac_add_archive_size(const char* path, const char* method, int threads, bool estimate,
+                                  uint64_t* out_archive_size_bytes) {
   clear_last_error();
+  clear_last_output();
   try {
-    return new RustWriter(ctx, put_cb, write_cb);
+    if (!path || !*path || !method || !*method || !out_archive_size_bytes) return -1;
+
+    // Build argv like: zpaq add "" <path> -method <method> -threads <N> [-estimate]
+    std::string threads_s = std::to_string(threads);
+    const char* argv[10];
+    int argc = 0;
+    argv[argc++] = "zpaq";
+    argv[argc++] = "add";
+    argv[argc++] = "";
+    argv[argc++] = path;
+    argv[argc++] = "-method";
+    argv[argc++] = method;
+    argv[argc++] = "-threads";
+    argv[argc++] = threads_s.c_str();
+    if (estimate) argv[argc++] = "-estimate";
+    zpaq_jidac_summary summary;
+    if (jidac_capture(argc, argv, &summary) != 0) {
+      set_error_from_stderr_fallback();
+      return -1;
+    }
+    *out_archive_size_bytes = summary.archive_size > 0 ? uint64_t(summary.archive_size) : 0;
+    return 0;
   } catch (const std::exception& e) {
     set_last_error(e.what());
-    return nullptr;
+    return -1;
   }
 }
 
-void zpaq_writer_free(RustWriter* w) {
-  delete w;
+int zpaq_jidac_add_archive_size_file(const char* path, const char* method, int threads, uint64_t* out_archive_size_bytes) {
+  return jidac_add_archive_size(path, method, threads, false, out_archive_size_bytes);
 }
 
-// ---------------- Top-level convenience API ----------------
+// Same as zpaq_jidac_add_archive_size_file with -estimate: the blocks are
+// estimated by the Compressor's estimate mode instead of coded.
+int zpaq_jidac_add_archive_estimate_file(const char* path, const char* method, int threads,
+                                         uint64_t* out_archive_size_bytes) {
+  return jidac_add_archive_size(path, method, threads, true, out_archive_size_bytes);
+}
 
-int zpaq_compress(RustReader* in, RustWriter* out, const char* method, const char* filename,
-                 const char* comment, int dosha1) {
+// For tests of zpaq.cpp's packed file table
+size_t zpaq_jidac_test_fraglist(unsigned n) { return jidac_test_fraglist(n); }
+size_t zpaq_jidac_test_archive_fraglists(const char* arc) {
+  return arc ? jidac_test_archive_fraglists(arc) : 0;
+}
+
+// ---------------- Fragments ----------------
+
+// A JidacFragmentTable: the fragments of a deduplicating entry archive
+struct zpaq_fragment_table {
+  JidacFragmentTable t;
+};
+
+zpaq_fragment_table* zpaq_fragment_table_new() {
   clear_last_error();
   try {
-    libzpaq::compress(in, out, method, filename, comment, dosha1 != 0);
-    return 0;
+    return new zpaq_fragment_table();
   } catch (const std::exception& e) {
     set_last_error(e.what());
-    return -1;
+    return nullptr;
   }
 }
 
-int zpaq_decompress(RustReader* in, RustWriter* out) {
+void zpaq_fragment_table_free(zpaq_fragment_table* t) { delete t; }
+
+uint32_t zpaq_fragment_table_len(const zpaq_fragment_table* t) { return t ? t->t.size() : 0; }
+
+// Keep fragments 1..n
+void zpaq_fragment_table_truncate(zpaq_fragment_table* t, uint32_t n) {
+  if (t) t->t.truncate(n);
+}
+
+// Return the ID of fragment data[0..len-1] in t, adding it with the next
+// ID and setting *added if it is not there. Its SHA-1 goes to sha1_out.
+// Returns 0 on error.
+uint32_t zpaq_fragment_table_add(zpaq_fragment_table* t, const char* data, size_t len,
+                                 unsigned char sha1_out[20], int* added) {
   clear_last_error();
   try {
-    libzpaq::decompress(in, out);
-    return 0;
+    if (!t || (!data && len) || len > 0x7fffffff || !sha1_out || !added) return 0;
+    libzpaq::SHA1 sha1;
+    sha1.write(data, static_cast<int64_t>(len));
+    const char* h = sha1.result();
+    std::memcpy(sha1_out, h, 20);
+    unsigned id = t->t.find(h);
+    *added = id == 0;
+    if (!id) id = t->t.add(h, static_cast<int>(len));
+    return id;
   } catch (const std::exception& e) {
     set_last_error(e.what());
-    return -1;
-  }
-}
-
-static int method_block_size(const char* method) {
-  int bs = 4;
-  if (method && method[0] && method[1] >= '0' && method[1] <= '9') {
-    bs = method[1] - '0';
-    if (method[2] >= '0' && method[2] <= '9') bs = bs * 10 + (method[2] - '0');
-    if (bs > 11) bs = 11;
+    return 0;
   }
-  // Same formula as libzpaq::compress
-  const int block = (0x100000 << bs) - 4096;
-  return block > 0 ? block : (1 << 20);
 }
 
-int zpaq_compress_size(RustReader* in, const char* method, const char* filename, const char* comment, int dosha1,
-                      uint64_t* out_size) {
+// Add the fragment with sha1[20] with the next ID, to rebuild a table
+// from an archive. Returns the ID, or 0 on error.
+uint32_t zpaq_fragment_table_insert(zpaq_fragment_table* t, const unsigned char sha1[20]) {
   clear_last_error();
   try {
-    CountingWriter out;
-    libzpaq::compress(in, &out, method, filename, comment, dosha1 != 0);
-    if (out_size) *out_size = out.n;
-    return 0;
+    if (!t || !sha1) return 0;
+    return t->t.add(reinterpret_cast<const char*>(sha1), 0);  // size not needed
   } catch (const std::exception& e) {
     set_last_error(e.what());
-    return -1;
+    return 0;
   }
 }
 
-int zpaq_decompress_size(RustReader* in, uint64_t* out_size) {
+// Split data[0..len-1] into fragments like zpaq add -fragment fragment
+// with the block size of method. Sets ends[i] to the end offset of
+// fragment i for i < cap and returns the number of fragments, or -1.
+int64_t zpaq_fragments(const char* data, size_t len, const char* method, int fragment, size_t* ends,
+                       size_t cap) {
   clear_last_error();
   try {
-    CountingWriter out;
-    libzpaq::decompress(in, &out);
-    if (out_size) *out_size = out.n;
-    return 0;
+    if ((!data && len) || (!ends && cap)) return -1;
+    std::vector<size_t> v;
+    jidac_fragments(data, len, fragment, static_cast<unsigned>(method_block_size(method)), v);
+    std::copy(v.begin(), v.begin() + (v.size() < cap ? v.size() : cap), ends);
+    return static_cast<int64_t>(v.size());
   } catch (const std::exception& e) {
     set_last_error(e.what());
     return -1;
   }
 }
 
-int zpaq_compress_size_parallel(RustReader* in, const char* method, const char* filename, const char* comment, int dosha1,
-                               int threads, uint64_t* out_size) {
-  clear_last_error();
-  try {
-    if (!in) return -1;
-    if (threads <= 1) {
-      CountingWriter out;
-      libzpaq::compress(in, &out, method, filename, comment, dosha1 != 0);
-      if (out_size) *out_size = out.n;
-      return 0;
-    }
+// ---------------- Jobs ----------------
+
+// A job runs a compression, decompression or zpaq command on the job
+// threads and keeps its result until it is freed. The handle and the
+// worker share the state, so zpaq_job_free() never waits for a running
+// job: it cancels it, and the worker frees the state when it is done.
+struct JobState {
+  std::mutex mu;
+  std::condition_variable cv;
+  std::atomic<int> cancel{0};
+  int status = 0;  // 0 = queued or running, 1 = done, -1 = failed
+  std::string error;
+  std::string out;  // output data, or the stdout of a command
+  std::string err;  // stderr of a command
+  zpaq_jidac_summary summary{};
+  void (*notify)(void*) = nullptr;  // called once when status is set
+  void* notify_ctx = nullptr;
+  std::function<void(JobState&)> run;
+};
 
-    const int bs = method_block_size(method);
-    struct Block {
-      size_t idx;
-      std::string data;
-    };
+struct zpaq_job {
+  std::shared_ptr<JobState> s;
+};
 
-    std::mutex mu;
-    std::condition_variable cv;
-    std::deque<Block> q;
-    bool done = false;
-    bool failed = false;
-    std::string fail_msg;
-    std::vector<uint64_t> sizes;
+// Collects the output of a job. Output is written between blocks, so
+// checking for cancellation here stops compression and decompression
+// at the next block.
+class JobWriter final : public RustWriter {
+  JobState& s_;
 
-    auto worker = [&]() {
-      for (;;) {
-        Block blk;
-        {
-          std::unique_lock<std::mutex> lock(mu);
-          cv.wait(lock, [&] { return failed || done || !q.empty(); });
-          if (failed) return;
-          if (q.empty()) {
-            if (done) return;
-            continue;
-          }
-          blk = std::move(q.front());
-          q.pop_front();
-        }
+  void check() {
+    if (s_.cancel.load(std::memory_order_relaxed)) throw LibZpaqError("cancelled");
+  }
 
-        try {
-          libzpaq::StringBuffer sb(bs);
-          sb.write(nullptr, blk.data.size());
-          if (blk.data.size()) std::memcpy(sb.data(), blk.data.data(), blk.data.size());
-          sb.resize(blk.data.size());
-
-          CountingWriter out;
-          const char* fn = (blk.idx == 0) ? filename : nullptr;
-          const char* cm = (blk.idx == 0) ? comment : nullptr;
-          libzpaq::compressBlock(&sb, &out, method, fn, cm, dosha1 != 0);
-
-          {
-            std::lock_guard<std::mutex> lock(mu);
-            if (blk.idx >= sizes.size()) sizes.resize(blk.idx + 1, 0);
-            sizes[blk.idx] = out.n;
-          }
-        } catch (const std::exception& e) {
-          std::lock_guard<std::mutex> lock(mu);
-          if (!failed) {
-            failed = true;
-            fail_msg = e.what();
-          }
-          cv.notify_all();
-          return;
-        }
-      }
-    };
+public:
+  explicit JobWriter(JobState& s) : s_(s) {}
 
-    std::vector<std::thread> pool;
-    pool.reserve(static_cast<size_t>(threads));
-    for (int i = 0; i < threads; ++i) pool.emplace_back(worker);
+  void put(int c) override {
+    check();
+    s_.out.push_back(static_cast<char>(c));
+  }
 
-    size_t idx = 0;
-    for (;;) {
-      {
-        std::lock_guard<std::mutex> lock(mu);
-        if (failed) break;
-      }
+  void write(const char* buf, int n) override {
+    check();
+    if (buf && n > 0) s_.out.append(buf, static_cast<size_t>(n));
+  }
+};
 
-      std::string buf;
-      buf.resize(static_cast<size_t>(bs));
-      const int n = in->read(&buf[0], bs);
-      if (n <= 0) break;
-      buf.resize(static_cast<size_t>(n));
+// Threads that run queued jobs, started as needed up to one per core.
+// Allocated once and never destroyed, like the JIT cache in libzpaq.
+struct JobPool {
+  std::mutex mu;
+  std::condition_variable cv;
+  std::deque<std::shared_ptr<JobState>> q;
+  unsigned threads = 0;
+  unsigned idle = 0;
+};
 
-      {
-        std::lock_guard<std::mutex> lock(mu);
-        q.push_back(Block{idx++, std::move(buf)});
-      }
-      cv.notify_one();
-    }
+static JobPool& job_pool() {
+  static JobPool* pool = new JobPool;
+  return *pool;
+}
 
+static void job_worker() {
+  JobPool& pool = job_pool();
+  for (;;) {
+    std::shared_ptr<JobState> s;
     {
-      std::lock_guard<std::mutex> lock(mu);
-      done = true;
+      std::unique_lock<std::mutex> lock(pool.mu);
+      ++pool.idle;
+      pool.cv.wait(lock, [&] { return !pool.q.empty(); });
+      --pool.idle;
+      s = std::move(pool.q.front());
+      pool.q.pop_front();
     }
-    cv.notify_all();
-    for (auto& t : pool) t.join();
-
-    {
-      std::lock_guard<std::mutex> lock(mu);
-      if (failed) {
-        set_last_error(fail_msg.c_str());
-        return -1;
-      }
+    int status = 1;
+    std::string msg;
+    try {
+      if (s->cancel.load()) throw LibZpaqError("cancelled");
+      s->run(*s);
+    } catch (const std::exception& e) {
+      status = -1;
+      msg = e.what();
     }
-
-    uint64_t total = 0;
-    for (uint64_t s : sizes) total += s;
-    if (out_size) *out_size = total;
-    return 0;
-  } catch (const std::exception& e) {
-    set_last_error(e.what());
-    return -1;
+    s->run = nullptr;  // free the input
+    std::lock_guard<std::mutex> lock(s->mu);
+    s->status = status;
+    s->error.swap(msg);
+    if (s->notify) s->notify(s->notify_ctx);
+    s->notify = nullptr;
+    s->cv.notify_all();
   }
 }
 
-static bool parse_last_archive_mb(const char* s, size_t n, double* out_mb) {
-  if (!s || n == 0 || !out_mb) return false;
-  // Look for the last occurrence of "= <num> MB" in the captured stderr.
-  // The summary line in zpaq.cpp is:
-  //   "... = %1.6f MB\n"
-  const char* end = s + n;
-  const char* p = end;
-  while (p > s) {
-    // Find previous '='
-    const char* eq = (const char*)zpaq_memrchr(s, '=', (size_t)(p - s));
-    if (!eq) break;
-    const char* q = eq + 1;
-    while (q < end && (*q == ' ' || *q == '\t')) ++q;
-    char* num_end = nullptr;
-    const double val = std::strtod(q, &num_end);
-    if (num_end && num_end > q) {
-      const char* r = num_end;
-      while (r < end && (*r == ' ' || *r == '\t')) ++r;
-      if (r + 2 <= end && r[0] == 'M' && r[1] == 'B') {
-        *out_mb = val;
-        return true;
-      }
+static zpaq_job* submit_job(std::function<void(JobState&)> run) {
+  std::shared_ptr<JobState> s = std::make_shared<JobState>();
+  s->run = std::move(run);
+  std::unique_ptr<zpaq_job> job(new zpaq_job{s});
+  JobPool& pool = job_pool();
+  {
+    std::lock_guard<std::mutex> lock(pool.mu);
+    const unsigned cores = std::max(std::thread::hardware_concurrency(), 1u);
+    if (pool.idle <= pool.q.size() && pool.threads < cores) {
+      std::thread(job_worker).detach();
+      ++pool.threads;
     }
-    p = eq;
+    pool.q.push_back(std::move(s));
   }
-  return false;
+  pool.cv.notify_one();
+  return job.release();
 }
 
-static bool read_stream_to_string(FILE* stream, std::string* out) {
-  if (!stream || !out) return false;
-  out->clear();
-  if (fseek(stream, 0, SEEK_END) != 0) return false;
-  long n = ftell(stream);
-  if (n < 0) return false;
-  if (n == 0) return true;
-  out->resize(static_cast<size_t>(n));
-  rewind(stream);
-  const size_t got = fread(&(*out)[0], 1, out->size(), stream);
-  out->resize(got);
-  return true;
+// Start compressing a copy of data[0..len-1] like
+// zpaq_compress_buffer_parallel() with no filename or comment.
+zpaq_job* zpaq_job_compress(const char* data, size_t len, const char* method, int threads) {
+  clear_last_error();
+  try {
+    if ((!data && len) || !method) return nullptr;
+    std::string in = len ? std::string(data, len) : std::string();
+    std::string m = method;
+    return submit_job([in = std::move(in), m = std::move(m), threads](JobState& s) {
+      JobWriter w(s);
+      s.out.reserve(in.size() / 2 + 64);
+      compress_parallel(nullptr, in.data(), in.size(), &w, m.c_str(), nullptr, nullptr, true,
+                        threads < 1 ? 1 : threads, nullptr);
+    });
+  } catch (const std::exception& e) {
+    set_last_error(e.what());
+    return nullptr;
+  }
 }
 
-static void set_error_from_stderr_fallback() {
-  if (!g_last_error.empty()) return;
-  if (g_last_stderr.empty()) {
-    set_last_error("zpaq command failed");
-    return;
-  }
-  const char* begin = g_last_stderr.c_str();
-  const char* end = begin + g_last_stderr.size();
-  while (begin < end && (*begin == '\n' || *begin == '\r' || *begin == ' ' || *begin == '\t')) ++begin;
-  const char* line_end = begin;
-  while (line_end < end && *line_end != '\n' && *line_end != '\r') ++line_end;
-  if (line_end > begin) {
-    set_last_error(std::string(begin, static_cast<size_t>(line_end - begin)).c_str());
-  } else {
-    set_last_error("zpaq command failed");
+// Start decompressing a copy of data[0..len-1] like zpaq_decompress_parallel()
+zpaq_job* zpaq_job_decompress(const char* data, size_t len, int threads) {
+  clear_last_error();
+  try {
+    if (!data && len) return nullptr;
+    std::string in = len ? std::string(data, len) : std::string();
+    return submit_job([in = std::move(in), threads](JobState& s) {
+      MemoryReader r(in.data(), in.size());
+      JobWriter w(s);
+      s.out.reserve(in.size() * 2);
+      decompress_parallel(&r, &w, threads);
+    });
+  } catch (const std::exception& e) {
+    set_last_error(e.what());
+    return nullptr;
   }
 }
 
-int zpaq_jidac_run(int argc, const char* const* argv) {
+// Start a zpaq.cpp command like zpaq_jidac_run(). Its output goes to the
+// job's data and stderr. add and extract stop at the next file or block
+// when cancelled.
+zpaq_job* zpaq_job_command(int argc, const char* const* argv) {
   clear_last_error();
-  clear_last_output();
   try {
     if (argc <= 0 || !argv) {
       set_last_error("invalid argv");
-      return -1;
-    }
-
-    static std::mutex g_mu;
-    std::lock_guard<std::mutex> lock(g_mu);
-
-    fflush(stdout);
-    fflush(stderr);
-
-    const int stderr_fd = fileno(stderr);
-    const int stdout_fd = fileno(stdout);
-    if (stderr_fd < 0 || stdout_fd < 0) {
-      set_last_error("fileno() failed");
-      return -1;
-    }
-
-    int old_stderr = dup(stderr_fd);
-    int old_stdout = dup(stdout_fd);
-    if (old_stderr < 0 || old_stdout < 0) {
-      if (old_stderr >= 0) close(old_stderr);
-      if (old_stdout >= 0) close(old_stdout);
-      set_last_error("dup() failed");
-      return -1;
-    }
-
-    FILE* err_stream = tmpfile();
-    FILE* out_stream = tmpfile();
-    if (!err_stream || !out_stream) {
-      if (err_stream) fclose(err_stream);
-      if (out_stream) fclose(out_stream);
-      close(old_stderr);
-      close(old_stdout);
-      set_last_error("failed to create capture streams");
-      return -1;
-    }
-
-    if (dup2(fileno(err_stream), stderr_fd) < 0 || dup2(fileno(out_stream), stdout_fd) < 0) {
-      fclose(err_stream);
-      fclose(out_stream);
-      close(old_stderr);
-      close(old_stdout);
-      set_last_error("dup2() failed");
-      return -1;
-    }
-
-    int rc = 0;
-    try {
-      rc = zpaq_cli_main(argc, const_cast<const char**>(argv));
-    } catch (const std::exception& e) {
-      rc = 2;
-      set_last_error(e.what());
-    }
-
-    fflush(stdout);
-    fflush(stderr);
-
-    const bool out_ok = read_stream_to_string(out_stream, &g_last_stdout);
-    const bool err_ok = read_stream_to_string(err_stream, &g_last_stderr);
-
-    const int restore_err = dup2(old_stderr, stderr_fd);
-    const int restore_out = dup2(old_stdout, stdout_fd);
-
-    fclose(err_stream);
-    fclose(out_stream);
-    close(old_stderr);
-    close(old_stdout);
-
-    if (restore_err < 0 || restore_out < 0) {
-      set_last_error("failed to restore stdio");
-      return -1;
-    }
-    if (!out_ok || !err_ok) {
-      set_last_error("failed to read captured zpaq output");
-      return -1;
-    }
-
-    if (rc != 0) {
-      set_error_from_stderr_fallback();
-      return -1;
+      return nullptr;
     }
-    return 0;
+    std::vector<std::string> args(argv, argv + argc);
+    return submit_job([args = std::move(args)](JobState& s) {
+      std::vector<const char*> argp;
+      for (const std::string& a : args) argp.push_back(a.c_str());
+      CaptureConsole cap;
+      zpaq_jidac_monitor mon;
+      mon.stats = nullptr;
+      mon.progress = nullptr;
+      mon.ctx = nullptr;
+      mon.cancel = &s.cancel;
+      std::string msg;
+      const int rc = jidac_command(static_cast<int>(argp.size()), argp.data(), &cap.con, &s.summary,
+                                   &msg, &mon);
+      s.out.swap(cap.out);
+      s.err.swap(cap.err);
+      if (rc != 0) throw LibZpaqError(msg.empty() ? command_error(s.err) : msg);
+    });
   } catch (const std::exception& e) {
     set_last_error(e.what());
-    return -1;
+    return nullptr;
   }
 }
 
-int zpaq_jidac_add_archive_size_file(const char* path, const char* method, int threads, uint64_t* out_archive_size_bytes) {
+// Return 0 while the job is queued or running, 1 when it is done, or -1
+// if it failed or was cancelled, with its error set as the last error.
+int zpaq_job_poll(zpaq_job* job) {
   clear_last_error();
-  try {
-    if (!path || !*path || !method || !*method || !out_archive_size_bytes) return -1;
-
-    // Build argv like: zpaq add "" <path> -method <method> -threads <N>
-    std::string threads_s = std::to_string(threads);
-    const char* argv[9];
-    int argc = 0;
-    argv[argc++] = "zpaq";
-    argv[argc++] = "add";
-    argv[argc++] = "";
-    argv[argc++] = path;
-    argv[argc++] = "-method";
-    argv[argc++] = method;
-    argv[argc++] = "-threads";
-    argv[argc++] = threads_s.c_str();
-    const int rc = zpaq_jidac_run(argc, argv);
-    if (rc != 0) return -1;
-
-    double archive_mb = 0.0;
-    const bool ok = parse_last_archive_mb(g_last_stderr.data(), g_last_stderr.size(), &archive_mb);
-    if (!ok) {
-      set_last_error("failed to parse zpaq summary output");
-      return -1;
-    }
+  if (!job) return -1;
+  std::lock_guard<std::mutex> lock(job->s->mu);
+  if (job->s->status < 0) set_last_error(job->s->error.c_str());
+  return job->s->status;
+}
 
-    const double bytes_d = archive_mb * 1000000.0;
-    const uint64_t bytes = bytes_d <= 0.0 ? 0ULL : (uint64_t)(bytes_d + 0.5);
-    *out_archive_size_bytes = bytes;
-    return 0;
-  } catch (const std::exception& e) {
-    set_last_error(e.what());
-    return -1;
+// Wait up to timeout_ms (forever if negative) for the job to finish and
+// return zpaq_job_poll().
+int zpaq_job_wait(zpaq_job* job, int64_t timeout_ms) {
+  clear_last_error();
+  if (!job) return -1;
+  JobState& s = *job->s;
+  std::unique_lock<std::mutex> lock(s.mu);
+  auto done = [&] { return s.status != 0; };
+  if (timeout_ms < 0)
+    s.cv.wait(lock, done);
+  else
+    s.cv.wait_for(lock, std::chrono::milliseconds(timeout_ms), done);
+  if (s.status < 0) set_last_error(s.error.c_str());
+  return s.status;
+}
+
+// Ask the job to stop. It fails with "cancelled" at its next block, file
+// or segment, or before it starts if still queued.
+void zpaq_job_cancel(zpaq_job* job) {
+  if (job) job->s->cancel.store(1);
+}
+
+// Call fn(ctx) once from the worker when the job finishes, replacing any
+// earlier fn. Nothing is called if it has already finished. Returns the
+// status as zpaq_job_poll() does, without setting the last error.
+int zpaq_job_set_notify(zpaq_job* job, void (*fn)(void*), void* ctx) {
+  if (!job) return -1;
+  std::lock_guard<std::mutex> lock(job->s->mu);
+  if (job->s->status == 0) {
+    job->s->notify = fn;
+    job->s->notify_ctx = ctx;
+  }
+  return job->s->status;
+}
+
+// Output of a finished job: its data, or the stdout of a command
+const unsigned char* zpaq_job_output(zpaq_job* job, size_t* len) {
+  if (len) *len = 0;
+  if (!job) return nullptr;
+  std::lock_guard<std::mutex> lock(job->s->mu);
+  if (job->s->status == 0) return nullptr;
+  if (len) *len = job->s->out.size();
+  return reinterpret_cast<const unsigned char*>(job->s->out.data());
+}
+
+// stderr of a finished command
+const char* zpaq_job_stderr(zpaq_job* job, size_t* len) {
+  if (len) *len = 0;
+  if (!job) return nullptr;
+  std::lock_guard<std::mutex> lock(job->s->mu);
+  if (job->s->status == 0) return nullptr;
+  if (len) *len = job->s->err.size();
+  return job->s->err.data();
+}
+
+int zpaq_job_summary(zpaq_job* job, zpaq_jidac_summary* summary) {
+  if (!job || !summary) return -1;
+  std::lock_guard<std::mutex> lock(job->s->mu);
+  if (job->s->status == 0) return -1;
+  *summary = job->s->summary;
+  return 0;
+}
+
+// Free the handle, cancelling the job if it is still running. After this
+// returns the notify function is not called.
+void zpaq_job_free(zpaq_job* job) {
+  if (!job) return;
+  {
+    std::lock_guard<std::mutex> lock(job->s->mu);
+    job->s->cancel.store(1);
+    job->s->notify = nullptr;
   }
+  delete job;
 }
 
 // ---------------- StringBuffer ----------------
@@ -1083,6 +2111,10 @@ void zpaq_sha256_put(libzpaq::SHA256* s, int c) {
   if (s) s->put(c);
 }
 
+void zpaq_sha256_write(libzpaq::SHA256* s, const char* buf, int64_t n) {
+  if (s) s->write(buf, n);
+}
+
 uint64_t zpaq_sha256_usize(const libzpaq::SHA256* s) { return s ? s->usize() : 0; }
 
 double zpaq_sha256_size(const libzpaq::SHA256* s) { return s ? s->size() : 0.0; }
@@ -1152,6 +2184,20 @@ int zpaq_stretch_key(unsigned char out32[32], const unsigned char key32[32], con
   }
 }
 
+int zpaq_stretch_keys(unsigned char* out, const unsigned char* keys, const unsigned char* salts, int n,
+                      int threads) {
+  clear_last_error();
+  try {
+    if (n < 0 || (n > 0 && (!out || !keys || !salts))) return -1;
+    libzpaq::stretchKeys(reinterpret_cast<char*>(out), reinterpret_cast<const char*>(keys),
+                         reinterpret_cast<const char*>(salts), n, threads);
+    return 0;
+  } catch (const std::exception& e) {
+    set_last_error(e.what());
+    return -1;
+  }
+}
+
 int zpaq_random(unsigned char* buf, int n) {
   clear_last_error();
   try {
@@ -1164,6 +2210,14 @@ int zpaq_random(unsigned char* buf, int n) {
   }
 }
 
+size_t zpaq_set_pool_limit(size_t n) { return libzpaq::setPoolLimit(n); }
+
+int zpaq_set_huge_pages(int mode, size_t min_bytes) { return libzpaq::setHugePages(mode, min_bytes); }
+
+void zpaq_pool_stats(libzpaq::PoolStats* out) {
+  if (out) *out = libzpaq::poolStats();
+}
+
 uint16_t zpaq_to_u16(const char* p) {
   return static_cast<uint16_t>(libzpaq::toU16(p));
 }